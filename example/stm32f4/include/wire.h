@@ -0,0 +1,46 @@
+/*
+ * wire.h
+ *
+ *  Binary wire protocol shared with the Janus serial plugin: every packet
+ *  is a type byte followed by TLV (tag, length, value) fields and by the
+ *  CRC-16/CCITT of all that, the whole COBS encoded and terminated by a 0
+ *  byte. Integers are little endian, like the Cortex-M4.
+ */
+
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <stdint.h>
+
+/* Packet types */
+#define WIRE_REQUEST       0x01
+#define WIRE_REPLY         0x02
+#define WIRE_SAMPLE        0x03
+/* Field tags */
+#define WIRE_SEQ           0x01	//u32
+#define WIRE_COMMAND       0x02	//u8
+#define WIRE_ID            0x03	//u8
+#define WIRE_RATE          0x04	//u16, ms
+#define WIRE_OPSTATUS      0x05	//u8, 0 is ok
+#define WIRE_CODE          0x06	//u8
+#define WIRE_ACCELEROMETER 0x07	//3 x s16
+#define WIRE_TEMPERATURE   0x08	//s32, 1/10000 of Celsius
+#define WIRE_STREAM        0x09	//u8
+
+/* Biggest packet we build, before encoding */
+#define WIRE_MAX 64
+
+/* Packet being built */
+typedef struct Wire{
+	uint8_t buf[WIRE_MAX];
+	int len;
+}Wire;
+
+void wire_begin(Wire *w, uint8_t type);
+void wire_put(Wire *w, uint8_t tag, const void *value, uint8_t len);
+int wire_finish(Wire *w, uint8_t *out);
+int wire_open(uint8_t *frame, int len);
+int wire_next(const uint8_t *packet, int len, int *pos, uint8_t *tag, const uint8_t **value, uint8_t *vlen);
+uint32_t wire_uint(const uint8_t *value, uint8_t vlen);
+
+#endif /* WIRE_H_ */
@@ -40,27 +40,43 @@ void setup(){
 	//Initializze logical variable and memory areas
 	memset(request, '\0',256);
 	memset(response,'\0',256);
+	memset(streams, 0, sizeof(streams));
+	binary = 0;
 }
 /* Loop function ------------------------------*/
 void loop(){
 	/*Local Logical Variable ------------------*/
+	static int spot = 0;
 	char buf = '\0';
-	int spot = 0, p_code;
 	Comand receivedcomand;
-	//Reading cycle
+	//Reading cycle: one command per frame, the server may pipeline several.
+	//JSON commands start with '{' and end with '\n', binary ones end with 0
 	while(VCP_read(&buf,1) != 0){
-		if(buf!='\n'){
-			sprintf(&request[spot], "%c", buf );
-			spot += 1;
+		if(spot == 0 && buf == '\0')
+			continue;
+		char end = (spot == 0 ? buf : request[0]) == '{' ? '\n' : '\0';
+		if(buf != end){
+			if(spot < (int)sizeof(request)-1){
+				request[spot] = buf;
+				spot += 1;
+			}
+			continue;
 		}
+		if(end == '\n'){
+			binary = 0;
+			if(parsing(&receivedcomand) == 1) {/*TODO: gestione errori di ricezioni*/}
+			execComand(receivedcomand);
+		}else if(parsingBinary(&receivedcomand, spot) == 0){
+			//Broken packets are dropped, the server will time them out
+			binary = 1;
+			execComand(receivedcomand);
+		}
+		//Reset the request string
+		memset(request, '\0', sizeof(request));
+		spot = 0;
 	}
-	if(strlen(request) != 0){
-		if(parsing(&receivedcomand) == 1) {/*TODO: gestione errori di ricezioni*/}
-		execComand(receivedcomand);
-	}
-	//Reset the request string
-	memset(request, '\0', strlen(request));
-	//TODO: Letture periodiche
+	//Periodic readings of the subscribed sensors
+	sampling();
 }
 //Parsing the message and execute commands
 int  parsing (Comand *received)
@@ -74,6 +90,9 @@ int  parsing (Comand *received)
 	/*Initializze variable */
 	received->name 	= 0;
 	received->ID 	= 0;
+	received->seq 	= 0;
+	received->rate 	= 0;
+	received->protocol = 0;
 	memset(store,"\0",20);
 	/*Initializze parse */
 	jsmn_init(&parser);
@@ -98,6 +117,18 @@ int  parsing (Comand *received)
 					memset(store,"\0",t_length);
 					strncpy(store,&request[tokens[i+1].start],tokens[i+1].end-tokens[i+1].start);
 					received->ID = atoi(store);
+				}else if(strncmp(store,"seq",t_length) == 0){
+					memset(store,'\0',20);
+					strncpy(store,&request[tokens[i+1].start],tokens[i+1].end-tokens[i+1].start);
+					received->seq = strtoul(store,NULL,10);
+				}else if(strncmp(store,"rate",t_length) == 0){
+					memset(store,'\0',20);
+					strncpy(store,&request[tokens[i+1].start],tokens[i+1].end-tokens[i+1].start);
+					received->rate = atoi(store);
+				}else if(strncmp(store,"protocol",t_length) == 0){
+					memset(store,'\0',20);
+					strncpy(store,&request[tokens[i+1].start],tokens[i+1].end-tokens[i+1].start);
+					received->protocol = atoi(store);
 				}else{
 					//Quando mi arriva qualcosa di inateso
 				}
@@ -111,103 +142,210 @@ int  parsing (Comand *received)
 	return 0;
 }
 
+//Parsing a binary command (see wire.h)
+int parsingBinary(Comand *received, int len)
+{
+	const uint8_t *packet = (const uint8_t *)request;
+	const uint8_t *value;
+	uint8_t tag, vlen;
+	int pos = 1;
+	received->name 	= -1;
+	received->ID 	= 0;
+	received->seq 	= 0;
+	received->rate 	= 0;
+	received->protocol = 0;
+	int n = wire_open((uint8_t *)request, len);
+	if(n < 1 || packet[0] != WIRE_REQUEST)
+		return 1;
+	while(wire_next(packet, n, &pos, &tag, &value, &vlen)){
+		switch(tag){
+			case WIRE_SEQ: received->seq = wire_uint(value, vlen); break;
+			case WIRE_COMMAND: received->name = wire_uint(value, vlen); break;
+			case WIRE_ID: received->ID = wire_uint(value, vlen); break;
+			case WIRE_RATE: received->rate = wire_uint(value, vlen); break;
+			default: break;	//Quando mi arriva qualcosa di inatteso
+		}
+	}
+	return 0;
+}
+
 int execComand(Comand received){
-	memset(response,'\0',256);
+	//Board LEDs, by ID (3 to 6)
+	static const Led_TypeDef leds[] = { LED3, LED4, LED5, LED6 };
+	Answer answer = { received.seq, 0, OK, -1, -1, -1, -1, NULL };
+	Measure reading;
 	switch(received.name){
 		case C_ON :
-			if(received.ID == 3){
-				BSP_LED_On(LED3);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 4){
-				BSP_LED_On(LED4);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 5){
-				BSP_LED_On(LED5);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 6){
-				BSP_LED_On(LED6);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-			  VCP_write(&response,256);
-			}
-			break;
 		case C_OFF :
-			if(received.ID == 6) {
-				BSP_LED_Off(LED6);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 5){
-				BSP_LED_Off(LED5);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 4){
-				BSP_LED_Off(LED4);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
-			}
-			if(received.ID == 3) {
-				BSP_LED_Off(LED3);
-				sprintf(response,"{ \"opstatus\" : \"ok\ , \"id\" : %d }\n",received.ID);
-				VCP_write(&response,256);
+			if(received.ID >= 3 && received.ID <= 6){
+				if(received.name == C_ON)
+					BSP_LED_On(leds[received.ID-3]);
+				else
+					BSP_LED_Off(leds[received.ID-3]);
+				answer.id = received.ID;
+			}else{
+				answer.opstatus = ERR;
+				answer.code = 2;
 			}
 			break;
 		case C_READ :
-			if(received.ID == 1){
-				/*Initializzae local variable*/
-				int16_t pos[3];
-				/*Reading the board accelerometer */
-				BSP_ACCELERO_GetXYZ(pos);
-				/*Build JSON response */
-				sprintf(response,"{ \"opstatus\" : \"ok\", \"measure\" : [ %d,%d,%d],\"type\" : \"accelerometer\" }\n ",pos[0],pos[1],pos[2]);
-				//sprintf(response,"{ \"session\" : %d , \"opstatus\" : \"ok\", \"measure\" : [ %d,%d,%d],\"type\" : \"accelerometer\" }\n ",session,pos[0],pos[1],pos[2]);
-				/*Send the json on usb*/
-				VCP_write(&response,256);
-			}else if (received.ID == 2){
-				//Lettura da sensore di temperatura
-				float temperature;
-				//Start the conversion
-				if(HAL_ADC_Start (&hadc1) != HAL_OK){
-					//Gestire errore
-				}
-				while (HAL_ADC_GetState(&hadc1) == HAL_ADC_STATE_BUSY ){}
-				//Processing the conversion
-				temperature = HAL_ADC_GetValue(&hadc1); //Return the converted data
-				temperature *= 3300;
-				temperature /= 0xfff; //Reading in mV
-				temperature /= 1000.0; //Reading in Volts
-				temperature -= 0.760; // Subtract the reference voltage at 25°C
-				temperature /= .0025; // Divide by slope 2.5mV
-
-				temperature += 25.0; // Add the 25°C
-
-				int d1 = temperature;            // Get the integer part (678).
-				float f2 = temperature - d1;     // Get fractional part (678.0123 - 678 = 0.0123).
-				int d2 = trunc(f2 * 10000);   // Turn into integer (123).
-				// Print as parts, note that you need 0-padding for fractional bit.
-				// Since d1 is 678 and d2 is 123, you get "678.0123".
-				sprintf(response,"{ \"opstatus\" : \"ok\", \"measure\" : %d.%d4,\"type\" : \"temperature\" }\n ",d1,d2);
-				//sprintf(response,"{ \"session\" : %d , \"opstatus\" : \"ok\", \"measure\" : %d.%d4,\"type\" : \"temperature\" }\n ",session,d1,d2);
-				VCP_write(&response,256);
+			if(measure(received.ID, &reading) == 0){
+				answer.measure = &reading;
+			}else{
+				answer.opstatus = ERR;
+				answer.code = 2;
+			}
+			break;
+		case C_SUBSCRIBE :
+			//Sample the sensor every rate ms from now on, see sampling()
+			if(received.ID > 0 && received.ID < STREAMS && received.rate >= RATE_MIN && received.rate <= RATE_MAX){
+				streams[received.ID].period = received.rate;
+				streams[received.ID].next = HAL_GetTick();
+				answer.id = received.ID;
+				answer.rate = received.rate;
+			}else{
+				answer.opstatus = ERR;
+				answer.code = 2;
 			}
 			break;
+		case C_UNSUBSCRIBE :
+			if(received.ID > 0 && received.ID < STREAMS)
+				streams[received.ID].period = 0;
+			answer.id = received.ID;
+			break;
+		case C_PROTOCOL :
+			//Agree on the binary protocol if asked: the answer still goes in
+			//JSON, as that's what the server is expecting until it gets it
+			answer.protocol = received.protocol == 1 ? 1 : 0;
+			binary = 0;
+			reply(&answer);
+			binary = answer.protocol;
+			return 0;
 		default:
 			//Nel caso arrivi un comando non conosciuto
-			sprintf(response,"{ \"opstatus\" : \"err\" , \"code\" : 1 }\n");
-			VCP_write(&response,256);
+			answer.opstatus = ERR;
+			answer.code = 1;
+			reply(&answer);
 			return 1;
-			break;
 	}
-	memset(response,'\0',256);
+	reply(&answer);
 	return 0;
 }
 
+//Read a sensor
+int measure(int id, Measure *reading){
+	reading->sensor = id;
+	if(id == 1){
+		/*Reading the board accelerometer */
+		BSP_ACCELERO_GetXYZ(reading->xyz);
+		return 0;
+	}else if (id == 2){
+		//Lettura da sensore di temperatura
+		float temperature;
+		//Start the conversion
+		if(HAL_ADC_Start (&hadc1) != HAL_OK){
+			//Gestire errore
+		}
+		while (HAL_ADC_GetState(&hadc1) == HAL_ADC_STATE_BUSY ){}
+		//Processing the conversion
+		temperature = HAL_ADC_GetValue(&hadc1); //Return the converted data
+		temperature *= 3300;
+		temperature /= 0xfff; //Reading in mV
+		temperature /= 1000.0; //Reading in Volts
+		temperature -= 0.760; // Subtract the reference voltage at 25°C
+		temperature /= .0025; // Divide by slope 2.5mV
+
+		temperature += 25.0; // Add the 25°C
+
+		//In 1/10000 of degree, to keep floats off the wire
+		reading->temperature = (int32_t)(temperature * 10000);
+		return 0;
+	}
+	return 1;
+}
+
+//Send an answer (or a sample) in the protocol the server is talking: only
+//the bytes of the answer are sent, not the whole buffer
+void reply(Answer *answer){
+	int n = 0;
+	if(binary){
+		Wire w;
+		uint8_t u8;
+		wire_begin(&w, answer->stream ? WIRE_SAMPLE : WIRE_REPLY);
+		if(answer->stream){
+			u8 = answer->stream;
+			wire_put(&w, WIRE_STREAM, &u8, 1);
+		}else{
+			uint32_t seq = answer->seq;
+			wire_put(&w, WIRE_SEQ, &seq, 4);
+		}
+		u8 = answer->opstatus;
+		wire_put(&w, WIRE_OPSTATUS, &u8, 1);
+		if(answer->code >= 0){
+			u8 = answer->code;
+			wire_put(&w, WIRE_CODE, &u8, 1);
+		}
+		if(answer->id >= 0){
+			u8 = answer->id;
+			wire_put(&w, WIRE_ID, &u8, 1);
+		}
+		if(answer->rate >= 0){
+			uint16_t rate = answer->rate;
+			wire_put(&w, WIRE_RATE, &rate, 2);
+		}
+		if(answer->measure != NULL && answer->measure->sensor == 1)
+			wire_put(&w, WIRE_ACCELEROMETER, answer->measure->xyz, 6);
+		else if(answer->measure != NULL && answer->measure->sensor == 2)
+			wire_put(&w, WIRE_TEMPERATURE, &answer->measure->temperature, 4);
+		n = wire_finish(&w, (uint8_t *)response);
+		VCP_write(response, n);
+		return;
+	}
+	if(answer->stream)
+		n += sprintf(response+n,"{ \"stream\" : %d, ",answer->stream);
+	else
+		n += sprintf(response+n,"{ \"seq\" : %lu, ",answer->seq);
+	n += sprintf(response+n,"\"opstatus\" : \"%s\"",answer->opstatus == OK ? "ok" : "err");
+	if(answer->code >= 0)
+		n += sprintf(response+n,", \"code\" : %d",answer->code);
+	if(answer->id >= 0)
+		n += sprintf(response+n,", \"id\" : %d",answer->id);
+	if(answer->rate >= 0)
+		n += sprintf(response+n,", \"rate\" : %d",answer->rate);
+	if(answer->protocol >= 0)
+		n += sprintf(response+n,", \"protocol\" : %d",answer->protocol);
+	if(answer->measure != NULL && answer->measure->sensor == 1){
+		n += sprintf(response+n,", \"measure\" : [ %d,%d,%d],\"type\" : \"accelerometer\"",
+			answer->measure->xyz[0],answer->measure->xyz[1],answer->measure->xyz[2]);
+	}else if(answer->measure != NULL && answer->measure->sensor == 2){
+		// Print as parts, note that you need 0-padding for fractional bit.
+		int32_t t = answer->measure->temperature;
+		n += sprintf(response+n,", \"measure\" : %s%ld.%04ld,\"type\" : \"temperature\"",
+			t < 0 ? "-" : "",(long)(t < 0 ? -t : t)/10000,(long)(t < 0 ? -t : t)%10000);
+	}
+	n += sprintf(response+n," }\n");
+	VCP_write(response, n);
+}
+
+//Periodic readings: send a sample of every subscribed sensor that is due,
+//tagged with "stream" (the sensor ID) instead of "seq"
+void sampling(){
+	uint32_t now = HAL_GetTick();
+	Measure reading;
+	for(int id = 1; id < STREAMS; id++){
+		if(streams[id].period == 0 || (int32_t)(now - streams[id].next) < 0)
+			continue;
+		//Keep the pace, unless we fell too far behind
+		streams[id].next += streams[id].period;
+		if((int32_t)(now - streams[id].next) >= 0)
+			streams[id].next = now + streams[id].period;
+		if(measure(id, &reading) != 0)
+			continue;
+		Answer sample = { 0, id, OK, -1, -1, -1, -1, &reading };
+		reply(&sample);
+	}
+}
+
 uint8_t isLoop(){
 	return 1;
 }
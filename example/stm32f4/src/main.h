@@ -22,6 +22,7 @@
 #include "usbd_cdc_if_template.h"
 #include "usbd_desc.h"
 #include "jsmn.h"
+#include "wire.h"
 
 // Sample pragmas to cope with warnings. Please note the related line at
 // the end of this function, used to pop the compiler diagnostics status.
@@ -34,15 +35,47 @@
 typedef struct Comand{
 	int name;
 	int ID;
+	unsigned long seq;	//Correlation ID, echoed back in the answer
+	int rate;		//Sampling period (ms) of a subscription
+	int protocol;		//Protocol the server wants to switch to
 }Comand;
 
+/* Sensor reading typedef -----------------*/
+typedef struct Measure{
+	int sensor;		//1 accelerometer, 2 temperature
+	int16_t xyz[3];
+	int32_t temperature;	//In 1/10000 of Celsius
+}Measure;
+
+/* Answer typedef: what's not there is -1 --*/
+typedef struct Answer{
+	unsigned long seq;	//Request this answers
+	int stream;		//Sensor ID if this is a sample instead
+	int opstatus;
+	int code;
+	int id;
+	int rate;
+	int protocol;
+	Measure *measure;
+}Answer;
+
+/* Periodic reading typedef ---------------*/
+typedef struct Stream{
+	uint32_t period;	//Sampling period in ms, 0 if nobody subscribed
+	uint32_t next;		//Tick of the next sample
+}Stream;
+
 //Function prototypes --------------------*/
 void setup();
 void loop();
 uint8_t isLoop();
 void finalize();
 int  parsing (Comand * received);
+int parsingBinary(Comand *received, int len);
 int execComand(Comand received);
+int measure(int id, Measure *reading);
+void reply(Answer *answer);
+void sampling();
 static void MX_ADC1_Init(void);
 
 
@@ -51,6 +84,12 @@ uint8_t receiving_buffer;
 uint8_t jstring[256];
 char response[256];
 char request [256];
+/* Protocol: 0 JSON lines, 1 binary packets */
+uint8_t binary;
+
+/* Periodic readings, indexed by sensor ID */
+#define STREAMS 3
+Stream streams[STREAMS];
 
 /* Session ID -----------------------------*/
 uint64_t session;
@@ -68,6 +107,12 @@ ADC_HandleTypeDef hadc1;
 #define C_ON   0
 #define C_OFF  1
 #define C_READ 2
+#define C_SUBSCRIBE   3
+#define C_UNSUBSCRIBE 4
+#define C_PROTOCOL    5
+// Periodic readings limits (ms)
+#define RATE_MIN 10
+#define RATE_MAX 60000
 // Risposte
 #define OK  0
 #define ERR 1
@@ -0,0 +1,102 @@
+/*
+ * wire.c
+ *
+ *  Binary wire protocol, see wire.h
+ */
+
+#include <string.h>
+#include "wire.h"
+
+/* CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) */
+static uint16_t wire_crc16(const uint8_t *data, int len){
+	uint16_t crc = 0xFFFF;
+	for(int i = 0; i < len; i++){
+		crc ^= (uint16_t)data[i] << 8;
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+void wire_begin(Wire *w, uint8_t type){
+	w->buf[0] = type;
+	w->len = 1;
+}
+
+void wire_put(Wire *w, uint8_t tag, const void *value, uint8_t len){
+	//Leave room for the CRC
+	if(w->len + 2 + len > WIRE_MAX - 2)
+		return;
+	w->buf[w->len++] = tag;
+	w->buf[w->len++] = len;
+	memcpy(&w->buf[w->len], value, len);
+	w->len += len;
+}
+
+//Add the CRC and COBS encode the packet in out (which needs WIRE_MAX+2
+//bytes), 0 terminated: returns how many bytes to send
+int wire_finish(Wire *w, uint8_t *out){
+	uint16_t crc = wire_crc16(w->buf, w->len);
+	w->buf[w->len++] = crc & 0xFF;
+	w->buf[w->len++] = crc >> 8;
+	int code_pos = 0, n = 1;
+	uint8_t code = 1;
+	for(int i = 0; i < w->len; i++){
+		if(w->buf[i] == 0){
+			out[code_pos] = code;
+			code_pos = n++;
+			code = 1;
+			continue;
+		}
+		out[n++] = w->buf[i];
+		if(++code == 0xFF){
+			out[code_pos] = code;
+			code_pos = n++;
+			code = 1;
+		}
+	}
+	out[code_pos] = code;
+	out[n++] = 0;
+	return n;
+}
+
+//COBS decode a received frame (without its 0) in place and check its CRC:
+//returns the length of the packet without the CRC, -1 if it's broken
+int wire_open(uint8_t *frame, int len){
+	int in = 0, n = 0;
+	while(in < len){
+		uint8_t code = frame[in++];
+		if(code == 0 || in + code - 1 > len)
+			return -1;
+		for(int i = 1; i < code; i++)
+			frame[n++] = frame[in++];
+		if(code != 0xFF && in < len)
+			frame[n++] = 0;
+	}
+	if(n < 3)
+		return -1;
+	n -= 2;
+	if(wire_crc16(frame, n) != (frame[n] | (frame[n+1] << 8)))
+		return -1;
+	return n;
+}
+
+//Walk the fields of a packet, starting from pos 1 (after the type)
+int wire_next(const uint8_t *packet, int len, int *pos, uint8_t *tag, const uint8_t **value, uint8_t *vlen){
+	if(*pos + 2 > len)
+		return 0;
+	*tag = packet[*pos];
+	*vlen = packet[*pos+1];
+	*value = &packet[*pos+2];
+	if(*pos + 2 + *vlen > len)
+		return 0;
+	*pos += 2 + *vlen;
+	return 1;
+}
+
+uint32_t wire_uint(const uint8_t *value, uint8_t vlen){
+	uint32_t result = 0;
+	for(int i = 0; i < vlen && i < 4; i++)
+		result |= (uint32_t)value[i] << (8*i);
+	return result;
+}
@@ -14,6 +14,8 @@ var startled3 = false;
 var startled4 = false;
 var startled5 = false;
 var startled6 = false;
+var streamacc = false;
+var streamtemp = false;
 
 
 /***MESSAGGI JSON***/
@@ -27,6 +29,11 @@ var led5_on = { "command": 0, "id": 5 }; //on l5
 var led5_off = { "command": 1, "id": 5 }; //off l5
 var led6_on = { "command": 0, "id": 6 }; //on l6
 var led6_off = { "command": 1, "id": 6 }; //off l6
+var stream_rate = 200; //ms between samples when streaming
+var sub_a = { "command": 3, "id": 1, "rate": stream_rate }; //stream accelerometer
+var unsub_a = { "command": 4, "id": 1 }; //stop streaming accelerometer
+var sub_t = { "command": 3, "id": 2, "rate": stream_rate }; //stream temperature
+var unsub_t = { "command": 4, "id": 2 }; //stop streaming temperature
 
 
 $(document).ready(function() {
@@ -75,6 +82,29 @@ $(document).ready(function() {
 										serial.send({"message": sens_t});
 									});	
 
+									//Streaming: the board sends samples by itself, no polling
+									$('#accel-stream').click(function() {
+										streamacc = !streamacc;
+										if(streamacc) {
+											$('#accel-stream').removeClass("btn-default").addClass("btn-info");
+											serial.send({"message": sub_a});
+										} else {
+											$('#accel-stream').removeClass("btn-info").addClass("btn-default");
+											serial.send({"message": unsub_a});
+										}
+									});
+
+									$('#temp-stream').click(function() {
+										streamtemp = !streamtemp;
+										if(streamtemp) {
+											$('#temp-stream').removeClass("btn-default").addClass("btn-info");
+											serial.send({"message": sub_t});
+										} else {
+											$('#temp-stream').removeClass("btn-info").addClass("btn-default");
+											serial.send({"message": unsub_t});
+										}
+									});
+
 									//Led 3
 									$('#l3').click(function(){
 										startled3 = !startled3;			
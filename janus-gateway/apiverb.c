@@ -0,0 +1,106 @@
+/*! \file    apiverb.c
+ * \copyright GNU General Public License v3
+ * \brief    Janus API requests
+ * \details  Implementation of the lookup of the requests ("janus" verbs)
+ * the Janus API and the admin/monitor API understand. The verb is hashed
+ * (FNV-1a, case-insensitive) with a seed picked so that no two verbs end
+ * up in the same slot of the table: the slot tells which verb it can be,
+ * and a single comparison tells whether it is.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <stddef.h>
+#include <strings.h>
+
+#include "apiverb.h"
+
+#define JANUS_API_VERB_SLOTS	(1 << JANUS_API_VERB_BITS)
+
+/* Names of the verbs, indexed by identifier */
+static const char *janus_api_verb_names[JANUS_API_VERBS] = {
+	[JANUS_API_VERB_UNKNOWN] = NULL,
+	[JANUS_API_VERB_INFO] = "info",
+	[JANUS_API_VERB_PING] = "ping",
+	[JANUS_API_VERB_RMQTEST] = "rmqtest",
+	[JANUS_API_VERB_CREATE] = "create",
+	[JANUS_API_VERB_KEEPALIVE] = "keepalive",
+	[JANUS_API_VERB_ATTACH] = "attach",
+	[JANUS_API_VERB_DESTROY] = "destroy",
+	[JANUS_API_VERB_DETACH] = "detach",
+	[JANUS_API_VERB_MESSAGE] = "message",
+	[JANUS_API_VERB_TRICKLE] = "trickle",
+	[JANUS_API_VERB_GET_STATUS] = "get_status",
+	[JANUS_API_VERB_SET_LOG_LEVEL] = "set_log_level",
+	[JANUS_API_VERB_SET_LOCKING_DEBUG] = "set_locking_debug",
+	[JANUS_API_VERB_SET_LOG_TIMESTAMPS] = "set_log_timestamps",
+	[JANUS_API_VERB_SET_LOG_COLORS] = "set_log_colors",
+	[JANUS_API_VERB_SET_LIBNICE_DEBUG] = "set_libnice_debug",
+	[JANUS_API_VERB_SET_MAX_NACK_QUEUE] = "set_max_nack_queue",
+	[JANUS_API_VERB_LIST_SESSIONS] = "list_sessions",
+	[JANUS_API_VERB_ADD_TOKEN] = "add_token",
+	[JANUS_API_VERB_LIST_TOKENS] = "list_tokens",
+	[JANUS_API_VERB_ALLOW_TOKEN] = "allow_token",
+	[JANUS_API_VERB_DISALLOW_TOKEN] = "disallow_token",
+	[JANUS_API_VERB_REMOVE_TOKEN] = "remove_token",
+	[JANUS_API_VERB_LIST_HANDLES] = "list_handles",
+	[JANUS_API_VERB_HANDLE_INFO] = "handle_info",
+};
+
+/* Slot of each verb with JANUS_API_VERB_SEED (empty slots are unknown) */
+static const unsigned char janus_api_verb_slots[JANUS_API_VERB_SLOTS] = {
+	[0] = JANUS_API_VERB_ADD_TOKEN,
+	[1] = JANUS_API_VERB_ATTACH,
+	[3] = JANUS_API_VERB_SET_LOG_TIMESTAMPS,
+	[4] = JANUS_API_VERB_KEEPALIVE,
+	[5] = JANUS_API_VERB_SET_LOG_LEVEL,
+	[7] = JANUS_API_VERB_GET_STATUS,
+	[8] = JANUS_API_VERB_DISALLOW_TOKEN,
+	[9] = JANUS_API_VERB_ALLOW_TOKEN,
+	[11] = JANUS_API_VERB_DETACH,
+	[12] = JANUS_API_VERB_SET_LIBNICE_DEBUG,
+	[13] = JANUS_API_VERB_SET_LOG_COLORS,
+	[15] = JANUS_API_VERB_CREATE,
+	[16] = JANUS_API_VERB_HANDLE_INFO,
+	[18] = JANUS_API_VERB_DESTROY,
+	[19] = JANUS_API_VERB_SET_MAX_NACK_QUEUE,
+	[20] = JANUS_API_VERB_TRICKLE,
+	[21] = JANUS_API_VERB_LIST_HANDLES,
+	[22] = JANUS_API_VERB_PING,
+	[24] = JANUS_API_VERB_SET_LOCKING_DEBUG,
+	[25] = JANUS_API_VERB_LIST_TOKENS,
+	[26] = JANUS_API_VERB_LIST_SESSIONS,
+	[28] = JANUS_API_VERB_REMOVE_TOKEN,
+	[29] = JANUS_API_VERB_RMQTEST,
+	[30] = JANUS_API_VERB_MESSAGE,
+	[31] = JANUS_API_VERB_INFO,
+};
+
+uint32_t janus_api_verb_hash(const char *name, uint32_t seed) {
+	uint32_t hash = seed;
+	const unsigned char *c = (const unsigned char *)name;
+	while(*c) {
+		unsigned char lower = (*c >= 'A' && *c <= 'Z') ? (*c + ('a' - 'A')) : *c;
+		hash ^= lower;
+		hash *= 16777619u;
+		c++;
+	}
+	return hash;
+}
+
+janus_api_verb janus_get_api_verb(const char *name) {
+	if(name == NULL)
+		return JANUS_API_VERB_UNKNOWN;
+	uint32_t slot = janus_api_verb_hash(name, JANUS_API_VERB_SEED) >> (32 - JANUS_API_VERB_BITS);
+	janus_api_verb verb = (janus_api_verb)janus_api_verb_slots[slot];
+	if(verb == JANUS_API_VERB_UNKNOWN || strcasecmp(name, janus_api_verb_names[verb]))
+		return JANUS_API_VERB_UNKNOWN;
+	return verb;
+}
+
+const char *janus_api_verb_name(janus_api_verb verb) {
+	if(verb <= JANUS_API_VERB_UNKNOWN || verb >= JANUS_API_VERBS)
+		return NULL;
+	return janus_api_verb_names[verb];
+}
@@ -0,0 +1,73 @@
+/*! \file    apiverb.h
+ * \copyright GNU General Public License v3
+ * \brief    Janus API requests (headers)
+ * \details  Definition of all the requests ("janus" verbs) the Janus API
+ * and the admin/monitor API understand, and of the lookup that maps the
+ * verb in a request to its identifier. The lookup is a perfect hash, so
+ * whatever the verb it costs a hash of the string and a single
+ * comparison, rather than a chain of case-insensitive comparisons.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_API_VERB_H
+#define _JANUS_API_VERB_H
+
+#include <stdint.h>
+
+/*! \brief Requests of the Janus API and of the admin/monitor API */
+typedef enum janus_api_verb {
+	/*! \brief Not a request we know about */
+	JANUS_API_VERB_UNKNOWN = 0,
+	/* Janus API (info is shared with the admin API) */
+	JANUS_API_VERB_INFO,
+	JANUS_API_VERB_PING,
+	JANUS_API_VERB_RMQTEST,
+	JANUS_API_VERB_CREATE,
+	JANUS_API_VERB_KEEPALIVE,
+	JANUS_API_VERB_ATTACH,
+	JANUS_API_VERB_DESTROY,
+	JANUS_API_VERB_DETACH,
+	JANUS_API_VERB_MESSAGE,
+	JANUS_API_VERB_TRICKLE,
+	/* Admin/monitor API */
+	JANUS_API_VERB_GET_STATUS,
+	JANUS_API_VERB_SET_LOG_LEVEL,
+	JANUS_API_VERB_SET_LOCKING_DEBUG,
+	JANUS_API_VERB_SET_LOG_TIMESTAMPS,
+	JANUS_API_VERB_SET_LOG_COLORS,
+	JANUS_API_VERB_SET_LIBNICE_DEBUG,
+	JANUS_API_VERB_SET_MAX_NACK_QUEUE,
+	JANUS_API_VERB_LIST_SESSIONS,
+	JANUS_API_VERB_ADD_TOKEN,
+	JANUS_API_VERB_LIST_TOKENS,
+	JANUS_API_VERB_ALLOW_TOKEN,
+	JANUS_API_VERB_DISALLOW_TOKEN,
+	JANUS_API_VERB_REMOVE_TOKEN,
+	JANUS_API_VERB_LIST_HANDLES,
+	JANUS_API_VERB_HANDLE_INFO,
+	/*! \brief Number of verbs (not a verb) */
+	JANUS_API_VERBS
+} janus_api_verb;
+
+/*! \brief Seed and size (in bits) of the perfect hash: if verbs are
+ * added, a new seed can be searched for with test/dispatch_bench.c */
+#define JANUS_API_VERB_SEED		1443866
+#define JANUS_API_VERB_BITS		5
+
+/*! \brief Hash of a verb, as the lookup computes it (case-insensitive)
+ * @param[in] name The verb
+ * @param[in] seed The seed of the hash
+ * @returns The 32 bit hash: the top JANUS_API_VERB_BITS bits are the slot */
+uint32_t janus_api_verb_hash(const char *name, uint32_t seed);
+/*! \brief Helper method to get the identifier of a request verb
+ * @param[in] name The verb, as found in the "janus" element of the request (case-insensitive)
+ * @returns The verb identifier, or JANUS_API_VERB_UNKNOWN */
+janus_api_verb janus_get_api_verb(const char *name);
+/*! \brief Helper method to get the name of a request verb
+ * @param[in] verb The verb identifier
+ * @returns The verb, as it appears in requests, or NULL if unknown */
+const char *janus_api_verb_name(janus_api_verb verb);
+
+#endif
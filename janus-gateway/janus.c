@@ -20,13 +20,16 @@
 #include <signal.h>
 #include <getopt.h>
 #include <sys/resource.h>
+#include <time.h>
 
 #include "janus.h"
 #include "cmdline.h"
 #include "config.h"
 #include "apierror.h"
+#include "apiverb.h"
 #include "debug.h"
 #include "rtcp.h"
+#include "record.h"
 #include "sdp.h"
 #include "auth.h"
 #include "utils.h"
@@ -56,14 +59,46 @@ static GHashTable *plugins_so = NULL;
 static struct MHD_Daemon *ws = NULL, *sws = NULL;
 static char *ws_path = NULL;
 static char *ws_api_secret = NULL;
+/* Whether long polls suspend their connection while waiting (thread pool),
+ * or wait on the session condition (thread per connection) */
+static gboolean ws_suspend = FALSE;
+/* JSON format of what we send: compact unless configured otherwise, and
+ * each transport can have its own (e.g., indented, for debugging) */
+static size_t json_format = JSON_COMPACT | JSON_PRESERVE_ORDER;
+static size_t http_json_format = JSON_COMPACT | JSON_PRESERVE_ORDER;
+static size_t admin_json_format = JSON_COMPACT | JSON_PRESERVE_ORDER;
+static size_t ws_json_format = JSON_COMPACT | JSON_PRESERVE_ORDER;
+static size_t rmq_json_format = JSON_COMPACT | JSON_PRESERVE_ORDER;
+#define LONGPOLL_TIMEOUT	30
+/* How many events a session can have waiting for a transport to send them,
+ * and what to do when a producer (e.g., telemetry) is faster than that */
+#define SESSION_EVENTS_DEFAULT	256
+static guint session_events = SESSION_EVENTS_DEFAULT;
+static janus_events_overflow session_events_overflow = JANUS_EVENTS_DROP_OLDEST;
+/* Events transports take from a session at a time, in an array on the stack */
+#define SESSION_EVENTS_BATCH	16
+#if MHD_VERSION < 0x00094600
+/* Before 0.9.46 resuming connections only needed the shutdown pipe */
+#define MHD_USE_SUSPEND_RESUME MHD_USE_PIPE_FOR_SHUTDOWN
+#endif
+#if MHD_VERSION >= 0x00093400
+/* libmicrohttpd may have been built without epoll (it's Linux only anyway) */
+#define JANUS_MHD_EPOLL_SUPPORTED	(MHD_is_feature_supported(MHD_FEATURE_EPOLL) == MHD_YES)
+#define JANUS_MHD_USE_EPOLL			MHD_USE_EPOLL_LINUX_ONLY
+#else
+#define JANUS_MHD_EPOLL_SUPPORTED	FALSE
+#define JANUS_MHD_USE_EPOLL			0
+#endif
+/* File descriptors to leave to everything else when sizing webservers */
+#define WS_RESERVED_FDS		256
 
 
 #ifdef HAVE_WEBSOCKETS
 /* libwebsockets WS context(s) */
 static struct libwebsocket_context *wss = NULL, *swss = NULL;
-/* libwebsockets sessions that have been closed */
-static GList *old_wss;
-static janus_mutex old_wss_mutex;
+/* Thread pool serving the requests of all WebSocket clients */
+static GThreadPool *wss_pool = NULL;
+#define WSS_THREADS_PER_CORE	2
 /* Callbacks for HTTP-related events (automatically rejected) */
 static int janus_wss_callback_http(struct libwebsocket_context *this,
 		struct libwebsocket *wsi,
@@ -82,27 +117,46 @@ static int janus_wss_callback_secure(struct libwebsocket_context *this,
 		struct libwebsocket *wsi,
 		enum libwebsocket_callback_reasons reason,
 		void *user, void *in, size_t len);
-/* Protocol mappings */
+/* Protocol mappings: libwebsockets only keeps a pointer to the client for
+ * each connection, since the client itself may outlive the connection */
 static struct libwebsocket_protocols wss_protocols[] = {
 	{ "http-only", janus_wss_callback_http, 0, 0 },
-	{ "janus-protocol", janus_wss_callback, sizeof(janus_websocket_client), 0 },
+	{ "janus-protocol", janus_wss_callback, sizeof(janus_websocket_client *), 0 },
 	{ NULL, NULL, 0 }
 };
 static struct libwebsocket_protocols swss_protocols[] = {
 	{ "http-only", janus_wss_callback_https, 0, 0 },
-	{ "janus-protocol", janus_wss_callback_secure, sizeof(janus_websocket_client), 0 },
+	{ "janus-protocol", janus_wss_callback_secure, sizeof(janus_websocket_client *), 0 },
 	{ NULL, NULL, 0 }
 };
 /* Helper for debugging reasons */
 const char *janus_wss_reason_string(enum libwebsocket_callback_reasons reason);
+/* Client references */
+static janus_websocket_client *janus_wss_client_ref(janus_websocket_client *client);
+static void janus_wss_client_unref(janus_websocket_client *client);
+/* Helper to ask for a writable callback when there's something to send */
+static void janus_wss_writable(janus_websocket_client *client);
 #endif
 
 
 #ifdef HAVE_RABBITMQ
-/* RabbitMQ support */
+/* RabbitMQ support: this is the connection responses and events are
+ * published on, consumers have their own */
 amqp_connection_state_t rmq_conn = NULL;
 amqp_channel_t rmq_channel = 0;
 amqp_bytes_t to_janus_queue, from_janus_queue;
+/* How many consumers, how many unacknowledged requests each can have,
+ * how many messages to publish at most before waiting for the confirms,
+ * and whether to ask the broker for confirms at all */
+static int rmq_consumers = 1, rmq_prefetch = 16, rmq_batch = 64;
+static gboolean rmq_confirms = TRUE;
+/* Delivery tag of the last message published, and of the last one confirmed */
+static guint64 rmq_published_tag = 0, rmq_confirmed_tag = 0;
+#define RMQ_CONFIRMS_TIMEOUT	5
+/* Wake up the outgoing thread, when sessions have events to publish */
+static void janus_rmq_wakeup(void);
+/* Counters, for the admin API */
+static json_t *janus_rmq_stats_json(void);
 #endif
 
 
@@ -183,8 +237,8 @@ gint janus_is_stopping(void) {
 
 
 /* Information */
-char *janus_info(const char *transaction);
-char *janus_info(const char *transaction) {
+char *janus_info(const char *transaction, size_t format);
+char *janus_info(const char *transaction, size_t format) {
 	/* Prepare a summary on the gateway */
 	json_t *info = json_object();
 	json_object_set_new(info, "janus", json_string("server_info"));
@@ -247,7 +301,7 @@ char *janus_info(const char *transaction) {
 	}
 	json_object_set_new(info, "plugins", data);
 	/* Convert to a string */
-	char *info_text = json_dumps(info, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+	char *info_text = json_dumps(info, format);
 	json_decref(info);
 	
 	return info_text;
@@ -289,6 +343,7 @@ void janus_handle_signal(int signum)
  */
 ///@{
 int janus_push_event(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *transaction, const char *message, const char *sdp_type, const char *sdp);
+int janus_push_event_json(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *transaction, json_t *message, const char *sdp_type, const char *sdp);
 json_t *janus_handle_sdp(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *sdp_type, const char *sdp);
 void janus_relay_rtp(janus_plugin_session *plugin_session, int video, char *buf, int len);
 void janus_relay_rtcp(janus_plugin_session *plugin_session, int video, char *buf, int len);
@@ -303,6 +358,7 @@ static janus_callbacks janus_handler_plugin =
 		.relay_data = janus_relay_data,
 		.close_pc = janus_close_pc,
 		.end_session = janus_end_session,
+		.push_event_json = janus_push_event_json,
 	}; 
 ///@}
 
@@ -312,166 +368,291 @@ static janus_callbacks janus_handler_plugin =
 janus_rabbitmq_client *rmq_client = NULL;
 #endif
 
-/* Gateway Sessions */
-static janus_mutex sessions_mutex;
-static GHashTable *sessions = NULL, *old_sessions = NULL;
-static GMainContext *sessions_watchdog_context = NULL;
+/* Gateway Sessions: the registry is split in shards by session ID, each
+ * with its own lock, so that requests for different sessions don't contend,
+ * and lookups (by far the most common access) don't block each other.
+ * Sessions are only freed a while after they've been removed from it */
+#define SESSIONS_SHARDS_BITS	6
+#define SESSIONS_SHARDS		(1 << SESSIONS_SHARDS_BITS)
+typedef struct janus_sessions_shard {
+	/* Readers look sessions up, writers add and remove them */
+	GRWLock lock;
+	/* Active sessions, and sessions scheduled for deletion */
+	GHashTable *sessions, *old_sessions;
+} janus_sessions_shard;
+static janus_sessions_shard sessions_shards[SESSIONS_SHARDS];
+
+static janus_sessions_shard *janus_sessions_shard_get(guint64 session_id) {
+	/* Fibonacci hashing, as IDs may be chosen by applications rather than random */
+	return &sessions_shards[(session_id * G_GUINT64_CONSTANT(11400714819323198485)) >> (64 - SESSIONS_SHARDS_BITS)];
+}
 
 
 #define SESSION_TIMEOUT		60		/* FIXME Should this be higher, e.g., 120 seconds? */
 
-static gboolean janus_cleanup_session(gpointer user_data) {
+/* Sessions timeouts and cleanups are timers, and so they're all handled on
+ * the timer thread: as such, a session can't be freed while one of its
+ * timers is checking it, and doesn't need to be looked up again */
+static void janus_cleanup_session(gpointer user_data) {
 	janus_session *session = (janus_session *) user_data;
 
 	JANUS_LOG(LOG_DBG, "Cleaning up session %"SCNu64"...\n", session->session_id);
 	janus_session_destroy(session->session_id);
-
-	return G_SOURCE_REMOVE;
 }
 
-static gboolean janus_check_sessions(gpointer user_data) {
-	GMainContext *watchdog_context = (GMainContext *) user_data;
-	janus_mutex_lock(&sessions_mutex);
-	if(sessions && g_hash_table_size(sessions) > 0) {
-		GHashTableIter iter;
-		gpointer value;
-		g_hash_table_iter_init(&iter, sessions);
-		while (g_hash_table_iter_next(&iter, NULL, &value)) {
-			janus_session *session = (janus_session *) value;
-			if (!session || session->destroy) {
-				continue;
-			}
-			gint64 now = janus_get_monotonic_time();
-			if (now - session->last_activity >= SESSION_TIMEOUT * G_USEC_PER_SEC && !session->timeout) {
-				JANUS_LOG(LOG_INFO, "Timeout expired for session %"SCNu64"...\n", session->session_id);
-
-				json_t *event = json_object();
-				json_object_set_new(event, "janus", json_string("timeout"));
-				json_object_set_new(event, "session_id", json_integer(session->session_id));
-				gchar *event_text = json_dumps(event, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-				json_decref(event);
-
-				janus_http_event *notification = g_malloc0(sizeof(janus_http_event));
-				notification->code = 200;
-				notification->payload = event_text;
-				notification->allocated = 1;
-				g_async_queue_push(session->messages, notification);
-#ifdef HAVE_WEBSOCKETS
-				janus_request_source *source = (janus_request_source *)session->source;
-				if(source != NULL && source->type == JANUS_SOURCE_WEBSOCKETS) {
-					/* Send this as soon as the WebSocket becomes writeable */
-					janus_websocket_client *client = (janus_websocket_client *)source->source;
-					/* Make sure this is not related to a closed WebSocket session */
-					janus_mutex_lock(&old_wss_mutex);
-					if(g_list_find(old_wss, client) == NULL) {
-						janus_mutex_lock(&client->mutex);
-						libwebsocket_callback_on_writable(client->context, client->wsi);
-						janus_mutex_unlock(&client->mutex);
-					}
-					janus_mutex_unlock(&old_wss_mutex);
-				}
-#endif
-				session->timeout = 1;
-				g_hash_table_iter_remove(&iter);
-				g_hash_table_insert(old_sessions, GUINT_TO_POINTER(session->session_id), session);
-
-				/* Schedule the session for deletion */
-				GSource *timeout_source = g_timeout_source_new_seconds(3);
-				g_source_set_callback(timeout_source, janus_cleanup_session, session, NULL);
-				g_source_attach(timeout_source, watchdog_context);
-				g_source_unref(timeout_source);
-			}
-		}
+static void janus_session_timeout(janus_session *session) {
+	janus_sessions_shard *shard = janus_sessions_shard_get(session->session_id);
+	g_rw_lock_writer_lock(&shard->lock);
+	if(!g_hash_table_remove(shard->sessions, GUINT_TO_POINTER(session->session_id))) {
+		/* Destroyed in the meanwhile */
+		g_rw_lock_writer_unlock(&shard->lock);
+		return;
 	}
-	janus_mutex_unlock(&sessions_mutex);
+	g_hash_table_insert(shard->old_sessions, GUINT_TO_POINTER(session->session_id), session);
+	g_rw_lock_writer_unlock(&shard->lock);
+	JANUS_LOG(LOG_INFO, "Timeout expired for session %"SCNu64"...\n", session->session_id);
 
-	return G_SOURCE_CONTINUE;
-}
-
-static gpointer janus_sessions_watchdog(gpointer user_data) {
-	GMainLoop *loop = (GMainLoop *) user_data;
-	GMainContext *watchdog_context = g_main_loop_get_context(loop);
-	GSource *timeout_source;
-
-	timeout_source = g_timeout_source_new_seconds(2);
-	g_source_set_callback(timeout_source, janus_check_sessions, watchdog_context, NULL);
-	g_source_attach(timeout_source, watchdog_context);
-	g_source_unref(timeout_source);
+	json_t *event = json_object();
+	json_object_set_new(event, "janus", json_string("timeout"));
+	json_object_set_new(event, "session_id", json_integer(session->session_id));
 
-	JANUS_LOG(LOG_INFO, "Sessions watchdog started\n");
+	janus_http_event notification = { .code = 200, .json = event };
+	janus_session_push_event(session, &notification);
+	session->timeout = 1;
 
-	g_main_loop_run(loop);
+	/* Schedule the session for deletion */
+	janus_timer_schedule(&session->cleanup_timer, 3000);
+}
 
-	return NULL;
+static void janus_check_session(gpointer user_data) {
+	janus_session *session = (janus_session *) user_data;
+	if(session->destroy || session->timeout)
+		return;
+	gint64 due = session->last_activity + SESSION_TIMEOUT * G_USEC_PER_SEC;
+	gint64 now = janus_get_monotonic_time();
+	if(now < due) {
+		/* There's been activity in the meanwhile, check again later */
+		janus_timer_schedule(&session->timeout_timer, (due - now)/1000);
+		return;
+	}
+	janus_session_timeout(session);
 }
 
 janus_session *janus_session_create(guint64 session_id) {
-	if(session_id == 0) {
-		while(session_id == 0) {
-			session_id = g_random_int();
-			if(janus_session_find(session_id) != NULL) {
-				/* Session ID already taken, try another one */
-				session_id = 0;
-			}
-		}
-	}
-	JANUS_LOG(LOG_INFO, "Creating new session: %"SCNu64"\n", session_id);
 	janus_session *session = (janus_session *)g_malloc0(sizeof(janus_session));
 	if(session == NULL) {
 		JANUS_LOG(LOG_FATAL, "Memory error!\n");
 		return NULL;
 	}
-	session->session_id = session_id;
-	session->messages = g_async_queue_new_full((GDestroyNotify) janus_http_event_free);
+	session->events.slots = g_malloc0(session_events * sizeof(janus_http_event));
+	session->events.size = session_events;
 	session->destroy = 0;
 	session->last_activity = janus_get_monotonic_time();
+	session->longpolls = NULL;
+	janus_condition_init(&session->longpoll_cond);
+	janus_timer_init(&session->timeout_timer, janus_check_session, session);
+	janus_timer_init(&session->cleanup_timer, janus_cleanup_session, session);
 	janus_mutex_init(&session->mutex);
-	janus_mutex_lock(&sessions_mutex);
-	g_hash_table_insert(sessions, GUINT_TO_POINTER(session_id), session);
-	janus_mutex_unlock(&sessions_mutex);
+	/* The ID is checked and taken atomically */
+	gboolean random = (session_id == 0);
+	while(TRUE) {
+		if(random)
+			session_id = g_random_int();
+		if(session_id == 0)
+			continue;
+		janus_sessions_shard *shard = janus_sessions_shard_get(session_id);
+		g_rw_lock_writer_lock(&shard->lock);
+		if(g_hash_table_lookup(shard->sessions, GUINT_TO_POINTER(session_id)) == NULL) {
+			session->session_id = session_id;
+			g_hash_table_insert(shard->sessions, GUINT_TO_POINTER(session_id), session);
+			g_rw_lock_writer_unlock(&shard->lock);
+			break;
+		}
+		g_rw_lock_writer_unlock(&shard->lock);
+		if(!random) {
+			/* Somebody else took it in the meanwhile: the existing session stays */
+			JANUS_LOG(LOG_WARN, "Session ID %"SCNu64" already taken\n", session_id);
+			janus_session_free(session);
+			return NULL;
+		}
+		/* Session ID already taken, try another one */
+	}
+	JANUS_LOG(LOG_INFO, "Creating new session: %"SCNu64"\n", session_id);
+	janus_timer_schedule(&session->timeout_timer, SESSION_TIMEOUT*1000);
 	return session;
 }
 
 janus_session *janus_session_find(guint64 session_id) {
-	janus_mutex_lock(&sessions_mutex);
-	janus_session *session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id));
-	janus_mutex_unlock(&sessions_mutex);
+	janus_sessions_shard *shard = janus_sessions_shard_get(session_id);
+	g_rw_lock_reader_lock(&shard->lock);
+	janus_session *session = g_hash_table_lookup(shard->sessions, GUINT_TO_POINTER(session_id));
+	g_rw_lock_reader_unlock(&shard->lock);
 	return session;
 }
 
 janus_session *janus_session_find_destroyed(guint64 session_id) {
-	janus_mutex_lock(&sessions_mutex);
-	janus_session *session = g_hash_table_lookup(old_sessions, GUINT_TO_POINTER(session_id));
-	janus_mutex_unlock(&sessions_mutex);
+	janus_sessions_shard *shard = janus_sessions_shard_get(session_id);
+	g_rw_lock_reader_lock(&shard->lock);
+	janus_session *session = g_hash_table_lookup(shard->old_sessions, GUINT_TO_POINTER(session_id));
+	g_rw_lock_reader_unlock(&shard->lock);
 	return session;
 }
 
 void janus_session_notify_event(guint64 session_id, janus_http_event *event) {
-	janus_mutex_lock(&sessions_mutex);
-	janus_session *session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(session_id));
-	janus_mutex_unlock(&sessions_mutex);
+	janus_session *session = janus_session_find(session_id);
 	if(session != NULL) {
-		g_async_queue_push(session->messages, event);
-#ifdef HAVE_WEBSOCKETS
-		janus_request_source *source = (janus_request_source *)session->source;
-		if(source != NULL && source->type == JANUS_SOURCE_WEBSOCKETS) {
-			/* Send this as soon as the WebSocket becomes writeable */
-			janus_websocket_client *client = (janus_websocket_client *)source->source;
-			/* Make sure this is not related to a closed WebSocket session */
-			janus_mutex_lock(&old_wss_mutex);
-			if(g_list_find(old_wss, client) == NULL) {
-				janus_mutex_lock(&client->mutex);
-				libwebsocket_callback_on_writable(client->context, client->wsi);
-				janus_mutex_unlock(&client->mutex);
+		janus_session_push_event(session, event);
+		g_free(event);
+	} else {
+		janus_http_event_free(event);
+	}
+}
+
+/* Wakes up the long polls of a session: the mutex must be locked */
+static void janus_session_wakeup_locked(janus_session *session) {
+	/* Long polls served by the thread pool: resume their connections, the
+	 * handler will be invoked again and send what's in the ring */
+	GList *lp = session->longpolls;
+	session->longpolls = NULL;
+	while(lp != NULL) {
+		janus_http_msg *msg = (janus_http_msg *)lp->data;
+		MHD_resume_connection(msg->connection);
+		lp = g_list_delete_link(lp, lp);
+	}
+	/* Long polls served by a thread of their own */
+	janus_condition_broadcast(&session->longpoll_cond);
+}
+
+void janus_session_wakeup(janus_session *session) {
+	if(session == NULL)
+		return;
+	janus_mutex_lock(&session->mutex);
+	janus_session_wakeup_locked(session);
+	janus_mutex_unlock(&session->mutex);
+}
+
+void janus_session_push_event(janus_session *session, janus_http_event *event) {
+	if(session == NULL || event == NULL)
+		return;
+	janus_mutex_lock(&session->mutex);
+	janus_events_ring *ring = &session->events;
+	if(ring->slots == NULL) {
+		/* Session freed in the meanwhile */
+		janus_mutex_unlock(&session->mutex);
+		janus_http_event_clear(event);
+		return;
+	}
+	if(ring->count == ring->size) {
+		/* Full: the browser isn't keeping up, something has to go */
+		guint i = 0;
+		if(session_events_overflow == JANUS_EVENTS_COALESCE_LATEST && event->sender != 0) {
+			/* Replace the most recent notification from the same handle */
+			for(i = ring->count; i > 0; i--) {
+				janus_http_event *slot = &ring->slots[(ring->head + i-1) % ring->size];
+				if(slot->sender == event->sender) {
+					janus_http_event_clear(slot);
+					*slot = *event;
+					memset(event, 0, sizeof(*event));
+					ring->coalesced++;
+					/* Transports already know there's something to send */
+					janus_mutex_unlock(&session->mutex);
+					return;
+				}
 			}
-			janus_mutex_unlock(&old_wss_mutex);
 		}
-#endif
+		janus_http_event_clear(&ring->slots[ring->head]);
+		ring->head = (ring->head+1) % ring->size;
+		ring->count--;
+		ring->dropped++;
+		if(ring->dropped % 1000 == 1) {
+			JANUS_LOG(LOG_WARN, "Session %"SCNu64" has %u events waiting to be sent, dropped the oldest (%"SCNu64" so far)\n",
+				session->session_id, ring->size, ring->dropped);
+		}
 	}
+	/* The ring owns the content now */
+	ring->slots[(ring->head + ring->count) % ring->size] = *event;
+	ring->count++;
+	memset(event, 0, sizeof(*event));
+	janus_session_wakeup_locked(session);
+	janus_mutex_unlock(&session->mutex);
+#ifdef HAVE_WEBSOCKETS
+	janus_request_source *source = (janus_request_source *)session->source;
+	if(source != NULL && source->type == JANUS_SOURCE_WEBSOCKETS) {
+		/* Send this as soon as the WebSocket becomes writeable */
+		janus_wss_writable((janus_websocket_client *)source->source);
+	}
+#endif
+#ifdef HAVE_RABBITMQ
+	if(session->source != NULL && ((janus_request_source *)session->source)->type == JANUS_SOURCE_RABBITMQ)
+		janus_rmq_wakeup();
+#endif
 }
 
+guint janus_session_pop_events(janus_session *session, janus_http_event *events, guint max) {
+	if(session == NULL || events == NULL || max == 0)
+		return 0;
+	janus_mutex_lock(&session->mutex);
+	janus_events_ring *ring = &session->events;
+	guint n = MIN(max, ring->count), i = 0;
+	for(i = 0; i < n; i++) {
+		janus_http_event *slot = &ring->slots[ring->head];
+		events[i] = *slot;
+		memset(slot, 0, sizeof(*slot));
+		ring->head = (ring->head+1) % ring->size;
+	}
+	ring->count -= n;
+	janus_mutex_unlock(&session->mutex);
+	return n;
+}
 
-/* Destroys a session but does not remove it from the sessions hash table. */
+/* Takes up to max_events events from a session and returns them as the text
+ * to send back to a long poll (an array if max_events > 1), or NULL if there
+ * are none: events are taken in batches, so there's no per-event allocation
+ * other than their serialization */
+static char *janus_session_pop_events_text(janus_session *session, int max_events, size_t flags) {
+	janus_http_event batch[SESSION_EVENTS_BATCH];
+	if(max_events <= 1) {
+		if(janus_session_pop_events(session, batch, 1) == 0)
+			return NULL;
+		const char *payload = janus_http_event_payload(&batch[0], flags);
+		char *text = NULL;
+		if(batch[0].allocated && batch[0].payload != NULL) {
+			/* Serialized just for us, take it as it is */
+			text = batch[0].payload;
+			batch[0].payload = NULL;
+		} else {
+			text = g_strdup(payload ? payload : "");
+		}
+		janus_http_event_clear(&batch[0]);
+		return text;
+	}
+	/* The application is willing to receive more events at the same time, anything to report? */
+	json_t *list = NULL;
+	int events = 0;
+	while(events < max_events) {
+		guint n = janus_session_pop_events(session, batch, MIN(SESSION_EVENTS_BATCH, max_events - events)), i = 0;
+		if(n == 0)
+			break;
+		if(list == NULL)
+			list = json_array();
+		for(i = 0; i < n; i++) {
+			json_t *ev = janus_http_event_json(&batch[i]);
+			if(ev && json_is_object(ev))	/* FIXME Should we fail if this is not valid JSON? */
+				json_array_append_new(list, ev);
+			else if(ev)
+				json_decref(ev);
+			janus_http_event_clear(&batch[i]);
+		}
+		events += n;
+	}
+	if(list == NULL)
+		return NULL;
+	char *text = json_dumps(list, flags);
+	json_decref(list);
+	return text;
+}
+
+/* Destroys a session scheduled for deletion, and removes it from the old sessions. */
 gint janus_session_destroy(guint64 session_id) {
 	janus_session *session = janus_session_find_destroyed(session_id);
 	if(session == NULL) {
@@ -496,6 +677,10 @@ gint janus_session_destroy(guint64 session_id) {
 	}
 
 	/* FIXME Actually destroy session */
+	janus_sessions_shard *shard = janus_sessions_shard_get(session_id);
+	g_rw_lock_writer_lock(&shard->lock);
+	g_hash_table_remove(shard->old_sessions, GUINT_TO_POINTER(session_id));
+	g_rw_lock_writer_unlock(&shard->lock);
 	janus_session_free(session);
 
 	return 0;
@@ -504,14 +689,27 @@ gint janus_session_destroy(guint64 session_id) {
 void janus_session_free(janus_session *session) {
 	if(session == NULL)
 		return;
+	janus_timer_cancel(&session->timeout_timer);
+	janus_timer_cancel(&session->cleanup_timer);
 	janus_mutex_lock(&session->mutex);
 	if(session->ice_handles != NULL) {
 		g_hash_table_destroy(session->ice_handles);
 		session->ice_handles = NULL;
 	}
-	if(session->messages != NULL) {
-		g_async_queue_unref(session->messages);
-		session->messages = NULL;
+	if(session->events.slots != NULL) {
+		while(session->events.count > 0) {
+			janus_http_event_clear(&session->events.slots[session->events.head]);
+			session->events.head = (session->events.head+1) % session->events.size;
+			session->events.count--;
+		}
+		g_free(session->events.slots);
+		session->events.slots = NULL;
+	}
+	/* Don't leave any long poll suspended: they'll find the session gone */
+	while(session->longpolls != NULL) {
+		janus_http_msg *msg = (janus_http_msg *)session->longpolls->data;
+		MHD_resume_connection(msg->connection);
+		session->longpolls = g_list_delete_link(session->longpolls, session->longpolls);
 	}
 	janus_request_source *source = (janus_request_source *)session->source;
 	if(source != NULL) {
@@ -581,6 +779,15 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 	} else {
 		JANUS_LOG(LOG_DBG, "Processing HTTP %s request on %s...\n", method, url);
 	}
+	if(msg->longpoll) {
+		/* A suspended long poll has been resumed, send what it was waiting for */
+		janus_request_source source = {
+			.type = JANUS_SOURCE_PLAIN_HTTP,
+			.source = (void *)connection,
+			.msg = (void *)msg,
+		};
+		return janus_ws_notifier(&source, msg->max_events);
+	}
 	/* Parse request */
 	if (strcasecmp(method, "GET") && strcasecmp(method, "POST") && strcasecmp(method, "OPTIONS")) {
 		JANUS_LOG(LOG_ERR, "Unsupported method...\n");
@@ -724,7 +931,7 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			goto done;
 		}
 		/* Send the success reply */
-		ret = janus_process_success(&source, janus_info(NULL));
+		ret = janus_process_success(&source, janus_info(NULL, janus_json_format(&source)));
 		goto done;
 	}
 	
@@ -820,46 +1027,11 @@ int janus_ws_handler(void *cls, struct MHD_Connection *connection, const char *u
 			}
 		}
 		JANUS_LOG(LOG_VERB, "Session %"SCNu64" found... returning up to %d messages\n", session->session_id, max_events);
-		/* Handle GET, taking the first message from the list */
-		janus_http_event *event = g_async_queue_try_pop(session->messages);
-		if(event != NULL) {
-			if(max_events == 1) {
-				/* Return just this message and leave */
-				ret = janus_process_success(&source, event->payload);
-			} else {
-				/* The application is willing to receive more events at the same time, anything to report? */
-				json_t *list = json_array();
-				json_error_t error;
-				if(event->payload) {
-					json_t *ev = json_loads(event->payload, 0, &error);
-					if(ev && json_is_object(ev))	/* FIXME Should we fail if this is not valid JSON? */
-						json_array_append_new(list, ev);
-					g_free(event->payload);
-					event->payload = NULL;
-				}
-				g_free(event);
-				event = NULL;
-				int events = 1;
-				while(events < max_events) {
-					event = g_async_queue_try_pop(session->messages);
-					if(event == NULL)
-						break;
-					if(event->payload) {
-						json_t *ev = json_loads(event->payload, 0, &error);
-						if(ev && json_is_object(ev))	/* FIXME Should we fail if this is not valid JSON? */
-							json_array_append_new(list, ev);
-						g_free(event->payload);
-						event->payload = NULL;
-					}
-					g_free(event);
-					event = NULL;
-					events++;
-				}
-				/* Return the array of messages and leave */
-				char *event_text = json_dumps(list, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-				json_decref(list);
-				ret = janus_process_success(&source, event_text);
-			}
+		/* Handle GET, taking the first message(s) from the ring */
+		char *event_text = janus_session_pop_events_text(session, max_events, janus_json_format(&source));
+		if(event_text != NULL) {
+			/* Return the message(s) and leave */
+			ret = janus_process_success(&source, event_text);
 		} else {
 			/* Still no message, wait */
 			ret = janus_ws_notifier(&source, max_events);
@@ -896,17 +1068,43 @@ done:
 	return ret;
 }
 
+size_t janus_json_format(janus_request_source *source) {
+	if(source == NULL)
+		return json_format;
+	if(source->admin)
+		return admin_json_format;
+	switch(source->type) {
+		case JANUS_SOURCE_PLAIN_HTTP:
+			return http_json_format;
+		case JANUS_SOURCE_WEBSOCKETS:
+			return ws_json_format;
+		case JANUS_SOURCE_RABBITMQ:
+			return rmq_json_format;
+		default:
+			break;
+	}
+	return json_format;
+}
+
 janus_request_source *janus_request_source_new(int type, void *source, void *msg) {
 	janus_request_source *req_source = (janus_request_source *)g_malloc0(sizeof(janus_request_source));
 	req_source->type = type;
 	req_source->source = source;
 	req_source->msg = msg;
+#ifdef HAVE_WEBSOCKETS
+	if(type == JANUS_SOURCE_WEBSOCKETS)
+		janus_wss_client_ref((janus_websocket_client *)source);
+#endif
 	return req_source;
 }
 
 void janus_request_source_destroy(janus_request_source *req_source) {
 	if(req_source == NULL)
 		return;
+#ifdef HAVE_WEBSOCKETS
+	if(req_source->type == JANUS_SOURCE_WEBSOCKETS)
+		janus_wss_client_unref((janus_websocket_client *)req_source->source);
+#endif
 	req_source->source = NULL;
 	req_source->msg = NULL;
 	g_free(req_source);
@@ -948,31 +1146,33 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		goto jsondone;
 	}
 	const gchar *message_text = json_string_value(message);
+	/* Which request is this? (one lookup, whatever the request) */
+	janus_api_verb verb = janus_get_api_verb(message_text);
 	
 	if(session_id == 0 && handle_id == 0) {
 		/* Can only be a 'Create new session', a 'Get info' or a 'Ping/Pong' request */
-		if(!strcasecmp(message_text, "info")) {
-			ret = janus_process_success(source, janus_info(transaction_text));
+		if(verb == JANUS_API_VERB_INFO) {
+			ret = janus_process_success(source, janus_info(transaction_text, janus_json_format(source)));
 			goto jsondone;
 		}
-		if(!strcasecmp(message_text, "ping")) {
+		if(verb == JANUS_API_VERB_PING) {
 			/* Prepare JSON reply */
 			json_t *reply = json_object();
 			json_object_set_new(reply, "janus", json_string("pong"));
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			ret = janus_process_success(source, g_strdup(reply_text));
 			goto jsondone;
 		}
 #ifdef HAVE_RABBITMQ
-		if(!strcasecmp(message_text, "rmqtest")) {
+		if(verb == JANUS_API_VERB_RMQTEST) {
 			/* This is a request which is specifically conceived to send a notification
 			 * on the RabbitMQ outgoing queue, and as such can help debugging potential
 			 * issues there (e.g., whether Janus can still send messages on RabbitMQ) */
 			json_t *event = json_object();
 			json_object_set_new(event, "janus", json_string("rmqtest"));
-			char *event_text = json_dumps(event, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *event_text = json_dumps(event, janus_json_format(source));
 			json_decref(event);
 			janus_rabbitmq_response *response = (janus_rabbitmq_response *)g_malloc0(sizeof(janus_rabbitmq_response));
 			response->payload = event_text;
@@ -982,13 +1182,13 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 			json_t *reply = json_object();
 			json_object_set_new(reply, "janus", json_string("success"));
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			ret = janus_process_success(source, g_strdup(reply_text));
 			goto jsondone;
 		}
 #endif
-		if(strcasecmp(message_text, "create")) {
+		if(verb != JANUS_API_VERB_CREATE) {
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
 			goto jsondone;
 		}
@@ -1037,7 +1237,12 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		/* Handle it */
 		janus_session *session = janus_session_create(session_id);
 		if(session == NULL) {
-			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Memory error");
+			if(session_id > 0 && janus_session_find(session_id) != NULL) {
+				/* A concurrent request took the same ID first */
+				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_SESSION_CONFLICT, "Session ID already in use");
+			} else {
+				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Memory error");
+			}
 			goto jsondone;
 		}
 		session_id = session->session_id;
@@ -1049,9 +1254,11 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 			janus_websocket_client *client = (janus_websocket_client *)source->source;
 			if(client) {
 				janus_mutex_lock(&client->mutex);
-				if(client->sessions == NULL)
-					client->sessions = g_hash_table_new(NULL, NULL);
-				g_hash_table_insert(client->sessions, GUINT_TO_POINTER(session_id), session);
+				if(!client->destroy) {
+					if(client->sessions == NULL)
+						client->sessions = g_hash_table_new(NULL, NULL);
+					g_hash_table_insert(client->sessions, GUINT_TO_POINTER(session_id), session);
+				}
 				janus_mutex_unlock(&client->mutex);
 			}
 		}
@@ -1077,7 +1284,7 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		json_object_set_new(data, "id", json_integer(session_id));
 		json_object_set_new(reply, "data", data);
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
@@ -1147,7 +1354,7 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 	session->last_activity = janus_get_monotonic_time();
 
 	/* What is this? */
-	if(!strcasecmp(message_text, "keepalive")) {
+	if(verb == JANUS_API_VERB_KEEPALIVE) {
 		/* Just a keep-alive message, reply with an ack */
 		JANUS_LOG(LOG_VERB, "Got a keep-alive on session %"SCNu64"\n", session_id);
 		json_t *reply = json_object();
@@ -1155,11 +1362,11 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		json_object_set_new(reply, "session_id", json_integer(session_id));
 		json_object_set_new(reply, "transaction", json_string(transaction_text));
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
-	} else if(!strcasecmp(message_text, "attach")) {
+	} else if(verb == JANUS_API_VERB_ATTACH) {
 		if(handle != NULL) {
 			/* Attach is a session-level command */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
@@ -1220,11 +1427,11 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		json_object_set_new(data, "id", json_integer(handle_id));
 		json_object_set_new(reply, "data", data);
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
-	} else if(!strcasecmp(message_text, "destroy")) {
+	} else if(verb == JANUS_API_VERB_DESTROY) {
 		if(handle != NULL) {
 			/* Query is a session-level command */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
@@ -1234,15 +1441,12 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		if(source->type == JANUS_SOURCE_WEBSOCKETS) {
 			/* Remove the session from the list of sessions created by this WS client */
 			janus_websocket_client *client = (janus_websocket_client *)source->source;
-			/* Make sure this is not related to a closed WebSocket session */
-			janus_mutex_lock(&old_wss_mutex);
-			if(client != NULL && g_list_find(old_wss, client) == NULL) {
+			if(client != NULL) {
 				janus_mutex_lock(&client->mutex);
 				if(client->sessions)
 					g_hash_table_remove(client->sessions, GUINT_TO_POINTER(session_id));
 				janus_mutex_unlock(&client->mutex);
 			}
-			janus_mutex_unlock(&old_wss_mutex);
 		}
 #endif
 #ifdef HAVE_RABBITMQ
@@ -1257,14 +1461,15 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 #endif
 		/* Schedule the session for deletion */
 		session->destroy = 1;
-		janus_mutex_lock(&sessions_mutex);
-		g_hash_table_remove(sessions, GUINT_TO_POINTER(session->session_id));
-		g_hash_table_insert(old_sessions, GUINT_TO_POINTER(session->session_id), session);
-		GSource *timeout_source = g_timeout_source_new_seconds(3);
-		g_source_set_callback(timeout_source, janus_cleanup_session, session, NULL);
-		g_source_attach(timeout_source, sessions_watchdog_context);
-		g_source_unref(timeout_source);
-		janus_mutex_unlock(&sessions_mutex);
+		janus_session_wakeup(session);
+		janus_sessions_shard *shard = janus_sessions_shard_get(session->session_id);
+		g_rw_lock_writer_lock(&shard->lock);
+		/* If it timed out in the meanwhile, it's already scheduled */
+		if(g_hash_table_remove(shard->sessions, GUINT_TO_POINTER(session->session_id))) {
+			g_hash_table_insert(shard->old_sessions, GUINT_TO_POINTER(session->session_id), session);
+			janus_timer_schedule(&session->cleanup_timer, 3000);
+		}
+		g_rw_lock_writer_unlock(&shard->lock);
 
 		/* Prepare JSON reply */
 		json_t *reply = json_object();
@@ -1272,11 +1477,11 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		json_object_set_new(reply, "session_id", json_integer(session_id));
 		json_object_set_new(reply, "transaction", json_string(transaction_text));
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
-	} else if(!strcasecmp(message_text, "detach")) {
+	} else if(verb == JANUS_API_VERB_DETACH) {
 		if(handle == NULL) {
 			/* Query is an handle-level command */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
@@ -1303,11 +1508,11 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 		json_object_set_new(reply, "session_id", json_integer(session_id));
 		json_object_set_new(reply, "transaction", json_string(transaction_text));
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
-	} else if(!strcasecmp(message_text, "message")) {
+	} else if(verb == JANUS_API_VERB_MESSAGE) {
 		if(handle == NULL) {
 			/* Query is an handle-level command */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
@@ -1673,9 +1878,18 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 			goto jsondone;
 		}
 
-		/* Send the message to the plugin (which must eventually free transaction_text, body_text, jsep_type and sdp) */
-		char *body_text = json_dumps(body, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-		janus_plugin_result *result = plugin_t->handle_message(handle->app_handle, g_strdup((char *)transaction_text), body_text, jsep_type, jsep_sdp_stripped);
+		/* Send the message to the plugin (which must eventually free transaction_text, the body, jsep_type and sdp) */
+		janus_plugin_result *result = NULL;
+		if(plugin_t->handle_message_json != NULL) {
+			/* The plugin can take the body as it is: detach it from the request,
+			 * so that the plugin ends up holding the only reference to it */
+			json_incref(body);
+			json_object_del(root, "body");
+			result = plugin_t->handle_message_json(handle->app_handle, g_strdup((char *)transaction_text), body, jsep_type, jsep_sdp_stripped);
+		} else {
+			char *body_text = json_dumps(body, JSON_COMPACT | JSON_PRESERVE_ORDER);
+			result = plugin_t->handle_message(handle->app_handle, g_strdup((char *)transaction_text), body_text, jsep_type, jsep_sdp_stripped);
+		}
 		if(result == NULL) {
 			/* Something went horribly wrong! */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_PLUGIN_MESSAGE, "Plugin didn't give a result");
@@ -1715,7 +1929,7 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 			json_object_set_new(plugin_data, "data", event);
 			json_object_set_new(reply, "plugindata", plugin_data);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			if(jsep != NULL)
 				json_decref(jsep);
 			json_decref(reply);
@@ -1730,7 +1944,7 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 				json_object_set_new(reply, "hint", json_string(result->content));
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
@@ -1741,7 +1955,7 @@ int janus_process_incoming_request(janus_request_source *source, json_t *root) {
 			goto jsondone;
 		}			
 		janus_plugin_result_destroy(result);
-	} else if(!strcasecmp(message_text, "trickle")) {
+	} else if(verb == JANUS_API_VERB_TRICKLE) {
 		if(handle == NULL) {
 			/* Trickle is an handle-level command */
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
@@ -1821,7 +2035,7 @@ trickledone:
 		json_object_set_new(reply, "session_id", json_integer(session_id));
 		json_object_set_new(reply, "transaction", json_string(transaction_text));
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
@@ -2001,6 +2215,7 @@ int janus_admin_ws_handler(void *cls, struct MHD_Connection *connection, const c
 		.type = JANUS_SOURCE_PLAIN_HTTP,
 		.source = (void *)connection,
 		.msg = (void *)msg,
+		.admin = 1,
 	};
 	
 	/* Is this a generic request for info? */
@@ -2011,7 +2226,7 @@ int janus_admin_ws_handler(void *cls, struct MHD_Connection *connection, const c
 			goto done;
 		}
 		/* Send the success reply */
-		ret = janus_process_success(&source, janus_info(NULL));
+		ret = janus_process_success(&source, janus_info(NULL, janus_json_format(&source)));
 		goto done;
 	}
 	
@@ -2086,12 +2301,14 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 		goto jsondone;
 	}
 	const gchar *message_text = json_string_value(message);
+	/* Which request is this? (one lookup, whatever the request) */
+	janus_api_verb verb = janus_get_api_verb(message_text);
 	
 	if(session_id == 0 && handle_id == 0) {
 		/* Can only be a 'Get all sessions' or some general setting manipulation request */
-		if(!strcasecmp(message_text, "info")) {
+		if(verb == JANUS_API_VERB_INFO) {
 			/* The generic info request */
-			ret = janus_process_success(source, janus_info(transaction_text));
+			ret = janus_process_success(source, janus_info(transaction_text, janus_json_format(source)));
 			goto jsondone;
 		}
 		if(admin_ws_api_secret != NULL) {
@@ -2102,7 +2319,7 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 				goto jsondone;
 			}
 		}
-		if(!strcasecmp(message_text, "get_status")) {
+		if(verb == JANUS_API_VERB_GET_STATUS) {
 			/* Return some info on the settings (mostly debug-related, at the moment) */
 			json_t *reply = json_object();
 			json_object_set_new(reply, "janus", json_string("success"));
@@ -2115,14 +2332,18 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(status, "locking_debug", json_integer(lock_debug));
 			json_object_set_new(status, "libnice_debug", json_integer(janus_ice_is_ice_debugging_enabled()));
 			json_object_set_new(status, "max_nack_queue", json_integer(janus_get_max_nack_queue()));
+#ifdef HAVE_RABBITMQ
+			if(rmq_client != NULL)
+				json_object_set_new(status, "rabbitmq", janus_rmq_stats_json());
+#endif
 			json_object_set_new(reply, "status", status);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_log_level")) {
+		} else if(verb == JANUS_API_VERB_SET_LOG_LEVEL) {
 			/* Change the debug logging level */
 			json_t *level = json_object_get(root, "level");
 			if(!level) {
@@ -2148,12 +2369,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "level", json_integer(janus_log_level));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_locking_debug")) {
+		} else if(verb == JANUS_API_VERB_SET_LOCKING_DEBUG) {
 			/* Enable/disable the locking debug (would show a message on the console for every lock attempt) */
 			json_t *debug = json_object_get(root, "debug");
 			if(!debug) {
@@ -2176,12 +2397,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "locking_debug", json_integer(lock_debug));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_log_timestamps")) {
+		} else if(verb == JANUS_API_VERB_SET_LOG_TIMESTAMPS) {
 			/* Enable/disable the log timestamps */
 			json_t *timestamps = json_object_get(root, "timestamps");
 			if(!timestamps) {
@@ -2204,12 +2425,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "log_timestamps", json_integer(janus_log_timestamps));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_log_colors")) {
+		} else if(verb == JANUS_API_VERB_SET_LOG_COLORS) {
 			/* Enable/disable the log colors */
 			json_t *colors = json_object_get(root, "colors");
 			if(!colors) {
@@ -2232,12 +2453,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "log_colors", json_integer(janus_log_colors));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_libnice_debug")) {
+		} else if(verb == JANUS_API_VERB_SET_LIBNICE_DEBUG) {
 			/* Enable/disable the libnice debugging (http://nice.freedesktop.org/libnice/libnice-Debug-messages.html) */
 			json_t *debug = json_object_get(root, "debug");
 			if(!debug) {
@@ -2264,12 +2485,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "libnice_debug", json_integer(janus_ice_is_ice_debugging_enabled()));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "set_max_nack_queue")) {
+		} else if(verb == JANUS_API_VERB_SET_MAX_NACK_QUEUE) {
 			/* Change the current value for the max NACK queue */
 			json_t *mnq = json_object_get(root, "max_nack_queue");
 			if(!mnq) {
@@ -2292,20 +2513,22 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "max_nack_queue", json_integer(janus_get_max_nack_queue()));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "list_sessions")) {
+		} else if(verb == JANUS_API_VERB_LIST_SESSIONS) {
 			/* List sessions */
 			session_id = 0;
 			json_t *list = json_array();
-			if(sessions != NULL && g_hash_table_size(sessions) > 0) {
-				janus_mutex_lock(&sessions_mutex);
+			int i = 0;
+			for(i = 0; i < SESSIONS_SHARDS; i++) {
+				janus_sessions_shard *shard = &sessions_shards[i];
+				g_rw_lock_reader_lock(&shard->lock);
 				GHashTableIter iter;
 				gpointer value;
-				g_hash_table_iter_init(&iter, sessions);
+				g_hash_table_iter_init(&iter, shard->sessions);
 				while (g_hash_table_iter_next(&iter, NULL, &value)) {
 					janus_session *session = value;
 					if(session == NULL) {
@@ -2313,7 +2536,7 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 					}
 					json_array_append_new(list, json_integer(session->session_id));
 				}
-				janus_mutex_unlock(&sessions_mutex);
+				g_rw_lock_reader_unlock(&shard->lock);
 			}
 			/* Prepare JSON reply */
 			json_t *reply = json_object();
@@ -2321,12 +2544,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			json_object_set_new(reply, "sessions", list);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "add_token")) {
+		} else if(verb == JANUS_API_VERB_ADD_TOKEN) {
 			/* Add a token valid for authentication */
 			if(!janus_auth_is_enabled()) {
 				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Token based authentication disabled");
@@ -2413,12 +2636,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(data, "plugins", plugins_list);
 			json_object_set_new(reply, "data", data);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "list_tokens")) {
+		} else if(verb == JANUS_API_VERB_LIST_TOKENS) {
 			/* List all the valid tokens */
 			if(!janus_auth_is_enabled()) {
 				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Token based authentication disabled");
@@ -2463,12 +2686,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(data, "tokens", tokens_list);
 			json_object_set_new(reply, "data", data);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "allow_token")) {
+		} else if(verb == JANUS_API_VERB_ALLOW_TOKEN) {
 			/* Allow a valid token valid to access a plugin */
 			if(!janus_auth_is_enabled()) {
 				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Token based authentication disabled");
@@ -2556,12 +2779,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(data, "plugins", plugins_list);
 			json_object_set_new(reply, "data", data);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "disallow_token")) {
+		} else if(verb == JANUS_API_VERB_DISALLOW_TOKEN) {
 			/* Disallow a valid token valid from accessing a plugin */
 			if(!janus_auth_is_enabled()) {
 				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Token based authentication disabled");
@@ -2649,12 +2872,12 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(data, "plugins", plugins_list);
 			json_object_set_new(reply, "data", data);
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
 			goto jsondone;
-		} else if(!strcasecmp(message_text, "remove_token")) {
+		} else if(verb == JANUS_API_VERB_REMOVE_TOKEN) {
 			/* Invalidate a token for authentication purposes */
 			if(!janus_auth_is_enabled()) {
 				ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_UNKNOWN, "Token based authentication disabled");
@@ -2679,7 +2902,7 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 			json_object_set_new(reply, "janus", json_string("success"));
 			json_object_set_new(reply, "transaction", json_string(transaction_text));
 			/* Convert to a string */
-			char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+			char *reply_text = json_dumps(reply, janus_json_format(source));
 			json_decref(reply);
 			/* Send the success reply */
 			ret = janus_process_success(source, reply_text);
@@ -2736,7 +2959,7 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 	/* What is this? */
 	if(handle == NULL) {
 		/* Session-related */
-		if(strcasecmp(message_text, "list_handles")) {
+		if(verb != JANUS_API_VERB_LIST_HANDLES) {
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
 			goto jsondone;
 		}
@@ -2763,14 +2986,14 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 		json_object_set_new(reply, "session_id", json_integer(session_id));
 		json_object_set_new(reply, "handles", list);
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
 		goto jsondone;
 	} else {
 		/* Handle-related */
-		if(strcasecmp(message_text, "handle_info")) {
+		if(verb != JANUS_API_VERB_HANDLE_INFO) {
 			ret = janus_process_error(source, session_id, transaction_text, JANUS_ERROR_INVALID_REQUEST_PATH, "Unhandled request '%s' at this path", message_text);
 			goto jsondone;
 		}
@@ -2859,7 +3082,7 @@ int janus_process_incoming_admin_request(janus_request_source *source, json_t *r
 		json_object_set_new(reply, "handle_id", json_integer(handle_id));
 		json_object_set_new(reply, "info", info);
 		/* Convert to a string */
-		char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+		char *reply_text = json_dumps(reply, janus_json_format(source));
 		json_decref(reply);
 		/* Send the success reply */
 		ret = janus_process_success(source, reply_text);
@@ -2893,6 +3116,8 @@ void janus_ws_request_completed(void *cls, struct MHD_Connection *connection, vo
 	janus_http_msg *request = *con_cls;
 	if(!request)
 		return;
+	/* Make sure a timer isn't going to resume it anymore */
+	janus_timer_cancel(&request->longpoll_timer);
 	if(request->payload != NULL)
 		g_free(request->payload);
 	if(request->contenttype != NULL)
@@ -2906,6 +3131,22 @@ void janus_ws_request_completed(void *cls, struct MHD_Connection *connection, vo
 }
 
 /* Worker to handle notifications */
+/* A suspended long poll timed out: resume it, it will get a keep-alive */
+static void janus_ws_longpoll_timeout(gpointer user_data) {
+	janus_http_msg *msg = (janus_http_msg *)user_data;
+	janus_session *session = janus_session_find(msg->session_id);
+	if(session == NULL)
+		return;
+	janus_mutex_lock(&session->mutex);
+	/* The session may have resumed it already, if events came */
+	GList *lp = g_list_find(session->longpolls, msg);
+	if(lp != NULL) {
+		session->longpolls = g_list_delete_link(session->longpolls, lp);
+		MHD_resume_connection(msg->connection);
+	}
+	janus_mutex_unlock(&session->mutex);
+}
+
 int janus_ws_notifier(janus_request_source *source, int max_events) {
 	if(!source || source->type != JANUS_SOURCE_PLAIN_HTTP)
 		return MHD_NO;
@@ -2916,7 +3157,6 @@ int janus_ws_notifier(janus_request_source *source, int max_events) {
 	if(max_events < 1)
 		max_events = 1;
 	JANUS_LOG(LOG_DBG, "... handling long poll...\n");
-	janus_http_event *event = NULL;
 	struct MHD_Response *response = NULL;
 	int ret = MHD_NO;
 	guint64 session_id = msg->session_id;
@@ -2933,108 +3173,55 @@ int janus_ws_notifier(janus_request_source *source, int max_events) {
 		MHD_destroy_response(response);
 		return ret;
 	}
-	gint64 start = janus_get_monotonic_time();
-	gint64 end = 0;
-	json_t *list = NULL;
-	gboolean found = FALSE;
-	/* We have a timeout for the long poll: 30 seconds */
-	while(end-start < 30*G_USEC_PER_SEC) {
-		event = g_async_queue_try_pop(session->messages);
-		if(!session || session->destroy || g_atomic_int_get(&stop) || event != NULL) {
-			if(event == NULL)
-				break;
-			/* Gotcha! */
-			found = TRUE;
-			if(max_events == 1) {
-				break;
-			} else {
-				/* The application is willing to receive more events at the same time, anything to report? */
-				list = json_array();
-				json_error_t error;
-				if(event->payload) {
-					json_t *ev = json_loads(event->payload, 0, &error);
-					if(ev && json_is_object(ev))	/* FIXME Should we fail if this is not valid JSON? */
-						json_array_append_new(list, ev);
-					g_free(event->payload);
-					event->payload = NULL;
-				}
-				g_free(event);
-				event = NULL;
-				int events = 1;
-				while(events < max_events) {
-					event = g_async_queue_try_pop(session->messages);
-					if(event == NULL)
-						break;
-					if(event->payload) {
-						json_t *ev = json_loads(event->payload, 0, &error);
-						if(ev && json_is_object(ev))	/* FIXME Should we fail if this is not valid JSON? */
-							json_array_append_new(list, ev);
-						g_free(event->payload);
-						event->payload = NULL;
-					}
-					g_free(event);
-					event = NULL;
-					events++;
+	if(!msg->longpoll) {
+		/* We have a timeout for the long poll: 30 seconds */
+		msg->longpoll = 1;
+		msg->connection = connection;
+		msg->max_events = max_events;
+		msg->deadline = janus_get_monotonic_time() + LONGPOLL_TIMEOUT*G_USEC_PER_SEC;
+		janus_timer_init(&msg->longpoll_timer, janus_ws_longpoll_timeout, msg);
+		/* The queue is checked with the session locked, so that a concurrent
+		 * janus_session_wakeup either sees this long poll or we see its event */
+		janus_mutex_lock(&session->mutex);
+		if(ws_suspend) {
+			if(session->events.count == 0 && !session->destroy && !g_atomic_int_get(&stop)) {
+				/* Nothing to send yet, park the connection until there is */
+				JANUS_LOG(LOG_DBG, "Suspending long poll for session %"SCNu64"...\n", session_id);
+				MHD_suspend_connection(connection);
+				session->longpolls = g_list_prepend(session->longpolls, msg);
+				janus_timer_schedule(&msg->longpoll_timer, LONGPOLL_TIMEOUT*1000);
+				janus_mutex_unlock(&session->mutex);
+				return MHD_YES;
+			}
+		} else {
+			/* This thread is ours anyway, wait until there's something to send */
+			while(session->events.count == 0 && !session->destroy && !g_atomic_int_get(&stop)) {
+				gint64 left = msg->deadline - janus_get_monotonic_time();
+				if(left <= 0)
+					break;
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += left/G_USEC_PER_SEC;
+				until.tv_nsec += (left%G_USEC_PER_SEC)*1000;
+				if(until.tv_nsec >= 1000000000) {
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000;
 				}
-				break;
+				janus_condition_timedwait(&session->longpoll_cond, &session->mutex, &until);
 			}
 		}
-		/* Sleep 100ms */
-		g_usleep(100000);
-		end = janus_get_monotonic_time();
+		janus_mutex_unlock(&session->mutex);
 	}
-	if(!found) {
+	char *payload = janus_session_pop_events_text(session, max_events, janus_json_format(source));
+	if(payload == NULL) {
 		JANUS_LOG(LOG_VERB, "Long poll time out for session %"SCNu64"...\n", session_id);
-		event = (janus_http_event *)g_malloc0(sizeof(janus_http_event));
-		if(event == NULL) {
-			JANUS_LOG(LOG_FATAL, "Memory error!\n");
-			ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
-			MHD_destroy_response(response);
-			return ret;
-		}
-		event->code = 200;
 		/*! \todo Improve the Janus protocol keep-alive mechanism in JavaScript */
-		event->payload = (char *)(max_events == 1 ? "{\"janus\" : \"keepalive\"}" : "[{\"janus\" : \"keepalive\"}]");
-		event->allocated = 0;
-	}
-	if(list != NULL) {
-		event = (janus_http_event *)g_malloc0(sizeof(janus_http_event));
-		if(event == NULL) {
-			JANUS_LOG(LOG_FATAL, "Memory error!\n");
-			ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
-			MHD_destroy_response(response);
-			return ret;
-		}
-		event->code = 200;
-		char *event_text = json_dumps(list, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-		json_decref(list);
-		event->payload = event_text;
-		event->allocated = 1;
+		payload = g_strdup(max_events == 1 ? "{\"janus\" : \"keepalive\"}" : "[{\"janus\" : \"keepalive\"}]");
 	}
-	/* Finish the request by sending the response */
-	JANUS_LOG(LOG_VERB, "We have a message to serve...\n\t%s\n", event->payload);
+	/* Finish the request by sending the response (this is where queued JSON events get serialized) */
+	JANUS_LOG(LOG_VERB, "We have a message to serve...\n\t%s\n", payload);
 	/* Send event */
-	char *payload = g_strdup(event && event->payload ? event->payload : "");
-	if(payload == NULL) {
-		JANUS_LOG(LOG_FATAL, "Memory error!\n");
-		ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, response);
-		MHD_destroy_response(response);
-		if(event->payload && event->allocated) {
-			g_free(event->payload);
-			event->payload = NULL;
-		}
-		g_free(event);
-		return ret;
-	}
-	ret = janus_process_success(source, payload);
-	if(event != NULL) {
-		if(event->payload && event->allocated) {
-			g_free(event->payload);
-			event->payload = NULL;
-		}
-		g_free(event);
-	}
-	return ret;
+	return janus_process_success(source, payload);
 }
 
 int janus_process_success(janus_request_source *source, char *payload)
@@ -3067,16 +3254,12 @@ int janus_process_success(janus_request_source *source, char *payload)
 #ifdef HAVE_WEBSOCKETS
 		janus_websocket_client *client = (janus_websocket_client *)source->source;
 		/* Make sure this is not related to a closed WebSocket session */
-		janus_mutex_lock(&old_wss_mutex);
-		if(g_list_find(old_wss, client) == NULL) {
+		if(!g_atomic_int_get(&client->destroy)) {
 			g_async_queue_push(client->responses, payload);
-			janus_mutex_lock(&client->mutex);
-			libwebsocket_callback_on_writable(client->context, client->wsi);
-			janus_mutex_unlock(&client->mutex);
+			janus_wss_writable(client);
 		} else {
 			g_free(payload);
 		}
-		janus_mutex_unlock(&old_wss_mutex);
 		return MHD_YES;
 #else
 		JANUS_LOG(LOG_ERR, "WebSockets support not compiled\n");
@@ -3152,7 +3335,7 @@ int janus_process_error(janus_request_source *source, uint64_t session_id, const
 	json_object_set_new(error_data, "reason", json_string(error_string ? error_string : "no text"));
 	json_object_set_new(reply, "error", error_data);
 	/* Convert to a string */
-	char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+	char *reply_text = json_dumps(reply, janus_json_format(source));
 	json_decref(reply);
 	if(format != NULL && error_string != NULL)
 		g_free(error_string);
@@ -3182,16 +3365,12 @@ int janus_process_error(janus_request_source *source, uint64_t session_id, const
 #ifdef HAVE_WEBSOCKETS
 		janus_websocket_client *client = (janus_websocket_client *)source->source;
 		/* Make sure this is not related to a closed WebSocket session */
-		janus_mutex_lock(&old_wss_mutex);
-		if(g_list_find(old_wss, client) == NULL) {
+		if(!g_atomic_int_get(&client->destroy)) {
 			g_async_queue_push(client->responses, reply_text);
-			janus_mutex_lock(&client->mutex);
-			libwebsocket_callback_on_writable(client->context, client->wsi);
-			janus_mutex_unlock(&client->mutex);
+			janus_wss_writable(client);
 		} else {
 			g_free(reply_text);
 		}
-		janus_mutex_unlock(&old_wss_mutex);
 		return MHD_YES;
 #else
 		JANUS_LOG(LOG_ERR, "WebSockets support not compiled\n");
@@ -3338,42 +3517,89 @@ static int janus_wss_callback_https(struct libwebsocket_context *this,
 	return janus_wss_callback_http(this, wsi, reason, user, in, len);
 }
 
+/* Sends a message on a WebSocket, copying it to the client buffer (which
+ * only grows when needed) for the padding libwebsockets wants around it:
+ * the client mutex must be locked */
+static int janus_wss_write(janus_websocket_client *ws_client, const char *text) {
+	size_t len = strlen(text);
+	size_t needed = LWS_SEND_BUFFER_PRE_PADDING + len + LWS_SEND_BUFFER_POST_PADDING;
+	if(ws_client->buflen < needed) {
+		g_free(ws_client->buffer);
+		ws_client->buffer = g_malloc0(needed);
+		ws_client->buflen = needed;
+	}
+	memcpy(ws_client->buffer+LWS_SEND_BUFFER_PRE_PADDING, text, len);
+	JANUS_LOG(LOG_VERB, "Sending WebSocket response (%zu bytes)...\n", len);
+	int sent = libwebsocket_write(ws_client->wsi, ws_client->buffer+LWS_SEND_BUFFER_PRE_PADDING, len, LWS_WRITE_TEXT);
+	JANUS_LOG(LOG_VERB, "  -- Sent %d/%zu bytes\n", sent, len);
+	return sent;
+}
+
+static janus_websocket_client *janus_wss_client_ref(janus_websocket_client *client) {
+	if(client != NULL)
+		g_atomic_int_inc(&client->ref);
+	return client;
+}
+
+static void janus_wss_client_unref(janus_websocket_client *client) {
+	if(client == NULL || !g_atomic_int_dec_and_test(&client->ref))
+		return;
+	/* Last reference gone, the connection was closed long ago */
+	if(client->responses != NULL) {
+		char *response = NULL;
+		while((response = g_async_queue_try_pop(client->responses)) != NULL)
+			g_free(response);
+		g_async_queue_unref(client->responses);
+	}
+	g_free(client->buffer);
+	janus_mutex_destroy(&client->mutex);
+	g_free(client);
+}
+
+/* Asks libwebsockets for a writable callback on a client that hasn't been
+ * closed, unless one is pending already: whatever is queued until it's served
+ * will be sent then, in as many writes as the socket takes. The caller must
+ * hold a reference to the client (e.g., through a request source) */
+static void janus_wss_writable(janus_websocket_client *client) {
+	if(client == NULL || g_atomic_int_get(&client->destroy))
+		return;
+	if(!g_atomic_int_compare_and_exchange(&client->writable, 0, 1))
+		return;
+	janus_mutex_lock(&client->mutex);
+	if(!client->destroy)
+		libwebsocket_callback_on_writable(client->context, client->wsi);
+	janus_mutex_unlock(&client->mutex);
+}
+
 static int janus_wss_callback(struct libwebsocket_context *this,
 		struct libwebsocket *wsi,
 		enum libwebsocket_callback_reasons reason,
 		void *user, void *in, size_t len)
 {
-	janus_websocket_client *ws_client = (janus_websocket_client *)user;
+	janus_websocket_client **connection = (janus_websocket_client **)user;
+	janus_websocket_client *ws_client = connection ? *connection : NULL;
 	switch(reason) {
 		case LWS_CALLBACK_ESTABLISHED: {
 			JANUS_LOG(LOG_VERB, "[WSS-%p] WebSocket connection accepted\n", wsi);
-			if(ws_client == NULL) {
+			if(connection == NULL) {
 				JANUS_LOG(LOG_ERR, "[WSS-%p] Invalid WebSocket client instance...\n", wsi);
 				return 1;
 			}
-			/* Clean the old sessions list, in case this pointer was used before */
-			janus_mutex_lock(&old_wss_mutex);
-			if(g_list_find(old_wss, ws_client) != NULL)
-				old_wss = g_list_remove(old_wss, ws_client);
-			janus_mutex_unlock(&old_wss_mutex);
-			/* Prepare the session */
+			/* Prepare the session: the connection holds the first reference, and
+			 * requests are served by the shared thread pool */
+			ws_client = g_malloc0(sizeof(janus_websocket_client));
+			ws_client->ref = 1;
+			*connection = ws_client;
 			ws_client->context = this;
 			ws_client->wsi = wsi;
-			/* Create a thread pool to handle incoming requests */
-			GError *error = NULL;
-			GThreadPool *thread_pool = g_thread_pool_new(janus_wss_task, ws_client, -1, FALSE, &error);
-			if(error != NULL) {
-				/* Something went wrong... */
-				JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the pool thread...\n", error->code, error->message ? error->message : "??");
-				/* Close and free connection */
-				return 1;
-			}
-			ws_client->thread_pool = thread_pool;
 			ws_client->responses = g_async_queue_new();
 			ws_client->sessions = NULL;
+			ws_client->buffer = NULL;
+			ws_client->buflen = 0;
 			ws_client->destroy = 0;
 			janus_mutex_init(&ws_client->mutex);
 			/* Let us know when the WebSocket channel becomes writeable */
+			g_atomic_int_set(&ws_client->writable, 1);
 			libwebsocket_callback_on_writable(this, wsi);
 			JANUS_LOG(LOG_VERB, "[WSS-%p]   -- Ready to be used!\n", wsi);
 			return 0;
@@ -3408,18 +3634,17 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 			}
 			/* Parse the request now */
 			janus_websocket_request *request = (janus_websocket_request *)g_malloc0(sizeof(janus_websocket_request));
+			request->client = ws_client;
 			request->source = source;
 			request->request = root;
 			GError *tperror = NULL;
-			g_thread_pool_push(ws_client->thread_pool, request, &tperror);
+			g_thread_pool_push(wss_pool, request, &tperror);
 			if(tperror != NULL) {
 				/* Something went wrong... */
-				JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to push task in thread pool...\n", tperror->code, tperror->message ? tperror->message : "??");
-				json_t *transaction = json_object_get(root, "transaction");
-				const char *transaction_text = json_is_string(transaction) ? json_string_value(transaction) : NULL;
-				janus_process_error(source, 0, transaction_text, JANUS_ERROR_UNKNOWN, "Thread pool error");
-				janus_request_source_destroy(source);
-				json_decref(root);
+				/* The pool couldn't start a new thread, but the request is queued anyway
+				 * and will be served by one of those already running */
+				JANUS_LOG(LOG_WARN, "Got error %d (%s) trying to push task in thread pool...\n", tperror->code, tperror->message ? tperror->message : "??");
+				g_error_free(tperror);
 			}
 			return 0;
 		}
@@ -3430,21 +3655,16 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 			}
 			if(!ws_client->destroy && !g_atomic_int_get(&stop)) {
 				janus_mutex_lock(&ws_client->mutex);
-				/* Responses first */
-				char *response = g_async_queue_try_pop(ws_client->responses);
-				if(response && !ws_client->destroy && !g_atomic_int_get(&stop)) {
-					/* Gotcha! */
-					unsigned char *buf = g_malloc0(LWS_SEND_BUFFER_PRE_PADDING + strlen(response) + LWS_SEND_BUFFER_POST_PADDING);
-					memcpy(buf+LWS_SEND_BUFFER_PRE_PADDING, response, strlen(response));
-					JANUS_LOG(LOG_VERB, "Sending WebSocket response (%zu bytes)...\n", strlen(response));
-					int sent = libwebsocket_write(wsi, buf+LWS_SEND_BUFFER_PRE_PADDING, strlen(response), LWS_WRITE_TEXT);
-					JANUS_LOG(LOG_VERB, "  -- Sent %d/%zu bytes\n", sent, strlen(response));
-					g_free(buf);
+				/* Whatever is queued from now on needs another callback */
+				g_atomic_int_set(&ws_client->writable, 0);
+				/* Send as much as the socket takes without blocking, responses first */
+				char *response = NULL;
+				while(!lws_send_pipe_choked(wsi) && (response = g_async_queue_try_pop(ws_client->responses)) != NULL) {
+					if(!ws_client->destroy && !g_atomic_int_get(&stop)) {
+						/* Gotcha! */
+						janus_wss_write(ws_client, response);
+					}
 					g_free(response);
-					/* Done for this round, check the next response/notification later */
-					libwebsocket_callback_on_writable(this, wsi);
-					janus_mutex_unlock(&ws_client->mutex);
-					return 0;
 				}
 				/* Now iterate on all the sessions handled by this WebSocket ws_client */
 				if(ws_client->sessions != NULL && g_hash_table_size(ws_client->sessions) > 0) {
@@ -3456,23 +3676,17 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 						if(ws_client->destroy || !session || session->destroy || g_atomic_int_get(&stop)) {
 							continue;
 						}
-						janus_http_event *event = g_async_queue_try_pop(session->messages);
-						if(event && event->payload && !ws_client->destroy && session && !session->destroy && !g_atomic_int_get(&stop)) {
-							/* Gotcha! */
-							unsigned char *buf = g_malloc0(LWS_SEND_BUFFER_PRE_PADDING + strlen(event->payload) + LWS_SEND_BUFFER_POST_PADDING);
-							memcpy(buf+LWS_SEND_BUFFER_PRE_PADDING, event->payload, strlen(event->payload));
-							JANUS_LOG(LOG_VERB, "Sending WebSocket response (%zu bytes)...\n", strlen(event->payload));
-							int sent = libwebsocket_write(wsi, buf+LWS_SEND_BUFFER_PRE_PADDING, strlen(event->payload), LWS_WRITE_TEXT);
-							JANUS_LOG(LOG_VERB, "  -- Sent %d/%zu bytes\n", sent, strlen(event->payload));
-							g_free(buf);
-							/* Done for this round, check the next response later */
-							libwebsocket_callback_on_writable(this, wsi);
-							janus_mutex_unlock(&ws_client->mutex);
-							return 0;
+						janus_http_event event;
+						while(!lws_send_pipe_choked(wsi) && janus_session_pop_events(session, &event, 1) == 1) {
+							const char *payload = janus_http_event_payload(&event, ws_json_format);
+							if(payload && !ws_client->destroy && !session->destroy && !g_atomic_int_get(&stop)) {
+								/* Gotcha! */
+								janus_wss_write(ws_client, payload);
+							}
+							janus_http_event_clear(&event);
 						}
-						if(session->timeout) {
+						if(session->timeout && session->events.count == 0) {
 							/* Remove all sessions (and handles) created by this ws_client */
-							janus_mutex_lock(&sessions_mutex);
 							GHashTableIter ws_iter;
 							gpointer ws_value;
 							g_hash_table_iter_init(&ws_iter, ws_client->sessions);
@@ -3481,8 +3695,8 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 								if(!ws_session || ws_session == session)
 									continue;
 								ws_session->last_activity = 0;	/* This will trigger a timeout */
+								janus_timer_schedule(&ws_session->timeout_timer, 0);
 							}
-							janus_mutex_unlock(&sessions_mutex);
 							g_hash_table_destroy(ws_client->sessions);
 							ws_client->sessions = NULL;
 							/* Close the WebSocket: the watchdog will get rid of resources */
@@ -3491,6 +3705,11 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 						}
 					}
 				}
+				if(lws_send_pipe_choked(wsi)) {
+					/* The rest will be sent when the socket drains */
+					g_atomic_int_set(&ws_client->writable, 1);
+					libwebsocket_callback_on_writable(this, wsi);
+				}
 				janus_mutex_unlock(&ws_client->mutex);
 			}
 			return 0;
@@ -3498,20 +3717,15 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 		case LWS_CALLBACK_CLOSED: {
 			JANUS_LOG(LOG_VERB, "[WSS-%p] WS connection closed\n", wsi);
 			if(ws_client != NULL) {
-				/* Mark the session as closed */
-				janus_mutex_lock(&old_wss_mutex);
-				old_wss = g_list_append(old_wss, ws_client);
-				janus_mutex_unlock(&old_wss_mutex);
-				/* Cleanup */
+				/* Mark the session as closed: whoever still has a reference will see it */
 				janus_mutex_lock(&ws_client->mutex);
 				JANUS_LOG(LOG_INFO, "[WSS-%p] Destroying WebSocket client\n", wsi);
-				ws_client->destroy = 1;
+				g_atomic_int_set(&ws_client->destroy, 1);
 				ws_client->context = NULL;
 				ws_client->wsi = NULL;
-				g_thread_pool_free(ws_client->thread_pool, FALSE, FALSE);
+				/* Its requests still in the shared pool will find it closed */
 				if(ws_client->sessions != NULL && g_hash_table_size(ws_client->sessions) > 0) {
 					/* Remove all sessions (and handles) created by this ws_client */
-					janus_mutex_lock(&sessions_mutex);
 					GHashTableIter iter;
 					gpointer value;
 					g_hash_table_iter_init(&iter, ws_client->sessions);
@@ -3520,20 +3734,19 @@ static int janus_wss_callback(struct libwebsocket_context *this,
 						if(!session)
 							continue;
 						session->last_activity = 0;	/* This will trigger a timeout */
+						janus_timer_schedule(&session->timeout_timer, 0);
 					}
-					janus_mutex_unlock(&sessions_mutex);
 					g_hash_table_destroy(ws_client->sessions);
 				}
-				/* Remove responses queue too, if needed */
-				if(ws_client->responses != NULL) {
-					char *response = NULL;
-					while((response = g_async_queue_try_pop(ws_client->responses)) != NULL) {
-						g_free(response);
-					}
-					g_async_queue_unref(ws_client->responses);
-				}
+				/* Drop the responses nobody will read */
+				char *response = NULL;
+				while((response = g_async_queue_try_pop(ws_client->responses)) != NULL)
+					g_free(response);
 				ws_client->sessions = NULL;
 				janus_mutex_unlock(&ws_client->mutex);
+				/* The rest goes away with the last reference */
+				*connection = NULL;
+				janus_wss_client_unref(ws_client);
 			}
 			JANUS_LOG(LOG_VERB, "[WSS-%p]   -- closed\n", wsi);
 			return 0;
@@ -3561,20 +3774,19 @@ static int janus_wss_callback_secure(struct libwebsocket_context *this,
 void janus_wss_task(gpointer data, gpointer user_data) {
 	JANUS_LOG(LOG_VERB, "Thread pool, serving request\n");
 	janus_websocket_request *request = (janus_websocket_request *)data;
-	janus_websocket_client *client = (janus_websocket_client *)user_data;
+	janus_websocket_client *client = request ? request->client : NULL;
 	if(request == NULL || client == NULL) {
 		JANUS_LOG(LOG_ERR, "Missing request or client\n");
 		return;
 	}
 	janus_request_source *source = (janus_request_source *)request->source;
 	json_t *root = (json_t *)request->request;
-	/* Make sure this is not related to a closed WebSocket session */
-	janus_mutex_lock(&old_wss_mutex);
-	if(g_list_find(old_wss, client) == NULL) {
-		janus_mutex_unlock(&old_wss_mutex);
+	/* Make sure this is not related to a closed WebSocket session: the
+	 * source holds a reference, so the client is still there to check */
+	if(!g_atomic_int_get(&client->destroy)) {
 		janus_process_incoming_request(source, root);
 	} else {
-		janus_mutex_unlock(&old_wss_mutex);
+		json_decref(root);
 	}
 	/* Done */
 	janus_request_source_destroy(source);
@@ -3586,69 +3798,125 @@ void janus_wss_task(gpointer data, gpointer user_data) {
 
 
 #ifdef HAVE_RABBITMQ
+/* Opens a connection to the broker, with a channel where both queues are declared */
+static amqp_connection_state_t janus_rmq_connect(const char *host, int port) {
+	amqp_connection_state_t conn = amqp_new_connection();
+	JANUS_LOG(LOG_VERB, "Creating RabbitMQ socket...\n");
+	amqp_socket_t *socket = amqp_tcp_socket_new(conn);
+	if(socket == NULL) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error creating socket...\n");
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	JANUS_LOG(LOG_VERB, "Connecting to RabbitMQ server...\n");
+	int status = amqp_socket_open(socket, host, port);
+	if(status != AMQP_STATUS_OK) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error opening socket... (%s)\n", amqp_error_string2(status));
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	JANUS_LOG(LOG_VERB, "Logging in...\n");
+	amqp_rpc_reply_t result = amqp_login(conn, "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, "guest", "guest");
+	if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error logging in... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	JANUS_LOG(LOG_VERB, "Opening channel...\n");
+	amqp_channel_open(conn, 1);
+	result = amqp_get_rpc_reply(conn);
+	if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error opening channel... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	JANUS_LOG(LOG_VERB, "Declaring incoming queue... (%.*s)\n", (int)to_janus_queue.len, (char *)to_janus_queue.bytes);
+	amqp_queue_declare(conn, 1, to_janus_queue, 0, 0, 0, 0, amqp_empty_table);
+	result = amqp_get_rpc_reply(conn);
+	if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error declaring queue... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	JANUS_LOG(LOG_VERB, "Declaring outgoing queue... (%.*s)\n", (int)from_janus_queue.len, (char *)from_janus_queue.bytes);
+	amqp_queue_declare(conn, 1, from_janus_queue, 0, 0, 0, 0, amqp_empty_table);
+	result = amqp_get_rpc_reply(conn);
+	if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+		JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error declaring queue... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+		amqp_destroy_connection(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/* Closes a connection opened with janus_rmq_connect */
+static void janus_rmq_disconnect(amqp_connection_state_t conn) {
+	if(conn == NULL)
+		return;
+	amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
+	amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+	amqp_destroy_connection(conn);
+}
+
 void *janus_rmq_in_thread(void *data) {
-	if(rmq_client == NULL) {
+	janus_rabbitmq_consumer *consumer = (janus_rabbitmq_consumer *)data;
+	if(rmq_client == NULL || consumer == NULL || consumer->conn == NULL) {
 		JANUS_LOG(LOG_ERR, "No RabbitMQ connection??\n");
 		return NULL;
 	}
-	JANUS_LOG(LOG_VERB, "Joining RabbitMQ in thread\n");
+	JANUS_LOG(LOG_VERB, "Joining RabbitMQ in thread #%d\n", consumer->id);
+	amqp_connection_state_t conn = consumer->conn;
 
+	/* The timeout is only there to notice when we're stopping: requests
+	 * wake us up as soon as they're delivered */
 	struct timeval timeout;
 	timeout.tv_sec = 0;
-	timeout.tv_usec = 20000;
-	amqp_frame_t frame;
+	timeout.tv_usec = 250000;
+	/* Requests are acknowledged in batches, when there are no more already
+	 * received or half the prefetch window is waiting for an ack */
+	int unacked = 0;
+	uint64_t last_tag = 0;
 	while(!rmq_client->destroy && !g_atomic_int_get(&stop)) {
-		amqp_maybe_release_buffers(rmq_conn);
-		/* Wait for a frame */
-		int res = amqp_simple_wait_frame_noblock(rmq_conn, &frame, &timeout);
-		if(res != AMQP_STATUS_OK) {
-			/* No data */
-			if(res == AMQP_STATUS_TIMEOUT)
+		if(unacked > 0 && (!amqp_data_in_buffer(conn) || unacked >= (rmq_prefetch+1)/2)) {
+			amqp_basic_ack(conn, 1, last_tag, 1);
+			unacked = 0;
+		}
+		amqp_maybe_release_buffers(conn);
+		/* Wait for a request */
+		amqp_envelope_t envelope;
+		amqp_rpc_reply_t res = amqp_consume_message(conn, &envelope, &timeout, 0);
+		if(res.reply_type != AMQP_RESPONSE_NORMAL) {
+			if(res.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION && res.library_error == AMQP_STATUS_TIMEOUT)
 				continue;
-			JANUS_LOG(LOG_VERB, "Error on amqp_simple_wait_frame_noblock: %d (%s)\n", res, amqp_error_string2(res));
+			if(res.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION && res.library_error == AMQP_STATUS_UNEXPECTED_STATE) {
+				/* Something other than a delivery, e.g., a channel event: skip it */
+				amqp_frame_t frame;
+				if(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK)
+					continue;
+			}
+			JANUS_LOG(LOG_ERR, "Error consuming on RabbitMQ (#%d): %s\n", consumer->id,
+				res.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION ? amqp_error_string2(res.library_error) : amqp_method_name(res.reply.id));
 			break;
 		}
-		/* We expect method first */
-		JANUS_LOG(LOG_VERB, "Frame type %d, channel %d\n", frame.frame_type, frame.channel);
-		if(frame.frame_type != AMQP_FRAME_METHOD)
-			continue;
-		JANUS_LOG(LOG_VERB, "Method %s\n", amqp_method_name(frame.payload.method.id));
-		if(frame.payload.method.id == AMQP_BASIC_DELIVER_METHOD) {
-			amqp_basic_deliver_t *d = (amqp_basic_deliver_t *)frame.payload.method.decoded;
-			JANUS_LOG(LOG_VERB, "Delivery #%u, %.*s\n", (unsigned) d->delivery_tag, (int) d->routing_key.len, (char *) d->routing_key.bytes);
-		}
-		/* Then the header */
-		amqp_simple_wait_frame(rmq_conn, &frame);
-		JANUS_LOG(LOG_VERB, "Frame type %d, channel %d\n", frame.frame_type, frame.channel);
-		if(frame.frame_type != AMQP_FRAME_HEADER)
-			continue;
-		amqp_basic_properties_t *p = (amqp_basic_properties_t *)frame.payload.properties.decoded;
+		gint64 received = janus_get_monotonic_time();
+		last_tag = envelope.delivery_tag;
+		unacked++;
+		amqp_basic_properties_t *p = &envelope.message.properties;
 		if(p->_flags & AMQP_BASIC_REPLY_TO_FLAG) {
 			JANUS_LOG(LOG_VERB, "  -- Reply-to: %.*s\n", (int) p->reply_to.len, (char *) p->reply_to.bytes);
 		}
 		char *correlation = NULL;
 		if(p->_flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
-			correlation = (char *)g_malloc0(p->correlation_id.len+1);
-			sprintf(correlation, "%.*s", (int) p->correlation_id.len, (char *) p->correlation_id.bytes);
+			correlation = g_strndup((char *)p->correlation_id.bytes, p->correlation_id.len);
 			JANUS_LOG(LOG_VERB, "  -- Correlation-id: %s\n", correlation);
 		}
-		if(p->_flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
-			JANUS_LOG(LOG_VERB, "  -- Content-type: %.*s\n", (int) p->content_type.len, (char *) p->content_type.bytes);
-		}
-		/* And the body */
-		uint64_t total = frame.payload.properties.body_size, received = 0;
-		char *payload = (char *)g_malloc0(total+1), *index = payload;
-		while(received < total) {
-			amqp_simple_wait_frame(rmq_conn, &frame);
-			JANUS_LOG(LOG_VERB, "Frame type %d, channel %d\n", frame.frame_type, frame.channel);
-			if(frame.frame_type != AMQP_FRAME_BODY)
-				break;
-			sprintf(index, "%.*s", (int) frame.payload.body_fragment.len, (char *) frame.payload.body_fragment.bytes);
-			received += frame.payload.body_fragment.len;
-			index = payload+received;
-		}
-		JANUS_LOG(LOG_VERB, "Got %"SCNu64"/%"SCNu64" bytes (%"SCNu64")\n", received, total, frame.payload.body_fragment.len);
+		char *payload = g_strndup((char *)envelope.message.body.bytes, envelope.message.body.len);
+		JANUS_LOG(LOG_VERB, "Got %zu bytes (#%d, delivery #%"SCNu64")\n", envelope.message.body.len, consumer->id, (guint64)envelope.delivery_tag);
 		JANUS_LOG(LOG_HUGE, "%s\n", payload);
+		amqp_destroy_envelope(&envelope);
+		janus_mutex_lock(&rmq_client->stats_mutex);
+		rmq_client->stats.received++;
+		janus_mutex_unlock(&rmq_client->stats_mutex);
 		/* Parse it */
 		janus_request_source *source = janus_request_source_new(JANUS_SOURCE_RABBITMQ, (void *)rmq_client, (void *)correlation);
 		/* Parse the JSON payload */
@@ -3670,56 +3938,139 @@ void *janus_rmq_in_thread(void *data) {
 		janus_rabbitmq_request *request = (janus_rabbitmq_request *)g_malloc0(sizeof(janus_rabbitmq_request));
 		request->source = source;
 		request->request = root;
+		request->received = received;
 		GError *tperror = NULL;
 		g_thread_pool_push(rmq_client->thread_pool, request, &tperror);
 		if(tperror != NULL) {
 			/* Something went wrong... */
 			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to push task in thread pool...\n", tperror->code, tperror->message ? tperror->message : "??");
+			g_error_free(tperror);
 		}
 	}
-	JANUS_LOG(LOG_INFO, "Leaving RabbitMQ in thread\n");
+	if(unacked > 0)
+		amqp_basic_ack(conn, 1, last_tag, 1);
+	JANUS_LOG(LOG_INFO, "Leaving RabbitMQ in thread #%d\n", consumer->id);
 	return NULL;
 }
 
+/* Sentinel the outgoing thread is woken up with when sessions have events */
+static janus_rabbitmq_response rmq_wakeup_response;
+
+static void janus_rmq_wakeup(void) {
+	if(rmq_client != NULL && g_atomic_int_compare_and_exchange(&rmq_client->wakeup, 0, 1))
+		g_async_queue_push(rmq_client->responses, &rmq_wakeup_response);
+}
+
+/* Publishes a message on the outgoing queue: returns 0 if it was sent */
+static int janus_rmq_publish(const char *correlation_id, const char *payload) {
+	JANUS_LOG(LOG_VERB, "Sending %s to RabbitMQ (%zu bytes)...\n", correlation_id ? "response" : "event", strlen(payload));
+	JANUS_LOG(LOG_HUGE, "%s\n", payload);
+	amqp_basic_properties_t props;
+	props._flags = 0;
+	props._flags |= AMQP_BASIC_REPLY_TO_FLAG;
+	props.reply_to = amqp_cstring_bytes("Janus");
+	if(correlation_id) {
+		props._flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
+		props.correlation_id = amqp_cstring_bytes(correlation_id);
+	}
+	props._flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
+	props.content_type = amqp_cstring_bytes("application/json");
+	amqp_bytes_t message = amqp_cstring_bytes(payload);
+	int status = amqp_basic_publish(rmq_conn, rmq_channel, amqp_empty_bytes, from_janus_queue, 0, 0, &props, message);
+	if(status != AMQP_STATUS_OK) {
+		JANUS_LOG(LOG_ERR, "Error publishing... %d, %s\n", status, amqp_error_string2(status));
+		return -1;
+	}
+	if(rmq_confirms)
+		rmq_published_tag++;
+	return 0;
+}
+
+/* Waits for the broker to confirm everything published so far */
+static void janus_rmq_wait_confirms(guint64 *confirmed, guint64 *nacked) {
+	struct timeval timeout;
+	timeout.tv_sec = RMQ_CONFIRMS_TIMEOUT;
+	timeout.tv_usec = 0;
+	while(rmq_confirmed_tag < rmq_published_tag && !g_atomic_int_get(&stop)) {
+		amqp_frame_t frame;
+		int res = amqp_simple_wait_frame_noblock(rmq_conn, &frame, &timeout);
+		if(res != AMQP_STATUS_OK) {
+			JANUS_LOG(LOG_WARN, "No confirm from RabbitMQ for %"SCNu64" messages (%s)\n",
+				rmq_published_tag - rmq_confirmed_tag, amqp_error_string2(res));
+			/* Don't wait for those again */
+			rmq_confirmed_tag = rmq_published_tag;
+			return;
+		}
+		if(frame.frame_type != AMQP_FRAME_METHOD)
+			continue;
+		guint64 tag = 0;
+		gboolean multiple = FALSE, ack = TRUE;
+		if(frame.payload.method.id == AMQP_BASIC_ACK_METHOD) {
+			amqp_basic_ack_t *a = (amqp_basic_ack_t *)frame.payload.method.decoded;
+			tag = a->delivery_tag;
+			multiple = a->multiple;
+		} else if(frame.payload.method.id == AMQP_BASIC_NACK_METHOD) {
+			amqp_basic_nack_t *n = (amqp_basic_nack_t *)frame.payload.method.decoded;
+			tag = n->delivery_tag;
+			multiple = n->multiple;
+			ack = FALSE;
+		} else {
+			continue;
+		}
+		if(tag <= rmq_confirmed_tag)
+			continue;
+		guint64 count = multiple ? tag - rmq_confirmed_tag : 1;
+		if(ack) {
+			*confirmed += count;
+		} else {
+			*nacked += count;
+			JANUS_LOG(LOG_WARN, "RabbitMQ rejected %"SCNu64" message(s)\n", count);
+		}
+		rmq_confirmed_tag = tag;
+	}
+}
+
 void *janus_rmq_out_thread(void *data) {
 	if(rmq_client == NULL) {
 		JANUS_LOG(LOG_ERR, "No RabbitMQ connection??\n");
 		return NULL;
 	}
 	JANUS_LOG(LOG_VERB, "Joining RabbitMQ out thread\n");
+	gboolean more = FALSE;
 	while(!rmq_client->destroy && !g_atomic_int_get(&stop)) {
+		/* Wait for responses, or for a wakeup if sessions have events (the
+		 * timeout is only there to notice when we're stopping), unless the
+		 * previous batch was full and there's more to publish already */
+		janus_rabbitmq_response *response = more ?
+			g_async_queue_try_pop(rmq_client->responses) :
+			g_async_queue_timeout_pop(rmq_client->responses, 250000);
+		if(response == NULL && !more)
+			continue;
+		more = FALSE;
+		gint64 start = janus_get_monotonic_time();
+		guint64 published = 0, confirmed = 0, nacked = 0;
 		janus_mutex_lock(&rmq_client->mutex);
+		/* We're going to look at the sessions: events added from now on need another wakeup */
+		g_atomic_int_set(&rmq_client->wakeup, 0);
 		/* We send responses from here as well, not only notifications */
-		janus_rabbitmq_response *response = NULL;
-		while ((response = g_async_queue_try_pop(rmq_client->responses)) != NULL) {
-			if(!g_atomic_int_get(&stop) && response && response->payload) {
-				/* Gotcha! */
-				JANUS_LOG(LOG_VERB, "Sending response to RabbitMQ (%zu bytes)...\n", strlen(response->payload));
-				JANUS_LOG(LOG_HUGE, "%s\n", response->payload);
-				amqp_basic_properties_t props;
-				props._flags = 0;
-				props._flags |= AMQP_BASIC_REPLY_TO_FLAG;
-				props.reply_to = amqp_cstring_bytes("Janus");
-				if(response->correlation_id) {
-					props._flags |= AMQP_BASIC_CORRELATION_ID_FLAG;
-					props.correlation_id = amqp_cstring_bytes(response->correlation_id);
-				}
-				props._flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
-				props.content_type = amqp_cstring_bytes("application/json");
-				amqp_bytes_t message = amqp_cstring_bytes(response->payload);
-				int status = amqp_basic_publish(rmq_conn, rmq_channel, amqp_empty_bytes, from_janus_queue, 0, 0, &props, message);
-				if(status != AMQP_STATUS_OK) {
-					JANUS_LOG(LOG_ERR, "Error publishing... %d, %s\n", status, amqp_error_string2(status));
+		while(response != NULL) {
+			if(response != &rmq_wakeup_response) {
+				if(!g_atomic_int_get(&stop) && response->payload) {
+					/* Gotcha! */
+					if(janus_rmq_publish(response->correlation_id, response->payload) == 0)
+						published++;
 				}
 				g_free(response->correlation_id);
-				response->correlation_id = NULL;
 				g_free(response->payload);
-				response->payload = NULL;
 				g_free(response);
-				response = NULL;
 			}
+			if(published >= (guint64)rmq_batch) {
+				more = TRUE;
+				break;
+			}
+			response = g_async_queue_try_pop(rmq_client->responses);
 		}
-		if(rmq_client->sessions != NULL && g_hash_table_size(rmq_client->sessions) > 0) {
+		if(!more && rmq_client->sessions != NULL && g_hash_table_size(rmq_client->sessions) > 0) {
 			/* Iterate on all the sessions handled by this rmq_client */
 			GHashTableIter iter;
 			gpointer value;
@@ -3729,35 +4080,49 @@ void *janus_rmq_out_thread(void *data) {
 				if(rmq_client->destroy || !session || session->destroy || g_atomic_int_get(&stop)) {
 					continue;
 				}
-				janus_http_event *event;
-				while ((event = g_async_queue_try_pop(session->messages)) != NULL) {
-					if(!rmq_client->destroy && session && !session->destroy && !g_atomic_int_get(&stop) && event && event->payload) {
-						/* Gotcha! */
-						JANUS_LOG(LOG_VERB, "Sending event to RabbitMQ (%zu bytes)...\n", strlen(event->payload));
-						JANUS_LOG(LOG_HUGE, "%s\n", event->payload);
-						amqp_basic_properties_t props;
-						props._flags = 0;
-						props._flags |= AMQP_BASIC_REPLY_TO_FLAG;
-						props.reply_to = amqp_cstring_bytes("Janus");
-						props._flags |= AMQP_BASIC_CONTENT_TYPE_FLAG;
-						props.content_type = amqp_cstring_bytes("application/json");
-						amqp_bytes_t message = amqp_cstring_bytes(event->payload);
-						int status = amqp_basic_publish(rmq_conn, rmq_channel, amqp_empty_bytes, from_janus_queue, 0, 0, &props, message);
-						if(status != AMQP_STATUS_OK) {
-							JANUS_LOG(LOG_ERR, "Error publishing... %d, %s\n", status, amqp_error_string2(status));
+				janus_http_event events[SESSION_EVENTS_BATCH];
+				guint n = 0, i = 0;
+				while(published < (guint64)rmq_batch &&
+						(n = janus_session_pop_events(session, events, MIN(SESSION_EVENTS_BATCH, rmq_batch - published))) > 0) {
+					for(i = 0; i < n; i++) {
+						janus_http_event *event = &events[i];
+						const char *payload = janus_http_event_payload(event, rmq_json_format);
+						if(!rmq_client->destroy && !session->destroy && !g_atomic_int_get(&stop) && payload) {
+							/* Gotcha! */
+							if(janus_rmq_publish(NULL, payload) == 0)
+								published++;
 						}
+						janus_http_event_clear(event);
 					}
 				}
+				if(published >= (guint64)rmq_batch) {
+					/* Whatever is left goes in the next batch */
+					more = TRUE;
+					break;
+				}
 				if(session->timeout) {
 					/* A session timed out, remove it from the list of sessions we manage */
-					g_hash_table_remove(rmq_client->sessions, GUINT_TO_POINTER(session->session_id));
+					g_hash_table_iter_remove(&iter);
 					continue;
 				}
 			}
 		}
 		janus_mutex_unlock(&rmq_client->mutex);
-		/* Sleep 100ms */
-		g_usleep(100000);
+		if(published == 0)
+			continue;
+		/* Wait for the broker to take responsibility for the whole batch */
+		if(rmq_confirms)
+			janus_rmq_wait_confirms(&confirmed, &nacked);
+		gint64 elapsed = janus_get_monotonic_time() - start;
+		janus_mutex_lock(&rmq_client->stats_mutex);
+		rmq_client->stats.published += published;
+		rmq_client->stats.confirmed += confirmed;
+		rmq_client->stats.nacked += nacked;
+		rmq_client->stats.batches++;
+		rmq_client->stats.batch_time += elapsed;
+		if((guint64)elapsed > rmq_client->stats.batch_time_max)
+			rmq_client->stats.batch_time_max = elapsed;
+		janus_mutex_unlock(&rmq_client->stats_mutex);
 	}
 	JANUS_LOG(LOG_INFO, "Leaving RabbitMQ out thread\n");
 	return NULL;
@@ -3774,11 +4139,40 @@ void janus_rmq_task(gpointer data, gpointer user_data) {
 	janus_request_source *source = (janus_request_source *)request->source;
 	json_t *root = (json_t *)request->request;
 	janus_process_incoming_request(source, root);
+	/* The response (if any) is queued, see how long it took */
+	gint64 elapsed = janus_get_monotonic_time() - request->received;
+	janus_mutex_lock(&client->stats_mutex);
+	client->stats.serve_time += elapsed;
+	if((guint64)elapsed > client->stats.serve_time_max)
+		client->stats.serve_time_max = elapsed;
+	janus_mutex_unlock(&client->stats_mutex);
 	janus_request_source_destroy(source);
 	request->source = NULL;
 	request->request = NULL;
 	g_free(request);
 }
+
+static json_t *janus_rmq_stats_json(void) {
+	json_t *info = json_object();
+	json_object_set_new(info, "consumers", json_integer(rmq_consumers));
+	json_object_set_new(info, "prefetch", json_integer(rmq_prefetch));
+	json_object_set_new(info, "publish_batch", json_integer(rmq_batch));
+	json_object_set_new(info, "confirms", json_string(rmq_confirms ? "true" : "false"));
+	janus_mutex_lock(&rmq_client->stats_mutex);
+	janus_rabbitmq_stats stats = rmq_client->stats;
+	janus_mutex_unlock(&rmq_client->stats_mutex);
+	json_object_set_new(info, "received", json_integer(stats.received));
+	json_object_set_new(info, "serve_time_avg", json_integer(stats.received ? stats.serve_time/stats.received : 0));
+	json_object_set_new(info, "serve_time_max", json_integer(stats.serve_time_max));
+	json_object_set_new(info, "published", json_integer(stats.published));
+	json_object_set_new(info, "confirmed", json_integer(stats.confirmed));
+	json_object_set_new(info, "nacked", json_integer(stats.nacked));
+	json_object_set_new(info, "batches", json_integer(stats.batches));
+	json_object_set_new(info, "batch_size_avg", json_real(stats.batches ? (double)stats.published/stats.batches : 0));
+	json_object_set_new(info, "batch_time_avg", json_integer(stats.batches ? stats.batch_time/stats.batches : 0));
+	json_object_set_new(info, "batch_time_max", json_integer(stats.batch_time_max));
+	return info;
+}
 #endif
 
 
@@ -3932,24 +4326,41 @@ janus_plugin *janus_plugin_find(const gchar *package) {
 int janus_push_event(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *transaction, const char *message, const char *sdp_type, const char *sdp) {
 	if(!plugin || !message)
 		return -1;
+	/* Make sure this is JSON */
+	json_error_t error;
+	json_t *event = json_loads(message, 0, &error);
+	if(!event) {
+		JANUS_LOG(LOG_ERR, "Cannot push event (JSON error: on line %d: %s)\n", error.line, error.text);
+		return JANUS_ERROR_INVALID_JSON;
+	}
+	return janus_push_event_json(plugin_session, plugin, transaction, event, sdp_type, sdp);
+}
+
+int janus_push_event_json(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *transaction, json_t *event, const char *sdp_type, const char *sdp) {
+	/* We own the event, whatever happens */
+	if(!plugin || !event) {
+		if(event)
+			json_decref(event);
+		return -1;
+	}
 	if(!plugin_session || plugin_session < (janus_plugin_session *)0x1000 ||
-			!janus_plugin_session_is_alive(plugin_session) || plugin_session->stopped)
+			!janus_plugin_session_is_alive(plugin_session) || plugin_session->stopped) {
+		json_decref(event);
 		return -2;
+	}
 	janus_ice_handle *ice_handle = (janus_ice_handle *)plugin_session->gateway_handle;
-	if(!ice_handle || janus_flags_is_set(&ice_handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP))
+	if(!ice_handle || janus_flags_is_set(&ice_handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP)) {
+		json_decref(event);
 		return JANUS_ERROR_SESSION_NOT_FOUND;
+	}
 	janus_session *session = ice_handle->session;
-	if(!session || session->destroy)
+	if(!session || session->destroy) {
+		json_decref(event);
 		return JANUS_ERROR_SESSION_NOT_FOUND;
-	/* Make sure this is JSON */
-	json_error_t error;
-	json_t *event = json_loads(message, 0, &error);
-	if(!event) {
-		JANUS_LOG(LOG_ERR, "[%"SCNu64"] Cannot push event (JSON error: on line %d: %s)\n", ice_handle->handle_id, error.line, error.text);
-		return JANUS_ERROR_INVALID_JSON;
 	}
 	if(!json_is_object(event)) {
 		JANUS_LOG(LOG_ERR, "[%"SCNu64"] Cannot push event (JSON error: not an object)\n", ice_handle->handle_id);
+		json_decref(event);
 		return JANUS_ERROR_INVALID_JSON_OBJECT;
 	}
 	/* Attach JSEP if possible? */
@@ -3957,6 +4368,7 @@ int janus_push_event(janus_plugin_session *plugin_session, janus_plugin *plugin,
 	if(sdp_type != NULL && sdp != NULL) {
 		jsep = janus_handle_sdp(plugin_session, plugin, sdp_type, sdp);
 		if(jsep == NULL) {
+			json_decref(event);
 			if(ice_handle == NULL || janus_flags_is_set(&ice_handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP)
 					|| janus_flags_is_set(&ice_handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT)) {
 				JANUS_LOG(LOG_ERR, "[%"SCNu64"] Cannot push event (handle not available anymore or negotiation stopped)\n", ice_handle->handle_id);
@@ -3980,43 +4392,20 @@ int janus_push_event(janus_plugin_session *plugin_session, janus_plugin *plugin,
 	json_object_set_new(reply, "plugindata", plugin_data);
 	if(jsep != NULL)
 		json_object_set_new(reply, "jsep", jsep);
-	/* Convert to a string */
-	char *reply_text = json_dumps(reply, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-	json_decref(reply);
-	/* Send the event */
+	/* Send the event: it will only be serialized when a transport sends it */
 	JANUS_LOG(LOG_VERB, "[%"SCNu64"] Adding event to queue of messages...\n", ice_handle->handle_id);
-	janus_http_event *notification = (janus_http_event *)g_malloc0(sizeof(janus_http_event));
-	if(notification == NULL) {
-		JANUS_LOG(LOG_FATAL, "Memory error!\n");
-		return JANUS_ERROR_UNKNOWN;	/* FIXME Do we need something like "Internal Server Error"? */
-	}
-	notification->code = 200;
-	notification->payload = reply_text;
-	notification->allocated = 1;
-
-	g_async_queue_push(session->messages, notification);
-#ifdef HAVE_WEBSOCKETS
-	janus_request_source *source = (janus_request_source *)session->source;
-	if(source != NULL && source->type == JANUS_SOURCE_WEBSOCKETS) {
-		/* Send this as soon as the WebSocket becomes writeable */
-		janus_websocket_client *client = (janus_websocket_client *)source->source;
-		/* Make sure this is not related to a closed WebSocket session */
-		janus_mutex_lock(&old_wss_mutex);
-		if(g_list_find(old_wss, client) == NULL) {
-			janus_mutex_lock(&client->mutex);
-			libwebsocket_callback_on_writable(client->context, client->wsi);
-			janus_mutex_unlock(&client->mutex);
-		}
-		janus_mutex_unlock(&old_wss_mutex);
-	}
-#endif
+	janus_http_event notification = { .code = 200, .json = reply };
+	/* Notifications (no transaction) can be coalesced if the session falls behind */
+	notification.sender = (transaction == NULL ? ice_handle->handle_id : 0);
+	janus_session_push_event(session, &notification);
 
 	return JANUS_OK;
 }
 
+/* Only invoked by janus_push_event_json, which has just checked the plugin
+ * session is alive: that lookup isn't cheap, so it isn't repeated here */
 json_t *janus_handle_sdp(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *sdp_type, const char *sdp) {
-	if(!plugin_session || plugin_session < (janus_plugin_session *)0x1000 ||
-			!janus_plugin_session_is_alive(plugin_session) || plugin_session->stopped ||
+	if(!plugin_session || plugin_session < (janus_plugin_session *)0x1000 || plugin_session->stopped ||
 			plugin == NULL || sdp_type == NULL || sdp == NULL) {
 		JANUS_LOG(LOG_ERR, "Invalid arguments\n");
 		return NULL;
@@ -4350,6 +4739,66 @@ void janus_end_session(janus_plugin_session *plugin_session) {
 }
 
 
+/* JSON formats, as they're named in the configuration */
+static size_t janus_json_format_parse(const char *value, size_t def) {
+	if(value == NULL)
+		return def;
+	if(!strcasecmp(value, "compact"))
+		return JSON_COMPACT | JSON_PRESERVE_ORDER;
+	if(!strcasecmp(value, "plain"))
+		return JSON_PRESERVE_ORDER;
+	if(!strcasecmp(value, "indented"))
+		return JSON_INDENT(3) | JSON_PRESERVE_ORDER;
+	JANUS_LOG(LOG_WARN, "Unsupported JSON format '%s', should be compact, plain or indented\n", value);
+	return def;
+}
+
+static const char *janus_json_format_name(size_t format) {
+	if(format & JSON_COMPACT)
+		return "compact";
+	if(format & JSON_INDENT(31))
+		return "indented";
+	return "plain";
+}
+
+/* Whether a webserver should be served by libmicrohttpd's epoll loop, which
+ * unlike select() has no FD_SETSIZE limit and doesn't walk all connections
+ * (most of them idle long polls) whenever one of them is ready */
+static gboolean janus_ws_epoll(janus_config *config, const char *category, const char *name) {
+	janus_config_item *item = janus_config_get_item_drilldown(config, category, name);
+	if(!item || !item->value || !janus_is_true(item->value))
+		return FALSE;
+	if(!JANUS_MHD_EPOLL_SUPPORTED) {
+		JANUS_LOG(LOG_WARN, "libmicrohttpd was built without epoll support, ignoring %s\n", name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* How many connections a webserver can take: with select() it's capped by
+ * FD_SETSIZE anyway, with epoll only by the file descriptors we can open,
+ * so raise that limit as far as we're allowed to */
+static unsigned int janus_ws_connection_limit(gboolean epoll) {
+	if(!epoll)
+		return FD_SETSIZE - 4;	/* libmicrohttpd's default */
+	struct rlimit fd_limits;
+	if(getrlimit(RLIMIT_NOFILE, &fd_limits) < 0)
+		return FD_SETSIZE - 4;
+	if(fd_limits.rlim_cur < fd_limits.rlim_max) {
+		rlim_t previous = fd_limits.rlim_cur;
+		fd_limits.rlim_cur = fd_limits.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &fd_limits) < 0)
+			fd_limits.rlim_cur = previous;
+		else
+			JANUS_LOG(LOG_INFO, "Raised the file descriptors limit to %"SCNu64"\n", (guint64)fd_limits.rlim_cur);
+	}
+	if(fd_limits.rlim_cur == RLIM_INFINITY || fd_limits.rlim_cur > G_MAXINT)
+		return G_MAXINT;
+	if(fd_limits.rlim_cur <= FD_SETSIZE + WS_RESERVED_FDS)
+		return FD_SETSIZE - 4;
+	return fd_limits.rlim_cur - WS_RESERVED_FDS;
+}
+
 static void janus_detect_local_ip(gchar *buf, size_t buflen) {
 	JANUS_LOG(LOG_VERB, "Autodetecting local IP...\n");
 	struct sockaddr_in addr;
@@ -4647,6 +5096,81 @@ gint main(int argc, char *argv[])
 		janus_log_colors = janus_is_true(item->value);
 	JANUS_PRINT("Debug/log colors are %s\n", janus_log_colors ? "enabled" : "disabled");
 
+	/* JSON format of what we send, and per-transport overrides (e.g., to debug) */
+	item = janus_config_get_item_drilldown(config, "general", "json");
+	json_format = janus_json_format_parse(item ? item->value : NULL, json_format);
+	item = janus_config_get_item_drilldown(config, "webserver", "json");
+	http_json_format = janus_json_format_parse(item ? item->value : NULL, json_format);
+	item = janus_config_get_item_drilldown(config, "webserver", "ws_json");
+	ws_json_format = janus_json_format_parse(item ? item->value : NULL, json_format);
+	item = janus_config_get_item_drilldown(config, "admin", "admin_json");
+	admin_json_format = janus_json_format_parse(item ? item->value : NULL, json_format);
+	item = janus_config_get_item_drilldown(config, "rabbitmq", "json");
+	rmq_json_format = janus_json_format_parse(item ? item->value : NULL, json_format);
+	JANUS_LOG(LOG_INFO, "JSON format is %s (HTTP: %s, WebSockets: %s, admin: %s, RabbitMQ: %s)\n",
+		janus_json_format_name(json_format), janus_json_format_name(http_json_format),
+		janus_json_format_name(ws_json_format), janus_json_format_name(admin_json_format),
+		janus_json_format_name(rmq_json_format));
+
+	/* How many events sessions can keep for transports, and what to do if they're more */
+	item = janus_config_get_item_drilldown(config, "general", "session_events");
+	if(item && item->value) {
+		int size = atoi(item->value);
+		if(size < 1) {
+			JANUS_LOG(LOG_WARN, "Invalid session_events value '%s', using %d\n", item->value, SESSION_EVENTS_DEFAULT);
+			size = SESSION_EVENTS_DEFAULT;
+		}
+		session_events = size;
+	}
+	item = janus_config_get_item_drilldown(config, "general", "session_events_overflow");
+	if(item && item->value) {
+		if(!strcasecmp(item->value, "coalesce")) {
+			session_events_overflow = JANUS_EVENTS_COALESCE_LATEST;
+		} else if(strcasecmp(item->value, "drop")) {
+			JANUS_LOG(LOG_WARN, "Unsupported session_events_overflow '%s', should be drop or coalesce\n", item->value);
+		}
+	}
+	JANUS_LOG(LOG_INFO, "Sessions keep up to %u events, and %s when they're full\n", session_events,
+		session_events_overflow == JANUS_EVENTS_COALESCE_LATEST ? "coalesce notifications" : "drop the oldest");
+
+	/* Whether recordings are written by the media threads themselves, or asynchronously */
+	gboolean recordings_async = FALSE;
+	guint recordings_buffer = 1024, recordings_flush = 500, recordings_sync_interval = 0;
+	janus_recorder_sync recordings_sync = JANUS_RECORDER_SYNC_CLOSE;
+	item = janus_config_get_item_drilldown(config, "recordings", "async");
+	if(item && item->value)
+		recordings_async = janus_is_true(item->value);
+	item = janus_config_get_item_drilldown(config, "recordings", "buffer");
+	if(item && item->value) {
+		/* In KB */
+		int size = atoi(item->value);
+		if(size < 64)
+			JANUS_LOG(LOG_WARN, "Invalid recordings buffer value '%s', using %u\n", item->value, recordings_buffer);
+		else
+			recordings_buffer = size;
+	}
+	item = janus_config_get_item_drilldown(config, "recordings", "flush");
+	if(item && item->value) {
+		int flush = atoi(item->value);
+		if(flush < 10)
+			JANUS_LOG(LOG_WARN, "Invalid recordings flush value '%s', using %u\n", item->value, recordings_flush);
+		else
+			recordings_flush = flush;
+	}
+	item = janus_config_get_item_drilldown(config, "recordings", "fsync");
+	if(item && item->value) {
+		/* none, close, or how often (ms) to sync */
+		if(!strcasecmp(item->value, "none")) {
+			recordings_sync = JANUS_RECORDER_SYNC_NONE;
+		} else if(atoi(item->value) > 0) {
+			recordings_sync = JANUS_RECORDER_SYNC_PERIODIC;
+			recordings_sync_interval = atoi(item->value);
+		} else if(strcasecmp(item->value, "close")) {
+			JANUS_LOG(LOG_WARN, "Unsupported recordings fsync '%s', should be none, close or an interval in ms\n", item->value);
+		}
+	}
+	janus_recorder_init(recordings_async, recordings_buffer*1024, recordings_flush, recordings_sync, recordings_sync_interval);
+
 	/* Any IP/interface to enforce/ignore? */
 	item = janus_config_get_item_drilldown(config, "nat", "ice_enforce_list");
 	if(item && item->value) {
@@ -5053,7 +5577,6 @@ gint main(int argc, char *argv[])
 					!janus_plugin->create_session ||
 					!janus_plugin->query_session ||
 					!janus_plugin->destroy_session ||
-					!janus_plugin->handle_message ||
 					!janus_plugin->setup_media ||
 					!janus_plugin->hangup_media) {
 				JANUS_LOG(LOG_ERR, "\tMissing some mandatory methods/callbacks, skipping this plugin...\n");
@@ -5064,6 +5587,11 @@ gint main(int argc, char *argv[])
 					janus_plugin->get_package(), janus_plugin->get_api_compatibility(), JANUS_PLUGIN_API_VERSION);
 				continue;
 			}
+			/* Only now we know the plugin is as large as handle_message_json requires */
+			if(!janus_plugin->handle_message && !janus_plugin->handle_message_json) {
+				JANUS_LOG(LOG_ERR, "\tMissing some mandatory methods/callbacks, skipping this plugin...\n");
+				continue;
+			}
 			janus_plugin->init(&janus_handler_plugin, configs_folder);
 			JANUS_LOG(LOG_VERB, "\tVersion: %d (%s)\n", janus_plugin->get_version(), janus_plugin->get_version_string());
 			JANUS_LOG(LOG_VERB, "\t   [%s] %s\n", janus_plugin->get_package(), janus_plugin->get_name());
@@ -5091,9 +5619,15 @@ gint main(int argc, char *argv[])
 	disabled_plugins = NULL;
 
 	/* Start web server, if enabled */
-	sessions = g_hash_table_new(NULL, NULL);
-	old_sessions = g_hash_table_new(NULL, NULL);
-	janus_mutex_init(&sessions_mutex);
+	int shard = 0;
+	for(shard = 0; shard < SESSIONS_SHARDS; shard++) {
+		g_rw_lock_init(&sessions_shards[shard].lock);
+		sessions_shards[shard].sessions = g_hash_table_new(NULL, NULL);
+		sessions_shards[shard].old_sessions = g_hash_table_new(NULL, NULL);
+	}
+	/* Timeouts and lazy frees, of sessions and of plugins too */
+	if(janus_timers_start() < 0)
+		exit(1);
 	gint64 threads = 0;
 	item = janus_config_get_item_drilldown(config, "webserver", "threads");
 	if(item && item->value) {
@@ -5111,6 +5645,12 @@ gint main(int argc, char *argv[])
 			}
 		}
 	}
+	gboolean ws_epoll = janus_ws_epoll(config, "webserver", "epoll");
+	if(ws_epoll && threads == 0) {
+		/* The epoll loop needs threads of its own, one per core will do */
+		threads = g_get_num_processors();
+	}
+	unsigned int ws_connection_limit = janus_ws_connection_limit(ws_epoll);
 	item = janus_config_get_item_drilldown(config, "webserver", "http");
 	if(!item || !item->value || !janus_is_true(item->value)) {
 		JANUS_LOG(LOG_WARN, "HTTP webserver disabled\n");
@@ -5131,15 +5671,19 @@ gint main(int argc, char *argv[])
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 				MHD_OPTION_END);
 		} else {
-			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the HTTP webserver\n", threads);
+			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the HTTP webserver (%s, up to %u connections)\n",
+				threads, ws_epoll ? "epoll" : "select", ws_connection_limit);
+			/* Long polls don't take a thread of the pool while waiting */
+			ws_suspend = TRUE;
 			ws = MHD_start_daemon(
-				MHD_USE_SELECT_INTERNALLY,
+				MHD_USE_SELECT_INTERNALLY | MHD_USE_SUSPEND_RESUME | (ws_epoll ? JANUS_MHD_USE_EPOLL : 0),
 				wsport,
 				janus_ws_client_connect,
 				NULL,
 				&janus_ws_handler,
 				ws_path,
 				MHD_OPTION_THREAD_POOL_SIZE, threads,
+				MHD_OPTION_CONNECTION_LIMIT, ws_connection_limit,
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 				MHD_OPTION_END);
 		}
@@ -5219,15 +5763,18 @@ gint main(int argc, char *argv[])
 					MHD_OPTION_HTTPS_MEM_KEY, cert_key_bytes,
 				MHD_OPTION_END);
 		} else {
-			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the HTTPS webserver\n", threads);
+			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the HTTPS webserver (%s, up to %u connections)\n",
+				threads, ws_epoll ? "epoll" : "select", ws_connection_limit);
+			ws_suspend = TRUE;
 			sws = MHD_start_daemon(
-				MHD_USE_SSL | MHD_USE_SELECT_INTERNALLY,
+				MHD_USE_SSL | MHD_USE_SELECT_INTERNALLY | MHD_USE_SUSPEND_RESUME | (ws_epoll ? JANUS_MHD_USE_EPOLL : 0),
 				swsport,
 				janus_ws_client_connect,
 				NULL,
 				&janus_ws_handler,
 				ws_path,
 				MHD_OPTION_THREAD_POOL_SIZE, threads,
+				MHD_OPTION_CONNECTION_LIMIT, ws_connection_limit,
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 					/* FIXME We're using the same certificates as those for DTLS */
 					MHD_OPTION_HTTPS_MEM_CERT, cert_pem_bytes,
@@ -5246,8 +5793,24 @@ gint main(int argc, char *argv[])
 	JANUS_LOG(LOG_WARN, "WebSockets support not compiled\n");
 #else
 	lws_set_log_level(janus_log_level >= LOG_VERB ? 7 : 0, NULL);
-	old_wss = NULL;
-	janus_mutex_init(&old_wss_mutex);
+	/* All WebSocket clients share a bounded pool of threads to serve their
+	 * requests, rather than each getting an unbounded one of its own */
+	int wss_threads = WSS_THREADS_PER_CORE * g_get_num_processors();
+	item = janus_config_get_item_drilldown(config, "webserver", "ws_threads");
+	if(item && item->value) {
+		wss_threads = atoi(item->value);
+		if(wss_threads < 1) {
+			JANUS_LOG(LOG_WARN, "Invalid ws_threads value '%s', using %d\n", item->value, WSS_THREADS_PER_CORE * g_get_num_processors());
+			wss_threads = WSS_THREADS_PER_CORE * g_get_num_processors();
+		}
+	}
+	GError *wss_error = NULL;
+	wss_pool = g_thread_pool_new(janus_wss_task, NULL, wss_threads, FALSE, &wss_error);
+	if(wss_error != NULL) {
+		JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the WebSockets thread pool...\n", wss_error->code, wss_error->message ? wss_error->message : "??");
+		g_error_free(wss_error);
+		exit(1);
+	}
 	item = janus_config_get_item_drilldown(config, "webserver", "ws");
 	if(!item || !item->value || !janus_is_true(item->value)) {
 		JANUS_LOG(LOG_WARN, "WebSockets server disabled\n");
@@ -5336,57 +5899,52 @@ gint main(int argc, char *argv[])
 			exit(1);	/* FIXME Should we really give up? */
 		}
 		const char *from_janus = g_strdup(item->value);
-		JANUS_LOG(LOG_INFO, "RabbitMQ support enabled, %s:%d (%s/%s)\n", rmqhost, rmqport, to_janus, from_janus);
-		/* Connect */
-		rmq_conn = amqp_new_connection();
-		JANUS_LOG(LOG_VERB, "Creating RabbitMQ socket...\n");
-		amqp_socket_t *socket = amqp_tcp_socket_new(rmq_conn);
-		if(socket == NULL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error creating socket...\n");
-			exit(1);	/* FIXME Should we really give up? */
-		}
-		JANUS_LOG(LOG_VERB, "Connecting to RabbitMQ server...\n");
-		int status = amqp_socket_open(socket, rmqhost, rmqport);
-		g_free(rmqhost);
-		if(status != AMQP_STATUS_OK) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error opening socket... (%s)\n", amqp_error_string2(status));
-			exit(1);	/* FIXME Should we really give up? */
+		item = janus_config_get_item_drilldown(config, "rabbitmq", "consumers");
+		if(item && item->value) {
+			rmq_consumers = atoi(item->value);
+			if(rmq_consumers < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid number of RabbitMQ consumers %d, using 1\n", rmq_consumers);
+				rmq_consumers = 1;
+			}
 		}
-		JANUS_LOG(LOG_VERB, "Logging in...\n");
-		amqp_rpc_reply_t result = amqp_login(rmq_conn, "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, "guest", "guest");
-		if(result.reply_type != AMQP_RESPONSE_NORMAL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error logging in... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
-			exit(1);	/* FIXME Should we really give up? */
+		item = janus_config_get_item_drilldown(config, "rabbitmq", "prefetch");
+		if(item && item->value) {
+			rmq_prefetch = atoi(item->value);
+			if(rmq_prefetch < 1 || rmq_prefetch > 65535) {
+				JANUS_LOG(LOG_WARN, "Invalid RabbitMQ prefetch %d, using 16\n", rmq_prefetch);
+				rmq_prefetch = 16;
+			}
 		}
-		rmq_channel = 1;
-		JANUS_LOG(LOG_VERB, "Opening channel...\n");
-		amqp_channel_open(rmq_conn, rmq_channel);
-		result = amqp_get_rpc_reply(rmq_conn);
-		if(result.reply_type != AMQP_RESPONSE_NORMAL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error opening channel... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
-			exit(1);	/* FIXME Should we really give up? */
+		item = janus_config_get_item_drilldown(config, "rabbitmq", "publish_batch");
+		if(item && item->value) {
+			rmq_batch = atoi(item->value);
+			if(rmq_batch < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid RabbitMQ publish batch %d, using 64\n", rmq_batch);
+				rmq_batch = 64;
+			}
 		}
-		JANUS_LOG(LOG_VERB, "Declaring incoming queue... (%s)\n", to_janus);
+		item = janus_config_get_item_drilldown(config, "rabbitmq", "confirms");
+		if(item && item->value)
+			rmq_confirms = janus_is_true(item->value);
+		JANUS_LOG(LOG_INFO, "RabbitMQ support enabled, %s:%d (%s/%s)\n", rmqhost, rmqport, to_janus, from_janus);
+		JANUS_LOG(LOG_INFO, "  -- %d consumer(s), prefetch %d, publishing in batches of %d%s\n",
+			rmq_consumers, rmq_prefetch, rmq_batch, rmq_confirms ? " with confirms" : "");
 		to_janus_queue = amqp_cstring_bytes(to_janus);
-		amqp_queue_declare(rmq_conn, rmq_channel, to_janus_queue, 0, 0, 0, 0, amqp_empty_table);
-		result = amqp_get_rpc_reply(rmq_conn);
-		if(result.reply_type != AMQP_RESPONSE_NORMAL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error declaring queue... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
-			exit(1);	/* FIXME Should we really give up? */
-		}
-		JANUS_LOG(LOG_VERB, "Declaring outgoing queue... (%s)\n", from_janus);
 		from_janus_queue = amqp_cstring_bytes(from_janus);
-		amqp_queue_declare(rmq_conn, rmq_channel, from_janus_queue, 0, 0, 0, 0, amqp_empty_table);
-		result = amqp_get_rpc_reply(rmq_conn);
-		if(result.reply_type != AMQP_RESPONSE_NORMAL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error declaring queue... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
-			exit(1);	/* FIXME Should we really give up? */
-		}
-		amqp_basic_consume(rmq_conn, rmq_channel, to_janus_queue, amqp_empty_bytes, 0, 1, 0, amqp_empty_table);
-		result = amqp_get_rpc_reply(rmq_conn);
-		if(result.reply_type != AMQP_RESPONSE_NORMAL) {
-			JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error consuming... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+		/* Connect: rabbitmq-c connections can't be shared by threads, so
+		 * responses and events are published on a connection of their own */
+		rmq_conn = janus_rmq_connect(rmqhost, rmqport);
+		if(rmq_conn == NULL)
 			exit(1);	/* FIXME Should we really give up? */
+		rmq_channel = 1;
+		if(rmq_confirms) {
+			/* Have the broker confirm what we publish */
+			amqp_confirm_select(rmq_conn, rmq_channel);
+			amqp_rpc_reply_t result = amqp_get_rpc_reply(rmq_conn);
+			if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+				JANUS_LOG(LOG_FATAL, "Can't enable RabbitMQ publisher confirms... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+				exit(1);	/* FIXME Should we really give up? */
+			}
 		}
 		/* FIXME We currently support a single application, create a new janus_rabbitmq_client instance */
 		rmq_client = g_malloc0(sizeof(janus_rabbitmq_client));
@@ -5396,28 +5954,59 @@ gint main(int argc, char *argv[])
 		}
 		rmq_client->sessions = NULL;
 		rmq_client->responses = g_async_queue_new();
+		rmq_client->wakeup = 0;
 		rmq_client->destroy = 0;
+		janus_mutex_init(&rmq_client->mutex);
+		janus_mutex_init(&rmq_client->stats_mutex);
+		/* Each consumer has its own connection too, and as many requests not
+		 * acknowledged yet as the prefetch allows */
+		rmq_client->consumers = g_malloc0(rmq_consumers * sizeof(janus_rabbitmq_consumer));
+		rmq_client->consumers_num = rmq_consumers;
+		int i = 0;
+		for(i = 0; i < rmq_consumers; i++) {
+			janus_rabbitmq_consumer *consumer = &rmq_client->consumers[i];
+			consumer->id = i;
+			consumer->conn = janus_rmq_connect(rmqhost, rmqport);
+			if(consumer->conn == NULL)
+				exit(1);	/* FIXME Should we really give up? */
+			amqp_basic_qos(consumer->conn, 1, 0, rmq_prefetch, 0);
+			amqp_rpc_reply_t result = amqp_get_rpc_reply(consumer->conn);
+			if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+				JANUS_LOG(LOG_FATAL, "Can't set RabbitMQ prefetch... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+				exit(1);	/* FIXME Should we really give up? */
+			}
+			amqp_basic_consume(consumer->conn, 1, to_janus_queue, amqp_empty_bytes, 0, 0, 0, amqp_empty_table);
+			result = amqp_get_rpc_reply(consumer->conn);
+			if(result.reply_type != AMQP_RESPONSE_NORMAL) {
+				JANUS_LOG(LOG_FATAL, "Can't connect to RabbitMQ server: error consuming... %s, %s\n", amqp_error_string2(result.library_error), amqp_method_name(result.reply.id));
+				exit(1);	/* FIXME Should we really give up? */
+			}
+		}
+		g_free(rmqhost);
 		GError *error = NULL;
-		rmq_client->in_thread = g_thread_try_new("rmq_in_thread", &janus_rmq_in_thread, rmq_client, &error);
+		/* rabbitmq-c is single threaded, we need a thread pool to serve requests */
+		rmq_client->thread_pool = g_thread_pool_new(janus_rmq_task, rmq_client, -1, FALSE, &error);
 		if(error != NULL) {
 			/* Something went wrong... */
-			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the RabbitMQ incoming thread...\n", error->code, error->message ? error->message : "??");
+			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the pool thread...\n", error->code, error->message ? error->message : "??");
 			exit(1);	/* FIXME Should we really give up? */
 		}
+		for(i = 0; i < rmq_consumers; i++) {
+			char tname[16];
+			g_snprintf(tname, sizeof(tname), "rmq_in_%d", i);
+			rmq_client->consumers[i].thread = g_thread_try_new(tname, &janus_rmq_in_thread, &rmq_client->consumers[i], &error);
+			if(error != NULL) {
+				/* Something went wrong... */
+				JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the RabbitMQ incoming thread...\n", error->code, error->message ? error->message : "??");
+				exit(1);	/* FIXME Should we really give up? */
+			}
+		}
 		rmq_client->out_thread = g_thread_try_new("rmq_out_thread", &janus_rmq_out_thread, rmq_client, &error);
 		if(error != NULL) {
 			/* Something went wrong... */
 			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the RabbitMQ outgoing thread...\n", error->code, error->message ? error->message : "??");
 			exit(1);	/* FIXME Should we really give up? */
 		}
-		/* rabbitmq-c is single threaded, we need a thread pool to serve requests */
-		rmq_client->thread_pool = g_thread_pool_new(janus_rmq_task, rmq_client, -1, FALSE, &error);
-		if(error != NULL) {
-			/* Something went wrong... */
-			JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the pool thread...\n", error->code, error->message ? error->message : "??");
-			exit(1);	/* FIXME Should we really give up? */
-		}
-		janus_mutex_init(&rmq_client->mutex);
 		/* Done */
 		JANUS_LOG(LOG_INFO, "Setup of RabbitMQ integration completed\n");
 	}
@@ -5439,16 +6028,6 @@ gint main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Start the sessions watchdog */
-	sessions_watchdog_context = g_main_context_new();
-	GMainLoop *watchdog_loop = g_main_loop_new(sessions_watchdog_context, FALSE);
-	GError *error = NULL;
-	GThread *watchdog = g_thread_try_new("watchdog", &janus_sessions_watchdog, watchdog_loop, &error);
-	if(error != NULL) {
-		JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to start sessions watchdog...\n", error->code, error->message ? error->message : "??");
-		exit(1);
-	}
-
 	/* Admin/monitor time: start web server, if enabled */
 	threads = 0;
 	item = janus_config_get_item_drilldown(config, "admin", "admin_threads");
@@ -5467,6 +6046,10 @@ gint main(int argc, char *argv[])
 			}
 		}
 	}
+	gboolean admin_ws_epoll = janus_ws_epoll(config, "admin", "admin_epoll");
+	if(admin_ws_epoll && threads == 0)
+		threads = g_get_num_processors();
+	unsigned int admin_ws_connection_limit = janus_ws_connection_limit(admin_ws_epoll);
 	item = janus_config_get_item_drilldown(config, "admin", "admin_http");
 	if(!item || !item->value || !janus_is_true(item->value)) {
 		JANUS_LOG(LOG_WARN, "Admin/monitor HTTP webserver disabled\n");
@@ -5487,15 +6070,17 @@ gint main(int argc, char *argv[])
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 				MHD_OPTION_END);
 		} else {
-			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the admin/monitor HTTP webserver\n", threads);
+			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the admin/monitor HTTP webserver (%s, up to %u connections)\n",
+				threads, admin_ws_epoll ? "epoll" : "select", admin_ws_connection_limit);
 			admin_ws = MHD_start_daemon(
-				MHD_USE_SELECT_INTERNALLY,
+				MHD_USE_SELECT_INTERNALLY | (admin_ws_epoll ? JANUS_MHD_USE_EPOLL : 0),
 				wsport,
 				janus_admin_ws_client_connect,
 				NULL,
 				&janus_admin_ws_handler,
 				admin_ws_path,
 				MHD_OPTION_THREAD_POOL_SIZE, threads,
+				MHD_OPTION_CONNECTION_LIMIT, admin_ws_connection_limit,
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 				MHD_OPTION_END);
 		}
@@ -5578,15 +6163,17 @@ gint main(int argc, char *argv[])
 					MHD_OPTION_HTTPS_MEM_KEY, cert_key_bytes,
 				MHD_OPTION_END);
 		} else {
-			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the admin/monitor HTTPS webserver\n", threads);
+			JANUS_LOG(LOG_VERB, "Using a thread pool of size %"SCNi64" the admin/monitor HTTPS webserver (%s, up to %u connections)\n",
+				threads, admin_ws_epoll ? "epoll" : "select", admin_ws_connection_limit);
 			admin_sws = MHD_start_daemon(
-				MHD_USE_SSL | MHD_USE_SELECT_INTERNALLY,
+				MHD_USE_SSL | MHD_USE_SELECT_INTERNALLY | (admin_ws_epoll ? JANUS_MHD_USE_EPOLL : 0),
 				swsport,
 				janus_admin_ws_client_connect,
 				NULL,
 				&janus_admin_ws_handler,
 				admin_ws_path,
 				MHD_OPTION_THREAD_POOL_SIZE, threads,
+				MHD_OPTION_CONNECTION_LIMIT, admin_ws_connection_limit,
 				MHD_OPTION_NOTIFY_COMPLETED, &janus_ws_request_completed, NULL,
 					/* FIXME We're using the same certificates as those for DTLS */
 					MHD_OPTION_HTTPS_MEM_CERT, cert_pem_bytes,
@@ -5630,12 +6217,19 @@ gint main(int argc, char *argv[])
 	//~ if(admin_sws) MHD_quiesce_daemon(admin_sws);
 	//~ g_usleep(155000); /* Long-poll loop sleeps for 100ms between status checks */
 
-	JANUS_LOG(LOG_INFO, "Ending watchdog mainloop...\n");
-	g_main_loop_quit(watchdog_loop);
-	g_thread_join(watchdog);
-	watchdog = NULL;
-	g_main_loop_unref(watchdog_loop);
-	g_main_context_unref(sessions_watchdog_context);
+	/* Wake up all the long polls, so that no connection is left suspended (or
+	 * waiting): sessions already scheduled for deletion were woken up then */
+	for(shard = 0; shard < SESSIONS_SHARDS; shard++) {
+		g_rw_lock_reader_lock(&sessions_shards[shard].lock);
+		if(sessions_shards[shard].sessions != NULL) {
+			GHashTableIter iter;
+			gpointer value;
+			g_hash_table_iter_init(&iter, sessions_shards[shard].sessions);
+			while(g_hash_table_iter_next(&iter, NULL, &value))
+				janus_session_wakeup((janus_session *)value);
+		}
+		g_rw_lock_reader_unlock(&sessions_shards[shard].lock);
+	}
 
 	if(config)
 		janus_config_destroy(config);
@@ -5660,19 +6254,26 @@ gint main(int argc, char *argv[])
 	if(swss != NULL)
 		libwebsocket_cancel_service(swss);
 	swss = NULL;
-	if(old_wss != NULL)
-		g_list_free(old_wss);
-	old_wss = NULL;
+	if(wss_pool != NULL)
+		g_thread_pool_free(wss_pool, FALSE, TRUE);
+	wss_pool = NULL;
 #endif
 #ifdef HAVE_RABBITMQ
 	if(rmq_channel) {
 		if(rmq_client) {
-			g_thread_join(rmq_client->in_thread);
+			int i = 0;
+			for(i = 0; i < rmq_client->consumers_num; i++) {
+				if(rmq_client->consumers[i].thread != NULL)
+					g_thread_join(rmq_client->consumers[i].thread);
+				janus_rmq_disconnect(rmq_client->consumers[i].conn);
+			}
 			g_thread_join(rmq_client->out_thread);
+			/* Wait for the requests still being served */
+			if(rmq_client->thread_pool != NULL)
+				g_thread_pool_free(rmq_client->thread_pool, FALSE, TRUE);
+			rmq_client->thread_pool = NULL;
 		}
-		amqp_channel_close(rmq_conn, rmq_channel, AMQP_REPLY_SUCCESS);
-		amqp_connection_close(rmq_conn, AMQP_REPLY_SUCCESS);
-		amqp_destroy_connection(rmq_conn);
+		janus_rmq_disconnect(rmq_conn);
 	}
 #endif
 	if(cert_pem_bytes != NULL)
@@ -5682,10 +6283,15 @@ gint main(int argc, char *argv[])
 		g_free((gpointer)cert_key_bytes);
 	cert_key_bytes = NULL;
 	JANUS_LOG(LOG_INFO, "Destroying sessions...\n");
-	if(sessions != NULL)
-		g_hash_table_destroy(sessions);
-	if(old_sessions != NULL)
-		g_hash_table_destroy(old_sessions);
+	for(shard = 0; shard < SESSIONS_SHARDS; shard++) {
+		if(sessions_shards[shard].sessions != NULL)
+			g_hash_table_destroy(sessions_shards[shard].sessions);
+		sessions_shards[shard].sessions = NULL;
+		if(sessions_shards[shard].old_sessions != NULL)
+			g_hash_table_destroy(sessions_shards[shard].old_sessions);
+		sessions_shards[shard].old_sessions = NULL;
+		g_rw_lock_clear(&sessions_shards[shard].lock);
+	}
 	JANUS_LOG(LOG_INFO, "Freeing crypto resources...\n");
 	SSL_CTX_free(janus_dtls_get_ssl_ctx());
 	EVP_cleanup();
@@ -5708,13 +6314,16 @@ gint main(int argc, char *argv[])
 		g_hash_table_foreach(plugins_so, janus_pluginso_close, NULL);
 		g_hash_table_destroy(plugins_so);
 	}
+	/* Plugins may have used timers as well */
+	JANUS_LOG(LOG_INFO, "Stopping timers...\n");
+	janus_timers_stop();
 
 	JANUS_PRINT("Bye!\n");
 	exit(0);
 }
 
 
-void janus_http_event_free(janus_http_event *event)
+void janus_http_event_clear(janus_http_event *event)
 {
 	if (event == NULL) {
 		return;
@@ -5723,6 +6332,49 @@ void janus_http_event_free(janus_http_event *event)
 	if (event->payload && event->allocated) {
 		g_free(event->payload);
 	}
+	if (event->json) {
+		json_decref(event->json);
+	}
 
+	memset(event, 0, sizeof(*event));
+}
+
+void janus_http_event_free(janus_http_event *event)
+{
+	if (event == NULL) {
+		return;
+	}
+
+	janus_http_event_clear(event);
 	g_free(event);
 }
+
+const char *janus_http_event_payload(janus_http_event *event, size_t flags)
+{
+	if (event == NULL) {
+		return NULL;
+	}
+	if (event->payload == NULL && event->json != NULL) {
+		/* First (and only) time this event is serialized */
+		event->payload = json_dumps(event->json, flags);
+		event->allocated = 1;
+	}
+
+	return event->payload;
+}
+
+json_t *janus_http_event_json(janus_http_event *event)
+{
+	if (event == NULL) {
+		return NULL;
+	}
+	if (event->json != NULL) {
+		return json_incref(event->json);
+	}
+	if (event->payload == NULL) {
+		return NULL;
+	}
+	/* Queued as text, we have to parse it */
+	json_error_t error;
+	return json_loads(event->payload, 0, &error);
+}
@@ -36,6 +36,7 @@
 #endif
 
 #include "mutex.h"
+#include "timer.h"
 #include "dtls.h"
 #include "ice.h"
 #include "sctp.h"
@@ -59,6 +60,16 @@ typedef struct janus_http_msg {
 	size_t len;
 	/*! \brief Gateway-Client session identifier this message belongs to */
 	gint64 session_id;
+	/*! \brief The libmicrohttpd connection this message came from (needed to resume it when suspended) */
+	struct MHD_Connection *connection;
+	/*! \brief Maximum number of events this long poll can return */
+	int max_events;
+	/*! \brief Monotonic time at which this long poll times out */
+	gint64 deadline;
+	/*! \brief Timer to resume this long poll when it times out, if suspended */
+	janus_timer longpoll_timer;
+	/*! \brief Whether this message is a long poll waiting for events */
+	gint longpoll:1;
 } janus_http_msg;
 
 /*! \brief HTTP event to push */
@@ -67,10 +78,56 @@ typedef struct janus_http_event {
 	gint code;
 	/*! \brief Payload to send to the client, if any */
 	gchar *payload;
+	/*! \brief The event as a JSON object, if it was queued as such: it's only
+	 * serialized (to payload) when a transport actually sends it */
+	json_t *json;
+	/*! \brief Handle that originated the event, if it's a notification that can be
+	 * coalesced with a more recent one from the same handle (0 otherwise) */
+	guint64 sender;
 	/*! \brief Whether the payload has been allocated (and thus needs to be freed) or not */
 	gint allocated:1;
 } janus_http_event;
+/*! \brief Method to free a janus_http_event instance
+ * @param[in] event The janus_http_event instance to free */
 void janus_http_event_free(janus_http_event *event);
+/*! \brief Method to free the content of a janus_http_event instance, but not the instance itself (e.g., a slot in a ring)
+ * @param[in] event The janus_http_event instance to clear */
+void janus_http_event_clear(janus_http_event *event);
+/*! \brief Method to get the text of an event to send, serializing it the first time if it was queued as JSON
+ * @param[in] event The janus_http_event instance
+ * @param[in] flags The Jansson flags to serialize the event with (see janus_json_format)
+ * @returns The payload to send, owned by the event, or NULL if there isn't any */
+const char *janus_http_event_payload(janus_http_event *event, size_t flags);
+/*! \brief Method to get an event as a JSON object, e.g., to return it in an array with others
+ * \note The JSON object is only parsed from the payload if the event was queued as text
+ * @param[in] event The janus_http_event instance
+ * @returns A new reference to the JSON object, or NULL if there isn't any or it isn't valid JSON */
+json_t *janus_http_event_json(janus_http_event *event);
+
+/*! \brief What to do when an event is added to a session whose ring of events is full */
+typedef enum janus_events_overflow {
+	/*! \brief Drop the oldest event in the ring */
+	JANUS_EVENTS_DROP_OLDEST = 0,
+	/*! \brief Replace the most recent event from the same handle, if the new one
+	 * is a notification and there's one in the ring, or drop the oldest otherwise */
+	JANUS_EVENTS_COALESCE_LATEST,
+} janus_events_overflow;
+
+/*! \brief Bounded ring of events to push to a session, with slots allocated once */
+typedef struct janus_events_ring {
+	/*! \brief Slots of the ring, events are copied in and out of them */
+	janus_http_event *slots;
+	/*! \brief Number of slots */
+	guint size;
+	/*! \brief Index of the oldest event */
+	guint head;
+	/*! \brief Number of events in the ring */
+	guint count;
+	/*! \brief Events dropped because the ring was full */
+	guint64 dropped;
+	/*! \brief Events replaced by a more recent one from the same handle because the ring was full */
+	guint64 coalesced;
+} janus_events_ring;
 
 
 /*! \brief Gateway-Client session */
@@ -79,8 +136,8 @@ typedef struct janus_session {
 	guint64 session_id;
 	/*! \brief Map of handles this session is managing */
 	GHashTable *ice_handles;
-	/*! \brief Queue of outgoing messages to push */
-	GAsyncQueue *messages;
+	/*! \brief Ring of outgoing events to push (protected by the session mutex) */
+	janus_events_ring events;
 	/*! \brief Time of the last activity on the session */
 	gint64 last_activity;
 	/*! \brief Opaque pointer to a janus_request_source instance (where the session came from) */
@@ -89,12 +146,24 @@ typedef struct janus_session {
 	gint destroy:1;
 	/*! \brief Flag to notify there's been a session timeout */
 	gint timeout:1;
+	/*! \brief Long polls (janus_http_msg instances) whose connection is suspended until there are events */
+	GList *longpolls;
+	/*! \brief Condition long polls served by a thread of their own wait on until there are events */
+	janus_condition longpoll_cond;
+	/*! \brief Timer to check whether the session has been idle for too long */
+	janus_timer timeout_timer;
+	/*! \brief Timer to actually free the session, a while after it's been destroyed */
+	janus_timer cleanup_timer;
 	/*! \brief Mutex to lock/unlock this session */
 	janus_mutex mutex;
 } janus_session;
 
 #ifdef HAVE_WEBSOCKETS
-/*! \brief WebSocket client session */
+/*! \brief WebSocket client session
+ * \details Clients are refcounted: besides the connection, each request
+ * source pointing to a client (pending requests, sessions the client
+ * created) holds a reference, so that whoever has one can check whether
+ * the client has been closed without any lock or lookup */
 typedef struct janus_websocket_client {
 	/*! \brief The libwebsock client context */
 	struct libwebsocket_context *context;
@@ -104,16 +173,24 @@ typedef struct janus_websocket_client {
 	GHashTable *sessions;
 	/*! \brief Queue of outgoing responses to push */
 	GAsyncQueue *responses;
-	/*! \brief Thread pool to serve requests */
-	GThreadPool *thread_pool;
+	/*! \brief Whether a writable callback has been asked for and not served yet (responses and events queued in the meanwhile don't need another one) */
+	volatile gint writable;
+	/*! \brief Buffer (with the padding libwebsockets needs) outgoing messages are copied to, reused for all writes */
+	unsigned char *buffer;
+	/*! \brief Size of the buffer */
+	size_t buflen;
+	/*! \brief Number of references to this client */
+	volatile gint ref;
 	/*! \brief Mutex to lock/unlock this session */
 	janus_mutex mutex;
-	/*! \brief Flag to trigger a lazy session destruction */
-	gint destroy:1;
+	/*! \brief Whether the connection has been closed (set atomically, so it can be checked without locking) */
+	volatile gint destroy;
 } janus_websocket_client;
 
 /*! \brief WebSocket request */
 typedef struct janus_websocket_request {
+	/*! \brief The WebSocket client the request came from */
+	janus_websocket_client *client;
 	/*! \brief Opaque pointer to a janus_request_source instance (where the request came from) */
 	void *source;
 	/*! \brief Opaque pointer to the payload of the request (json_t *) */
@@ -122,16 +199,52 @@ typedef struct janus_websocket_request {
 #endif
 
 #ifdef HAVE_RABBITMQ
+/*! \brief RabbitMQ consumer of the incoming queue
+ * \details rabbitmq-c connections can't be shared by threads, so each
+ * consumer has a connection of its own */
+typedef struct janus_rabbitmq_consumer {
+	/*! \brief Index of the consumer, for logging */
+	int id;
+	/*! \brief The connection to the broker this consumer receives requests on */
+	amqp_connection_state_t conn;
+	/*! \brief The thread consuming the requests */
+	GThread *thread;
+} janus_rabbitmq_consumer;
+
+/*! \brief RabbitMQ counters, to see how the integration is doing */
+typedef struct janus_rabbitmq_stats {
+	/*! \brief Requests received, by all consumers */
+	guint64 received;
+	/*! \brief Total and maximum time spent serving requests, from delivery to response (us) */
+	guint64 serve_time, serve_time_max;
+	/*! \brief Messages (responses and events) published */
+	guint64 published;
+	/*! \brief Messages the broker confirmed, or rejected, if confirms are enabled */
+	guint64 confirmed, nacked;
+	/*! \brief Batches published, and total and maximum time spent publishing them and waiting for the confirms (us) */
+	guint64 batches, batch_time, batch_time_max;
+} janus_rabbitmq_stats;
+
 /*! \brief RabbitMQ client session */
 typedef struct janus_rabbitmq_client {
 	/*! \brief List of gateway sessions this client has created and is managing */
 	GHashTable *sessions;
 	/*! \brief Queue of outgoing responses to push */
 	GAsyncQueue *responses;
-	/*! \brief Threads to handle messaging */
-	GThread *in_thread, *out_thread;
+	/*! \brief Consumers of the incoming queue */
+	janus_rabbitmq_consumer *consumers;
+	/*! \brief Number of consumers */
+	int consumers_num;
+	/*! \brief Thread publishing responses and events */
+	GThread *out_thread;
 	/*! \brief Thread pool to serve requests */
 	GThreadPool *thread_pool;
+	/*! \brief Whether the outgoing thread has been woken up for session events and hasn't looked at them yet */
+	volatile gint wakeup;
+	/*! \brief Counters */
+	janus_rabbitmq_stats stats;
+	/*! \brief Mutex to lock/unlock the counters */
+	janus_mutex stats_mutex;
 	/*! \brief Mutex to lock/unlock this session */
 	janus_mutex mutex;
 	/*! \brief Flag to trigger a lazy session destruction */
@@ -144,6 +257,8 @@ typedef struct janus_rabbitmq_request {
 	void *source;
 	/*! \brief Opaque pointer to the payload of the request (json_t *) */
 	void *request;
+	/*! \brief Monotonic time the request was delivered at */
+	gint64 received;
 } janus_rabbitmq_request;
 
 /*! \brief RabbitMQ response */
@@ -161,7 +276,7 @@ typedef struct janus_rabbitmq_response {
 ///@{
 /*! \brief Method to create a new Janus Gateway-Client session
  * @param[in] session_id The desired Janus Gateway-Client session ID, or 0 if it needs to be generated randomly
- * @returns The created Janus Gateway-Client session if successful, NULL otherwise */
+ * @returns The created Janus Gateway-Client session if successful, NULL otherwise (including when the desired ID is already taken) */
 janus_session *janus_session_create(guint64 session_id);
 /*! \brief Method to find an existing Janus Gateway-Client session from its ID
  * @param[in] session_id The Janus Gateway-Client session ID
@@ -171,6 +286,26 @@ janus_session *janus_session_find(guint64 session_id);
  * @param[in] session_id The Janus Gateway-Client session ID
  * @param[in] event The janus_http_event instance to add to the queue */
 void janus_session_notify_event(guint64 session_id, janus_http_event *event);
+/*! \brief Method to add an event to the ring of events of a session, and let transports know
+ * \details The content of the event is copied to a slot of the ring, which takes ownership
+ * of it: the janus_http_event instance itself is not, and can live on the stack.
+ * If the ring is full, an older event is dropped according to the overflow policy.
+ * @param[in] session The Janus Gateway-Client session instance
+ * @param[in] event The janus_http_event instance whose content to add to the ring */
+void janus_session_push_event(janus_session *session, janus_http_event *event);
+/*! \brief Method to take the oldest events from the ring of events of a session
+ * @param[in] session The Janus Gateway-Client session instance
+ * @param[out] events Array the events are copied to: the caller owns their content, and
+ * must release it with janus_http_event_clear when done
+ * @param[in] max Maximum number of events to take (size of the array)
+ * @returns The number of events copied to the array */
+guint janus_session_pop_events(janus_session *session, janus_http_event *events, guint max);
+/*! \brief Method to wake up the long polls waiting for events on this session
+ * \details To be called any time an event is added to the session queue, or
+ * when the session goes away: suspended long poll connections are resumed,
+ * and the ones served by a thread of their own are signalled.
+ * @param[in] session The Janus Gateway-Client session instance */
+void janus_session_wakeup(janus_session *session);
 /*! \brief Method to find an existing Janus Gateway-Client session scheduled to be destroyed from its ID
  * @param[in] session_id The Janus Gateway-Client session ID
  * @returns The created Janus Gateway-Client session if successful, NULL otherwise */
@@ -206,6 +341,8 @@ typedef struct janus_request_source {
 	void *source;
 	/*! \brief Opaque pointer to the original request, if available */
 	void *msg;
+	/*! \brief Whether the request came through the admin/monitor interface */
+	int admin;
 } janus_request_source;
 /*! \brief Helper to allocate a janus_request_source instance
  * @param[in] type The source type
@@ -217,6 +354,12 @@ janus_request_source *janus_request_source_new(int type, void *source, void *msg
  * @param[in] req_source The janus_request_source instance to destroy
  * @note The opaque pointers in the instance are not destroyed, that's up to you */
 void janus_request_source_destroy(janus_request_source *req_source);
+/*! \brief Helper to get the Jansson flags to serialize what we send to a source with
+ * \details Messages are compact by default, but the format can be configured,
+ * globally and per transport (e.g., indented, for debugging)
+ * @param[in] source The source the message is for, or NULL for the global format
+ * @returns The flags to pass to json_dumps */
+size_t janus_json_format(janus_request_source *source);
 /*! \brief Helper to process an incoming request, no matter where it comes from
  * @param[in] source The source that originated the request
  * @param[in] request The JSON request
@@ -274,10 +417,14 @@ int janus_ws_headers(void *cls, enum MHD_ValueKind kind, const char *key, const
 /*! \brief Callback (libmicrohttpd) invoked when a request has been processed and can be freed */
 void janus_ws_request_completed (void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe);
 /*! \brief Worker to handle requests that are actually long polls
- * \details As this method handles a long poll, it doesn't return until an
- * event (e.g., pushed by a plugin) is available, or a timeout (30 seconds)
- * has been fired. In case of a timeout, a keep-alive Janus response (JSON)
- * is sent to tell the browser that the session is still valid.
+ * \details A long poll is answered as soon as an event (e.g., pushed by a
+ * plugin) is available, or when a timeout (30 seconds) fires. In case of a
+ * timeout, a keep-alive Janus response (JSON) is sent to tell the browser
+ * that the session is still valid. When the webserver uses a thread pool,
+ * the connection is suspended while waiting (no thread is kept busy) and
+ * resumed by janus_session_wakeup, which calls this method again to send
+ * the response; with a thread per connection, the thread waits on the
+ * session condition instead of polling the queue.
  * @param[in] source The janus_request_source instance that is handling the request
  * @param[in] max_events The maximum number of events that can be returned in a single response (by default just one; if more, an array is returned)
  * @returns MHD_YES on success, MHD_NO otherwise */
@@ -313,9 +460,9 @@ int janus_ws_notifier(janus_request_source *source, int max_events);
  * @param[in] data Opaque pointer to the janus_websocket_client this thread refers to
  * @returns Nothing important */
 void *janus_wss_thread(void *data);
-/*! \brief Worker to have a new request server by the thread pool
- * @param[in] data Opaque pointer to the content of the response
- * @param[in] user_data Opaque pointer to a janus_websocket_client instance
+/*! \brief Worker to have a new request served by the thread pool shared by all WebSocket clients
+ * @param[in] data Opaque pointer to the janus_websocket_request instance
+ * @param[in] user_data Unused
  * @returns Nothing important */
 void janus_wss_task(gpointer data, gpointer user_data);
 ///@}
@@ -349,8 +496,9 @@ void janus_wss_task(gpointer data, gpointer user_data);
  */
 ///@{
 /*! \brief Worker to handle incoming messages coming from the external
- * application.
- * @param[in] data Currently unused
+ * application: there may be more than one, each with its own connection
+ * and prefetch window, sharing the incoming queue.
+ * @param[in] data Opaque pointer to the janus_rabbitmq_consumer instance
  * @returns Nothing important */
 void *janus_rmq_in_thread(void *data);
 /*! \brief Worker to handle responses and push notifications from the
@@ -361,6 +509,8 @@ void *janus_rmq_in_thread(void *data);
  * property in the requests: responses will include it (as part of the RPC
  * pattern), notifications won't. You'll still be able to associate notifications
  * to requests by looking at the transaction identifier in the messages.
+ * Whatever is there to send is published in batches, and if publisher
+ * confirms are enabled each batch is confirmed by the broker before the next.
  * @param[in] data Currently unused
  * @returns Nothing important */
 void *janus_rmq_out_thread(void *data);
@@ -1,7 +1,7 @@
 /*! \file    mutex.h
  * \author   Lorenzo Miniero <lorenzo@meetecho.com>
- * \brief    Semaphors and Mutexes
- * \details  Implementation (based on pthread) of a locking mechanism based on mutexes.
+ * \brief    Semaphors, Mutexes and Conditions
+ * \details  Implementation (based on pthread) of a locking mechanism based on mutexes and conditions.
  * 
  * \ingroup core
  * \ref core
@@ -33,4 +33,19 @@ typedef pthread_mutex_t janus_mutex;
 /*! \brief Janus mutex unlock wrapper (selective locking debug) */
 #define janus_mutex_unlock(a) { if(!lock_debug) { janus_mutex_unlock_nodebug(a); } else { janus_mutex_unlock_debug(a); } };
 
+/*! \brief Janus condition implementation */
+typedef pthread_cond_t janus_condition;
+/*! \brief Janus condition initialization */
+#define janus_condition_init(a) pthread_cond_init(a,NULL)
+/*! \brief Janus condition destruction */
+#define janus_condition_destroy(a) pthread_cond_destroy(a)
+/*! \brief Janus condition wait (the mutex must be locked) */
+#define janus_condition_wait(a, b) pthread_cond_wait(a, b);
+/*! \brief Janus condition wait with an absolute (CLOCK_REALTIME) timeout (the mutex must be locked) */
+#define janus_condition_timedwait(a, b, c) pthread_cond_timedwait(a, b, c);
+/*! \brief Janus condition signal */
+#define janus_condition_signal(a) pthread_cond_signal(a);
+/*! \brief Janus condition broadcast */
+#define janus_condition_broadcast(a) pthread_cond_broadcast(a);
+
 #endif
@@ -18,6 +18,10 @@
  * the syntax of the message/event is completely up to you, the only
  * important thing is that it MUST be a JSON object, as it will be included
  * as such within the Janus session/handle protocol;
+ * - \c push_event_json(): same as \c push_event(), but the message/event
+ * is passed as a Jansson object the gateway takes ownership of, which
+ * spares it parsing the text back (the gateway serializes it only once,
+ * when a transport sends it);
  * - \c relay_rtp(): to send/relay the peer an RTP packet;
  * - \c relay_rtcp(): to send/relay the peer an RTCP message.
  * - \c relay_data(): to send/relay the peer a SCTP DataChannel message.
@@ -60,6 +64,10 @@ janus_plugin *create(void) {
  * - \c get_package(): this method should return a unique package identifier for your plugin (e.g., "janus.plugin.myplugin");
  * - \c create_session(): this method is called by the gateway to create a session between you and a peer;
  * - \c handle_message(): a callback to notify you the peer sent you a message/request;
+ * - \c handle_message_json(): same as \c handle_message(), but the message/request
+ * is passed as the Jansson object the gateway parsed already (optional: if
+ * you implement it, the gateway uses it in place of \c handle_message() and
+ * you don't have to parse the text back);
  * - \c setup_media(): a callback to notify you the peer PeerConnection is now ready to be used;
  * - \c incoming_rtp(): a callback to notify you a peer has sent you a RTP packet;
  * - \c incoming_rtcp(): a callback to notify you a peer has sent you a RTCP message;
@@ -154,6 +162,8 @@ janus_plugin *create(void) {
 #include <unistd.h>
 #include <inttypes.h>
 
+#include <jansson.h>
+
 
 /*! \brief Version of the API, to match the one plugins were compiled against
  * 
@@ -164,7 +174,7 @@ janus_plugin *create(void) {
  * gateway or it will crash.
  * 
  */
-#define JANUS_PLUGIN_API_VERSION	4
+#define JANUS_PLUGIN_API_VERSION	6
 
 /*! \brief Initialization of all plugin properties to NULL
  * 
@@ -202,6 +212,7 @@ static janus_plugin janus_echotest_plugin =
 		.hangup_media = NULL,			\
 		.destroy_session = NULL,		\
 		.query_session = NULL, 			\
+		.handle_message_json = NULL,	\
 		## __VA_ARGS__ }
 
 
@@ -320,6 +331,20 @@ struct janus_plugin {
 	 * @returns A JSON-formatted string with the requested info */
 	char *(* const query_session)(janus_plugin_session *handle);
 
+	/*! \brief Method to handle an incoming message/request from a peer, passed as a JSON object
+	 * \note Optional: when available, the gateway invokes this instead of
+	 * handle_message(). The plugin takes ownership of the message (a reference
+	 * to it), and the gateway doesn't touch it afterwards, so the plugin can
+	 * keep it and modify it as it sees fit
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] transaction The transaction identifier for this message/request
+	 * @param[in] message The JSON message/request (an object)
+	 * @param[in] sdp_type The type of the SDP attached to the message/request, if any (offer/answer)
+	 * @param[in] sdp The SDP attached to the message/request, if any
+	 * @returns A janus_plugin_result instance that may contain a response (for immediate/synchronous replies), an ack
+	 * (for asynchronously managed requests) or an error */
+	struct janus_plugin_result * (* const handle_message_json)(janus_plugin_session *handle, char *transaction, json_t *message, char *sdp_type, char *sdp);
+
 };
 
 /*! \brief Callbacks to contact the gateway */
@@ -362,6 +387,18 @@ struct janus_callbacks {
 	 * @param[in] handle The plugin/gateway session to get rid of */
 	void (* const end_session)(janus_plugin_session *handle);
 
+	/*! \brief Callback to push events/messages to a peer, passed as a JSON object
+	 * \note The gateway takes ownership of the message (a reference to it),
+	 * whether the event is pushed or not: plugins must not use it afterwards
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] plugin The plugin instance that is sending the message/event
+	 * @param[in] transaction The transaction identifier this message refers to
+	 * @param[in] message The JSON message (must be an object)
+	 * @param[in] sdp_type The type of the SDP attached to the message/event, if any (offer/answer)
+	 * @param[in] sdp The SDP attached to the message/event, if any (in case the plugin is requesting or responding to a media setup)
+	 * @returns JANUS_OK (0) if the event was queued, an error code otherwise */
+	int (* const push_event_json)(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, json_t *message, const char *sdp_type, const char *sdp);
+
 };
 
 /*! \brief The hook that plugins need to implement to be created from the gateway */
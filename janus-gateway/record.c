@@ -11,6 +11,11 @@
  * \note If you want to record both audio and video, you'll have to use
  * two different recorders. Any muxing in the same container will have
  * to be done in the post-processing phase.
+ * \note Recorders can write the frames themselves, on the thread that
+ * saves them, or (see janus_recorder_init()) just copy them to a ring
+ * buffer that a thread of their own writes to disk in large chunks,
+ * so that disk latency never stalls the media path: if the disk can't
+ * keep up and the buffer fills up, frames are dropped instead.
  * 
  * \ingroup core
  * \ref core
@@ -18,7 +23,10 @@
  
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 
 #include <glib.h>
 #include <jansson.h>
@@ -33,6 +41,249 @@ static const char *header = "MJR00001";
 /* Frame header in the structured recording */
 static const char *frame_header = "MEETECHO";
 
+/* Smallest ring buffer of an asynchronous recorder */
+#define JANUS_RECORDER_BUFFER_MIN	(64*1024)
+/* Asynchronous recorders write whole chunks of this size, so that the file
+ * offsets they write at are aligned, unless it's time to flush everything */
+#define JANUS_RECORDER_CHUNK		4096
+/* How much needs to be buffered for the writer to be woken up before the
+ * flush interval expires (a quarter of the ring buffer, if smaller) */
+#define JANUS_RECORDER_WAKEUP		(64*1024)
+
+/* How the recorders created from now on write their frames */
+static gboolean recorder_async = FALSE;
+static guint recorder_buffer = 1024*1024;
+static guint recorder_flush = 500;
+static janus_recorder_sync recorder_sync = JANUS_RECORDER_SYNC_CLOSE;
+static guint recorder_sync_interval = 5000;
+
+/* Ring buffer of an asynchronous recorder, and the thread that writes it.
+ * Frames are copied to the ring as they'll be on file: the thread saving
+ * them (holding the recorder mutex, which makes it a single producer) is
+ * the only one that moves the head forward, and the writer thread the
+ * only one that moves the tail, so neither needs to lock the other out */
+struct janus_recorder_writer {
+	char *ring;
+	guint32 size;
+	volatile gint head, tail;
+	/* How much needs to be buffered to wake the writer up */
+	guint32 wakeup;
+	/* Where the writer writes to, and how */
+	int fd;
+	gint64 offset;
+	guint flush;
+	janus_recorder_sync sync;
+	guint sync_interval;
+	GThread *thread;
+	janus_mutex mutex;
+	janus_condition cond;
+	volatile gint stopping;
+	/* Frames dropped because the ring was full */
+	guint dropped;
+	gboolean failed;
+};
+
+
+void janus_recorder_init(gboolean async, guint buffer, guint flush, janus_recorder_sync sync, guint sync_interval) {
+	recorder_async = async;
+	recorder_buffer = JANUS_RECORDER_BUFFER_MIN;
+	while(recorder_buffer < buffer && recorder_buffer < (1 << 30))
+		recorder_buffer <<= 1;
+	recorder_flush = flush > 10 ? flush : 10;
+	recorder_sync = sync;
+	recorder_sync_interval = sync_interval > 100 ? sync_interval : 100;
+	if(!recorder_async) {
+		JANUS_LOG(LOG_INFO, "Recorders write frames as they get them\n");
+	} else {
+		JANUS_LOG(LOG_INFO, "Recorders write frames asynchronously (%u bytes buffered at most, flushed every %ums, %s)\n",
+			recorder_buffer, recorder_flush,
+			recorder_sync == JANUS_RECORDER_SYNC_NONE ? "never synced" :
+				(recorder_sync == JANUS_RECORDER_SYNC_CLOSE ? "synced when closed" : "synced periodically"));
+	}
+}
+
+/* Copies data to the ring (the caller made sure it fits) */
+static void janus_recorder_ring_copy(janus_recorder_writer *writer, guint32 pos, const void *data, guint32 len) {
+	guint32 index = pos & (writer->size-1);
+	guint32 first = MIN(len, writer->size - index);
+	memcpy(writer->ring + index, data, first);
+	if(first < len)
+		memcpy(writer->ring, (const char *)data + first, len - first);
+}
+
+/* Queues some data preceded by its length (and by a prefix, if any) as
+ * it will be on file: if there's no room for it, it's dropped. Must be
+ * called with the recorder mutex locked */
+static int janus_recorder_writer_put(janus_recorder_writer *writer, const char *prefix, const char *data, uint16_t length) {
+	guint32 head = g_atomic_int_get(&writer->head);
+	guint32 used = head - (guint32)g_atomic_int_get(&writer->tail);
+	guint32 prefix_len = prefix ? strlen(prefix) : 0;
+	guint32 needed = prefix_len + sizeof(uint16_t) + length;
+	if(needed > writer->size - used) {
+		writer->dropped++;
+		if(writer->dropped == 1 || writer->dropped % 1000 == 0)
+			JANUS_LOG(LOG_WARN, "Recording buffer full, dropped %u frames so far\n", writer->dropped);
+		return -1;
+	}
+	guint32 pos = head;
+	if(prefix_len > 0) {
+		janus_recorder_ring_copy(writer, pos, prefix, prefix_len);
+		pos += prefix_len;
+	}
+	uint16_t length_bytes = htons(length);
+	janus_recorder_ring_copy(writer, pos, &length_bytes, sizeof(uint16_t));
+	pos += sizeof(uint16_t);
+	janus_recorder_ring_copy(writer, pos, data, length);
+	g_atomic_int_set(&writer->head, head + needed);
+	/* Wake the writer up when there's enough to write */
+	if(used < writer->wakeup && used + needed >= writer->wakeup) {
+		janus_mutex_lock_nodebug(&writer->mutex);
+		janus_condition_signal(&writer->cond);
+		janus_mutex_unlock_nodebug(&writer->mutex);
+	}
+	return 0;
+}
+
+/* Writes part of the ring to file: what can't be written is lost */
+static void janus_recorder_writer_write(janus_recorder_writer *writer, guint32 pos, guint32 amount) {
+	while(amount > 0) {
+		/* Two pieces, if the data wraps around the end of the ring */
+		guint32 index = pos & (writer->size-1);
+		struct iovec iov[2];
+		int iovcnt = 1;
+		iov[0].iov_base = writer->ring + index;
+		iov[0].iov_len = MIN(amount, writer->size - index);
+		if(iov[0].iov_len < amount) {
+			iov[1].iov_base = writer->ring;
+			iov[1].iov_len = amount - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		ssize_t res = writev(writer->fd, iov, iovcnt);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0) {
+			if(!writer->failed)
+				JANUS_LOG(LOG_ERR, "Error saving frames: %d (%s)\n", errno, strerror(errno));
+			writer->failed = TRUE;
+			return;
+		}
+		pos += res;
+		amount -= res;
+		writer->offset += res;
+	}
+}
+
+static void *janus_recorder_writer_thread(void *data) {
+	janus_recorder_writer *writer = (janus_recorder_writer *)data;
+	gint64 last_flush = janus_get_monotonic_time(), last_sync = last_flush;
+	gboolean dirty = FALSE;
+	while(TRUE) {
+		/* Wait for a chunk's worth of data, or for the next flush or sync */
+		gboolean stopping = FALSE, flush = FALSE;
+		gint64 now = 0;
+		janus_mutex_lock_nodebug(&writer->mutex);
+		while(TRUE) {
+			stopping = g_atomic_int_get(&writer->stopping);
+			if(stopping)
+				break;
+			guint32 used = (guint32)g_atomic_int_get(&writer->head) - (guint32)g_atomic_int_get(&writer->tail);
+			if(used >= writer->wakeup)
+				break;
+			now = janus_get_monotonic_time();
+			gint64 deadline = last_flush + (gint64)writer->flush*1000;
+			if(dirty && writer->sync == JANUS_RECORDER_SYNC_PERIODIC)
+				deadline = MIN(deadline, last_sync + (gint64)writer->sync_interval*1000);
+			if(now >= deadline) {
+				flush = TRUE;
+				break;
+			}
+			gint64 wakeup = janus_get_real_time() + (deadline - now);
+			struct timespec ts;
+			ts.tv_sec = wakeup / G_USEC_PER_SEC;
+			ts.tv_nsec = (wakeup % G_USEC_PER_SEC) * 1000;
+			janus_condition_timedwait(&writer->cond, &writer->mutex, &ts);
+		}
+		janus_mutex_unlock_nodebug(&writer->mutex);
+		now = janus_get_monotonic_time();
+		guint32 tail = g_atomic_int_get(&writer->tail);
+		guint32 used = (guint32)g_atomic_int_get(&writer->head) - tail;
+		guint32 amount = used;
+		if(!stopping && !flush) {
+			/* Only whole chunks: the rest waits for more data or for the flush */
+			amount = ((writer->offset + used) & ~(gint64)(JANUS_RECORDER_CHUNK-1)) - writer->offset;
+		} else {
+			last_flush = now;
+		}
+		if(amount > 0) {
+			janus_recorder_writer_write(writer, tail, amount);
+			g_atomic_int_set(&writer->tail, tail + amount);
+			dirty = TRUE;
+		}
+		if(dirty && writer->sync == JANUS_RECORDER_SYNC_PERIODIC && now - last_sync >= (gint64)writer->sync_interval*1000) {
+			fdatasync(writer->fd);
+			last_sync = now;
+			dirty = FALSE;
+		}
+		/* Once stopping, nothing is added to the ring anymore */
+		if(stopping && amount == used)
+			break;
+	}
+	if(dirty && writer->sync != JANUS_RECORDER_SYNC_NONE)
+		fsync(writer->fd);
+	return NULL;
+}
+
+/* Sets up the asynchronous writer of a recorder whose file was just created */
+static janus_recorder_writer *janus_recorder_writer_create(janus_recorder *recorder) {
+	/* What was written so far must be on file before the writer takes over */
+	fflush(recorder->file);
+	janus_recorder_writer *writer = g_malloc0(sizeof(janus_recorder_writer));
+	writer->size = recorder_buffer;
+	writer->ring = g_malloc(writer->size);
+	writer->wakeup = MIN(JANUS_RECORDER_WAKEUP, writer->size/4);
+	writer->fd = fileno(recorder->file);
+	writer->offset = ftell(recorder->file);
+	writer->flush = recorder_flush;
+	writer->sync = recorder_sync;
+	writer->sync_interval = recorder_sync_interval;
+	janus_mutex_init(&writer->mutex);
+	janus_condition_init(&writer->cond);
+	GError *error = NULL;
+	writer->thread = g_thread_try_new("recorder", &janus_recorder_writer_thread, writer, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to start the recorder writer thread, writing synchronously...\n", error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		janus_mutex_destroy(&writer->mutex);
+		janus_condition_destroy(&writer->cond);
+		g_free(writer->ring);
+		g_free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+/* Waits for the writer to write what's left in the ring, and stops it */
+static void janus_recorder_writer_stop(janus_recorder_writer *writer) {
+	if(writer->thread == NULL)
+		return;
+	janus_mutex_lock_nodebug(&writer->mutex);
+	g_atomic_int_set(&writer->stopping, 1);
+	janus_condition_signal(&writer->cond);
+	janus_mutex_unlock_nodebug(&writer->mutex);
+	g_thread_join(writer->thread);
+	writer->thread = NULL;
+	if(writer->dropped > 0)
+		JANUS_LOG(LOG_WARN, "Recording buffer was full, %u frames were dropped\n", writer->dropped);
+}
+
+static void janus_recorder_writer_free(janus_recorder_writer *writer) {
+	janus_recorder_writer_stop(writer);
+	janus_mutex_destroy(&writer->mutex);
+	janus_condition_destroy(&writer->cond);
+	g_free(writer->ring);
+	g_free(writer);
+}
+
 
 janus_recorder *janus_recorder_create(const char *dir, int video, const char *filename) {
 	janus_recorder *rc = g_malloc0(sizeof(janus_recorder));
@@ -98,6 +349,8 @@ janus_recorder *janus_recorder_create(const char *dir, int video, const char *fi
 	rc->video = video;
 	/* Write the first part of the header */
 	fwrite(header, sizeof(char), strlen(header), rc->file);
+	if(recorder_async)
+		rc->writer = janus_recorder_writer_create(rc);
 	rc->writable = 1;
 	/* We still need to also write the info header first */
 	rc->header = 0;
@@ -131,12 +384,29 @@ int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, int length
 		json_object_set_new(info, "u", json_integer(janus_get_real_time()));			/* First frame written time */
 		gchar *info_text = json_dumps(info, JSON_PRESERVE_ORDER);
 		json_decref(info);
-		uint16_t info_bytes = htons(strlen(info_text));
-		fwrite(&info_bytes, sizeof(uint16_t), 1, recorder->file);
-		fwrite(info_text, sizeof(char), strlen(info_text), recorder->file);
+		if(recorder->writer) {
+			/* Queue it with the first frame: if it doesn't fit, we'll try again with the next one */
+			int res = janus_recorder_writer_put(recorder->writer, NULL, info_text, strlen(info_text));
+			free(info_text);
+			if(res < 0) {
+				janus_mutex_unlock_nodebug(&recorder->mutex);
+				return -5;
+			}
+		} else {
+			uint16_t info_bytes = htons(strlen(info_text));
+			fwrite(&info_bytes, sizeof(uint16_t), 1, recorder->file);
+			fwrite(info_text, sizeof(char), strlen(info_text), recorder->file);
+			free(info_text);
+		}
 		/* Done */
 		recorder->header = 1;
 	}
+	if(recorder->writer) {
+		/* Just queue the frame for the writer thread */
+		int res = janus_recorder_writer_put(recorder->writer, frame_header, buffer, length);
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+		return res < 0 ? -5 : 0;
+	}
 	/* Write frame header */
 	fwrite(frame_header, sizeof(char), strlen(frame_header), recorder->file);
 	uint16_t header_bytes = htons(length);
@@ -162,6 +432,12 @@ int janus_recorder_close(janus_recorder *recorder) {
 		return -1;
 	janus_mutex_lock_nodebug(&recorder->mutex);
 	recorder->writable = 0;
+	janus_mutex_unlock_nodebug(&recorder->mutex);
+	/* Nothing is queued anymore: wait for what's left to be written,
+	 * without keeping those trying to save frames waiting too */
+	if(recorder->writer)
+		janus_recorder_writer_stop(recorder->writer);
+	janus_mutex_lock_nodebug(&recorder->mutex);
 	if(recorder->file) {
 		fseek(recorder->file, 0L, SEEK_END);
 		size_t fsize = ftell(recorder->file);
@@ -183,6 +459,9 @@ int janus_recorder_free(janus_recorder *recorder) {
 	if(recorder->filename)
 		g_free(recorder->filename);
 	recorder->filename = NULL;
+	if(recorder->writer)
+		janus_recorder_writer_free(recorder->writer);
+	recorder->writer = NULL;
 	if(recorder->file)
 		fclose(recorder->file);
 	recorder->file = NULL;
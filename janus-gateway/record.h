@@ -11,6 +11,11 @@
  * \note If you want to record both audio and video, you'll have to use
  * two different recorders. Any muxing in the same container will have
  * to be done in the post-processing phase.
+ * \note Recorders can write the frames themselves, on the thread that
+ * saves them, or (see janus_recorder_init()) just copy them to a ring
+ * buffer that a thread of their own writes to disk in large chunks,
+ * so that disk latency never stalls the media path: if the disk can't
+ * keep up and the buffer fills up, frames are dropped instead.
  * 
  * \ingroup core
  * \ref core
@@ -24,9 +29,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <glib.h>
+
 #include "mutex.h"
 
 
+/*! \brief When the data recorders write asynchronously is synced to disk */
+typedef enum janus_recorder_sync {
+	/*! \brief Never, it's up to the OS */
+	JANUS_RECORDER_SYNC_NONE = 0,
+	/*! \brief When the recording is closed */
+	JANUS_RECORDER_SYNC_CLOSE,
+	/*! \brief Periodically, and when the recording is closed */
+	JANUS_RECORDER_SYNC_PERIODIC,
+} janus_recorder_sync;
+
+/*! \brief Asynchronous writer of a recorder (private to record.c) */
+typedef struct janus_recorder_writer janus_recorder_writer;
+
 /*! \brief Structure that represents a recorder */
 typedef struct janus_recorder {
 	/*! \brief Absolute path to the directory where the recorder file is stored */ 
@@ -45,9 +65,22 @@ typedef struct janus_recorder {
 	int writable:1;
 	/*! \brief Mutex to lock/unlock this recorder instance */ 
 	janus_mutex mutex;
+	/*! \brief Ring buffer and thread that write the frames, if asynchronous */
+	janus_recorder_writer *writer;
 } janus_recorder;
 
 
+/*! \brief Configure how the recorders created from now on write their frames
+ * @param[in] async Whether frames should be written by a thread of each recorder's own
+ * @param[in] buffer Size in bytes of the ring buffer of each asynchronous recorder
+ * (rounded up to a power of two, at least 64KB): frames that don't fit are dropped
+ * @param[in] flush How long (ms) frames can wait in the buffer before they're
+ * written, if there's not enough of them for a full chunk
+ * @param[in] sync When the data written asynchronously should be synced to disk
+ * @param[in] sync_interval How often (ms) to sync, with JANUS_RECORDER_SYNC_PERIODIC */
+void janus_recorder_init(gboolean async, guint buffer, guint flush, janus_recorder_sync sync, guint sync_interval);
+
+
 /*! \brief Create a new recorder
  * \note If no target directory is provided, the current directory will be used. If no filename
  * is passed, a random filename will be used.
@@ -57,12 +90,16 @@ typedef struct janus_recorder {
  * @returns A valid janus_recorder instance in case of success, NULL otherwise */
 janus_recorder *janus_recorder_create(const char *dir, int video, const char *filename);
 /*! \brief Save an RTP frame in the recorder
+ * \note An asynchronous recorder only copies the frame to its buffer, and
+ * the frame is dropped if it doesn't fit: the return value doesn't tell
+ * whether it was written to disk, which happens later
  * @param[in] recorder The janus_recorder instance to save the frame to
  * @param[in] buffer The frame data to save
  * @param[in] length The frame data length
  * @returns 0 in case of success, a negative integer otherwise */
 int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, int length);
 /*! \brief Close the recorder
+ * \note An asynchronous recorder waits for its buffer to be written first
  * @param[in] recorder The janus_recorder instance to close
  * @returns 0 in case of success, a negative integer otherwise */
 int janus_recorder_close(janus_recorder *recorder);
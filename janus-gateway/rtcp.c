@@ -437,52 +437,71 @@ GSList *janus_rtcp_get_nacks(char *packet, int len) {
 	return list;
 }
 
+int janus_rtcp_get_nacks_array(char *packet, int len, uint16_t *seqs, int max) {
+	if(packet == NULL || len < 4 || seqs == NULL || max < 1)
+		return 0;
+	rtcp_header *rtcp = (rtcp_header *)packet;
+	if(rtcp->version != 2)
+		return 0;
+	int count = 0, offset = 0;
+	while(offset + 4 <= len) {
+		rtcp = (rtcp_header *)(packet+offset);
+		int length = ntohs(rtcp->length)*4+4;
+		if(offset + length > len)
+			break;
+		if(rtcp->type == RTCP_RTPFB && rtcp->rc == 1 && length >= 16) {
+			rtcp_fb *rtcpfb = (rtcp_fb *)rtcp;
+			int blocks = (length-12)/4, i = 0;
+			for(i = 0; i < blocks; i++) {
+				rtcp_nack *nack = (rtcp_nack *)rtcpfb->fci + i;
+				uint16_t pid = ntohs(nack->pid);
+				uint16_t blp = ntohs(nack->blp);
+				if(count == max)
+					return count;
+				seqs[count++] = pid;
+				/* Only the bits that are set */
+				while(blp) {
+					int bit = __builtin_ctz(blp);
+					blp &= blp-1;
+					if(count == max)
+						return count;
+					seqs[count++] = pid+bit+1;
+				}
+			}
+		}
+		offset += length;
+	}
+	return count;
+}
+
 int janus_rtcp_remove_nacks(char *packet, int len) {
 	if(packet == NULL || len == 0)
 		return len;
 	rtcp_header *rtcp = (rtcp_header *)packet;
 	if(rtcp->version != 2)
 		return len;
-	/* Find the NACK message */
-	char *nacks = NULL;
-	int total = len, nacks_len = 0;
-	while(rtcp) {
-		if(rtcp->type == RTCP_RTPFB) {
-			gint fmt = rtcp->rc;
-			if(fmt == 1) {
-				nacks = (char *)rtcp;
+	/* Walk the compound packet once, moving what we keep over the NACKs we drop */
+	int offset = 0, kept = 0;
+	while(offset < len) {
+		int length = len - offset;
+		gboolean nack = FALSE;
+		if(length >= 4) {
+			rtcp = (rtcp_header *)(packet+offset);
+			int declared = ntohs(rtcp->length)*4+4;
+			if(declared <= length) {
+				/* Anything that doesn't add up is kept as it is */
+				length = declared;
+				nack = (rtcp->type == RTCP_RTPFB && rtcp->rc == 1);
 			}
 		}
-		/* Is this a compound packet? */
-		int length = ntohs(rtcp->length);
-		if(length == 0)
-			break;
-		if(nacks != NULL) {
-			nacks_len = length*4+4;
-			break;
-		}
-		total -= length*4+4;
-		if(total <= 0)
-			break;
-		rtcp = (rtcp_header *)((uint32_t*)rtcp + length + 1);
-	}
-	if(nacks != NULL) {
-		total = len - ((nacks-packet)+nacks_len);
-		if(total < 0) {
-			/* FIXME Should never happen, but you never know: do nothing */
-			return len;
-		} else if(total == 0) {
-			/* NACK was the last compound packet, easy enough */
-			return len-nacks_len;
-		} else {
-			/* NACK is between two compound packets, move them around */
-			int i=0;
-			for(i=0; i<total; i++)
-				*(nacks+i) = *(nacks+nacks_len+i);
-			return len-nacks_len;
+		if(!nack) {
+			if(kept != offset)
+				memmove(packet+kept, packet+offset, length);
+			kept += length;
 		}
+		offset += length;
 	}
-	return len;
+	return kept;
 }
 
 /* Query an existing REMB message */
@@ -509,7 +528,7 @@ uint64_t janus_rtcp_get_remb(char *packet, int len) {
 					uint32_t brMantissa = (_ptrRTCPData[1] & 0x03) << 16;
 					brMantissa += (_ptrRTCPData[2] << 8);
 					brMantissa += (_ptrRTCPData[3]);
-					uint64_t bitrate = brMantissa << brExp;
+					uint64_t bitrate = (uint64_t)brMantissa << brExp;
 					JANUS_LOG(LOG_HUGE, "Got REMB bitrate %"SCNu64"\n", bitrate);
 					return bitrate;
 				}
@@ -527,6 +546,108 @@ uint64_t janus_rtcp_get_remb(char *packet, int len) {
 	return 0;
 }
 
+/* Query an RTCP message for everything the getters above look for, at once */
+int janus_rtcp_get_summary(char *packet, int len, janus_rtcp_summary *summary) {
+	if(summary == NULL)
+		return -1;
+	/* The report blocks are only filled as far as needed */
+	memset(summary, 0, G_STRUCT_OFFSET(janus_rtcp_summary, reports));
+	if(packet == NULL || len < 4)
+		return -1;
+	/* What we report is the first we find, even if it's 0 */
+	gboolean got_sender = FALSE, got_receiver = FALSE, got_remb = FALSE;
+	int offset = 0;
+	while(offset < len) {
+		if(len - offset < 4)
+			return -1;
+		rtcp_header *rtcp = (rtcp_header *)(packet+offset);
+		int length = ntohs(rtcp->length)*4+4;
+		if(rtcp->version != 2 || length > len - offset)
+			return -1;
+		summary->packets++;
+		switch(rtcp->type) {
+			case RTCP_SR:
+			case RTCP_RR: {
+				if(length < 8)
+					break;
+				/* Report blocks come after the sender info, if it's an SR */
+				report_block *rb = NULL;
+				int blocks = rtcp->rc;
+				if(rtcp->type == RTCP_SR) {
+					summary->sr = TRUE;
+					rb = ((rtcp_sr *)rtcp)->rb;
+				} else {
+					summary->rr = TRUE;
+					rb = ((rtcp_rr *)rtcp)->rb;
+				}
+				if(!got_sender) {
+					summary->sender_ssrc = ntohl(((rtcp_rr *)rtcp)->ssrc);
+					got_sender = TRUE;
+				}
+				int room = (packet+offset+length) - (char *)rb;
+				if(room < 0)
+					room = 0;
+				if(blocks > room/(int)sizeof(report_block))
+					blocks = room/sizeof(report_block);
+				if(blocks > 0 && !got_receiver) {
+					summary->receiver_ssrc = ntohl(rb[0].ssrc);
+					got_receiver = TRUE;
+				}
+				/* Only the first few are decoded, the others are just counted */
+				int i = 0;
+				for(i = 0; i < blocks && summary->reports_num < JANUS_RTCP_SUMMARY_REPORTS; i++) {
+					janus_rtcp_report *report = &summary->reports[summary->reports_num++];
+					uint32_t flcnpl = ntohl(rb[i].flcnpl);
+					report->ssrc = ntohl(rb[i].ssrc);
+					report->fraction_lost = flcnpl >> 24;
+					/* Sign extend the 24 bits of the cumulative loss */
+					report->lost = (int32_t)(flcnpl << 8) >> 8;
+					report->ehsnr = ntohl(rb[i].ehsnr);
+					report->jitter = ntohl(rb[i].jitter);
+					report->lsr = ntohl(rb[i].lsr);
+					report->dlsr = ntohl(rb[i].delay);
+				}
+				summary->reports_num += blocks - i;
+				break;
+			}
+			case RTCP_FIR:
+				summary->fir = TRUE;
+				break;
+			case RTCP_RTPFB:
+			case RTCP_PSFB: {
+				if(length < 12)
+					break;
+				rtcp_fb *rtcpfb = (rtcp_fb *)rtcp;
+				if(!got_sender) {
+					summary->sender_ssrc = ntohl(rtcpfb->ssrc);
+					got_sender = TRUE;
+				}
+				if(rtcp->type == RTCP_RTPFB) {
+					if(rtcp->rc == 1)
+						summary->nacks += (length-12)/4;
+				} else if(rtcp->rc == 1) {
+					summary->pli = TRUE;
+				} else if(rtcp->rc == 15 && length >= 20 && !got_remb) {
+					rtcp_remb *remb = (rtcp_remb *)rtcpfb->fci;
+					if(remb->id[0] == 'R' && remb->id[1] == 'E' && remb->id[2] == 'M' && remb->id[3] == 'B') {
+						/* Same as janus_rtcp_get_remb() */
+						unsigned char *data = (unsigned char *)remb + 4;
+						uint8_t exp = (data[1] >> 2) & 0x3F;
+						uint32_t mantissa = ((data[1] & 0x03) << 16) + (data[2] << 8) + data[3];
+						summary->remb = (uint64_t)mantissa << exp;
+						got_remb = TRUE;
+					}
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		offset += length;
+	}
+	return 0;
+}
+
 /* Change an existing REMB message */
 int janus_rtcp_cap_remb(char *packet, int len, uint64_t bitrate) {
 	if(packet == NULL || len == 0)
@@ -756,3 +877,106 @@ int janus_rtcp_nacks(char *packet, int len, GSList *nacks) {
 	rtcp->length = htons(words);
 	return words*4+4;
 }
+
+/* Clear a range of a map of sequence numbers, a word at a time */
+static void janus_rtcp_seq_map_clear(janus_rtcp_seq_map *map, uint16_t first, int count) {
+	while(count > 0) {
+		int index = first & (JANUS_RTCP_SEQ_MAP_SIZE-1), bit = index & 63;
+		int chunk = MIN(64-bit, count);
+		uint64_t mask = (chunk == 64 ? ~G_GUINT64_CONSTANT(0) : ((G_GUINT64_CONSTANT(1) << chunk)-1)) << bit;
+		map->words[index >> 6] &= ~mask;
+		first += chunk;
+		count -= chunk;
+	}
+}
+
+void janus_rtcp_seq_map_init(janus_rtcp_seq_map *map) {
+	if(map == NULL)
+		return;
+	memset(map, 0, sizeof(*map));
+}
+
+void janus_rtcp_seq_map_received(janus_rtcp_seq_map *map, uint16_t seq) {
+	if(map == NULL)
+		return;
+	if(!map->started) {
+		memset(map->words, 0, sizeof(map->words));
+		map->started = 1;
+		map->highest = seq;
+		map->span = 1;
+	} else {
+		int16_t delta = (int16_t)(seq - map->highest);
+		if(delta > 0) {
+			/* Whatever is between the highest and this one is missing, for now */
+			janus_rtcp_seq_map_clear(map, map->highest+1, MIN(delta, JANUS_RTCP_SEQ_MAP_SIZE));
+			map->highest = seq;
+			map->span = MIN(map->span+delta, JANUS_RTCP_SEQ_MAP_SIZE);
+		} else if(-delta >= map->span) {
+			/* Too old, we don't keep track of it anymore */
+			return;
+		}
+	}
+	map->words[(seq & (JANUS_RTCP_SEQ_MAP_SIZE-1)) >> 6] |= G_GUINT64_CONSTANT(1) << (seq & 63);
+}
+
+/* Generate a new NACK message from a map of received sequence numbers */
+int janus_rtcp_nacks_from_map(char *packet, int len, janus_rtcp_seq_map *map, uint16_t window) {
+	if(packet == NULL || len < 16 || map == NULL)
+		return -1;
+	if(!map->started)
+		return 0;
+	/* The highest sequence number was received, look at the ones before it */
+	int left = MIN(window, map->span)-1;
+	uint16_t seq = map->highest-left;
+	rtcp_nack *nack = NULL;
+	uint16_t pid = 0, blp = 0;
+	int words = 2;
+	while(left > 0) {
+		/* Look at the rest of the current word (or what's left of the window) at once */
+		int index = seq & (JANUS_RTCP_SEQ_MAP_SIZE-1), bit = index & 63;
+		int chunk = MIN(64-bit, left);
+		uint64_t mask = (chunk == 64 ? ~G_GUINT64_CONSTANT(0) : ((G_GUINT64_CONSTANT(1) << chunk)-1)) << bit;
+		uint64_t missing = ~map->words[index >> 6] & mask;
+		while(missing) {
+			uint16_t lost = seq + (__builtin_ctzll(missing) - bit);
+			missing &= missing-1;
+			if(nack != NULL && (uint16_t)(lost-pid) <= 16) {
+				/* Fits in the bitmask of the current block */
+				blp |= 1 << ((uint16_t)(lost-pid)-1);
+				continue;
+			}
+			/* We need a new block: this sequence number will be its root PID */
+			if(nack != NULL)
+				nack->blp = htons(blp);
+			if(len < (words+1)*4+4) {
+				JANUS_LOG(LOG_HUGE, "Buffer too small for more NACK blocks (%d bytes), leaving the rest for later\n", len);
+				left = 0;
+				nack = NULL;
+				break;
+			}
+			if(words == 2)
+				memset(packet, 0, 12);
+			nack = (rtcp_nack *)(packet + 4 + words*4);
+			words++;
+			pid = lost;
+			blp = 0;
+			nack->pid = htons(pid);
+		}
+		seq += chunk;
+		left -= chunk;
+	}
+	if(words == 2) {
+		/* Nothing is missing */
+		return 0;
+	}
+	if(nack != NULL)
+		nack->blp = htons(blp);
+	rtcp_header *rtcp = (rtcp_header *)packet;
+	/* Set header */
+	rtcp->version = 2;
+	rtcp->padding = 0;
+	rtcp->type = RTCP_RTPFB;
+	rtcp->rc = 1;	/* FMT=1 */
+	rtcp->length = htons(words);
+	return words*4+4;
+}
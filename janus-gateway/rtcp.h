@@ -146,6 +146,27 @@ typedef struct janus_nack {
 	struct janus_nack *next;
 } janus_nack;
 
+/*! \brief Number of sequence numbers a janus_rtcp_seq_map keeps track of
+ * (a power of two, and a multiple of 64) */
+#define JANUS_RTCP_SEQ_MAP_SIZE		1024
+/*! \brief Ring bitmap of the sequence numbers received on a stream
+ * \details Sequence number \c seq is bit \c seq%JANUS_RTCP_SEQ_MAP_SIZE,
+ * which is set when the packet is received and cleared when a newer
+ * packet makes the ring wrap around: whatever is not set in the window
+ * behind the highest sequence number is missing, and can be NACKed
+ * with janus_rtcp_nacks_from_map() without going through lists. Embed it
+ * in the stream it's for, and initialize it with janus_rtcp_seq_map_init() */
+typedef struct janus_rtcp_seq_map {
+	/*! \brief The bitmap */
+	uint64_t words[JANUS_RTCP_SEQ_MAP_SIZE/64];
+	/*! \brief Highest sequence number received so far */
+	uint16_t highest;
+	/*! \brief How many sequence numbers, up to the highest, the bitmap is valid for */
+	uint16_t span;
+	/*! \brief Whether any packet was received at all */
+	int started;
+} janus_rtcp_seq_map;
+
 
 /*! \brief RTCP REMB (http://tools.ietf.org/html/draft-alvestrand-rmcat-remb-03) */
 typedef struct rtcp_remb
@@ -183,6 +204,58 @@ typedef struct rtcp_fb
 } rtcp_fb;
 
 
+/*! \brief Number of report blocks a janus_rtcp_summary keeps */
+#define JANUS_RTCP_SUMMARY_REPORTS	4
+/*! \brief Report block of an SR or RR, in host byte order */
+typedef struct janus_rtcp_report {
+	/*! \brief SSRC of the source the block is about */
+	uint32_t ssrc;
+	/*! \brief Fraction of packets lost since the previous report (out of 256) */
+	uint8_t fraction_lost;
+	/*! \brief Cumulative number of packets lost (signed, 24 bits) */
+	int32_t lost;
+	/*! \brief Extended highest sequence number received */
+	uint32_t ehsnr;
+	/*! \brief Interarrival jitter */
+	uint32_t jitter;
+	/*! \brief Last SR timestamp */
+	uint32_t lsr;
+	/*! \brief Delay since last SR */
+	uint32_t dlsr;
+} janus_rtcp_report;
+
+/*! \brief What janus_rtcp_get_summary() found in a compound RTCP packet
+ * \details Filled in a single walk of the packet, for those that need
+ * more than one of janus_rtcp_get_sender_ssrc(), janus_rtcp_get_receiver_ssrc(),
+ * janus_rtcp_has_fir(), janus_rtcp_has_pli() and janus_rtcp_get_remb(),
+ * which all walk it on their own: the values are the same they'd return */
+typedef struct janus_rtcp_summary {
+	/*! \brief Number of RTCP packets in the compound packet */
+	int packets;
+	/*! \brief Sender SSRC of the first SR, RR, RTPFB or PSFB, 0 if none */
+	uint32_t sender_ssrc;
+	/*! \brief SSRC of the first report block of an SR or RR, 0 if none */
+	uint32_t receiver_ssrc;
+	/*! \brief Whether there's an SR */
+	gboolean sr;
+	/*! \brief Whether there's an RR */
+	gboolean rr;
+	/*! \brief Whether there's a (legacy, RFC2032) FIR */
+	gboolean fir;
+	/*! \brief Whether there's a PLI */
+	gboolean pli;
+	/*! \brief Bitrate of the first REMB, 0 if none */
+	uint64_t remb;
+	/*! \brief Number of PID/BLP blocks in the NACKs, 0 if none */
+	int nacks;
+	/*! \brief Number of report blocks in the SRs and RRs */
+	int reports_num;
+	/*! \brief The first JANUS_RTCP_SUMMARY_REPORTS report blocks (only
+	 * the first reports_num, if there are fewer, are filled) */
+	janus_rtcp_report reports[JANUS_RTCP_SUMMARY_REPORTS];
+} janus_rtcp_summary;
+
+
 /*! \brief Method to quickly retrieve the sender SSRC (needed for demuxing RTCP in BUNDLE)
  * @param[in] packet The message data
  * @param[in] len The message data length in bytes
@@ -227,13 +300,23 @@ gboolean janus_rtcp_has_pli(char *packet, int len);
  * @returns A list of janus_nack elements containing the sequence numbers to send again */
 GSList *janus_rtcp_get_nacks(char *packet, int len);
 
-/*! \brief Method to remove an RTCP NACK message
+/*! \brief Method to parse an RTCP NACK message, without allocating anything
+ * @param[in] packet The message data
+ * @param[in] len The message data length in bytes
+ * @param[out] seqs Array to fill with the sequence numbers to send again
+ * @param[in] max Size of the array: sequence numbers that don't fit are ignored
+ * @returns The number of sequence numbers in the array */
+int janus_rtcp_get_nacks_array(char *packet, int len, uint16_t *seqs, int max);
+
+/*! \brief Method to remove the RTCP NACK messages from a compound packet
  * @param[in] packet The message data
  * @param[in] len The message data length in bytes
  * @returns The new message data length in bytes
- * @note This is mostly a placeholder: for the sake of simplicity, whenever we handle
- * some sequence numbers in a NACK, we remove the NACK as a whole before forwarding the
- * RTCP message. Future versions will only selectively remove the sequence numbers that
+ * @note All the NACK messages (e.g., one per media SSRC) are removed at
+ * once, and the rest of the compound packet is compacted in a single pass.
+ * For the sake of simplicity, whenever we handle some sequence numbers in
+ * a NACK, we remove the NACK as a whole before forwarding the RTCP message.
+ * Future versions will only selectively remove the sequence numbers that
  * have been handled. */
 int janus_rtcp_remove_nacks(char *packet, int len);
 
@@ -243,6 +326,16 @@ int janus_rtcp_remove_nacks(char *packet, int len);
  * @returns The reported bitrate if successful, 0 if no REMB packet was available */
 uint64_t janus_rtcp_get_remb(char *packet, int len);
 
+/*! \brief Method to find out what an RTCP message contains, walking it just once
+ * \note Every packet in the compound packet is checked against the
+ * buffer before it's looked at: if one doesn't add up, the walk stops
+ * there, and the summary only covers the packets that came before it
+ * @param[in] packet The message data
+ * @param[in] len The message data length in bytes
+ * @param[out] summary The summary to fill
+ * @returns 0 in case of success, -1 on errors */
+int janus_rtcp_get_summary(char *packet, int len, janus_rtcp_summary *summary);
+
 /*! \brief Method to modify an existing RTCP REMB message to cap the reported bitrate
  * @param[in] packet The message data
  * @param[in] len The message data length in bytes
@@ -290,7 +383,31 @@ int janus_rtcp_pli(char *packet, int len);
  * @param[in] packet The buffer data (MUST be at least 16 chars)
  * @param[in] len The message data length in bytes (MUST be 16)
  * @param[in] nacks List of packets to NACK
- * @returns The message data length in bytes, if successful, -1 on errors */
+ * @returns The message data length in bytes, if successful, -1 on errors
+ * \note janus_rtcp_nacks_from_map() does the same without needing a list */
 int janus_rtcp_nacks(char *packet, int len, GSList *nacks);
 
+/*! \brief Method to initialize (or reset) a map of received sequence numbers
+ * @param[in] map The map to initialize */
+void janus_rtcp_seq_map_init(janus_rtcp_seq_map *map);
+
+/*! \brief Method to mark a sequence number as received in a map
+ * \note Packets older than what the map keeps track of are ignored, while
+ * a jump ahead marks everything in between as missing
+ * @param[in] map The map to update
+ * @param[in] seq The sequence number of the packet that was received */
+void janus_rtcp_seq_map_received(janus_rtcp_seq_map *map, uint16_t seq);
+
+/*! \brief Method to generate a new RTCP NACK message for the packets a map says are missing
+ * \details The bitmap is scanned a 64 bit word at a time, and the missing
+ * sequence numbers are packed in PID/BLP blocks as they're found (oldest
+ * first): if the buffer can't fit all the blocks, the newest losses are
+ * left for the next NACK
+ * @param[in] packet The buffer data (MUST be at least 16 chars)
+ * @param[in] len The buffer data length in bytes (16 bytes, plus 4 for each additional block)
+ * @param[in] map The map of the received sequence numbers
+ * @param[in] window How many sequence numbers, up to the highest received, to look at
+ * @returns The message data length in bytes, if successful, 0 if nothing is missing, -1 on errors */
+int janus_rtcp_nacks_from_map(char *packet, int len, janus_rtcp_seq_map *map, uint16_t window);
+
 #endif
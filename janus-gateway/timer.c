@@ -0,0 +1,302 @@
+/*! \file    timer.c
+ * \copyright GNU General Public License v3
+ * \brief    Timers
+ * \details  Implementation of a hierarchical timer wheel, served by a
+ * thread of its own, that the core and plugins can use for timeouts,
+ * keep-alives and lazy frees instead of periodically sweeping their
+ * own lists. Timers are embedded in the structures they belong to, so
+ * scheduling, rescheduling and cancelling one are all O(1) and never
+ * allocate: they are just moved between the slots of the wheel.
+ * \note Callbacks are invoked on the timer thread, without any lock
+ * held, so they must not block. A timer can be rescheduled from within
+ * its own callback.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <time.h>
+
+#include "timer.h"
+#include "debug.h"
+#include "mutex.h"
+#include "utils.h"
+
+
+/* The wheel has a few levels of 64 slots each: the first has a slot per
+ * tick, the second a slot per 64 ticks, and so on. A timer is put in the
+ * lowest level it fits in, and whenever a level wraps around the next
+ * slot of the level above is cascaded, i.e., its timers are moved down.
+ * With 10ms ticks, four levels cover about 46 hours: timers farther than
+ * that just wait in the last slot they can reach and are cascaded again */
+#define JANUS_TIMER_WHEEL_BITS		6
+#define JANUS_TIMER_WHEEL_SLOTS		(1 << JANUS_TIMER_WHEEL_BITS)
+#define JANUS_TIMER_WHEEL_MASK		(JANUS_TIMER_WHEEL_SLOTS-1)
+#define JANUS_TIMER_WHEEL_LEVELS	4
+
+/* Every slot is a circular list around a sentinel */
+static janus_timer wheel[JANUS_TIMER_WHEEL_LEVELS][JANUS_TIMER_WHEEL_SLOTS];
+static janus_mutex timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static janus_condition timers_cond = PTHREAD_COND_INITIALIZER;
+/* Signalled when a callback returns, for those waiting to cancel it */
+static janus_condition timers_done = PTHREAD_COND_INITIALIZER;
+/* Monotonic time of tick 0, next tick to process, and the one the thread
+ * is going to wake up at (G_MAXUINT64 if it's waiting for timers) */
+static gint64 timers_start = 0;
+static guint64 timers_current = 0, timers_wakeup = G_MAXUINT64;
+static guint timers_pending = 0;
+/* Timer whose callback is being invoked, if any */
+static janus_timer *timers_running = NULL;
+static GThread *timers_thread = NULL;
+static volatile gint timers_stopping = 0;
+
+static guint64 janus_timers_now(void) {
+	return (janus_get_monotonic_time() - timers_start) / (JANUS_TIMER_TICK * 1000);
+}
+
+static void janus_timer_list_init(janus_timer *list) {
+	list->prev = list;
+	list->next = list;
+}
+
+static void janus_timer_list_append(janus_timer *list, janus_timer *timer) {
+	timer->prev = list->prev;
+	timer->next = list;
+	list->prev->next = timer;
+	list->prev = timer;
+}
+
+static void janus_timer_list_remove(janus_timer *timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+/* Moves all the timers of a list to another (empty) one */
+static void janus_timer_list_move(janus_timer *from, janus_timer *to) {
+	if(from->next == from) {
+		janus_timer_list_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	janus_timer_list_init(from);
+}
+
+/* Puts a timer in the right slot: the mutex must be locked */
+static void janus_timer_insert(janus_timer *timer) {
+	if(timer->expires < timers_current)
+		timer->expires = timers_current;
+	int level = 0;
+	/* Lowest level where the timer is less than a full round ahead */
+	while(level < JANUS_TIMER_WHEEL_LEVELS-1 &&
+			(timer->expires >> (level*JANUS_TIMER_WHEEL_BITS)) - (timers_current >> (level*JANUS_TIMER_WHEEL_BITS)) >= JANUS_TIMER_WHEEL_SLOTS)
+		level++;
+	guint64 slot = timer->expires >> (level*JANUS_TIMER_WHEEL_BITS);
+	guint64 last = (timers_current >> (level*JANUS_TIMER_WHEEL_BITS)) + JANUS_TIMER_WHEEL_SLOTS-1;
+	if(slot > last) {
+		/* Too far even for the last level: wait as far as we can */
+		slot = last;
+	}
+	janus_timer_list_append(&wheel[level][slot & JANUS_TIMER_WHEEL_MASK], timer);
+}
+
+/* Processes a tick: the mutex must be locked, and is released while
+ * invoking the callbacks */
+static void janus_timers_tick(void) {
+	guint64 tick = timers_current;
+	/* Cascade, starting from the highest level that wrapped around */
+	int level = JANUS_TIMER_WHEEL_LEVELS-1;
+	for(level = JANUS_TIMER_WHEEL_LEVELS-1; level > 0; level--) {
+		if((tick & ((G_GUINT64_CONSTANT(1) << (level*JANUS_TIMER_WHEEL_BITS))-1)) != 0)
+			continue;
+		janus_timer cascaded;
+		janus_timer_list_move(&wheel[level][(tick >> (level*JANUS_TIMER_WHEEL_BITS)) & JANUS_TIMER_WHEEL_MASK], &cascaded);
+		while(cascaded.next != &cascaded) {
+			janus_timer *timer = cascaded.next;
+			janus_timer_list_remove(timer);
+			janus_timer_insert(timer);
+		}
+	}
+	/* Fire the timers in this slot: those rescheduled now go to the next round */
+	janus_timer expired;
+	janus_timer_list_move(&wheel[0][tick & JANUS_TIMER_WHEEL_MASK], &expired);
+	timers_current = tick+1;
+	while(expired.next != &expired) {
+		janus_timer *timer = expired.next;
+		janus_timer_list_remove(timer);
+		timer->pending = FALSE;
+		timers_pending--;
+		timers_running = timer;
+		janus_mutex_unlock(&timers_mutex);
+		timer->callback(timer->user_data);
+		janus_mutex_lock(&timers_mutex);
+		timers_running = NULL;
+		/* Somebody may be waiting to cancel it */
+		janus_condition_broadcast(&timers_done);
+	}
+}
+
+static void *janus_timers_thread(void *data) {
+	JANUS_LOG(LOG_INFO, "Timers thread started\n");
+	janus_mutex_lock(&timers_mutex);
+	while(!g_atomic_int_get(&timers_stopping)) {
+		guint64 now = janus_timers_now();
+		if(timers_pending == 0) {
+			/* Nothing to do, catch up and wait for timers */
+			if(timers_current <= now)
+				timers_current = now+1;
+			timers_wakeup = G_MAXUINT64;
+			janus_condition_wait(&timers_cond, &timers_mutex);
+			continue;
+		}
+		while(timers_current <= now && !g_atomic_int_get(&timers_stopping))
+			janus_timers_tick();
+		if(timers_pending == 0)
+			continue;
+		/* Sleep until the next timer in the first level, or until it wraps
+		 * around and the next slot of the levels above must be cascaded */
+		guint64 next = timers_current;
+		while((next & JANUS_TIMER_WHEEL_MASK) != 0) {
+			janus_timer *slot = &wheel[0][next & JANUS_TIMER_WHEEL_MASK];
+			if(slot->next != slot)
+				break;
+			next++;
+		}
+		timers_wakeup = next;
+		gint64 wait = timers_start + (gint64)next * JANUS_TIMER_TICK * 1000 - janus_get_monotonic_time();
+		if(wait <= 0)
+			continue;
+		gint64 deadline = janus_get_real_time() + wait;
+		struct timespec ts;
+		ts.tv_sec = deadline / G_USEC_PER_SEC;
+		ts.tv_nsec = (deadline % G_USEC_PER_SEC) * 1000;
+		janus_condition_timedwait(&timers_cond, &timers_mutex, &ts);
+	}
+	janus_mutex_unlock(&timers_mutex);
+	JANUS_LOG(LOG_INFO, "Timers thread stopped\n");
+	return NULL;
+}
+
+int janus_timers_start(void) {
+	janus_mutex_lock(&timers_mutex);
+	if(timers_thread != NULL) {
+		janus_mutex_unlock(&timers_mutex);
+		return 0;
+	}
+	int level = 0, slot = 0;
+	for(level = 0; level < JANUS_TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < JANUS_TIMER_WHEEL_SLOTS; slot++)
+			janus_timer_list_init(&wheel[level][slot]);
+	}
+	timers_start = janus_get_monotonic_time();
+	timers_current = 0;
+	timers_wakeup = G_MAXUINT64;
+	timers_pending = 0;
+	g_atomic_int_set(&timers_stopping, 0);
+	GError *error = NULL;
+	timers_thread = g_thread_try_new("timers", &janus_timers_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to start the timers thread...\n", error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		timers_thread = NULL;
+		janus_mutex_unlock(&timers_mutex);
+		return -1;
+	}
+	janus_mutex_unlock(&timers_mutex);
+	return 0;
+}
+
+void janus_timers_stop(void) {
+	janus_mutex_lock(&timers_mutex);
+	if(timers_thread == NULL) {
+		janus_mutex_unlock(&timers_mutex);
+		return;
+	}
+	g_atomic_int_set(&timers_stopping, 1);
+	janus_condition_broadcast(&timers_cond);
+	janus_mutex_unlock(&timers_mutex);
+	g_thread_join(timers_thread);
+	janus_mutex_lock(&timers_mutex);
+	timers_thread = NULL;
+	/* Discard whatever is still pending */
+	int level = 0, slot = 0;
+	for(level = 0; level < JANUS_TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < JANUS_TIMER_WHEEL_SLOTS; slot++) {
+			janus_timer *list = &wheel[level][slot];
+			while(list->next != NULL && list->next != list) {
+				janus_timer *timer = list->next;
+				janus_timer_list_remove(timer);
+				timer->pending = FALSE;
+			}
+		}
+	}
+	timers_pending = 0;
+	janus_mutex_unlock(&timers_mutex);
+}
+
+void janus_timer_init(janus_timer *timer, janus_timer_callback callback, gpointer user_data) {
+	if(timer == NULL)
+		return;
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->expires = 0;
+	timer->callback = callback;
+	timer->user_data = user_data;
+	timer->pending = FALSE;
+}
+
+void janus_timer_schedule(janus_timer *timer, guint ms) {
+	if(timer == NULL || timer->callback == NULL)
+		return;
+	janus_mutex_lock(&timers_mutex);
+	if(timers_thread == NULL || g_atomic_int_get(&timers_stopping)) {
+		janus_mutex_unlock(&timers_mutex);
+		return;
+	}
+	if(timer->pending) {
+		janus_timer_list_remove(timer);
+	} else {
+		timer->pending = TRUE;
+		timers_pending++;
+	}
+	guint64 now = janus_timers_now();
+	if(timers_pending == 1 && timers_running == NULL && timers_current <= now) {
+		/* The wheel was empty: skip the ticks it didn't need to process */
+		timers_current = now+1;
+	}
+	timer->expires = now + (ms + JANUS_TIMER_TICK-1)/JANUS_TIMER_TICK;
+	janus_timer_insert(timer);
+	if(timer->expires < timers_wakeup)
+		janus_condition_signal(&timers_cond);
+	janus_mutex_unlock(&timers_mutex);
+}
+
+gboolean janus_timer_cancel(janus_timer *timer) {
+	if(timer == NULL)
+		return FALSE;
+	janus_mutex_lock(&timers_mutex);
+	gboolean pending = timer->pending;
+	if(pending) {
+		janus_timer_list_remove(timer);
+		timer->pending = FALSE;
+		timers_pending--;
+	}
+	/* If the callback is running, wait for it (unless we're it) */
+	while(timers_running == timer && g_thread_self() != timers_thread)
+		janus_condition_wait(&timers_done, &timers_mutex);
+	janus_mutex_unlock(&timers_mutex);
+	return pending;
+}
+
+gboolean janus_timer_is_pending(janus_timer *timer) {
+	if(timer == NULL)
+		return FALSE;
+	janus_mutex_lock(&timers_mutex);
+	gboolean pending = timer->pending;
+	janus_mutex_unlock(&timers_mutex);
+	return pending;
+}
@@ -0,0 +1,73 @@
+/*! \file    timer.h
+ * \copyright GNU General Public License v3
+ * \brief    Timers (headers)
+ * \details  Implementation of a hierarchical timer wheel, served by a
+ * thread of its own, that the core and plugins can use for timeouts,
+ * keep-alives and lazy frees instead of periodically sweeping their
+ * own lists. Timers are embedded in the structures they belong to, so
+ * scheduling, rescheduling and cancelling one are all O(1) and never
+ * allocate: they are just moved between the slots of the wheel.
+ * \note Callbacks are invoked on the timer thread, without any lock
+ * held, so they must not block. A timer can be rescheduled from within
+ * its own callback.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_TIMER_H
+#define _JANUS_TIMER_H
+
+#include <glib.h>
+
+
+/*! \brief Resolution of the timers, in milliseconds */
+#define JANUS_TIMER_TICK	10
+
+/*! \brief Timer callback
+ * @param[in] user_data The opaque pointer the timer was initialized with */
+typedef void (*janus_timer_callback)(gpointer user_data);
+
+/*! \brief Structure that represents a timer, to embed where needed
+ * \note The fields are private to the timer wheel */
+typedef struct janus_timer {
+	/*! \brief Neighbours in the slot of the wheel the timer is in */
+	struct janus_timer *prev, *next;
+	/*! \brief Tick at which the timer expires */
+	guint64 expires;
+	/*! \brief Function to invoke when the timer expires */
+	janus_timer_callback callback;
+	/*! \brief Opaque pointer to pass to the callback */
+	gpointer user_data;
+	/*! \brief Whether the timer is scheduled */
+	gboolean pending;
+} janus_timer;
+
+/*! \brief Start the timer thread
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_timers_start(void);
+/*! \brief Stop the timer thread: pending timers are discarded */
+void janus_timers_stop(void);
+
+/*! \brief Initialize a timer, before it's scheduled for the first time
+ * @param[in] timer The timer to initialize
+ * @param[in] callback The function to invoke when the timer expires
+ * @param[in] user_data Opaque pointer to pass to the callback */
+void janus_timer_init(janus_timer *timer, janus_timer_callback callback, gpointer user_data);
+/*! \brief Schedule a timer, or reschedule it if it's already pending
+ * @param[in] timer The timer to schedule
+ * @param[in] ms In how many milliseconds the timer should expire (rounded
+ * up to the next tick, 0 means as soon as possible) */
+void janus_timer_schedule(janus_timer *timer, guint ms);
+/*! \brief Cancel a timer: if its callback is running on the timer thread,
+ * waits for it to return, so that once this returns the structure the
+ * timer is embedded in can be freed
+ * @param[in] timer The timer to cancel
+ * @returns TRUE if the timer was pending, FALSE otherwise */
+gboolean janus_timer_cancel(janus_timer *timer);
+/*! \brief Check whether a timer is scheduled
+ * @param[in] timer The timer to check
+ * @returns TRUE if the timer is pending, FALSE otherwise */
+gboolean janus_timer_is_pending(janus_timer *timer);
+
+#endif
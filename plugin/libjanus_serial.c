@@ -18,11 +18,19 @@
 #include "../janus-gateway/record.h"
 #include "../janus-gateway/rtcp.h"
 #include "../janus-gateway/utils.h"
+#include "../janus-gateway/timer.h"
+
+/* push_event_json and the timers are only there in the bundled core */
+#if JANUS_PLUGIN_API_VERSION < 6
+#error "The serial plugin needs the bundled janus-gateway core (plugin API >= 6)"
+#endif
 
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <termios.h>
-//#include <errno.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 
 /* Plugin information */
@@ -37,36 +45,76 @@
 #define JANUS_SERIAL_ERROR_NO_MESSAGE      411
 #define JANUS_SERIAL_ERROR_INVALID_JSON    412
 #define JANUS_SERIAL_ERROR_INVALID_ELEMENT 413
-
-/* Use Variable */
-char *portname = "/dev/ttyACM0";
-int fd;
-struct termios toptions;
+#define JANUS_SERIAL_ERROR_IO              414
+#define JANUS_SERIAL_ERROR_TIMEOUT         415
+#define JANUS_SERIAL_ERROR_NO_SUCH_DEVICE  416
+
+/* Serial I/O engine tuning */
+#define JANUS_SERIAL_FRAME_MAX             256
+#define JANUS_SERIAL_REPLY_TIMEOUT         (2*G_USEC_PER_SEC)
+#define JANUS_SERIAL_PIPELINE_DEPTH        4
+
+/* Commands the plugin cares about (the others are just forwarded) */
+#define JANUS_SERIAL_COMMAND_READ          2
+#define JANUS_SERIAL_COMMAND_SUBSCRIBE     3
+#define JANUS_SERIAL_COMMAND_UNSUBSCRIBE   4
+#define JANUS_SERIAL_COMMAND_PROTOCOL      5
+/* Allowed sampling periods for subscriptions (ms) */
+#define JANUS_SERIAL_STREAM_RATE_MIN       10
+#define JANUS_SERIAL_STREAM_RATE_MAX       60000
+
+/* Binary wire protocol: every packet is a type byte followed by TLV
+ * (tag, length, value) fields and a CRC-16/CCITT of all that, the whole
+ * COBS encoded and terminated by a 0 byte. Integers are little endian */
+#define JANUS_SERIAL_WIRE_REQUEST          0x01
+#define JANUS_SERIAL_WIRE_REPLY            0x02
+#define JANUS_SERIAL_WIRE_SAMPLE           0x03
+#define JANUS_SERIAL_WIRE_SEQ              0x01	/* u32 */
+#define JANUS_SERIAL_WIRE_COMMAND          0x02	/* u8 */
+#define JANUS_SERIAL_WIRE_ID               0x03	/* u8 */
+#define JANUS_SERIAL_WIRE_RATE             0x04	/* u16, ms */
+#define JANUS_SERIAL_WIRE_OPSTATUS         0x05	/* u8, 0 is ok */
+#define JANUS_SERIAL_WIRE_CODE             0x06	/* u8 */
+#define JANUS_SERIAL_WIRE_ACCELEROMETER    0x07	/* 3 x s16 */
+#define JANUS_SERIAL_WIRE_TEMPERATURE      0x08	/* s32, 1/10000 of Celsius */
+#define JANUS_SERIAL_WIRE_STREAM           0x09	/* u8 */
+
+/* Defaults for ports that don't say otherwise */
+#define JANUS_SERIAL_DEFAULT_PORTNAME      "/dev/ttyACM0"
+#define JANUS_SERIAL_DEFAULT_BAUDRATE      B9600
 
 /* Useful stuff */
 static volatile gint initialized = 0, stopping = 0;
 static janus_callbacks *gateway = NULL;
-//Thread 
-static GThread *handler_thread;
-static GThread *watchdog;
-//Mesage queue
-static GAsyncQueue *messages = NULL;
+//Handler workers, each with its own message queue
+typedef struct janus_serial_worker janus_serial_worker;
+static janus_serial_worker **workers;
+static guint workers_num;
 //Hash Table
 static GHashTable *sessions;
-//List
-static GList *old_sessions;
+//Sessions waiting to be freed
+static GHashTable *old_sessions;
 //Mutex
 static janus_mutex sessions_mutex;
+//Serial ports, indexed by name (read-only once the plugin is initialized)
+typedef struct janus_serial_port janus_serial_port;
+static GHashTable *ports;
+static janus_serial_port *default_port;
 
 
 //Messaggio JSON di sessione
 typedef struct janus_serial_message {
   janus_plugin_session *handle;
   char *transaction;
-  char *message;
   char *sdp_type;
   char *sdp;     
+  json_t *body;			/* Parsed message */
+  janus_serial_port *port;	/* Device the message is addressed to */
+  gboolean datachannel;		/* Whether this came (and is answered) on the DataChannel */
+  gint64 queued;		/* When the message was handed to a worker */
 } janus_serial_message;
+/* Sentinel janus_serial_destroy pushes to wake the handlers up */
+static janus_serial_message exit_message;
 
 
 /*Plugin session typedef */
@@ -78,8 +126,134 @@ typedef struct janus_serial_session {
   guint16 slowlink_count;
   volatile gint hangingup; /*Indica lo stato in cui la sessione si è chiusa e si prova un riaggancio */
   gint64 destroyed; /* Time at which this session was marked as destroyed */
+  janus_timer free_timer; /* Frees the session a while after it's been destroyed */
 } janus_serial_session;
 
+
+/* Serial I/O engine: every port has a thread of its own that owns the tty
+ * and multiplexes it with an eventfd, so nobody ever spins on read()
+ * waiting for the MCU and boards don't wait on each other. Requests are
+ * queued by the handler and written out by the TX state machine; the RX
+ * state machine assembles complete lines. Each request carries a "seq"
+ * correlation ID the firmware echoes back, so up to
+ * JANUS_SERIAL_PIPELINE_DEPTH requests can be in flight at once and
+ * replies are matched by ID rather than by arrival order. Idle, the
+ * thread sleeps in poll() and costs nothing. */
+typedef enum janus_serial_tx_state {
+  JANUS_SERIAL_TX_IDLE = 0,	/* Nothing being written */
+  JANUS_SERIAL_TX_WRITING,	/* Request partially written to the tty */
+} janus_serial_tx_state;
+
+typedef enum janus_serial_rx_state {
+  JANUS_SERIAL_RX_IDLE = 0,	/* Between frames, skipping padding */
+  JANUS_SERIAL_RX_FRAME,	/* Accumulating a JSON frame until '\n' */
+  JANUS_SERIAL_RX_PACKET,	/* Accumulating a binary packet until 0 */
+  JANUS_SERIAL_RX_DISCARD,	/* Frame too long, dropping until '\n' */
+  JANUS_SERIAL_RX_DISCARD_PACKET,	/* Packet too long, dropping until 0 */
+} janus_serial_rx_state;
+
+/* How requests and replies are encoded on the serial link: ports start
+ * with JSON lines, and switch to binary packets if they are configured to
+ * and the firmware says it can (see janus_serial_port_start) */
+typedef enum janus_serial_protocol {
+  JANUS_SERIAL_PROTOCOL_JSON = 0,
+  JANUS_SERIAL_PROTOCOL_BINARY,
+} janus_serial_protocol;
+
+typedef struct janus_serial_request {
+  janus_serial_message *msg;	/* The message this request was built from */
+  guint32 seq;			/* Correlation ID echoed back by the firmware */
+  char *frame;			/* Wire-ready, encoded by the I/O thread */
+  size_t len;
+  size_t written;
+  gint64 deadline;		/* When to give up waiting for the reply */
+  gboolean coalesced;		/* Whether this is the read of a sensor other messages can share */
+  int sensor;			/* Which sensor, if so */
+  GList *waiters;		/* Other messages waiting for the same reply */
+} janus_serial_request;
+
+/* Latest successful read of a sensor */
+typedef struct janus_serial_cached {
+  json_t *reply;
+  gint64 updated;
+} janus_serial_cached;
+
+struct janus_serial_port {
+  char *name;			/* Name sessions use to address this device */
+  char *portname;		/* Path of the tty */
+  speed_t baudrate;
+  int vmin;
+  int vtime;
+  janus_serial_protocol protocol_wanted;	/* What to negotiate with the firmware */
+  int fd;
+  struct termios toptions;
+  int wakeup;			/* eventfd used to wake the I/O thread up */
+  GThread *thread;
+  janus_mutex mutex;		/* Protects pending and running */
+  gboolean running;		/* Whether the I/O thread still accepts requests */
+  GQueue pending;		/* Requests waiting for the TX state machine */
+  volatile gint next_seq;	/* Next correlation ID to hand out */
+  /* Everything below is only touched by the I/O thread */
+  janus_serial_request *current;	/* Request being written */
+  GQueue inflight;		/* Requests written and waiting for a reply, oldest first */
+  GHashTable *by_seq;		/* Same requests, indexed by correlation ID */
+  janus_serial_tx_state tx_state;
+  janus_serial_rx_state rx_state;
+  janus_serial_protocol protocol;	/* What the firmware is talking now */
+  janus_serial_request *hello;	/* Protocol negotiation in flight, if any */
+  char rx_buf[JANUS_SERIAL_FRAME_MAX];
+  size_t rx_len;
+  janus_serial_worker *worker;	/* Handler all messages for this device go through */
+  janus_mutex streams_mutex;	/* Protects streams */
+  GHashTable *streams;		/* Subscribed sensors, indexed by sensor ID */
+  /* Identical reads (same device, command and sensor) share a single MCU
+   * transaction: whoever asks while one is in flight just waits for its
+   * reply. The latest value of each sensor can also be cached for a short
+   * while, so that a burst of reads doesn't even get to the serial link */
+  janus_mutex reads_mutex;	/* Protects reads, cache and the counters */
+  GHashTable *reads;		/* Reads in flight, indexed by sensor ID */
+  GHashTable *cache;		/* Latest reads, indexed by sensor ID */
+  gint64 cache_ttl;		/* How long a cached read is good for (us), 0 to disable */
+  guint64 reads_sent;		/* Reads that actually went to the MCU */
+  guint64 reads_coalesced;	/* Reads that shared one in flight */
+  guint64 reads_cached;		/* Reads answered from the cache */
+};
+
+/* Telemetry subscriptions: rather than polling a sensor, sessions can
+ * subscribe to it with a sampling period, and the firmware then streams
+ * samples on its own timer, tagged with a "stream" element rather than a
+ * "seq". The MCU samples each sensor at the fastest period any subscriber
+ * asked for: every sample is serialized once and fanned out to all the
+ * subscribers, each throttled to the period it asked for. */
+typedef struct janus_serial_subscriber {
+  janus_plugin_session *handle;
+  gboolean datachannel;		/* Whether samples go on the DataChannel */
+  guint rate;			/* Sampling period this subscriber wants (ms) */
+  gint64 last_sent;		/* When it was last sent a sample */
+} janus_serial_subscriber;
+
+typedef struct janus_serial_stream {
+  int id;			/* Sensor ID */
+  guint rate;			/* Sampling period programmed on the MCU (ms) */
+  GList *subscribers;
+} janus_serial_stream;
+
+/* Handler workers: messages are sharded by device, so that the requests
+ * for a board are always handled in order by the same worker, while
+ * different boards are served concurrently. The counters are there to
+ * help sizing the pool ("handlers" in the configuration). */
+struct janus_serial_worker {
+  guint id;
+  GThread *thread;
+  GAsyncQueue *messages;
+  janus_mutex mutex;		/* Protects the counters */
+  guint64 handled;		/* Messages handled so far */
+  gint64 wait_time;		/* Total time messages spent queued (us) */
+  gint64 wait_time_max;
+  gint64 service_time;		/* Total time spent handling messages (us) */
+  gint64 service_time_max;
+};
+
 /* Plugin methods */
 janus_plugin *create(void);
 int janus_serial_init(janus_callbacks *callback, const char *config_path);
@@ -99,11 +273,33 @@ void janus_serial_destroy_session(janus_plugin_session *handle, int *error);
 char *janus_serial_query_session(janus_plugin_session *handle);
 /* Plugin Callback Method */
 struct janus_plugin_result *janus_serial_handle_message(janus_plugin_session *handle, char *transaction, char *message, char *sdp_type, char *sdp);
+struct janus_plugin_result *janus_serial_handle_message_json(janus_plugin_session *handle, char *transaction, json_t *message, char *sdp_type, char *sdp);
 void janus_serial_setup_media(janus_plugin_session *handle);
+void janus_serial_incoming_data(janus_plugin_session *handle, char *buf, int len);
 void janus_serial_hangup_media(janus_plugin_session *handle);
 /* Plugin Thread Method */
 static void *janus_serial_handler(void *data); //Cosa sei???
-void *janus_serial_watchdog(void *data);
+static int janus_serial_parse_request(const char *text, json_t **body, char *error_cause, int error_len);
+static int janus_serial_check_request(json_t *body, janus_serial_port **port, char *error_cause, int error_len);
+static char *janus_serial_error_event(int error_code, const char *error_cause, const char *transaction);
+static void janus_serial_reply(janus_serial_message *msg, const char *text);
+static void janus_serial_session_free(gpointer data);
+static void *janus_serial_io_thread(void *data);
+/* Serial I/O engine Method */
+static janus_serial_port *janus_serial_port_new(const char *name, janus_config_category *cat);
+static int janus_serial_port_open(janus_serial_port *port);
+static int janus_serial_port_start(janus_serial_port *port);
+static void janus_serial_port_destroy(janus_serial_port *port);
+static void janus_serial_io_submit(janus_serial_port *port, janus_serial_request *request);
+static void janus_serial_send(janus_serial_port *port, janus_serial_message *msg);
+static janus_serial_request *janus_serial_request_new(janus_serial_port *port, janus_serial_message *msg);
+static void janus_serial_read(janus_serial_port *port, janus_serial_message *msg, int sensor);
+static void janus_serial_io_fail(janus_serial_request *request, int error_code, const char *error_cause);
+static void janus_serial_request_free(janus_serial_request *request);
+static void janus_serial_push_error(janus_serial_message *msg, int error_code, const char *error_cause);
+static int janus_serial_stream_update(janus_serial_port *port, janus_serial_message *msg, int command, char *error_cause, int error_len);
+static void janus_serial_stream_deliver(janus_serial_port *port, int id, json_t *sample);
+static void janus_serial_stream_unsubscribe_all(janus_plugin_session *handle);
 
 
 
@@ -123,7 +319,9 @@ static janus_plugin janus_serial_plugin =
 		
     .create_session = janus_serial_create_session,
     .handle_message = janus_serial_handle_message,
+    .handle_message_json = janus_serial_handle_message_json,
     .setup_media = janus_serial_setup_media,
+    .incoming_data = janus_serial_incoming_data,
     .hangup_media = janus_serial_hangup_media,
     .destroy_session = janus_serial_destroy_session,
     .query_session = janus_serial_query_session,
@@ -143,52 +341,797 @@ void janus_serial_message_free(janus_serial_message *msg) {
 
   g_free(msg->transaction);
   msg->transaction = NULL;
-  g_free(msg->message);
-  msg->message = NULL;
   g_free(msg->sdp_type);
   msg->sdp_type = NULL;
   g_free(msg->sdp);
   msg->sdp = NULL;
+  if(msg->body != NULL)
+    json_decref(msg->body);
+  msg->body = NULL;
+  msg->port = NULL;
 
   g_free(msg);
 }
 
-/* Watchdog Thread Implementation */
-/* Serial watchdog/garbage collector (sort of) */
-void *janus_serial_watchdog(void *data) {
-  JANUS_LOG(LOG_INFO, "Serial watchdog started\n");
-  gint64 now = 0;
+/* Lazy free of destroyed sessions, on the gateway timer thread */
+static void janus_serial_session_free(gpointer data) {
+  janus_serial_session *session = (janus_serial_session *)data;
+  janus_mutex_lock(&sessions_mutex);
+  /* If the plugin is being destroyed, it's taking care of this session */
+  gboolean removed = old_sessions != NULL && g_hash_table_remove(old_sessions, session);
+  janus_mutex_unlock(&sessions_mutex);
+  if(!removed)
+    return;
+  JANUS_LOG(LOG_VERB, "Freeing old Serial session\n");
+  session->handle = NULL;
+  g_free(session);
+}
+
+/* Serial I/O engine Implementation */
+static void janus_serial_request_free(janus_serial_request *request) {
+  if(!request)
+    return;
+  janus_serial_message_free(request->msg);
+  request->msg = NULL;
+  g_list_free_full(request->waiters, (GDestroyNotify)janus_serial_message_free);
+  request->waiters = NULL;
+  g_free(request->frame);
+  request->frame = NULL;
+  g_free(request);
+}
+
+static void janus_serial_cached_free(janus_serial_cached *cached) {
+  if(!cached)
+    return;
+  if(cached->reply != NULL)
+    json_decref(cached->reply);
+  cached->reply = NULL;
+  g_free(cached);
+}
+
+static void janus_serial_stream_free(janus_serial_stream *stream) {
+  if(!stream)
+    return;
+  g_list_free_full(stream->subscribers, (GDestroyNotify)g_free);
+  stream->subscribers = NULL;
+  g_free(stream);
+}
+
+/* Map a configured baudrate to its termios constant: both the actual rate
+ * (e.g., 9600) and the old octal B* codes (e.g., 15 for B9600) are accepted */
+static speed_t janus_serial_parse_baudrate(const char *value) {
+  switch(atoi(value)) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default: break;
+  }
+  long code = strtol(value, NULL, 8);
+  if(code >= B50 && code <= B38400)
+    return (speed_t)code;
+  JANUS_LOG(LOG_WARN, "Unsupported baudrate %s, falling back to 9600\n", value);
+  return JANUS_SERIAL_DEFAULT_BAUDRATE;
+}
+
+/* Create a port out of a configuration category (which may be NULL) */
+static janus_serial_port *janus_serial_port_new(const char *name, janus_config_category *cat) {
+  janus_serial_port *port = g_malloc0(sizeof(janus_serial_port));
+  janus_config_item *item = cat ? janus_config_get_item(cat, "name") : NULL;
+  port->name = g_strdup(item && item->value ? item->value : name);
+  item = cat ? janus_config_get_item(cat, "portname") : NULL;
+  port->portname = g_strdup(item && item->value ? item->value : JANUS_SERIAL_DEFAULT_PORTNAME);
+  item = cat ? janus_config_get_item(cat, "baudrate") : NULL;
+  port->baudrate = item && item->value ? janus_serial_parse_baudrate(item->value) : JANUS_SERIAL_DEFAULT_BAUDRATE;
+  item = cat ? janus_config_get_item(cat, "vmin") : NULL;
+  port->vmin = item && item->value ? atoi(item->value) : 0;
+  item = cat ? janus_config_get_item(cat, "vtime") : NULL;
+  port->vtime = item && item->value ? atoi(item->value) : 0;
+  item = cat ? janus_config_get_item(cat, "protocol") : NULL;
+  port->protocol_wanted = item && item->value && !strcasecmp(item->value, "json") ?
+    JANUS_SERIAL_PROTOCOL_JSON : JANUS_SERIAL_PROTOCOL_BINARY;
+  item = cat ? janus_config_get_item(cat, "cache_ttl") : NULL;
+  port->cache_ttl = item && item->value && atoi(item->value) > 0 ? (gint64)atoi(item->value)*1000 : 0;
+  port->fd = -1;
+  port->wakeup = -1;
+  janus_mutex_init(&port->mutex);
+  g_queue_init(&port->pending);
+  g_atomic_int_set(&port->next_seq, 1);
+  g_queue_init(&port->inflight);
+  port->by_seq = g_hash_table_new(NULL, NULL);
+  port->tx_state = JANUS_SERIAL_TX_IDLE;
+  port->rx_state = JANUS_SERIAL_RX_IDLE;
+  port->protocol = JANUS_SERIAL_PROTOCOL_JSON;
+  janus_mutex_init(&port->streams_mutex);
+  port->streams = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)janus_serial_stream_free);
+  janus_mutex_init(&port->reads_mutex);
+  port->reads = g_hash_table_new(NULL, NULL);
+  port->cache = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)janus_serial_cached_free);
+  return port;
+}
+
+/* Open and configure the tty of a port */
+static int janus_serial_port_open(janus_serial_port *port) {
+  /* The tty is non-blocking: the I/O thread waits on it with poll() */
+  port->fd = open(port->portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(port->fd < 0) {
+    JANUS_LOG(LOG_ERR, "[%s] Error opening serial port %s: %d (%s)\n", port->name, port->portname, errno, strerror(errno));
+    return -1;
+  }
+  port->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(port->wakeup < 0) {
+    JANUS_LOG(LOG_ERR, "[%s] Error creating the serial I/O eventfd: %d (%s)\n", port->name, errno, strerror(errno));
+    close(port->fd);
+    port->fd = -1;
+    return -1;
+  }
+  JANUS_LOG(LOG_INFO, "[%s] stream aperto - Janus Serial (%s)\n", port->name, port->portname);
+
+  /* Get currently set options for the tty */
+  tcgetattr(port->fd, &port->toptions);
+  /* Set custom options */
+  /* 8 bits, no parity, no stop bits */
+  port->toptions.c_cflag &= ~PARENB;
+  port->toptions.c_cflag &= ~CSTOPB;
+  port->toptions.c_cflag &= ~CSIZE;
+  port->toptions.c_cflag |= CS8;
+  /* no hardware flow control */
+  port->toptions.c_cflag &= ~CRTSCTS;
+  /* enable receiver, ignore status lines */
+  port->toptions.c_cflag |= CREAD | CLOCAL;
+  /* disable input/output flow control, disable restart chars */
+  port->toptions.c_iflag &= ~(IXON | IXOFF | IXANY);
+  /* don't strip, translate or drop CR/NL and 8th bits, nor turn breaks
+  into signals: binary packets can contain any byte */
+  port->toptions.c_iflag &= ~(ICRNL | INLCR | IGNCR | ISTRIP | BRKINT);
+  /* disable canonical input, disable echo,
+  disable visually erase chars,
+  disable terminal-generated signals and extended input processing */
+  port->toptions.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
+  /* disable output processing */
+  port->toptions.c_oflag &= ~OPOST;
+  /* speed */
+  cfsetispeed(&port->toptions, port->baudrate);
+  cfsetospeed(&port->toptions, port->baudrate);
+  /* only relevant to blocking reads, we honour them anyway */
+  port->toptions.c_cc[VMIN] = port->vmin;
+  port->toptions.c_cc[VTIME] = port->vtime;
+  /* commit the options */
+  tcsetattr(port->fd, TCSANOW, &port->toptions);
+  return 0;
+}
+
+/* Launch the I/O thread of an open port */
+static int janus_serial_port_start(janus_serial_port *port) {
+  /* Flush anything already in the serial buffer */
+  tcflush(port->fd, TCIOFLUSH);
+  port->running = TRUE;
+  if(port->protocol_wanted == JANUS_SERIAL_PROTOCOL_BINARY) {
+    /* Ask the firmware to switch to binary packets before anything else:
+     * firmware that can't will say so (or won't answer), and we'll stick
+     * to JSON. Nobody waits for the reply to this one */
+    janus_serial_message *msg = g_malloc0(sizeof(janus_serial_message));
+    msg->body = json_object();
+    json_object_set_new(msg->body, "command", json_integer(JANUS_SERIAL_COMMAND_PROTOCOL));
+    json_object_set_new(msg->body, "protocol", json_integer(JANUS_SERIAL_PROTOCOL_BINARY));
+    msg->port = port;
+    msg->queued = janus_get_monotonic_time();
+    port->hello = janus_serial_request_new(port, msg);
+    g_queue_push_tail(&port->pending, port->hello);
+  }
+  GError *error = NULL;
+  char tname[16];
+  g_snprintf(tname, sizeof(tname), "serial %s", port->name);
+  port->thread = g_thread_try_new(tname, &janus_serial_io_thread, port, &error);
+  if(error != NULL) {
+    port->running = FALSE;
+    g_queue_clear(&port->pending);
+    janus_serial_request_free(port->hello);
+    port->hello = NULL;
+    JANUS_LOG(LOG_ERR, "[%s] Got error %d (%s) trying to launch the Serial I/O thread...\n", port->name, error->code, error->message ? error->message : "??");
+    g_error_free(error);
+    return -1;
+  }
+  return 0;
+}
+
+/* Stop the I/O thread of a port, if any, and get rid of it */
+static void janus_serial_port_destroy(janus_serial_port *port) {
+  if(!port)
+    return;
+  if(port->thread != NULL) {
+    /* Wake the I/O thread up, it will notice we're stopping */
+    eventfd_write(port->wakeup, 1);
+    g_thread_join(port->thread);
+    port->thread = NULL;
+  }
+  g_hash_table_destroy(port->by_seq);
+  port->by_seq = NULL;
+  g_hash_table_destroy(port->streams);
+  port->streams = NULL;
+  janus_mutex_destroy(&port->streams_mutex);
+  g_hash_table_destroy(port->reads);
+  port->reads = NULL;
+  g_hash_table_destroy(port->cache);
+  port->cache = NULL;
+  janus_mutex_destroy(&port->reads_mutex);
+  if(port->wakeup >= 0)
+    close(port->wakeup);
+  port->wakeup = -1;
+  if(port->fd >= 0)
+    close(port->fd);
+  port->fd = -1;
+  janus_mutex_destroy(&port->mutex);
+  g_free(port->name);
+  g_free(port->portname);
+  g_free(port);
+}
+
+/* Hand out the next correlation ID (never 0, which means "none") */
+static guint32 janus_serial_io_next_seq(janus_serial_port *port) {
+  guint32 seq = 0;
+  while(seq == 0)
+    seq = (guint32)g_atomic_int_add(&port->next_seq, 1) & 0x7FFFFFFF;
+  return seq;
+}
+
+/* Queue a request for the TX state machine and wake the I/O thread up */
+static void janus_serial_io_submit(janus_serial_port *port, janus_serial_request *request) {
+  janus_mutex_lock(&port->mutex);
+  if(!port->running) {
+    janus_mutex_unlock(&port->mutex);
+    janus_serial_io_fail(request, JANUS_SERIAL_ERROR_IO, "Serial port not available");
+    return;
+  }
+  g_queue_push_tail(&port->pending, request);
+  janus_mutex_unlock(&port->mutex);
+  eventfd_write(port->wakeup, 1);
+}
+
+/* Stop tracking a request that was in flight */
+static void janus_serial_io_forget(janus_serial_port *port, janus_serial_request *request) {
+  g_queue_remove(&port->inflight, request);
+  g_hash_table_remove(port->by_seq, GUINT_TO_POINTER(request->seq));
+  if(request == port->hello) {
+    /* Negotiation is over, whatever the outcome */
+    port->hello = NULL;
+  }
+}
+
+/* CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) */
+static guint16 janus_serial_wire_crc16(const guint8 *data, size_t len) {
+  guint16 crc = 0xFFFF;
+  size_t i = 0;
+  int bit = 0;
+  for(i = 0; i < len; i++) {
+    crc ^= (guint16)data[i] << 8;
+    for(bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/* COBS encode a packet (out must have room for len+len/254+1 bytes): the
+ * result has no 0 bytes, so that 0 can delimit packets on the link */
+static size_t janus_serial_wire_cobs_encode(const guint8 *in, size_t len, guint8 *out) {
+  size_t code_pos = 0, out_len = 1, i = 0;
+  guint8 code = 1;
+  for(i = 0; i < len; i++) {
+    if(in[i] == 0) {
+      out[code_pos] = code;
+      code_pos = out_len++;
+      code = 1;
+      continue;
+    }
+    out[out_len++] = in[i];
+    if(++code == 0xFF) {
+      out[code_pos] = code;
+      code_pos = out_len++;
+      code = 1;
+    }
+  }
+  out[code_pos] = code;
+  return out_len;
+}
+
+/* COBS decode a packet (without its delimiter): returns the decoded
+ * length, or -1 if it's malformed or doesn't fit */
+static ssize_t janus_serial_wire_cobs_decode(const guint8 *in, size_t len, guint8 *out, size_t size) {
+  size_t in_pos = 0, out_len = 0;
+  while(in_pos < len) {
+    guint8 code = in[in_pos++];
+    if(code == 0 || in_pos + code - 1 > len)
+      return -1;
+    guint8 i = 0;
+    for(i = 1; i < code; i++) {
+      if(out_len == size)
+        return -1;
+      out[out_len++] = in[in_pos++];
+    }
+    if(code != 0xFF && in_pos < len) {
+      if(out_len == size)
+        return -1;
+      out[out_len++] = 0;
+    }
+  }
+  return out_len;
+}
+
+static void janus_serial_wire_put(guint8 *packet, size_t *len, guint8 tag, guint32 value, guint8 size) {
+  packet[(*len)++] = tag;
+  packet[(*len)++] = size;
+  guint8 i = 0;
+  for(i = 0; i < size; i++)
+    packet[(*len)++] = (value >> (8*i)) & 0xFF;
+}
+
+static guint32 janus_serial_wire_get(const guint8 *value, guint8 size) {
+  guint32 result = 0;
+  guint8 i = 0;
+  for(i = 0; i < size && i < 4; i++)
+    result |= (guint32)value[i] << (8*i);
+  return result;
+}
+
+/* Turn a request into a binary packet: only the elements the firmware
+ * knows about make it, the others would be ignored anyway */
+static int janus_serial_wire_encode(json_t *body, guint8 *frame, size_t *frame_len) {
+  guint8 packet[32];
+  size_t len = 0;
+  packet[len++] = JANUS_SERIAL_WIRE_REQUEST;
+  const char *names[] = { "seq", "command", "id", "rate" };
+  const guint8 tags[] = { JANUS_SERIAL_WIRE_SEQ, JANUS_SERIAL_WIRE_COMMAND, JANUS_SERIAL_WIRE_ID, JANUS_SERIAL_WIRE_RATE };
+  const guint8 sizes[] = { 4, 1, 1, 2 };
+  int i = 0;
+  for(i = 0; i < 4; i++) {
+    json_t *value = json_object_get(body, names[i]);
+    if(value == NULL)
+      continue;
+    if(!json_is_integer(value) || json_integer_value(value) < 0 ||
+        (sizes[i] < 4 && json_integer_value(value) >= (1 << (8*sizes[i]))))
+      return -1;
+    janus_serial_wire_put(packet, &len, tags[i], (guint32)json_integer_value(value), sizes[i]);
+  }
+  guint16 crc = janus_serial_wire_crc16(packet, len);
+  packet[len++] = crc & 0xFF;
+  packet[len++] = crc >> 8;
+  *frame_len = janus_serial_wire_cobs_encode(packet, len, frame);
+  frame[(*frame_len)++] = 0;
+  return 0;
+}
+
+/* Turn a binary packet from the MCU into the JSON the firmware would have
+ * sent, which is what sessions get anyway */
+static json_t *janus_serial_wire_decode(janus_serial_port *port, const guint8 *frame, size_t frame_len) {
+  guint8 packet[JANUS_SERIAL_FRAME_MAX];
+  ssize_t len = janus_serial_wire_cobs_decode(frame, frame_len, packet, sizeof(packet));
+  if(len < 3) {
+    JANUS_LOG(LOG_WARN, "[%s] Dropping malformed serial packet (%zu bytes)\n", port->name, frame_len);
+    return NULL;
+  }
+  len -= 2;
+  if(janus_serial_wire_crc16(packet, len) != (packet[len] | (packet[len+1] << 8))) {
+    JANUS_LOG(LOG_WARN, "[%s] Dropping serial packet with a bad CRC (%zu bytes)\n", port->name, frame_len);
+    return NULL;
+  }
+  if(packet[0] != JANUS_SERIAL_WIRE_REPLY && packet[0] != JANUS_SERIAL_WIRE_SAMPLE) {
+    JANUS_LOG(LOG_WARN, "[%s] Dropping serial packet of unknown type %u\n", port->name, packet[0]);
+    return NULL;
+  }
+  json_t *root = json_object();
+  ssize_t pos = 1;
+  while(pos + 2 <= len) {
+    guint8 tag = packet[pos], size = packet[pos+1];
+    const guint8 *value = packet + pos + 2;
+    pos += 2 + size;
+    if(pos > len) {
+      JANUS_LOG(LOG_WARN, "[%s] Dropping truncated serial packet\n", port->name);
+      json_decref(root);
+      return NULL;
+    }
+    switch(tag) {
+      case JANUS_SERIAL_WIRE_SEQ:
+        json_object_set_new(root, "seq", json_integer(janus_serial_wire_get(value, size)));
+        break;
+      case JANUS_SERIAL_WIRE_STREAM:
+        json_object_set_new(root, "stream", json_integer(janus_serial_wire_get(value, size)));
+        break;
+      case JANUS_SERIAL_WIRE_OPSTATUS:
+        json_object_set_new(root, "opstatus", json_string(janus_serial_wire_get(value, size) == 0 ? "ok" : "err"));
+        break;
+      case JANUS_SERIAL_WIRE_CODE:
+        json_object_set_new(root, "code", json_integer(janus_serial_wire_get(value, size)));
+        break;
+      case JANUS_SERIAL_WIRE_ID:
+        json_object_set_new(root, "id", json_integer(janus_serial_wire_get(value, size)));
+        break;
+      case JANUS_SERIAL_WIRE_RATE:
+        json_object_set_new(root, "rate", json_integer(janus_serial_wire_get(value, size)));
+        break;
+      case JANUS_SERIAL_WIRE_ACCELEROMETER: {
+        if(size != 6)
+          break;
+        json_t *measure = json_array();
+        int i = 0;
+        for(i = 0; i < 3; i++)
+          json_array_append_new(measure, json_integer((gint16)janus_serial_wire_get(value + 2*i, 2)));
+        json_object_set_new(root, "measure", measure);
+        json_object_set_new(root, "type", json_string("accelerometer"));
+        break;
+      }
+      case JANUS_SERIAL_WIRE_TEMPERATURE:
+        if(size != 4)
+          break;
+        json_object_set_new(root, "measure", json_real((gint32)janus_serial_wire_get(value, size) / 10000.0));
+        json_object_set_new(root, "type", json_string("temperature"));
+        break;
+      default:
+        /* Newer firmware, maybe: skip what we don't know */
+        break;
+    }
+  }
+  return root;
+}
+
+/* Encode a request the way the firmware talks now */
+static int janus_serial_io_encode(janus_serial_port *port, janus_serial_request *request) {
+  g_free(request->frame);
+  request->frame = NULL;
+  request->written = 0;
+  if(port->protocol == JANUS_SERIAL_PROTOCOL_BINARY) {
+    guint8 frame[64];
+    size_t len = 0;
+    if(janus_serial_wire_encode(request->msg->body, frame, &len) < 0)
+      return -1;
+    request->frame = g_malloc(len);
+    memcpy(request->frame, frame, len);
+    request->len = len;
+    return 0;
+  }
+  /* No whitespace at all: every byte counts on a slow link */
+  char *request_text = json_dumps(request->msg->body, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  request->frame = g_strdup_printf("%s\n", request_text);
+  g_free(request_text);
+  request->len = strlen(request->frame);
+  return 0;
+}
+
+/* The firmware answered our protocol negotiation */
+static void janus_serial_io_negotiated(janus_serial_port *port, json_t *reply) {
+  json_t *opstatus = reply ? json_object_get(reply, "opstatus") : NULL;
+  json_t *protocol = reply ? json_object_get(reply, "protocol") : NULL;
+  if(opstatus && json_is_string(opstatus) && !strcasecmp(json_string_value(opstatus), "ok") &&
+      protocol && json_is_integer(protocol) && json_integer_value(protocol) == JANUS_SERIAL_PROTOCOL_BINARY) {
+    JANUS_LOG(LOG_INFO, "[%s] Switching to the binary serial protocol\n", port->name);
+    port->protocol = JANUS_SERIAL_PROTOCOL_BINARY;
+  } else {
+    JANUS_LOG(LOG_INFO, "[%s] The firmware doesn't do the binary serial protocol, sticking to JSON\n", port->name);
+  }
+}
+
+/* A request is over: if it was a read others were waiting for, stop
+ * sharing it, cache the reply if it's a good one, and return the waiters */
+static GList *janus_serial_io_detach(janus_serial_port *port, janus_serial_request *request, json_t *reply) {
+  if(!request->coalesced)
+    return NULL;
+  janus_mutex_lock(&port->reads_mutex);
+  if(g_hash_table_lookup(port->reads, GINT_TO_POINTER(request->sensor)) == request)
+    g_hash_table_remove(port->reads, GINT_TO_POINTER(request->sensor));
+  GList *waiters = request->waiters;
+  request->waiters = NULL;
+  json_t *opstatus = reply ? json_object_get(reply, "opstatus") : NULL;
+  if(port->cache_ttl > 0 && opstatus && json_is_string(opstatus) && !strcasecmp(json_string_value(opstatus), "ok")) {
+    janus_serial_cached *cached = g_hash_table_lookup(port->cache, GINT_TO_POINTER(request->sensor));
+    if(cached == NULL) {
+      cached = g_malloc0(sizeof(janus_serial_cached));
+      g_hash_table_insert(port->cache, GINT_TO_POINTER(request->sensor), cached);
+    }
+    if(cached->reply != NULL)
+      json_decref(cached->reply);
+    cached->reply = json_incref(reply);
+    cached->updated = janus_get_monotonic_time();
+  }
+  janus_mutex_unlock(&port->reads_mutex);
+  return waiters;
+}
+
+/* Give up on a request, telling the browser (all of them, if it was
+ * shared) why */
+static void janus_serial_io_fail(janus_serial_request *request, int error_code, const char *error_cause) {
+  if(request == NULL)
+    return;
+  GList *waiters = janus_serial_io_detach(request->msg->port, request, NULL);
+  GList *wl = waiters;
+  while(wl) {
+    janus_serial_push_error((janus_serial_message *)wl->data, error_code, error_cause);
+    wl = wl->next;
+  }
+  g_list_free_full(waiters, (GDestroyNotify)janus_serial_message_free);
+  janus_serial_push_error(request->msg, error_code, error_cause);
+  janus_serial_request_free(request);
+}
+
+/* Answer a message with a reply from the MCU: events get a copy of the
+ * reply, which the gateway serializes when sending it, while on DataChannels
+ * the text is serialized once and shared, unless the message needs its
+ * transaction in it */
+static void janus_serial_io_answer(janus_serial_message *msg, json_t *reply, const char *frame, char **shared) {
+  /* Requests the plugin sends on its own have nobody to answer to */
+  janus_serial_session *session = msg->handle ? (janus_serial_session *)msg->handle->plugin_handle : NULL;
+  if(session == NULL || session->destroyed)
+    return;
+  if(reply == NULL) {
+    /* Not JSON, pass it on as it is */
+    janus_serial_reply(msg, frame);
+    return;
+  }
+  if(!msg->datachannel) {
+    int ret = gateway->push_event_json(msg->handle, &janus_serial_plugin, msg->transaction, json_deep_copy(reply), NULL, NULL);
+    JANUS_LOG(LOG_VERB, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
+    return;
+  }
+  if(msg->transaction != NULL) {
+    json_t *copy = json_copy(reply);
+    json_object_set_new(copy, "transaction", json_string(msg->transaction));
+    char *text = json_dumps(copy, JSON_COMPACT | JSON_PRESERVE_ORDER);
+    json_decref(copy);
+    janus_serial_reply(msg, text);
+    g_free(text);
+    return;
+  }
+  if(*shared == NULL)
+    *shared = json_dumps(reply, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  janus_serial_reply(msg, *shared);
+}
+
+/* A complete frame came in from the MCU: hand it back to whoever asked.
+ * The text of the frame is only there if it came as JSON, and is what
+ * sessions get if it wasn't valid */
+static void janus_serial_io_deliver(janus_serial_port *port, json_t *root, const char *frame) {
+  janus_serial_request *request = NULL;
+  char *reply = NULL;
+  if(frame == NULL)
+    frame = "(binary)";
+  json_t *stream = root ? json_object_get(root, "stream") : NULL;
+  if(stream && json_is_integer(stream)) {
+    /* A sample of a subscribed sensor, nobody asked for it explicitly */
+    janus_serial_stream_deliver(port, (int)json_integer_value(stream), root);
+    json_decref(root);
+    return;
+  }
+  json_t *seq = root ? json_object_get(root, "seq") : NULL;
+  if(seq && json_is_integer(seq) && json_integer_value(seq) != 0) {
+    request = g_hash_table_lookup(port->by_seq, GUINT_TO_POINTER((guint32)json_integer_value(seq)));
+    if(request == NULL) {
+      /* Probably a straggler we already timed out */
+      JANUS_LOG(LOG_WARN, "[%s] Dropping serial reply with unknown seq %"JSON_INTEGER_FORMAT": %s\n", port->name, json_integer_value(seq), frame);
+      json_decref(root);
+      return;
+    }
+  } else {
+    /* Firmware that doesn't echo IDs back answers in order */
+    request = g_queue_peek_head(&port->inflight);
+    if(request == NULL) {
+      JANUS_LOG(LOG_WARN, "[%s] Dropping unsolicited serial frame: %s\n", port->name, frame);
+      if(root != NULL)
+        json_decref(root);
+      return;
+    }
+  }
+  if(root != NULL) {
+    /* The correlation ID is ours, the browser doesn't need to see it,
+     * while it may want to know which device answered */
+    json_object_del(root, "seq");
+    json_object_set_new(root, "device", json_string(port->name));
+  }
+  if(request == port->hello)
+    janus_serial_io_negotiated(port, root);
+  janus_serial_io_forget(port, request);
+  JANUS_LOG(LOG_VERB, "[%s] Got serial reply (seq %"PRIu32"): %s\n", port->name, request->seq, frame);
+  GList *waiters = janus_serial_io_detach(port, request, root);
+  janus_serial_io_answer(request->msg, root, frame, &reply);
+  GList *wl = waiters;
+  while(wl) {
+    janus_serial_io_answer((janus_serial_message *)wl->data, root, frame, &reply);
+    wl = wl->next;
+  }
+  g_list_free_full(waiters, (GDestroyNotify)janus_serial_message_free);
+  g_free(reply);
+  if(root != NULL)
+    json_decref(root);
+  janus_serial_request_free(request);
+}
+
+/* A JSON line came in from the MCU */
+static void janus_serial_io_deliver_frame(janus_serial_port *port, const char *frame) {
+  json_error_t error;
+  json_t *root = json_loads(frame, 0, &error);
+  if(root != NULL && !json_is_object(root)) {
+    json_decref(root);
+    root = NULL;
+  }
+  janus_serial_io_deliver(port, root, frame);
+}
+
+/* A binary packet came in from the MCU */
+static void janus_serial_io_deliver_packet(janus_serial_port *port, const char *packet, size_t len) {
+  json_t *root = janus_serial_wire_decode(port, (const guint8 *)packet, len);
+  if(root != NULL)
+    janus_serial_io_deliver(port, root, NULL);
+}
+
+/* RX state machine: JSON replies start with '{' and are terminated by
+ * '\n', with the USB transfer padded with NULs, so frames are split on
+ * newlines and any padding or whitespace between them is skipped. Once
+ * the binary protocol is negotiated, anything else is a COBS packet
+ * terminated by a 0 byte */
+static void janus_serial_io_feed(janus_serial_port *port, const char *buf, ssize_t len) {
+  ssize_t i = 0;
+  for(i = 0; i < len; i++) {
+    char c = buf[i];
+    switch(port->rx_state) {
+      case JANUS_SERIAL_RX_IDLE:
+        if(c == '\0' || (port->protocol == JANUS_SERIAL_PROTOCOL_JSON && g_ascii_isspace(c)))
+          break;
+        port->rx_len = 0;
+        if(c != '{' && port->protocol == JANUS_SERIAL_PROTOCOL_BINARY) {
+          port->rx_buf[port->rx_len++] = c;
+          port->rx_state = JANUS_SERIAL_RX_PACKET;
+          break;
+        }
+        port->rx_state = JANUS_SERIAL_RX_FRAME;
+        /* Fall through */
+      case JANUS_SERIAL_RX_FRAME:
+        if(c == '\n') {
+          while(port->rx_len > 0 && port->rx_buf[port->rx_len-1] == '\r')
+            port->rx_len--;
+          port->rx_buf[port->rx_len] = '\0';
+          janus_serial_io_deliver_frame(port, port->rx_buf);
+          port->rx_state = JANUS_SERIAL_RX_IDLE;
+        } else if(c == '\0') {
+          /* Padding after an unterminated frame, ignore */
+        } else if(port->rx_len < JANUS_SERIAL_FRAME_MAX-1) {
+          port->rx_buf[port->rx_len++] = c;
+        } else {
+          JANUS_LOG(LOG_WARN, "[%s] Serial frame longer than %d bytes, discarding it\n", port->name, JANUS_SERIAL_FRAME_MAX-1);
+          port->rx_state = JANUS_SERIAL_RX_DISCARD;
+        }
+        break;
+      case JANUS_SERIAL_RX_PACKET:
+        if(c == '\0') {
+          janus_serial_io_deliver_packet(port, port->rx_buf, port->rx_len);
+          port->rx_state = JANUS_SERIAL_RX_IDLE;
+        } else if(port->rx_len < JANUS_SERIAL_FRAME_MAX) {
+          port->rx_buf[port->rx_len++] = c;
+        } else {
+          JANUS_LOG(LOG_WARN, "[%s] Serial packet longer than %d bytes, discarding it\n", port->name, JANUS_SERIAL_FRAME_MAX);
+          port->rx_state = JANUS_SERIAL_RX_DISCARD_PACKET;
+        }
+        break;
+      case JANUS_SERIAL_RX_DISCARD:
+        if(c == '\n')
+          port->rx_state = JANUS_SERIAL_RX_IDLE;
+        break;
+      case JANUS_SERIAL_RX_DISCARD_PACKET:
+        if(c == '\0')
+          port->rx_state = JANUS_SERIAL_RX_IDLE;
+        break;
+    }
+  }
+}
+
+/* Time out the requests whose reply is overdue, and return how long (in ms)
+ * poll() can sleep before the next one is: the reply timeout is the same
+ * for everybody, so the oldest request in flight is always the first due */
+static int janus_serial_io_expire(janus_serial_port *port, gint64 now) {
+  janus_serial_request *request = NULL;
+  while((request = g_queue_peek_head(&port->inflight)) != NULL) {
+    if(request->deadline > now)
+      return (int)((request->deadline - now + 999)/1000);
+    JANUS_LOG(LOG_WARN, "[%s] Timeout waiting for the serial reply (seq %"PRIu32")\n", port->name, request->seq);
+    janus_serial_io_forget(port, request);
+    janus_serial_io_fail(request, JANUS_SERIAL_ERROR_TIMEOUT, "Timeout waiting for the device");
+  }
+  return -1;
+}
+
+/* Serial I/O Thread Implementation (one per port) */
+static void *janus_serial_io_thread(void *data) {
+  janus_serial_port *port = (janus_serial_port *)data;
+  JANUS_LOG(LOG_INFO, "[%s] Serial I/O thread started\n", port->name);
+  char buf[JANUS_SERIAL_FRAME_MAX];
+  struct pollfd fds[2];
   while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-    janus_mutex_lock(&sessions_mutex);
-    /* Iterate on all the sessions */
-    now = janus_get_monotonic_time();
-    if(old_sessions != NULL) {
-      GList *sl = old_sessions;
-      JANUS_LOG(LOG_HUGE, "Checking %d old Serial sessions...\n", g_list_length(old_sessions));
-      while(sl) {
-        janus_serial_session *session = (janus_serial_session *)sl->data;
-	if(!session) {
-	  sl = sl->next;
-	  continue;
-	}
-	if(now-session->destroyed >= 5*G_USEC_PER_SEC) {
-          /* We're lazy and actually get rid of the stuff only after a few seconds */
-	  JANUS_LOG(LOG_VERB, "Freeing old Serial session\n");
-	  GList *rm = sl->next;
-	  old_sessions = g_list_delete_link(old_sessions, sl);
-	  sl = rm;
-	  session->handle = NULL;
-	  g_free(session);
-	  session = NULL;
-	  continue;
-	}
-	sl = sl->next;
+    /* If the TX state machine is free and the pipeline isn't full, pick the
+     * next request: while the protocol is being negotiated, nothing else
+     * goes out, as we don't know how to encode it yet */
+    while(port->tx_state == JANUS_SERIAL_TX_IDLE && (port->hello == NULL || port->hello->frame == NULL) &&
+        g_queue_get_length(&port->inflight) < JANUS_SERIAL_PIPELINE_DEPTH) {
+      janus_mutex_lock(&port->mutex);
+      port->current = g_queue_pop_head(&port->pending);
+      janus_mutex_unlock(&port->mutex);
+      if(port->current == NULL)
+        break;
+      if(janus_serial_io_encode(port, port->current) == 0) {
+        port->tx_state = JANUS_SERIAL_TX_WRITING;
+        break;
+      }
+      janus_serial_io_fail(port->current, JANUS_SERIAL_ERROR_INVALID_ELEMENT, "Invalid element (the device only takes small non-negative integers)");
+      port->current = NULL;
+    }
+    int timeout = janus_serial_io_expire(port, janus_get_monotonic_time());
+    fds[0].fd = port->wakeup;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = port->fd;
+    fds[1].events = POLLIN | (port->tx_state == JANUS_SERIAL_TX_WRITING ? POLLOUT : 0);
+    fds[1].revents = 0;
+    int res = poll(fds, 2, timeout);
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      JANUS_LOG(LOG_ERR, "[%s] Error polling the serial port: %d (%s)\n", port->name, errno, strerror(errno));
+      break;
+    }
+    if(fds[0].revents & POLLIN) {
+      eventfd_t value = 0;
+      eventfd_read(port->wakeup, &value);
+    }
+    if(fds[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      JANUS_LOG(LOG_ERR, "[%s] Serial port %s went away\n", port->name, port->portname);
+      break;
+    }
+    if(fds[1].revents & POLLIN) {
+      ssize_t len = read(port->fd, buf, sizeof(buf));
+      if(len > 0) {
+        janus_serial_io_feed(port, buf, len);
+      } else if(len < 0 && errno != EAGAIN && errno != EINTR) {
+        JANUS_LOG(LOG_ERR, "[%s] Error reading from the serial port: %d (%s)\n", port->name, errno, strerror(errno));
+      }
+    }
+    if((fds[1].revents & POLLOUT) && port->tx_state == JANUS_SERIAL_TX_WRITING) {
+      janus_serial_request *request = port->current;
+      ssize_t len = write(port->fd, request->frame + request->written, request->len - request->written);
+      if(len > 0) {
+        request->written += len;
+        if(request->written == request->len) {
+          /* Reply timeouts only start once the whole request is on the wire */
+          request->deadline = janus_get_monotonic_time() + JANUS_SERIAL_REPLY_TIMEOUT;
+          g_queue_push_tail(&port->inflight, request);
+          g_hash_table_insert(port->by_seq, GUINT_TO_POINTER(request->seq), request);
+          port->current = NULL;
+          port->tx_state = JANUS_SERIAL_TX_IDLE;
+        }
+      } else if(len < 0 && errno != EAGAIN && errno != EINTR) {
+        JANUS_LOG(LOG_ERR, "[%s] Error writing to the serial port: %d (%s)\n", port->name, errno, strerror(errno));
+        if(request == port->hello)
+          port->hello = NULL;
+        janus_serial_io_fail(request, JANUS_SERIAL_ERROR_IO, "Error writing to the serial port");
+        port->current = NULL;
+        port->tx_state = JANUS_SERIAL_TX_IDLE;
       }
     }
-    janus_mutex_unlock(&sessions_mutex);
-    g_usleep(500000);
   }
-  JANUS_LOG(LOG_INFO, "Serial watchdog stopped\n");
+  /* Get rid of whatever was still pending */
+  janus_mutex_lock(&port->mutex);
+  port->running = FALSE;
+  janus_mutex_unlock(&port->mutex);
+  janus_serial_request *request = port->current;
+  port->current = NULL;
+  port->hello = NULL;
+  janus_serial_io_fail(request, JANUS_SERIAL_ERROR_IO, "Serial port not available");
+  while((request = g_queue_pop_head(&port->inflight)) != NULL) {
+    g_hash_table_remove(port->by_seq, GUINT_TO_POINTER(request->seq));
+    janus_serial_io_fail(request, JANUS_SERIAL_ERROR_IO, "Serial port not available");
+  }
+  while((request = g_queue_pop_head(&port->pending)) != NULL)
+    janus_serial_io_fail(request, JANUS_SERIAL_ERROR_IO, "Serial port not available");
+  JANUS_LOG(LOG_INFO, "[%s] Serial I/O thread stopped\n", port->name);
   return NULL;
 }
 
@@ -210,86 +1153,128 @@ int janus_serial_init(janus_callbacks *callback, const char *config_path) {
   janus_config *config = janus_config_parse(filename);
   if(config != NULL)
     janus_config_print(config);
-  /* This plugin actually has nothing to configure... */
+  /* Every [port-N] section is a device; a bare [general] section with a
+   * portname (what older configurations had) is a device as well */
+  ports = g_hash_table_new(g_str_hash, g_str_equal);
+  default_port = NULL;
+  GList *ports_list = NULL;
+  janus_config_category *cat = config ? janus_config_get_categories(config) : NULL;
+  while(cat != NULL) {
+    if(cat->name && (g_str_has_prefix(cat->name, "port-") ||
+        (!strcasecmp(cat->name, "general") && janus_config_get_item(cat, "portname") != NULL))) {
+      janus_serial_port *port = janus_serial_port_new(cat->name, cat);
+      if(g_hash_table_lookup(ports, port->name) != NULL) {
+        JANUS_LOG(LOG_WARN, "Duplicate serial device name %s, skipping %s\n", port->name, port->portname);
+        janus_serial_port_destroy(port);
+      } else {
+        g_hash_table_insert(ports, port->name, port);
+        ports_list = g_list_append(ports_list, port);
+      }
+    }
+    cat = cat->next;
+  }
+  if(ports_list == NULL) {
+    /* Nothing configured, go with the defaults */
+    janus_serial_port *port = janus_serial_port_new("default", NULL);
+    g_hash_table_insert(ports, port->name, port);
+    ports_list = g_list_append(ports_list, port);
+  }
+  janus_config_item *item = config ? janus_config_get_item_drilldown(config, "general", "default_device") : NULL;
+  if(item && item->value) {
+    default_port = g_hash_table_lookup(ports, item->value);
+    if(default_port == NULL)
+      JANUS_LOG(LOG_WARN, "Default device %s not found, using the first one\n", item->value);
+  }
+  if(default_port == NULL)
+    default_port = (janus_serial_port *)ports_list->data;
+  /* By default, as many handlers as devices, but no more than cores */
+  workers_num = MIN(g_hash_table_size(ports), g_get_num_processors());
+  item = config ? janus_config_get_item_drilldown(config, "general", "handlers") : NULL;
+  if(item && item->value && atoi(item->value) > 0)
+    workers_num = atoi(item->value);
   janus_config_destroy(config);
   config = NULL;
   
   sessions = g_hash_table_new(NULL, NULL);
+  old_sessions = g_hash_table_new(NULL, NULL);
   janus_mutex_init(&sessions_mutex);
-  messages = g_async_queue_new_full((GDestroyNotify) janus_serial_message_free);
+  /* Prepare the handler workers, and shard the devices among them */
+  workers = g_malloc0(workers_num * sizeof(janus_serial_worker *));
+  guint i = 0;
+  for(i = 0; i < workers_num; i++) {
+    janus_serial_worker *worker = g_malloc0(sizeof(janus_serial_worker));
+    worker->id = i;
+    worker->messages = g_async_queue_new_full((GDestroyNotify) janus_serial_message_free);
+    janus_mutex_init(&worker->mutex);
+    workers[i] = worker;
+  }
+  i = 0;
+  GList *pl = ports_list;
+  while(pl) {
+    ((janus_serial_port *)pl->data)->worker = workers[i % workers_num];
+    i++;
+    pl = pl->next;
+  }
   /* This is the callback we'll need to invoke to contact the gateway */
   gateway = callback;
   g_atomic_int_set(&initialized, 1);
 
-  if(fd = open(portname,O_RDWR | O_NOCTTY | O_NONBLOCK)){
-        //printf("stream aperto\n");
-    JANUS_LOG(LOG_INFO, "stream aperto - Janus Serial\n");
-  }else{
-    //printf("errora nell'apertura dello stream\n");
-    JANUS_LOG(LOG_INFO, "errore nell'apertura dello stream\n");
-    return 0;
+  /* Open all the ports: those that fail stay registered, so that requests
+   * addressed to them get an error rather than going to another board */
+  int opened = 0;
+  pl = ports_list;
+  while(pl) {
+    if(janus_serial_port_open((janus_serial_port *)pl->data) == 0)
+      opened++;
+    pl = pl->next;
   }
-  /* Set up the control structure */
-
-   /* Get currently set options for the tty */
-  tcgetattr(fd, &toptions);
-
-  /* Set custom options */
-
-  /* 9600 baud */
-  cfsetispeed(&toptions, B9600);
-  cfsetospeed(&toptions, B9600);
-  /* 8 bits, no parity, no stop bits */
-  toptions.c_cflag &= ~PARENB;
-  toptions.c_cflag &= ~CSTOPB;
-  toptions.c_cflag &= ~CSIZE;
-  toptions.c_cflag |= CS8;
-  /* no hardware flow control */
-  toptions.c_cflag &= ~CRTSCTS;
-  /* enable receiver, ignore status lines */
-  toptions.c_cflag |= CREAD | CLOCAL;
-  /* disable input/output flow control, disable restart chars */
-  toptions.c_iflag &= ~(IXON | IXOFF | IXANY);
-  /* disable canonical input, disable echo,
-  disable visually erase chars,
-  disable terminal-generated signals */
-  toptions.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-  /* disable output processing */
-  toptions.c_oflag &= ~OPOST;
-
-  /* wait for 24 characters to come in before read returns */
-  toptions.c_cc[VMIN] = 12;
-  /* no minimum time to wait before read returns */
-  toptions.c_cc[VTIME] = 0;
-
-  /* commit the options */
-  tcsetattr(fd, TCSANOW, &toptions);
-
-  /* Wait for the Arduino to reset */
+  if(opened == 0) {
+    JANUS_LOG(LOG_ERR, "Couldn't open any serial port\n");
+    g_atomic_int_set(&initialized, 0);
+    g_list_free_full(ports_list, (GDestroyNotify)janus_serial_port_destroy);
+    g_hash_table_destroy(ports);
+    ports = NULL;
+    default_port = NULL;
+    for(i = 0; i < workers_num; i++) {
+      g_async_queue_unref(workers[i]->messages);
+      janus_mutex_destroy(&workers[i]->mutex);
+      g_free(workers[i]);
+    }
+    g_free(workers);
+    workers = NULL;
+    workers_num = 0;
+    return -1;
+  }
+  /* Wait for the boards to reset (once for all of them) */
   usleep(1000*1000);
-
-  //close(fd);
-  /* Flush anything already in the serial buffer */
-  tcflush(fd, TCIOFLUSH);
+  /* Start one I/O thread per port */
+  pl = ports_list;
+  while(pl) {
+    janus_serial_port *port = (janus_serial_port *)pl->data;
+    if(port->fd >= 0)
+      janus_serial_port_start(port);
+    pl = pl->next;
+  }
+  g_list_free(ports_list);
+  JANUS_LOG(LOG_INFO, "Serial devices: %d configured, %d opened, default is %s\n",
+    g_hash_table_size(ports), opened, default_port->name);
   
   JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_SERIAL_NAME);
 
   g_atomic_int_set(&initialized, 1);
   GError *error = NULL;
-  /* Start the sessions watchdog */
-  watchdog = g_thread_try_new("serial watchdog", &janus_serial_watchdog, NULL, &error);
-  if(error != NULL) {
-    g_atomic_int_set(&initialized, 0);
-    JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the Serial watchdog thread...\n", error->code, error->message ? error->message : "??");
-    return -1;
-  }
-  /* Launch the thread that will handle incoming messages */
-  handler_thread = g_thread_try_new("janus serial handler", janus_serial_handler, NULL, &error);
-  if(error != NULL) {
-    g_atomic_int_set(&initialized, 0);
-    JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the serial handler thread...\n", error->code, error->message ? error->message : "??");
-    return -1;
+  /* Launch the threads that will handle incoming messages */
+  for(i = 0; i < workers_num; i++) {
+    char tname[16];
+    g_snprintf(tname, sizeof(tname), "serial hdlr %u", i);
+    workers[i]->thread = g_thread_try_new(tname, janus_serial_handler, workers[i], &error);
+    if(error != NULL) {
+      g_atomic_int_set(&initialized, 0);
+      JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the serial handler thread...\n", error->code, error->message ? error->message : "??");
+      return -1;
+    }
   }
+  JANUS_LOG(LOG_INFO, "Serial handlers: %u\n", workers_num);
 
   return 0;
 }
@@ -299,23 +1284,50 @@ void janus_serial_destroy(void) {
     return;
   g_atomic_int_set(&stopping, 1);
 
-  if(handler_thread != NULL) {
-    g_thread_join(handler_thread);
-    handler_thread = NULL;
-  }
-  if(watchdog != NULL) {
-    g_thread_join(watchdog);
-    watchdog = NULL;
+  /* The handlers block on their queues: wake them up */
+  guint i = 0;
+  for(i = 0; i < workers_num; i++) {
+    if(workers[i]->thread != NULL) {
+      g_async_queue_push(workers[i]->messages, &exit_message);
+      g_thread_join(workers[i]->thread);
+      workers[i]->thread = NULL;
+    }
   }
+  /* Stop the I/O threads and close the ports */
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, ports);
+  while(g_hash_table_iter_next(&iter, NULL, &value))
+    janus_serial_port_destroy((janus_serial_port *)value);
+  g_hash_table_destroy(ports);
+  ports = NULL;
+  default_port = NULL;
   
   /* FIXME We should destroy the sessions cleanly */
   janus_mutex_lock(&sessions_mutex);
   g_hash_table_destroy(sessions);
+  GList *old = g_hash_table_get_values(old_sessions);
+  g_hash_table_destroy(old_sessions);
+  old_sessions = NULL;
   janus_mutex_unlock(&sessions_mutex);
-  g_async_queue_unref(messages);
-  messages = NULL;
+  /* Don't leave timers behind that would call into an unloaded plugin */
+  GList *ol = old;
+  while(ol) {
+    janus_serial_session *session = (janus_serial_session *)ol->data;
+    janus_timer_cancel(&session->free_timer);
+    g_free(session);
+    ol = ol->next;
+  }
+  g_list_free(old);
+  for(i = 0; i < workers_num; i++) {
+    g_async_queue_unref(workers[i]->messages);
+    janus_mutex_destroy(&workers[i]->mutex);
+    g_free(workers[i]);
+  }
+  g_free(workers);
+  workers = NULL;
+  workers_num = 0;
   sessions = NULL;
-  close(fd);
 
   g_atomic_int_set(&initialized, 0);
   g_atomic_int_set(&stopping, 0);
@@ -364,6 +1376,7 @@ void janus_serial_create_session(janus_plugin_session *handle, int *error) {
   }
   session->handle = handle;
   session->destroyed = 0;
+  janus_timer_init(&session->free_timer, janus_serial_session_free, session);
   g_atomic_int_set(&session->hangingup, 0);
   handle->plugin_handle = session;
   janus_mutex_lock(&sessions_mutex);
@@ -385,12 +1398,14 @@ void janus_serial_destroy_session(janus_plugin_session *handle, int *error) {
     return;
   }
   JANUS_LOG(LOG_VERB, "Removing Serial session...\n");
+  janus_serial_stream_unsubscribe_all(handle);
   janus_mutex_lock(&sessions_mutex);
   if(!session->destroyed) {
     session->destroyed = janus_get_monotonic_time();
     g_hash_table_remove(sessions, handle);
     /* Cleaning up and removing the session is done in a lazy way */
-    old_sessions = g_list_append(old_sessions, session);
+    g_hash_table_insert(old_sessions, session, session);
+    janus_timer_schedule(&session->free_timer, 5000);
   }
   janus_mutex_unlock(&sessions_mutex);
   return;
@@ -412,37 +1427,172 @@ char *janus_serial_query_session(janus_plugin_session *handle) {
   
   json_object_set_new(info, "slowlink_count", json_integer(session->slowlink_count));
   json_object_set_new(info, "destroyed", json_integer(session->destroyed));
+  /* Handlers load, to help sizing the pool */
+  json_t *handlers = json_array();
+  guint i = 0;
+  for(i = 0; i < workers_num; i++) {
+    janus_serial_worker *worker = workers[i];
+    json_t *w = json_object();
+    json_object_set_new(w, "id", json_integer(worker->id));
+    json_object_set_new(w, "queued", json_integer(g_async_queue_length(worker->messages)));
+    janus_mutex_lock(&worker->mutex);
+    json_object_set_new(w, "handled", json_integer(worker->handled));
+    json_object_set_new(w, "wait_avg", json_integer(worker->handled ? worker->wait_time/worker->handled : 0));
+    json_object_set_new(w, "wait_max", json_integer(worker->wait_time_max));
+    json_object_set_new(w, "service_avg", json_integer(worker->handled ? worker->service_time/worker->handled : 0));
+    json_object_set_new(w, "service_max", json_integer(worker->service_time_max));
+    janus_mutex_unlock(&worker->mutex);
+    json_array_append_new(handlers, w);
+  }
+  json_object_set_new(info, "handlers", handlers);
+  /* How much the shared reads and the cache are saving */
+  json_t *devices = json_array();
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, ports);
+  while(g_hash_table_iter_next(&iter, NULL, &value)) {
+    janus_serial_port *port = (janus_serial_port *)value;
+    json_t *d = json_object();
+    json_object_set_new(d, "name", json_string(port->name));
+    janus_mutex_lock(&port->reads_mutex);
+    json_object_set_new(d, "reads_sent", json_integer(port->reads_sent));
+    json_object_set_new(d, "reads_coalesced", json_integer(port->reads_coalesced));
+    json_object_set_new(d, "reads_cached", json_integer(port->reads_cached));
+    janus_mutex_unlock(&port->reads_mutex);
+    json_array_append_new(devices, d);
+  }
+  json_object_set_new(info, "devices", devices);
   
-  char *info_text = json_dumps(info, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+  char *info_text = json_dumps(info, JSON_COMPACT | JSON_PRESERVE_ORDER);
   json_decref(info);
   return info_text;
 }
 
+/* Invalid requests get their error right away */
+static struct janus_plugin_result *janus_serial_reject(char *transaction, char *sdp_type, char *sdp, int error_code, const char *error_cause) {
+  g_free(transaction);
+  g_free(sdp_type);
+  g_free(sdp);
+  char *event_text = janus_serial_error_event(error_code, error_cause, NULL);
+  janus_plugin_result *result = janus_plugin_result_new(JANUS_PLUGIN_OK, event_text);
+  g_free(event_text);
+  return result;
+}
+
 /* CallBack Implementation */ 
 struct janus_plugin_result *janus_serial_handle_message(janus_plugin_session *handle, char *transaction, char *message, char *sdp_type, char *sdp) {
   if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
     return janus_plugin_result_new(JANUS_PLUGIN_ERROR, g_atomic_int_get(&stopping) ? "Shutting down" : "Plugin not initialized");
 
+  /* Only gateways that don't pass us the JSON object get here */
+  char error_cause[512];
+  json_t *root = NULL;
+  int error_code = janus_serial_parse_request(message, &root, error_cause, sizeof(error_cause));
+  g_free(message);
+  if(error_code != 0)
+    return janus_serial_reject(transaction, sdp_type, sdp, error_code, error_cause);
+  return janus_serial_handle_message_json(handle, transaction, root, sdp_type, sdp);
+}
+
+struct janus_plugin_result *janus_serial_handle_message_json(janus_plugin_session *handle, char *transaction, json_t *message, char *sdp_type, char *sdp) {
+  if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
+    if(message != NULL)
+      json_decref(message);
+    g_free(transaction);
+    g_free(sdp_type);
+    g_free(sdp);
+    return janus_plugin_result_new(JANUS_PLUGIN_ERROR, g_atomic_int_get(&stopping) ? "Shutting down" : "Plugin not initialized");
+  }
+
+  /* Validate the message here, as we need to know which device (and so
+   * which handler) it is for: the object is ours, so the handler can
+   * use it as it is, and encode it for the wire straight away */
+  char error_cause[512];
+  janus_serial_port *port = NULL;
+  int error_code = janus_serial_check_request(message, &port, error_cause, sizeof(error_cause));
+  if(error_code != 0)
+    return janus_serial_reject(transaction, sdp_type, sdp, error_code, error_cause);
+
   janus_serial_message *msg = calloc(1, sizeof(janus_serial_message));
 
   if(msg == NULL) {
     JANUS_LOG(LOG_FATAL, "Memory error!\n");
+    json_decref(message);
     return janus_plugin_result_new(JANUS_PLUGIN_ERROR, "Memory error");
   }
 	
   // Build the message
   msg->handle = handle;
   msg->transaction = transaction;
-  msg->message = message;
   msg->sdp_type = sdp_type;
   msg->sdp = sdp;
-  //Push in the thread queue
-  g_async_queue_push(messages, msg);
+  msg->body = message;
+  msg->port = port;
+  msg->queued = janus_get_monotonic_time();
+  //Push in the queue of the handler in charge of this device
+  g_async_queue_push(port->worker->messages, msg);
 	
-  /* All the requests to this plugin are handled asynchronously */
+  /* All the valid requests to this plugin are handled asynchronously */
   return janus_plugin_result_new(JANUS_PLUGIN_OK_WAIT, "I'm taking my time!");
 }
 
+/* Parse a request received as text: returns 0 if successful, an error
+ * code (with a cause) otherwise */
+static int janus_serial_parse_request(const char *text, json_t **body, char *error_cause, int error_len) {
+  *body = NULL;
+  if(text == NULL) {
+    JANUS_LOG(LOG_ERR, "No message??\n");
+    g_snprintf(error_cause, error_len, "%s", "No message??");
+    return JANUS_SERIAL_ERROR_NO_MESSAGE;
+  }
+  json_error_t error;
+  json_t *root = json_loads(text, 0, &error);
+  if(!root) {
+    JANUS_LOG(LOG_ERR, "JSON error: on line %d: %s\n", error.line, error.text);
+    g_snprintf(error_cause, error_len, "JSON error: on line %d: %s", error.line, error.text);
+    return JANUS_SERIAL_ERROR_INVALID_JSON;
+  }
+  *body = root;
+  return 0;
+}
+
+/* Validate a request, and find the device it is addressed to: returns 0
+ * if successful, an error code (with a cause) otherwise, in which case
+ * the request is released */
+static int janus_serial_check_request(json_t *body, janus_serial_port **port, char *error_cause, int error_len) {
+  *port = default_port;
+  if(body == NULL) {
+    JANUS_LOG(LOG_ERR, "No message??\n");
+    g_snprintf(error_cause, error_len, "%s", "No message??");
+    return JANUS_SERIAL_ERROR_NO_MESSAGE;
+  }
+  if(!json_is_object(body)) {
+    JANUS_LOG(LOG_ERR, "JSON error: not an object\n");
+    g_snprintf(error_cause, error_len, "JSON error: not an object");
+    json_decref(body);
+    return JANUS_SERIAL_ERROR_INVALID_JSON;
+  }
+  json_t *device = json_object_get(body, "device");
+  if(device != NULL) {
+    if(!json_is_string(device)) {
+      JANUS_LOG(LOG_ERR, "Invalid element (device should be a string)\n");
+      g_snprintf(error_cause, error_len, "Invalid element (device should be a string)");
+      json_decref(body);
+      return JANUS_SERIAL_ERROR_INVALID_ELEMENT;
+    }
+    *port = g_hash_table_lookup(ports, json_string_value(device));
+    if(*port == NULL) {
+      JANUS_LOG(LOG_ERR, "No such device %s\n", json_string_value(device));
+      g_snprintf(error_cause, error_len, "No such device %s", json_string_value(device));
+      json_decref(body);
+      return JANUS_SERIAL_ERROR_NO_SUCH_DEVICE;
+    }
+    /* The MCU doesn't care about the name we give it */
+    json_object_del(body, "device");
+  }
+  return 0;
+}
+
 void janus_serial_setup_media(janus_plugin_session *handle) {
 	JANUS_LOG(LOG_INFO, "WebRTC media is now available\n");
 	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) return;
@@ -459,6 +1609,60 @@ void janus_serial_setup_media(janus_plugin_session *handle) {
 	
 }
 
+/* DataChannel fast path: once a PeerConnection is up, commands can be sent
+ * on the DataChannel, using the same JSON as messages. They go straight to
+ * the handler of their device, and replies come back on the DataChannel as
+ * well, with no long poll or signalling round trip involved. A "transaction"
+ * element, if present, is kept out of the serial link and added back to the
+ * reply, so that the peer can match replies to requests. */
+void janus_serial_incoming_data(janus_plugin_session *handle, char *buf, int len) {
+  if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+    return;
+  janus_serial_session *session = (janus_serial_session *)handle->plugin_handle;
+  if(!session) {
+    JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+    return;
+  }
+  if(session->destroyed)
+    return;
+  if(buf == NULL || len <= 0)
+    return;
+  /* DataChannels send unterminated strings */
+  char *text = g_malloc0(len+1);
+  memcpy(text, buf, len);
+  *(text+len) = '\0';
+  JANUS_LOG(LOG_VERB, "Got a DataChannel message (%d bytes): %s\n", len, text);
+  char error_cause[512];
+  json_t *root = NULL;
+  janus_serial_port *port = NULL;
+  int error_code = janus_serial_parse_request(text, &root, error_cause, sizeof(error_cause));
+  if(error_code == 0)
+    error_code = janus_serial_check_request(root, &port, error_cause, sizeof(error_cause));
+  g_free(text);
+  if(error_code != 0) {
+    char *event_text = janus_serial_error_event(error_code, error_cause, NULL);
+    gateway->relay_data(handle, event_text, strlen(event_text));
+    g_free(event_text);
+    return;
+  }
+  janus_serial_message *msg = calloc(1, sizeof(janus_serial_message));
+  if(msg == NULL) {
+    JANUS_LOG(LOG_FATAL, "Memory error!\n");
+    json_decref(root);
+    return;
+  }
+  msg->handle = handle;
+  json_t *transaction = json_object_get(root, "transaction");
+  if(transaction && json_is_string(transaction))
+    msg->transaction = g_strdup(json_string_value(transaction));
+  json_object_del(root, "transaction");
+  msg->body = root;
+  msg->port = port;
+  msg->datachannel = TRUE;
+  msg->queued = janus_get_monotonic_time();
+  g_async_queue_push(port->worker->messages, msg);
+}
+
 void janus_serial_hangup_media(janus_plugin_session *handle) {
   JANUS_LOG(LOG_INFO, "No WebRTC media anymore\n");
   if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) return;
@@ -476,36 +1680,33 @@ void janus_serial_hangup_media(janus_plugin_session *handle) {
   json_t *event = json_object();
   json_object_set_new(event, "serial", json_string("event"));
   json_object_set_new(event, "result", json_string("done"));
-  char *event_text = json_dumps(event, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-  json_decref(event);
-  JANUS_LOG(LOG_VERB, "Pushing event: %s\n", event_text);
-  int ret = gateway->push_event(handle, &janus_serial_plugin, NULL, event_text, NULL, NULL);
+  JANUS_LOG(LOG_VERB, "Pushing event\n");
+  int ret = gateway->push_event_json(handle, &janus_serial_plugin, NULL, event, NULL, NULL);
   JANUS_LOG(LOG_VERB, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
-  g_free(event_text);
 
 }
 
 
-/* Thread to handle incoming messages */
+/* Threads to handle incoming messages (one per shard of devices) */
 static void *janus_serial_handler(void *data) {
+  janus_serial_worker *worker = (janus_serial_worker *)data;
   JANUS_LOG(LOG_INFO, "JOIN Serial handler thread\n");
-  JANUS_LOG(LOG_VERB, "Joining Serial handler thread\n");
+  JANUS_LOG(LOG_VERB, "Joining Serial handler thread #%u\n", worker->id);
   janus_serial_message *msg = NULL;
-  int error_code = 0;
-  char *error_cause = calloc(512, sizeof(char));
-  
-  if(error_cause == NULL) {
-    JANUS_LOG(LOG_FATAL, "Memory error!\n");
-    return NULL;
-  }
-
-  json_t *root = NULL;
 
-  while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-    if(!messages || (msg = g_async_queue_try_pop(messages)) == NULL) {
-      usleep(50000);
+  /* Only the exit sentinel ends the loop: it's not allocated, so it must
+   * never be left in the queue for its destroy notify to free */
+  while(TRUE) {
+    /* Block until a message (or the exit sentinel) comes in */
+    msg = g_async_queue_pop(worker->messages);
+    if(msg == &exit_message)
+      break;
+    if(g_atomic_int_get(&stopping)) {
+      /* Shutting down: drop what's still queued, up to the sentinel */
+      janus_serial_message_free(msg);
       continue;
     }
+    gint64 start = janus_get_monotonic_time();
 
     janus_serial_session *session = (janus_serial_session *)msg->handle->plugin_handle;
 
@@ -519,76 +1720,324 @@ static void *janus_serial_handler(void *data) {
       continue;
     }
 
-    /* Handle request */
-    error_code = 0;
-    root = NULL;
-    JANUS_LOG(LOG_VERB, "Handling message: %s\n", msg->message);
-    
-    if(msg->message == NULL) {
-      JANUS_LOG(LOG_ERR, "No message??\n");
-      error_code = JANUS_SERIAL_ERROR_NO_MESSAGE;
-      g_snprintf(error_cause, 512, "%s", "No message??");
-      goto error;
-    }
-
-    json_error_t error;
-    root = json_loads(msg->message, 0, &error);
-    if(!root) {
-      JANUS_LOG(LOG_ERR, "JSON error: on line %d: %s\n", error.line, error.text);
-      error_code = JANUS_SERIAL_ERROR_INVALID_JSON;
-      g_snprintf(error_cause, 512, "JSON error: on line %d: %s", error.line, error.text);
-      goto error;
-    }
-    if(!json_is_object(root)) {
-      JANUS_LOG(LOG_ERR, "JSON error: not an object\n");
-      error_code = JANUS_SERIAL_ERROR_INVALID_JSON;
-      g_snprintf(error_cause, 512, "JSON error: not an object");
-      goto error;
-    }
-
-    tcsetattr(fd, TCSANOW, &toptions);
-
-    tcflush(fd,TCIFLUSH);
-
-    //Local variable
-    char request[256];
-    char response[256];
-    //Initializze local variable
-    memset(request, '\0',256);
-    strncpy(request,msg->message,strlen(msg->message));
-    strcat(request,"\n");
-    //Write on serial port
-    if(write(fd,request,strlen(request)) == -1){
-      JANUS_LOG(LOG_INFO,"errore nella scrittura su seriale\n");
-    }
-    tcdrain(fd); 
-
-    //Active wait for MCU answer
-    while(read(fd,&response,256) == -1){}
-    tcflush(fd, TCIOFLUSH);
-        
-    int res = gateway->push_event(msg->handle, &janus_serial_plugin, NULL, response, NULL, NULL);
-    janus_serial_message_free(msg);
-    continue;
-  		
-error:
-    {
-      if(root != NULL) json_decref(root);
-      /* Prepare JSON error event */
+    /* Handle request (handle_message already validated it) */
+    if(janus_log_level >= LOG_VERB) {
+      char *text = json_dumps(msg->body, JSON_COMPACT | JSON_PRESERVE_ORDER);
+      JANUS_LOG(LOG_VERB, "Handling message: %s\n", text);
+      free(text);
+    }
+    janus_serial_port *port = msg->port;
+    gint64 wait = start - msg->queued;
+
+    if(msg->sdp != NULL) {
+      /* This is the negotiation of the PeerConnection for the DataChannel:
+       * answer with the same SDP, we never send or receive media though */
+      JANUS_LOG(LOG_VERB, "This is involving a negotiation (%s) as well:\n%s\n", msg->sdp_type, msg->sdp);
+      const char *type = !strcasecmp(msg->sdp_type, "offer") ? "answer" : "offer";
+      char *sdp = g_strdup(msg->sdp);
+      sdp = janus_string_replace(sdp, "a=sendrecv", "a=inactive");
+      sdp = janus_string_replace(sdp, "a=sendonly", "a=inactive");
+      sdp = janus_string_replace(sdp, "a=recvonly", "a=inactive");
       json_t *event = json_object();
       json_object_set_new(event, "serial", json_string("event"));
-      json_object_set_new(event, "error_code", json_integer(error_code));
-      json_object_set_new(event, "error", json_string(error_cause));
-      char *event_text = json_dumps(event, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-      json_decref(event);
-      JANUS_LOG(LOG_VERB, "Pushing event: %s\n", event_text);
-      int ret = gateway->push_event(msg->handle, &janus_serial_plugin, msg->transaction, event_text, NULL, NULL);
+      json_object_set_new(event, "result", json_string("ok"));
+      int ret = gateway->push_event_json(msg->handle, &janus_serial_plugin, msg->transaction, event, type, sdp);
       JANUS_LOG(LOG_VERB, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
-      g_free(event_text);
+      g_free(sdp);
       janus_serial_message_free(msg);
+      continue;
     }
+
+    json_t *command = json_object_get(msg->body, "command");
+    if(command && json_is_integer(command) &&
+        (json_integer_value(command) == JANUS_SERIAL_COMMAND_SUBSCRIBE ||
+        json_integer_value(command) == JANUS_SERIAL_COMMAND_UNSUBSCRIBE)) {
+      /* Subscriptions are tracked here, and the MCU is told the period to
+       * sample the sensor at (or to stop) in place of the original request */
+      char error_cause[512];
+      int error_code = janus_serial_stream_update(port, msg, (int)json_integer_value(command), error_cause, sizeof(error_cause));
+      if(error_code != 0) {
+        janus_serial_push_error(msg, error_code, error_cause);
+        janus_serial_message_free(msg);
+      }
+    } else if(command && json_is_integer(command) && json_integer_value(command) == JANUS_SERIAL_COMMAND_READ &&
+        json_is_integer(json_object_get(msg->body, "id")) && json_object_size(msg->body) == 2) {
+      /* Plain reads of the same sensor can be shared */
+      janus_serial_read(port, msg, (int)json_integer_value(json_object_get(msg->body, "id")));
+    } else {
+      /* Hand the request over to the serial I/O engine, which will push the reply */
+      janus_serial_send(port, msg);
+    }
+
+    /* Update the counters */
+    gint64 service = janus_get_monotonic_time() - start;
+    janus_mutex_lock(&worker->mutex);
+    worker->handled++;
+    worker->wait_time += wait;
+    if(wait > worker->wait_time_max)
+      worker->wait_time_max = wait;
+    worker->service_time += service;
+    if(service > worker->service_time_max)
+      worker->service_time_max = service;
+    janus_mutex_unlock(&worker->mutex);
   }
-  g_free(error_cause);
-  JANUS_LOG(LOG_VERB, "Leaving Serial handler thread\n");
+  JANUS_LOG(LOG_VERB, "Leaving Serial handler thread #%u\n", worker->id);
   return NULL;
 }
+
+/* Tag a message with a correlation ID: the I/O thread will encode it as
+ * the firmware wants it when it's its turn */
+static janus_serial_request *janus_serial_request_new(janus_serial_port *port, janus_serial_message *msg) {
+  janus_serial_request *request = g_malloc0(sizeof(janus_serial_request));
+  request->msg = msg;
+  request->seq = janus_serial_io_next_seq(port);
+  json_object_set_new(msg->body, "seq", json_integer(request->seq));
+  return request;
+}
+
+/* Queue a message for the serial I/O engine, which will push the reply */
+static void janus_serial_send(janus_serial_port *port, janus_serial_message *msg) {
+  janus_serial_io_submit(port, janus_serial_request_new(port, msg));
+}
+
+/* Read a sensor: answer from the cache if it's fresh enough, or wait for
+ * the same read if one is in flight already, and only go to the MCU if
+ * neither is the case. Only the handler of the device gets here, so
+ * nobody else can start the same read in the meanwhile */
+static void janus_serial_read(janus_serial_port *port, janus_serial_message *msg, int sensor) {
+  janus_mutex_lock(&port->reads_mutex);
+  if(port->cache_ttl > 0) {
+    janus_serial_cached *cached = g_hash_table_lookup(port->cache, GINT_TO_POINTER(sensor));
+    if(cached != NULL && janus_get_monotonic_time() - cached->updated < port->cache_ttl) {
+      /* The I/O thread owns the cached reply, get a copy of our own */
+      json_t *reply = json_deep_copy(cached->reply);
+      port->reads_cached++;
+      janus_mutex_unlock(&port->reads_mutex);
+      char *text = NULL;
+      janus_serial_io_answer(msg, reply, NULL, &text);
+      g_free(text);
+      json_decref(reply);
+      janus_serial_message_free(msg);
+      return;
+    }
+  }
+  janus_serial_request *request = g_hash_table_lookup(port->reads, GINT_TO_POINTER(sensor));
+  if(request != NULL) {
+    request->waiters = g_list_append(request->waiters, msg);
+    port->reads_coalesced++;
+    janus_mutex_unlock(&port->reads_mutex);
+    return;
+  }
+  request = janus_serial_request_new(port, msg);
+  request->coalesced = TRUE;
+  request->sensor = sensor;
+  g_hash_table_insert(port->reads, GINT_TO_POINTER(sensor), request);
+  port->reads_sent++;
+  janus_mutex_unlock(&port->reads_mutex);
+  janus_serial_io_submit(port, request);
+}
+
+/* Prepare a JSON error event (transaction is only needed on DataChannels) */
+static char *janus_serial_error_event(int error_code, const char *error_cause, const char *transaction) {
+  json_t *event = json_object();
+  json_object_set_new(event, "serial", json_string("event"));
+  json_object_set_new(event, "error_code", json_integer(error_code));
+  json_object_set_new(event, "error", json_string(error_cause));
+  if(transaction != NULL)
+    json_object_set_new(event, "transaction", json_string(transaction));
+  char *event_text = json_dumps(event, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  json_decref(event);
+  return event_text;
+}
+
+/* Prepare and push a JSON error event */
+static void janus_serial_push_error(janus_serial_message *msg, int error_code, const char *error_cause) {
+  if(msg == NULL || msg->handle == NULL)
+    return;
+  char *event_text = janus_serial_error_event(error_code, error_cause, msg->datachannel ? msg->transaction : NULL);
+  janus_serial_reply(msg, event_text);
+  g_free(event_text);
+}
+
+/* Send something back to whoever sent a message: requests that came on the
+ * DataChannel are answered there, the others with an event */
+static void janus_serial_reply(janus_serial_message *msg, const char *text) {
+  if(msg->datachannel) {
+    JANUS_LOG(LOG_VERB, "Relaying data: %s\n", text);
+    gateway->relay_data(msg->handle, (char *)text, strlen(text));
+    return;
+  }
+  JANUS_LOG(LOG_VERB, "Pushing event: %s\n", text);
+  int ret = gateway->push_event(msg->handle, &janus_serial_plugin, msg->transaction, text, NULL, NULL);
+  JANUS_LOG(LOG_VERB, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
+}
+
+/* Telemetry subscriptions Implementation */
+/* Sample as fast as the most demanding subscriber wants (0 if nobody does) */
+static guint janus_serial_stream_rate(janus_serial_stream *stream) {
+  guint rate = 0;
+  GList *sl = stream ? stream->subscribers : NULL;
+  while(sl) {
+    janus_serial_subscriber *subscriber = (janus_serial_subscriber *)sl->data;
+    if(rate == 0 || subscriber->rate < rate)
+      rate = subscriber->rate;
+    sl = sl->next;
+  }
+  return rate;
+}
+
+/* Turn a message into what the MCU has to do for a sensor now, and send
+ * it: must be called with the streams mutex locked, so that the frames go
+ * out in the same order the subscriptions changed */
+static void janus_serial_stream_program(janus_serial_port *port, janus_serial_message *msg, int id, guint rate) {
+  json_object_clear(msg->body);
+  json_object_set_new(msg->body, "command", json_integer(rate > 0 ? JANUS_SERIAL_COMMAND_SUBSCRIBE : JANUS_SERIAL_COMMAND_UNSUBSCRIBE));
+  json_object_set_new(msg->body, "id", json_integer(id));
+  if(rate > 0)
+    json_object_set_new(msg->body, "rate", json_integer(rate));
+  if(rate > 0)
+    JANUS_LOG(LOG_VERB, "[%s] Sampling sensor %d every %u ms\n", port->name, id, rate);
+  else
+    JANUS_LOG(LOG_VERB, "[%s] Not sampling sensor %d anymore\n", port->name, id);
+  janus_serial_send(port, msg);
+}
+
+/* Subscribe a session to a sensor of the device (or unsubscribe it), and
+ * tell the MCU: the reply to that is what the session gets back */
+static int janus_serial_stream_update(janus_serial_port *port, janus_serial_message *msg, int command, char *error_cause, int error_len) {
+  json_t *id = json_object_get(msg->body, "id");
+  if(!id || !json_is_integer(id)) {
+    JANUS_LOG(LOG_ERR, "Missing or invalid element (id)\n");
+    g_snprintf(error_cause, error_len, "Missing or invalid element (id)");
+    return JANUS_SERIAL_ERROR_INVALID_ELEMENT;
+  }
+  guint rate = 0;
+  if(command == JANUS_SERIAL_COMMAND_SUBSCRIBE) {
+    json_t *period = json_object_get(msg->body, "rate");
+    if(!period || !json_is_integer(period) ||
+        json_integer_value(period) < JANUS_SERIAL_STREAM_RATE_MIN || json_integer_value(period) > JANUS_SERIAL_STREAM_RATE_MAX) {
+      JANUS_LOG(LOG_ERR, "Missing or invalid element (rate should be between %d and %d ms)\n",
+        JANUS_SERIAL_STREAM_RATE_MIN, JANUS_SERIAL_STREAM_RATE_MAX);
+      g_snprintf(error_cause, error_len, "Missing or invalid element (rate should be between %d and %d ms)",
+        JANUS_SERIAL_STREAM_RATE_MIN, JANUS_SERIAL_STREAM_RATE_MAX);
+      return JANUS_SERIAL_ERROR_INVALID_ELEMENT;
+    }
+    rate = (guint)json_integer_value(period);
+  }
+  int sensor = (int)json_integer_value(id);
+  janus_mutex_lock(&port->streams_mutex);
+  janus_serial_stream *stream = g_hash_table_lookup(port->streams, GINT_TO_POINTER(sensor));
+  if(stream == NULL && command == JANUS_SERIAL_COMMAND_SUBSCRIBE) {
+    stream = g_malloc0(sizeof(janus_serial_stream));
+    stream->id = sensor;
+    g_hash_table_insert(port->streams, GINT_TO_POINTER(sensor), stream);
+  }
+  janus_serial_subscriber *subscriber = NULL;
+  GList *sl = stream ? stream->subscribers : NULL;
+  while(sl) {
+    if(((janus_serial_subscriber *)sl->data)->handle == msg->handle) {
+      subscriber = (janus_serial_subscriber *)sl->data;
+      break;
+    }
+    sl = sl->next;
+  }
+  if(command == JANUS_SERIAL_COMMAND_SUBSCRIBE) {
+    if(subscriber == NULL) {
+      subscriber = g_malloc0(sizeof(janus_serial_subscriber));
+      subscriber->handle = msg->handle;
+      stream->subscribers = g_list_append(stream->subscribers, subscriber);
+    }
+    /* Samples go where the subscription came from */
+    subscriber->datachannel = msg->datachannel;
+    subscriber->rate = rate;
+  } else if(subscriber != NULL) {
+    stream->subscribers = g_list_remove(stream->subscribers, subscriber);
+    g_free(subscriber);
+  }
+  rate = janus_serial_stream_rate(stream);
+  if(stream != NULL) {
+    stream->rate = rate;
+    if(rate == 0)
+      g_hash_table_remove(port->streams, GINT_TO_POINTER(sensor));
+  }
+  janus_serial_stream_program(port, msg, sensor, rate);
+  janus_mutex_unlock(&port->streams_mutex);
+  return 0;
+}
+
+/* A session is going away: drop all its subscriptions, and slow the MCU
+ * down (or stop it) where it was the most demanding subscriber */
+static void janus_serial_stream_unsubscribe_all(janus_plugin_session *handle) {
+  GHashTableIter piter;
+  gpointer value;
+  g_hash_table_iter_init(&piter, ports);
+  while(g_hash_table_iter_next(&piter, NULL, &value)) {
+    janus_serial_port *port = (janus_serial_port *)value;
+    janus_mutex_lock(&port->streams_mutex);
+    GHashTableIter siter;
+    g_hash_table_iter_init(&siter, port->streams);
+    while(g_hash_table_iter_next(&siter, NULL, &value)) {
+      janus_serial_stream *stream = (janus_serial_stream *)value;
+      GList *sl = stream->subscribers;
+      while(sl && ((janus_serial_subscriber *)sl->data)->handle != handle)
+        sl = sl->next;
+      if(sl == NULL)
+        continue;
+      g_free(sl->data);
+      stream->subscribers = g_list_delete_link(stream->subscribers, sl);
+      guint rate = janus_serial_stream_rate(stream);
+      if(rate == stream->rate)
+        continue;
+      int sensor = stream->id;
+      stream->rate = rate;
+      if(rate == 0)
+        g_hash_table_iter_remove(&siter);
+      /* Nobody will be waiting for the reply to this one */
+      janus_serial_message *msg = g_malloc0(sizeof(janus_serial_message));
+      msg->body = json_object();
+      msg->port = port;
+      msg->queued = janus_get_monotonic_time();
+      janus_serial_stream_program(port, msg, sensor, rate);
+    }
+    janus_mutex_unlock(&port->streams_mutex);
+  }
+}
+
+/* A sample of a sensor came in: send it to all the subscribers that are
+ * due one (serialized once for the DataChannels, as a copy for events) */
+static void janus_serial_stream_deliver(janus_serial_port *port, int id, json_t *sample) {
+  char *text = NULL;
+  gint64 now = janus_get_monotonic_time();
+  janus_mutex_lock(&port->streams_mutex);
+  janus_serial_stream *stream = g_hash_table_lookup(port->streams, GINT_TO_POINTER(id));
+  if(stream == NULL) {
+    janus_mutex_unlock(&port->streams_mutex);
+    JANUS_LOG(LOG_HUGE, "[%s] Dropping sample of sensor %d, nobody subscribed\n", port->name, id);
+    return;
+  }
+  GList *sl = stream->subscribers;
+  while(sl) {
+    janus_serial_subscriber *subscriber = (janus_serial_subscriber *)sl->data;
+    sl = sl->next;
+    janus_serial_session *session = (janus_serial_session *)subscriber->handle->plugin_handle;
+    if(session == NULL || session->destroyed || subscriber->handle->stopped)
+      continue;
+    /* The MCU samples at the fastest rate asked for: slower subscribers
+     * skip samples (with some slack, the MCU clock isn't ours) */
+    if(subscriber->last_sent != 0 && now - subscriber->last_sent < (gint64)subscriber->rate*900)
+      continue;
+    if(json_object_get(sample, "device") == NULL)
+      json_object_set_new(sample, "device", json_string(port->name));
+    subscriber->last_sent = now;
+    if(subscriber->datachannel) {
+      if(text == NULL)
+        text = json_dumps(sample, JSON_COMPACT | JSON_PRESERVE_ORDER);
+      gateway->relay_data(subscriber->handle, text, strlen(text));
+    } else {
+      int ret = gateway->push_event_json(subscriber->handle, &janus_serial_plugin, NULL, json_deep_copy(sample), NULL, NULL);
+      JANUS_LOG(LOG_HUGE, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
+    }
+  }
+  janus_mutex_unlock(&port->streams_mutex);
+  g_free(text);
+}
@@ -0,0 +1,309 @@
+/*
+ * bench.c
+ *
+ *  End-to-end benchmark of the serial plugin: the plugin is linked in and
+ *  driven through janus_serial_handle_message as the gateway would, with
+ *  the gateway callbacks timing the replies. Point it to a board or, more
+ *  usefully, to the simulator (test/simulator.c):
+ *
+ *    ./serial-sim -l /tmp/ttySIM -L read=2:1 &
+ *    ./serial-bench -d /tmp/ttySIM -r 500 -n 10000
+ *
+ *  Requests are sent open loop at the given rate (so that a slow device
+ *  shows up as latency rather than as a lower request rate), round robin
+ *  on a number of sessions, and the report has throughput and latency
+ *  percentiles of the replies. Requests are passed as JSON objects
+ *  (handle_message_json) unless -T is given, in which case they go as
+ *  text the way older gateways used to pass them.
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o serial-bench test/bench.c plugin/libjanus_serial.c \
+ *        janus-gateway/config.c janus-gateway/utils.c janus-gateway/apierror.c \
+ *        janus-gateway/timer.c \
+ *        $(pkg-config --cflags --libs glib-2.0 jansson) -lm -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "../janus-gateway/plugin.h"
+#include "../janus-gateway/debug.h"
+#include "../janus-gateway/utils.h"
+#include "../janus-gateway/timer.h"
+
+/* What the gateway would provide */
+int janus_log_level = LOG_ERR;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+janus_plugin_result *janus_plugin_result_new(janus_plugin_result_type type, const char *content) {
+	janus_plugin_result *result = (janus_plugin_result *)g_malloc0(sizeof(janus_plugin_result));
+	result->type = type;
+	result->content = content ? g_strdup(content) : NULL;
+	return result;
+}
+
+void janus_plugin_result_destroy(janus_plugin_result *result) {
+	if(result == NULL)
+		return;
+	g_free(result->content);
+	g_free(result);
+}
+
+/* The plugin, linked in */
+janus_plugin *create(void);
+
+/* Requests in flight, indexed by transaction (which is just the index) */
+static gint64 *sent, *latency;
+static guint total, warmup;
+static volatile gint answered = 0, errors = 0, samples = 0;
+
+static int bench_push_event(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, const char *message, const char *sdp_type, const char *sdp) {
+	gint64 now = janus_get_monotonic_time();
+	if(transaction == NULL) {
+		/* Telemetry sample, not a reply */
+		g_atomic_int_inc(&samples);
+		return 0;
+	}
+	guint i = (guint)strtoul(transaction, NULL, 10);
+	if(i >= total)
+		return 0;
+	latency[i] = now - sent[i];
+	if(message != NULL && strstr(message, "error_code") != NULL)
+		g_atomic_int_inc(&errors);
+	g_atomic_int_inc(&answered);
+	return 0;
+}
+
+static int bench_push_event_json(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, json_t *message, const char *sdp_type, const char *sdp) {
+	/* As the gateway would, serialize it once */
+	char *text = message ? json_dumps(message, JSON_COMPACT | JSON_PRESERVE_ORDER) : NULL;
+	if(message)
+		json_decref(message);
+	int ret = bench_push_event(handle, plugin, transaction, text, sdp_type, sdp);
+	free(text);
+	return ret;
+}
+
+static void bench_relay_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
+}
+
+static void bench_relay_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
+}
+
+static void bench_relay_data(janus_plugin_session *handle, char *buf, int len) {
+}
+
+static void bench_close_pc(janus_plugin_session *handle) {
+}
+
+static void bench_end_session(janus_plugin_session *handle) {
+}
+
+static janus_callbacks bench_callbacks = {
+	.push_event = bench_push_event,
+	.relay_rtp = bench_relay_rtp,
+	.relay_rtcp = bench_relay_rtcp,
+	.relay_data = bench_relay_data,
+	.close_pc = bench_close_pc,
+	.end_session = bench_end_session,
+	.push_event_json = bench_push_event_json,
+};
+
+static int compare_latency(const void *a, const void *b) {
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Nearest rank percentile of sorted values */
+static double percentile(gint64 *values, guint count, double p) {
+	if(count == 0)
+		return 0;
+	guint rank = (guint)ceil(p/100.0*count);
+	if(rank < 1)
+		rank = 1;
+	return values[rank-1]/1000.0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s -d device [options]\n"
+		"  -d device   tty of the board (or of the simulator)\n"
+		"  -r rate     requests per second (default 100, 0 as fast as possible)\n"
+		"  -n count    requests to send (default 1000)\n"
+		"  -w count    requests to leave out of the statistics (default 10)\n"
+		"  -s count    sessions to spread the requests on (default 1)\n"
+		"  -m json     request to send (default {\"command\":2,\"id\":1})\n"
+		"  -p proto    wire protocol, binary or json (default binary)\n"
+		"  -b baud     baudrate (default 115200)\n"
+		"  -t seconds  how long to wait for the last replies (default 5)\n"
+		"  -v level    plugin log level (default 2, errors only)\n"
+		"  -T          pass requests as text (handle_message) rather than as JSON\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	const char *device = NULL, *message = "{\"command\":2,\"id\":1}", *protocol = "binary";
+	double rate = 100;
+	guint sessions_num = 1;
+	int baudrate = 115200, wait = 5;
+	gboolean as_text = FALSE;
+	total = 1000;
+	warmup = 10;
+	int opt;
+	while((opt = getopt(argc, argv, "d:r:n:w:s:m:p:b:t:v:Th")) != -1) {
+		switch(opt) {
+			case 'd': device = optarg; break;
+			case 'r': rate = atof(optarg); break;
+			case 'n': total = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 's': sessions_num = atoi(optarg); break;
+			case 'm': message = optarg; break;
+			case 'p': protocol = optarg; break;
+			case 'b': baudrate = atoi(optarg); break;
+			case 't': wait = atoi(optarg); break;
+			case 'v': janus_log_level = atoi(optarg); break;
+			case 'T': as_text = TRUE; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(device == NULL || total == 0 || sessions_num == 0 || warmup >= total) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* As the gateway would, parse the request once */
+	json_error_t error;
+	json_t *request = json_loads(message, 0, &error);
+	if(request == NULL || !json_is_object(request)) {
+		fprintf(stderr, "Invalid request %s\n", message);
+		return 1;
+	}
+
+	/* The plugin reads its configuration from a folder */
+	char *config_path = g_strdup("/tmp/serial-bench-XXXXXX");
+	if(mkdtemp(config_path) == NULL) {
+		fprintf(stderr, "Error creating the configuration folder\n");
+		return 1;
+	}
+	char *config_file = g_strdup_printf("%s/janus.plugin.serial.cfg", config_path);
+	FILE *config = fopen(config_file, "wt");
+	if(config == NULL) {
+		fprintf(stderr, "Error creating %s\n", config_file);
+		return 1;
+	}
+	fprintf(config, "[general]\n\n[port-1]\nname = bench\nportname = %s\nbaudrate = %d\nprotocol = %s\nvmin = 0\nvtime = 0\n",
+		device, baudrate, protocol);
+	fclose(config);
+
+	/* The plugin frees sessions lazily with the gateway timers */
+	janus_timers_start();
+	janus_plugin *plugin = create();
+	if(plugin->init(&bench_callbacks, config_path) < 0) {
+		fprintf(stderr, "Error initializing the plugin on %s\n", device);
+		return 1;
+	}
+	janus_plugin_session *handles = g_malloc0(sessions_num * sizeof(janus_plugin_session));
+	guint i = 0;
+	for(i = 0; i < sessions_num; i++) {
+		int error = 0;
+		plugin->create_session(&handles[i], &error);
+		if(error != 0) {
+			fprintf(stderr, "Error creating session %u: %d\n", i, error);
+			return 1;
+		}
+	}
+	/* Give the protocol negotiation a chance to complete */
+	g_usleep(G_USEC_PER_SEC/2);
+
+	sent = g_malloc0(total * sizeof(gint64));
+	latency = g_malloc0(total * sizeof(gint64));
+	for(i = 0; i < total; i++)
+		latency[i] = -1;
+	if(plugin->handle_message_json == NULL)
+		as_text = TRUE;
+	printf("Sending %u requests at %s%.0f/s on %u session(s) to %s (%s, as %s): %s\n",
+		total, rate > 0 ? "" : "max ", rate, sessions_num, device, protocol, as_text ? "text" : "JSON", message);
+	gint64 start = janus_get_monotonic_time(), first = 0;
+	int rejected = 0;
+	for(i = 0; i < total; i++) {
+		if(rate > 0) {
+			gint64 due = start + (gint64)(i * G_USEC_PER_SEC / rate);
+			gint64 now = janus_get_monotonic_time();
+			if(due > now)
+				g_usleep(due - now);
+		}
+		if(i == warmup)
+			first = janus_get_monotonic_time();
+		char *transaction = g_strdup_printf("%u", i);
+		sent[i] = janus_get_monotonic_time();
+		/* The plugin owns what we pass it (and may modify the object) */
+		janus_plugin_result *result = as_text ?
+			plugin->handle_message(&handles[i % sessions_num], transaction,
+				json_dumps(request, JSON_COMPACT | JSON_PRESERVE_ORDER), NULL, NULL) :
+			plugin->handle_message_json(&handles[i % sessions_num], transaction,
+				json_deep_copy(request), NULL, NULL);
+		if(result == NULL || result->type != JANUS_PLUGIN_OK_WAIT) {
+			/* Rejected synchronously */
+			rejected++;
+			latency[i] = janus_get_monotonic_time() - sent[i];
+		}
+		janus_plugin_result_destroy(result);
+	}
+	gint64 end_sending = janus_get_monotonic_time();
+	/* Wait for the stragglers */
+	gint64 deadline = end_sending + (gint64)wait * G_USEC_PER_SEC;
+	while((guint)g_atomic_int_get(&answered) + rejected < total && janus_get_monotonic_time() < deadline)
+		g_usleep(1000);
+
+	/* Only the replies to requests after the warmup count */
+	gint64 *values = g_malloc0(total * sizeof(gint64));
+	guint count = 0, lost = 0;
+	gint64 last = first;
+	for(i = warmup; i < total; i++) {
+		if(latency[i] < 0) {
+			lost++;
+			continue;
+		}
+		values[count++] = latency[i];
+		if(sent[i] + latency[i] > last)
+			last = sent[i] + latency[i];
+	}
+	qsort(values, count, sizeof(gint64), compare_latency);
+	double elapsed = (last - first)/(double)G_USEC_PER_SEC;
+	printf("Sent:       %u in %.3f s (%.1f/s)\n", total, (end_sending-start)/(double)G_USEC_PER_SEC,
+		total/((end_sending-start)/(double)G_USEC_PER_SEC));
+	printf("Answered:   %d (%d errors, %d rejected, %u lost), %d samples\n",
+		g_atomic_int_get(&answered), g_atomic_int_get(&errors), rejected, lost, g_atomic_int_get(&samples));
+	printf("Throughput: %.1f replies/s\n", elapsed > 0 ? count/elapsed : 0);
+	printf("Latency:    p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+		percentile(values, count, 50), percentile(values, count, 99),
+		percentile(values, count, 99.9), count ? values[count-1]/1000.0 : 0);
+
+	/* Show what the plugin thinks of it */
+	char *info = plugin->query_session(&handles[0]);
+	if(info != NULL && janus_log_level >= LOG_VERB)
+		printf("%s\n", info);
+	free(info);
+	for(i = 0; i < sessions_num; i++) {
+		int error = 0;
+		plugin->destroy_session(&handles[i], &error);
+	}
+	plugin->destroy();
+	janus_timers_stop();
+	unlink(config_file);
+	rmdir(config_path);
+	g_free(config_file);
+	g_free(config_path);
+	g_free(handles);
+	json_decref(request);
+	g_free(values);
+	g_free(sent);
+	g_free(latency);
+	return lost > 0 ? 2 : 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * dispatch_bench.c
+ *
+ *  Micro-benchmark of how the core finds out which request ("janus"
+ *  verb) it got, on the Janus API and on the admin API: the chains of
+ *  strcasecmp it used to go through, in the same order, compared to the
+ *  perfect hash lookup of apiverb.c. It also checks that the lookup maps
+ *  every verb (in any case) to itself and nothing else to a verb, and
+ *  with -g it searches for a new seed, e.g., after verbs have been added
+ *  to apiverb.h (the slots table in apiverb.c must be updated accordingly).
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o dispatch-bench test/dispatch_bench.c janus-gateway/apiverb.c \
+ *        $(pkg-config --cflags --libs glib-2.0)
+ *
+ *  Run:
+ *    ./dispatch-bench [-n lookups] [-g]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+
+#include <glib.h>
+
+#include "../janus-gateway/apiverb.h"
+
+/* The Janus API chain, as janus_process_incoming_request had it */
+static int chain_janus(const char *verb) {
+	if(!strcasecmp(verb, "info"))
+		return JANUS_API_VERB_INFO;
+	if(!strcasecmp(verb, "ping"))
+		return JANUS_API_VERB_PING;
+	if(!strcasecmp(verb, "rmqtest"))
+		return JANUS_API_VERB_RMQTEST;
+	if(!strcasecmp(verb, "create"))
+		return JANUS_API_VERB_CREATE;
+	if(!strcasecmp(verb, "keepalive"))
+		return JANUS_API_VERB_KEEPALIVE;
+	if(!strcasecmp(verb, "attach"))
+		return JANUS_API_VERB_ATTACH;
+	if(!strcasecmp(verb, "destroy"))
+		return JANUS_API_VERB_DESTROY;
+	if(!strcasecmp(verb, "detach"))
+		return JANUS_API_VERB_DETACH;
+	if(!strcasecmp(verb, "message"))
+		return JANUS_API_VERB_MESSAGE;
+	if(!strcasecmp(verb, "trickle"))
+		return JANUS_API_VERB_TRICKLE;
+	return JANUS_API_VERB_UNKNOWN;
+}
+
+/* ... and the admin API one, as janus_process_incoming_admin_request had it */
+static int chain_admin(const char *verb) {
+	if(!strcasecmp(verb, "info"))
+		return JANUS_API_VERB_INFO;
+	if(!strcasecmp(verb, "get_status"))
+		return JANUS_API_VERB_GET_STATUS;
+	if(!strcasecmp(verb, "set_log_level"))
+		return JANUS_API_VERB_SET_LOG_LEVEL;
+	if(!strcasecmp(verb, "set_locking_debug"))
+		return JANUS_API_VERB_SET_LOCKING_DEBUG;
+	if(!strcasecmp(verb, "set_log_timestamps"))
+		return JANUS_API_VERB_SET_LOG_TIMESTAMPS;
+	if(!strcasecmp(verb, "set_log_colors"))
+		return JANUS_API_VERB_SET_LOG_COLORS;
+	if(!strcasecmp(verb, "set_libnice_debug"))
+		return JANUS_API_VERB_SET_LIBNICE_DEBUG;
+	if(!strcasecmp(verb, "set_max_nack_queue"))
+		return JANUS_API_VERB_SET_MAX_NACK_QUEUE;
+	if(!strcasecmp(verb, "list_sessions"))
+		return JANUS_API_VERB_LIST_SESSIONS;
+	if(!strcasecmp(verb, "add_token"))
+		return JANUS_API_VERB_ADD_TOKEN;
+	if(!strcasecmp(verb, "list_tokens"))
+		return JANUS_API_VERB_LIST_TOKENS;
+	if(!strcasecmp(verb, "allow_token"))
+		return JANUS_API_VERB_ALLOW_TOKEN;
+	if(!strcasecmp(verb, "disallow_token"))
+		return JANUS_API_VERB_DISALLOW_TOKEN;
+	if(!strcasecmp(verb, "remove_token"))
+		return JANUS_API_VERB_REMOVE_TOKEN;
+	if(!strcasecmp(verb, "list_handles"))
+		return JANUS_API_VERB_LIST_HANDLES;
+	if(!strcasecmp(verb, "handle_info"))
+		return JANUS_API_VERB_HANDLE_INFO;
+	return JANUS_API_VERB_UNKNOWN;
+}
+
+/* Look for a seed that puts every verb in a slot of its own */
+static int search_seed(void) {
+	int bits = 0;
+	for(bits = 1; bits <= 8; bits++) {
+		if((1 << bits) < JANUS_API_VERBS-1)
+			continue;
+		guint32 seed = 0;
+		for(seed = 0; seed < 10000000; seed++) {
+			guint64 used[4] = { 0, 0, 0, 0 };
+			int verb = 0;
+			for(verb = JANUS_API_VERB_UNKNOWN+1; verb < JANUS_API_VERBS; verb++) {
+				guint32 slot = janus_api_verb_hash(janus_api_verb_name(verb), seed) >> (32 - bits);
+				if(used[slot/64] & (G_GUINT64_CONSTANT(1) << (slot%64)))
+					break;
+				used[slot/64] |= (G_GUINT64_CONSTANT(1) << (slot%64));
+			}
+			if(verb < JANUS_API_VERBS)
+				continue;
+			printf("#define JANUS_API_VERB_SEED\t\t%u\n#define JANUS_API_VERB_BITS\t\t%d\n\n", seed, bits);
+			/* The slots, ready to be pasted in apiverb.c */
+			guint32 slot = 0;
+			for(slot = 0; slot < (1u << bits); slot++) {
+				for(verb = JANUS_API_VERB_UNKNOWN+1; verb < JANUS_API_VERBS; verb++) {
+					if((janus_api_verb_hash(janus_api_verb_name(verb), seed) >> (32 - bits)) != slot)
+						continue;
+					char *upper = g_ascii_strup(janus_api_verb_name(verb), -1);
+					printf("\t[%u] = JANUS_API_VERB_%s,\n", slot, upper);
+					g_free(upper);
+				}
+			}
+			return 0;
+		}
+	}
+	fprintf(stderr, "No seed found\n");
+	return 1;
+}
+
+/* The lookup must find every verb, whatever the case, and nothing else */
+static int check(void) {
+	int errors = 0, verb = 0;
+	for(verb = JANUS_API_VERB_UNKNOWN+1; verb < JANUS_API_VERBS; verb++) {
+		const char *name = janus_api_verb_name(verb);
+		char *upper = g_ascii_strup(name, -1);
+		if(janus_get_api_verb(name) != (janus_api_verb)verb || janus_get_api_verb(upper) != (janus_api_verb)verb) {
+			fprintf(stderr, "Lookup of %s (%s) failed\n", name, upper);
+			errors++;
+		}
+		/* Prefixes and extensions of a verb are not verbs */
+		char *longer = g_strdup_printf("%sx", name);
+		char *shorter = g_strndup(name, strlen(name)-1);
+		if(janus_get_api_verb(longer) != JANUS_API_VERB_UNKNOWN || janus_get_api_verb(shorter) != JANUS_API_VERB_UNKNOWN) {
+			fprintf(stderr, "Lookup of %s or %s didn't fail\n", longer, shorter);
+			errors++;
+		}
+		g_free(upper);
+		g_free(longer);
+		g_free(shorter);
+	}
+	if(janus_get_api_verb("") != JANUS_API_VERB_UNKNOWN || janus_get_api_verb(NULL) != JANUS_API_VERB_UNKNOWN) {
+		fprintf(stderr, "Lookup of an empty verb didn't fail\n");
+		errors++;
+	}
+	return errors;
+}
+
+static volatile int sink = 0;
+
+static double bench_chain(const char **verbs, int count, int n, int (*chain)(const char *)) {
+	gint64 start = g_get_monotonic_time();
+	int i = 0;
+	for(i = 0; i < n; i++)
+		sink += chain(verbs[i % count]);
+	return (g_get_monotonic_time() - start)*1000.0/n;
+}
+
+static double bench_lookup(const char **verbs, int count, int n) {
+	gint64 start = g_get_monotonic_time();
+	int i = 0;
+	for(i = 0; i < n; i++)
+		sink += janus_get_api_verb(verbs[i % count]);
+	return (g_get_monotonic_time() - start)*1000.0/n;
+}
+
+int main(int argc, char *argv[]) {
+	int n = 10000000, opt;
+	gboolean generate = FALSE;
+	while((opt = getopt(argc, argv, "n:gh")) != -1) {
+		switch(opt) {
+			case 'n': n = atoi(optarg); break;
+			case 'g': generate = TRUE; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n lookups] [-g]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(generate)
+		return search_seed();
+	if(n <= 0)
+		return 1;
+	if(check() > 0)
+		return 2;
+
+	/* What a session mostly sends, and what the admin API gets */
+	const char *janus_verbs[] = { "keepalive", "message", "trickle", "trickle", "trickle", "message", "attach", "detach", "create", "destroy" };
+	const char *admin_verbs[] = { "get_status", "list_sessions", "list_handles", "handle_info", "list_tokens", "set_log_level" };
+	const char *last_verb[] = { "trickle" };
+	printf("%d lookups\n", n);
+	printf("%-26s %8s %8s\n", "", "strcasecmp", "hash");
+	printf("%-26s %7.1fns %7.1fns\n", "Janus API (typical mix)",
+		bench_chain(janus_verbs, G_N_ELEMENTS(janus_verbs), n, chain_janus),
+		bench_lookup(janus_verbs, G_N_ELEMENTS(janus_verbs), n));
+	printf("%-26s %7.1fns %7.1fns\n", "Janus API (trickle only)",
+		bench_chain(last_verb, 1, n, chain_janus),
+		bench_lookup(last_verb, 1, n));
+	printf("%-26s %7.1fns %7.1fns\n", "Admin API",
+		bench_chain(admin_verbs, G_N_ELEMENTS(admin_verbs), n, chain_admin),
+		bench_lookup(admin_verbs, G_N_ELEMENTS(admin_verbs), n));
+	return 0;
+}
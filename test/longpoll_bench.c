@@ -0,0 +1,381 @@
+/*
+ * longpoll_bench.c
+ *
+ *  Connection scaling benchmark of the HTTP transport: opens a number of
+ *  connections to the gateway, creates a session on each, and then keeps
+ *  a long poll pending on all of them (re-polling whenever one returns,
+ *  e.g., with a keep-alive), as dashboards do. While the long polls are
+ *  idle it samples memory, CPU and threads of the gateway process, which
+ *  should stay flat however many they are when the webserver suspends
+ *  them (threads = N or epoll = yes in the [webserver] section) rather
+ *  than giving each a thread (threads = unlimited).
+ *
+ *    ./longpoll-bench -p $(pidof janus) -n 10000 -t 120
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o longpoll-bench test/longpoll_bench.c $(pkg-config --cflags --libs jansson)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <jansson.h>
+
+#define BUFFER_SIZE	8192
+
+typedef enum bench_state {
+	BENCH_CONNECTING = 0,
+	BENCH_CREATING,
+	BENCH_POLLING,
+	BENCH_CLOSED
+} bench_state;
+
+typedef struct bench_connection {
+	int fd;
+	bench_state state;
+	uint64_t session_id;
+	char buffer[BUFFER_SIZE];
+	size_t len;
+} bench_connection;
+
+static const char *host = "127.0.0.1", *port = "8088", *path = "/janus";
+static int epfd = -1;
+static unsigned long responses = 0, events = 0, errors = 0, closed = 0, polling = 0;
+
+static int64_t monotonic_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int bench_send(bench_connection *c, const char *request, size_t len) {
+	/* Requests are tiny, a short write means the gateway isn't reading */
+	ssize_t sent = send(c->fd, request, len, MSG_NOSIGNAL);
+	return sent == (ssize_t)len ? 0 : -1;
+}
+
+static int bench_create(bench_connection *c) {
+	const char *body = "{\"janus\":\"create\",\"transaction\":\"longpoll-bench\"}";
+	char request[512];
+	int len = snprintf(request, sizeof(request),
+		"POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+		path, host, strlen(body), body);
+	c->state = BENCH_CREATING;
+	return bench_send(c, request, len);
+}
+
+static int bench_poll(bench_connection *c) {
+	char request[512];
+	int len = snprintf(request, sizeof(request),
+		"GET %s/%"PRIu64"?maxev=1&rid=%lld HTTP/1.1\r\nHost: %s\r\n\r\n",
+		path, c->session_id, (long long)monotonic_us(), host);
+	c->state = BENCH_POLLING;
+	return bench_send(c, request, len);
+}
+
+static void bench_close(bench_connection *c) {
+	if(c->fd < 0)
+		return;
+	if(c->state == BENCH_POLLING)
+		polling--;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->state = BENCH_CLOSED;
+	closed++;
+}
+
+/* Returns the length of a complete response in the buffer, 0 if we need
+ * more, -1 if it's broken; the body is returned as well */
+static ssize_t bench_parse(bench_connection *c, int *status, const char **body, size_t *body_len) {
+	c->buffer[c->len] = '\0';
+	char *end = strstr(c->buffer, "\r\n\r\n");
+	if(end == NULL)
+		return c->len >= BUFFER_SIZE-1 ? -1 : 0;
+	if(sscanf(c->buffer, "HTTP/1.%*d %d", status) != 1)
+		return -1;
+	size_t content_length = 0;
+	char *header = strcasestr(c->buffer, "\r\nContent-Length:");
+	if(header != NULL && header < end)
+		content_length = strtoul(header + strlen("\r\nContent-Length:"), NULL, 10);
+	size_t headers_len = end + 4 - c->buffer;
+	if(headers_len + content_length >= BUFFER_SIZE)
+		return -1;
+	if(c->len < headers_len + content_length)
+		return 0;
+	*body = c->buffer + headers_len;
+	*body_len = content_length;
+	return headers_len + content_length;
+}
+
+static void bench_response(bench_connection *c, int status, const char *body, size_t body_len) {
+	responses++;
+	if(status != 200) {
+		errors++;
+		bench_close(c);
+		return;
+	}
+	json_error_t error;
+	json_t *root = json_loadb(body, body_len, 0, &error);
+	const char *janus = root ? json_string_value(json_object_get(root, "janus")) : NULL;
+	if(c->state == BENCH_CREATING) {
+		json_t *data = root ? json_object_get(root, "data") : NULL;
+		json_t *id = data ? json_object_get(data, "id") : NULL;
+		if(janus == NULL || strcmp(janus, "success") || !json_is_integer(id)) {
+			errors++;
+			json_decref(root);
+			bench_close(c);
+			return;
+		}
+		c->session_id = json_integer_value(id);
+		polling++;
+	} else {
+		/* Anything but a keep-alive is an event */
+		if(janus == NULL || strcmp(janus, "keepalive"))
+			events++;
+	}
+	json_decref(root);
+	if(bench_poll(c) < 0) {
+		errors++;
+		bench_close(c);
+	}
+}
+
+static void bench_readable(bench_connection *c) {
+	while(c->fd >= 0) {
+		ssize_t got = recv(c->fd, c->buffer + c->len, BUFFER_SIZE-1 - c->len, 0);
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(got <= 0) {
+			bench_close(c);
+			return;
+		}
+		c->len += got;
+		while(c->fd >= 0 && c->len > 0) {
+			int status = 0;
+			const char *body = NULL;
+			size_t body_len = 0;
+			ssize_t len = bench_parse(c, &status, &body, &body_len);
+			if(len == 0)
+				break;
+			if(len < 0) {
+				errors++;
+				bench_close(c);
+				return;
+			}
+			bench_response(c, status, body, body_len);
+			memmove(c->buffer, c->buffer + len, c->len - len);
+			c->len -= len;
+		}
+	}
+}
+
+static int bench_connect(bench_connection *c, struct addrinfo *address) {
+	c->fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(c->fd < 0)
+		return -1;
+	int on = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if(connect(c->fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	c->state = BENCH_CONNECTING;
+	c->len = 0;
+	struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &event);
+	return 0;
+}
+
+/* What we look at in the gateway process */
+typedef struct bench_sample {
+	long rss_kb;
+	long threads;
+	unsigned long long cpu_ticks;
+} bench_sample;
+
+static int bench_sample_process(int pid, bench_sample *sample) {
+	memset(sample, 0, sizeof(*sample));
+	char name[64];
+	snprintf(name, sizeof(name), "/proc/%d/status", pid);
+	FILE *file = fopen(name, "rt");
+	if(file == NULL)
+		return -1;
+	char line[256];
+	while(fgets(line, sizeof(line), file)) {
+		if(!strncmp(line, "VmRSS:", 6))
+			sample->rss_kb = atol(line + 6);
+		else if(!strncmp(line, "Threads:", 8))
+			sample->threads = atol(line + 8);
+	}
+	fclose(file);
+	snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+	file = fopen(name, "rt");
+	if(file == NULL)
+		return -1;
+	char stat[1024];
+	size_t len = fread(stat, 1, sizeof(stat)-1, file);
+	fclose(file);
+	stat[len] = '\0';
+	/* Fields after the command name, which may have spaces in it */
+	char *fields = strrchr(stat, ')');
+	unsigned long long utime = 0, stime = 0;
+	if(fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+		return -1;
+	sample->cpu_ticks = utime + stime;
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -H host     gateway address (default 127.0.0.1)\n"
+		"  -P port     gateway HTTP port (default 8088)\n"
+		"  -b path     base path of the Janus API (default /janus)\n"
+		"  -n count    connections, each with a session and a long poll (default 10000)\n"
+		"  -r rate     new connections per second (default 1000)\n"
+		"  -t seconds  how long to keep the long polls once all are pending (default 60)\n"
+		"  -p pid      gateway process to sample (memory, CPU, threads)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int count = 10000, duration = 60, pid = 0, opt;
+	double rate = 1000;
+	while((opt = getopt(argc, argv, "H:P:b:n:r:t:p:h")) != -1) {
+		switch(opt) {
+			case 'H': host = optarg; break;
+			case 'P': port = optarg; break;
+			case 'b': path = optarg; break;
+			case 'n': count = atoi(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'p': pid = atoi(optarg); break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(count <= 0 || rate <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* We need a file descriptor per connection too */
+	struct rlimit fd_limits;
+	if(getrlimit(RLIMIT_NOFILE, &fd_limits) == 0) {
+		fd_limits.rlim_cur = fd_limits.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fd_limits);
+		getrlimit(RLIMIT_NOFILE, &fd_limits);
+		if(fd_limits.rlim_cur != RLIM_INFINITY && (rlim_t)count + 16 > fd_limits.rlim_cur)
+			fprintf(stderr, "Warning: only %llu file descriptors available\n", (unsigned long long)fd_limits.rlim_cur);
+	}
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *address = NULL;
+	if(getaddrinfo(host, port, &hints, &address) != 0 || address == NULL) {
+		fprintf(stderr, "Couldn't resolve %s:%s\n", host, port);
+		return 1;
+	}
+	epfd = epoll_create1(0);
+	bench_connection *connections = calloc(count, sizeof(bench_connection));
+	if(epfd < 0 || connections == NULL) {
+		fprintf(stderr, "Error preparing the connections\n");
+		return 1;
+	}
+	int i = 0;
+	for(i = 0; i < count; i++)
+		connections[i].fd = -1;
+
+	long ticks_per_second = sysconf(_SC_CLK_TCK);
+	bench_sample first, previous, sample;
+	int have_samples = pid > 0 && bench_sample_process(pid, &previous) == 0;
+	if(pid > 0 && !have_samples)
+		fprintf(stderr, "Can't sample process %d, only reporting the client side\n", pid);
+	printf("Opening %d connections to %s:%s%s at %.0f/s\n", count, host, port, path, rate);
+	printf("%6s %8s %8s %8s %8s %10s %8s %8s\n", "time", "open", "polling", "resp/s", "errors", "rss (MB)", "cpu (%)", "threads");
+
+	int opened = 0;
+	int64_t start = monotonic_us(), next_report = start + 1000000, all_pending = 0, end = 0;
+	unsigned long last_responses = 0;
+	double idle_cpu = 0;
+	int idle_samples = 0;
+	struct epoll_event ready[256];
+	while(end == 0 || monotonic_us() < end) {
+		int64_t now = monotonic_us();
+		/* Ramp up */
+		while(opened < count && opened < (now - start) * rate / 1000000) {
+			if(bench_connect(&connections[opened], address) < 0) {
+				errors++;
+				closed++;
+			}
+			opened++;
+		}
+		if(end == 0 && opened == count && polling + closed >= (unsigned long)count) {
+			all_pending = now;
+			end = now + (int64_t)duration * 1000000;
+			printf("All %lu long polls pending after %.1f s (%lu connections failed)\n",
+				polling, (now - start)/1000000.0, closed);
+			if(have_samples)
+				bench_sample_process(pid, &first);
+		}
+		int n = epoll_wait(epfd, ready, sizeof(ready)/sizeof(ready[0]), 10);
+		for(i = 0; i < n; i++) {
+			bench_connection *c = (bench_connection *)ready[i].data.ptr;
+			if(c->fd < 0)
+				continue;
+			if(c->state == BENCH_CONNECTING && (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+				int error = 0;
+				socklen_t len = sizeof(error);
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+				struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+				if(error != 0 || epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &event) < 0 || bench_create(c) < 0) {
+					errors++;
+					bench_close(c);
+				}
+				continue;
+			}
+			if(ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				bench_readable(c);
+		}
+		now = monotonic_us();
+		if(now >= next_report) {
+			double elapsed = (now - next_report + 1000000)/1000000.0;
+			printf("%6.0f %8lu %8lu %8.0f %8lu", (now - start)/1000000.0,
+				(unsigned long)opened - closed, polling, (responses - last_responses)/elapsed, errors);
+			if(have_samples && bench_sample_process(pid, &sample) == 0) {
+				double cpu = 100.0*(sample.cpu_ticks - previous.cpu_ticks)/ticks_per_second/elapsed;
+				printf(" %10.1f %8.1f %8ld", sample.rss_kb/1024.0, cpu, sample.threads);
+				if(all_pending > 0 && now > all_pending + 1000000) {
+					idle_cpu += cpu;
+					idle_samples++;
+				}
+				previous = sample;
+			}
+			printf("\n");
+			last_responses = responses;
+			next_report = now + 1000000;
+		}
+	}
+	printf("Responses: %lu (%lu events, %lu errors), %lu connections closed\n", responses, events, errors, closed);
+	if(have_samples && idle_samples > 0) {
+		printf("With %lu idle long polls: rss %.1f -> %.1f MB, %ld -> %ld threads, %.2f%% cpu on average\n",
+			polling, first.rss_kb/1024.0, previous.rss_kb/1024.0, first.threads, previous.threads, idle_cpu/idle_samples);
+	}
+	for(i = 0; i < count; i++)
+		bench_close(&connections[i]);
+	free(connections);
+	freeaddrinfo(address);
+	close(epfd);
+	return errors > 0 ? 2 : 0;
+}
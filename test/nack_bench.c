@@ -0,0 +1,173 @@
+/*
+ * nack_bench.c
+ *
+ *  Micro-benchmark of the RTCP NACK helpers: a stream with random losses
+ *  is fed to a janus_rtcp_seq_map, and every few packets a NACK for what's
+ *  missing is built, either the way it used to be (a GSList with a node per
+ *  lost packet, passed to janus_rtcp_nacks) or straight from the bitmap
+ *  (janus_rtcp_nacks_from_map), and parsed back either with
+ *  janus_rtcp_get_nacks (a GSList again) or janus_rtcp_get_nacks_array.
+ *  Both paths are checked against the losses that were simulated, and so
+ *  is the removal of the NACKs from a compound packet.
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o nack-bench test/nack_bench.c janus-gateway/rtcp.c \
+ *        $(pkg-config --cflags --libs glib-2.0)
+ *
+ *  Run:
+ *    ./nack-bench [-n packets] [-l loss%] [-w window] [-i interval]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <glib.h>
+
+#include "../janus-gateway/debug.h"
+#include "../janus-gateway/rtcp.h"
+
+/* What the gateway would provide */
+int janus_log_level = LOG_ERR;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+#define NACK_BUFFER	1500
+
+static int compare_seqs(const void *a, const void *b) {
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/* Sequence numbers are compared relative to the oldest in the window */
+static int same_seqs(uint16_t *a, int a_count, uint16_t *b, int b_count, uint16_t base) {
+	if(a_count != b_count)
+		return 0;
+	int i = 0;
+	for(i = 0; i < a_count; i++) {
+		a[i] -= base;
+		b[i] -= base;
+	}
+	qsort(a, a_count, sizeof(uint16_t), compare_seqs);
+	qsort(b, b_count, sizeof(uint16_t), compare_seqs);
+	return memcmp(a, b, a_count*sizeof(uint16_t)) == 0;
+}
+
+int main(int argc, char *argv[]) {
+	int packets = 1000000, window = 256, interval = 20, opt;
+	double loss = 5;
+	while((opt = getopt(argc, argv, "n:l:w:i:h")) != -1) {
+		switch(opt) {
+			case 'n': packets = atoi(optarg); break;
+			case 'l': loss = atof(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 'i': interval = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n packets] [-l loss%%] [-w window] [-i interval]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(packets <= 0 || window < 2 || window > JANUS_RTCP_SEQ_MAP_SIZE || interval <= 0 || loss < 0 || loss >= 100)
+		return 1;
+
+	/* Simulate the losses first, so that both paths see the same stream,
+	 * starting close to the wrap around of the sequence numbers */
+	guint8 *lost = g_malloc0(packets);
+	int i = 0, total_lost = 0;
+	srand(42);
+	for(i = 1; i < packets; i++) {
+		lost[i] = (rand() % 10000) < loss*100;
+		total_lost += lost[i];
+	}
+	uint16_t first = 65535 - 1000;
+	janus_rtcp_seq_map map;
+	janus_rtcp_seq_map_init(&map);
+	char list_packet[NACK_BUFFER], map_packet[NACK_BUFFER];
+	uint16_t expected[JANUS_RTCP_SEQ_MAP_SIZE], parsed[JANUS_RTCP_SEQ_MAP_SIZE];
+	gint64 list_build = 0, map_build = 0, list_parse = 0, map_parse = 0;
+	guint64 nacks = 0, seqs = 0, bytes = 0, mismatches = 0;
+	for(i = 0; i < packets; i++) {
+		uint16_t seq = first + i;
+		if(!lost[i])
+			janus_rtcp_seq_map_received(&map, seq);
+		if(i % interval != interval-1 || lost[i])
+			continue;
+		/* What we expect to NACK: the losses in the window */
+		int expected_count = 0, j = 0;
+		int oldest = MAX(0, i - (window-1));
+		for(j = oldest; j < i; j++) {
+			if(lost[j])
+				expected[expected_count++] = first + j;
+		}
+		/* The old way: a list node per lost packet */
+		gint64 start = g_get_monotonic_time();
+		GSList *list = NULL;
+		for(j = oldest; j < i; j++) {
+			if(lost[j])
+				list = g_slist_prepend(list, GUINT_TO_POINTER((guint16)(first + j)));
+		}
+		list = g_slist_reverse(list);
+		int list_len = list ? janus_rtcp_nacks(list_packet, sizeof(list_packet), list) : 0;
+		g_slist_free(list);
+		list_build += g_get_monotonic_time() - start;
+		/* The new way: straight from the bitmap */
+		start = g_get_monotonic_time();
+		int map_len = janus_rtcp_nacks_from_map(map_packet, sizeof(map_packet), &map, window);
+		map_build += g_get_monotonic_time() - start;
+		if(map_len <= 0) {
+			if(expected_count > 0)
+				mismatches++;
+			continue;
+		}
+		nacks++;
+		seqs += expected_count;
+		bytes += map_len;
+		/* Parse them back */
+		start = g_get_monotonic_time();
+		GSList *got = janus_rtcp_get_nacks(list_len > 0 ? list_packet : map_packet, list_len > 0 ? list_len : map_len);
+		int list_count = g_slist_length(got);
+		g_slist_free(got);
+		list_parse += g_get_monotonic_time() - start;
+		start = g_get_monotonic_time();
+		int count = janus_rtcp_get_nacks_array(map_packet, map_len, parsed, G_N_ELEMENTS(parsed));
+		map_parse += g_get_monotonic_time() - start;
+		if(!same_seqs(parsed, count, expected, expected_count, first + oldest) || list_count < 1)
+			mismatches++;
+	}
+	g_free(lost);
+
+	/* Removing the NACKs from a compound packet (RR, NACK, NACK, PLI) */
+	char compound[64];
+	memset(compound, 0, sizeof(compound));
+	rtcp_header *rtcp = (rtcp_header *)compound;
+	rtcp->version = 2;
+	rtcp->type = RTCP_RR;
+	rtcp->length = htons(1);
+	janus_rtcp_seq_map_init(&map);
+	janus_rtcp_seq_map_received(&map, 100);
+	janus_rtcp_seq_map_received(&map, 103);
+	int nack_len = janus_rtcp_nacks_from_map(compound+8, 16, &map, 16);
+	memcpy(compound+8+nack_len, compound+8, nack_len);
+	janus_rtcp_pli(compound+8+2*nack_len, 12);
+	int compound_len = 8+2*nack_len+12;
+	int removed_len = janus_rtcp_remove_nacks(compound, compound_len);
+	rtcp_header *pli = (rtcp_header *)(compound+8);
+	if(nack_len != 16 || removed_len != 20 || pli->type != RTCP_PSFB || janus_rtcp_get_nacks_array(compound, removed_len, parsed, 16) != 0) {
+		fprintf(stderr, "Removing the NACKs failed (%d -> %d bytes)\n", compound_len, removed_len);
+		mismatches++;
+	}
+
+	printf("%d packets, %d lost (%.1f%%), NACKs every %d packets on the last %d\n",
+		packets, total_lost, 100.0*total_lost/packets, interval, window);
+	printf("%"SCNu64" NACKs, %.1f lost packets and %.1f bytes each\n",
+		nacks, nacks ? (double)seqs/nacks : 0, nacks ? (double)bytes/nacks : 0);
+	printf("%-8s %12s %12s\n", "", "GSList", "bitmap");
+	printf("%-8s %10.1fns %10.1fns\n", "Build", nacks ? list_build*1000.0/nacks : 0, nacks ? map_build*1000.0/nacks : 0);
+	printf("%-8s %10.1fns %10.1fns\n", "Parse", nacks ? list_parse*1000.0/nacks : 0, nacks ? map_parse*1000.0/nacks : 0);
+	if(mismatches > 0) {
+		printf("%"SCNu64" mismatches!\n", mismatches);
+		return 2;
+	}
+	return 0;
+}
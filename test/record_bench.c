@@ -0,0 +1,199 @@
+/*
+ * record_bench.c
+ *
+ *  Micro-benchmark of the recorder: frames like those of a video stream
+ *  are saved with janus_recorder_save_frame, either written right away
+ *  by the thread saving them (as it used to be) or queued for the writer
+ *  thread of an asynchronous recorder, and the time each call takes is
+ *  reported (average, 99th percentile and worst), since that's the time
+ *  the media thread is kept from relaying packets. The recordings are
+ *  then parsed back, to check that every frame that wasn't dropped is on
+ *  file, in order and intact.
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o record-bench test/record_bench.c janus-gateway/record.c \
+ *        janus-gateway/utils.c $(pkg-config --cflags --libs glib-2.0 jansson)
+ *
+ *  Run:
+ *    ./record-bench [-d folder] [-n frames] [-s size] [-r rate] [-b buffer KB]
+ *        [-f flush ms] [-y none|close|<ms>]
+ *  (with -r 0, the default, frames are saved as fast as possible)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+#include "../janus-gateway/debug.h"
+#include "../janus-gateway/record.h"
+#include "../janus-gateway/utils.h"
+
+/* What the gateway would provide */
+int janus_log_level = LOG_WARN;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+static int compare_times(const void *a, const void *b) {
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Frames carry their number in the first 4 bytes, and a pattern after that */
+static void bench_frame(char *buffer, int size, guint32 number) {
+	guint32 n = htonl(number);
+	memcpy(buffer, &n, sizeof(n));
+	int i = 0;
+	for(i = sizeof(n); i < size; i++)
+		buffer[i] = (char)(number + i);
+}
+
+/* Parses a recording back, returning how many frames it has, or -1 if it's broken */
+static int bench_check(const char *path, int size, guint32 count) {
+	gchar *contents = NULL;
+	gsize len = 0;
+	if(!g_file_get_contents(path, &contents, &len, NULL)) {
+		fprintf(stderr, "Couldn't read %s\n", path);
+		return -1;
+	}
+	int frames = -1;
+	char expected[65536];
+	gsize offset = 8;
+	if(len < 10 || memcmp(contents, "MJR00001", 8)) {
+		fprintf(stderr, "Missing MJR header\n");
+		goto done;
+	}
+	/* Info header */
+	uint16_t info_len = 0;
+	memcpy(&info_len, contents+offset, sizeof(info_len));
+	offset += 2 + ntohs(info_len);
+	if(offset > len || contents[10] != '{') {
+		fprintf(stderr, "Missing info header\n");
+		goto done;
+	}
+	/* Frames, in order, possibly with gaps if some were dropped */
+	int found = 0;
+	gint64 last = -1;
+	while(offset < len) {
+		uint16_t frame_len = 0;
+		if(len - offset < 10 || memcmp(contents+offset, "MEETECHO", 8)) {
+			fprintf(stderr, "Missing frame header at offset %zu\n", offset);
+			goto done;
+		}
+		memcpy(&frame_len, contents+offset+8, sizeof(frame_len));
+		frame_len = ntohs(frame_len);
+		offset += 10;
+		if(frame_len != size || len - offset < frame_len) {
+			fprintf(stderr, "Truncated frame at offset %zu\n", offset);
+			goto done;
+		}
+		guint32 number = 0;
+		memcpy(&number, contents+offset, sizeof(number));
+		number = ntohl(number);
+		bench_frame(expected, size, number);
+		if((gint64)number <= last || number >= count || memcmp(expected, contents+offset, size)) {
+			fprintf(stderr, "Unexpected frame at offset %zu\n", offset);
+			goto done;
+		}
+		last = number;
+		offset += frame_len;
+		found++;
+	}
+	frames = found;
+done:
+	g_free(contents);
+	return frames;
+}
+
+static int bench_run(const char *name, gboolean async, const char *folder, int count, int size, int rate,
+		guint buffer, guint flush, janus_recorder_sync sync, guint sync_interval) {
+	janus_recorder_init(async, buffer, flush, sync, sync_interval);
+	char filename[64];
+	g_snprintf(filename, sizeof(filename), "record-bench-%s", name);
+	janus_recorder *rc = janus_recorder_create(folder, 1, filename);
+	if(rc == NULL)
+		return -1;
+	gint64 *times = g_malloc(count * sizeof(gint64));
+	char frame[65536];
+	int i = 0, failed = 0;
+	gint64 start = janus_get_monotonic_time();
+	for(i = 0; i < count; i++) {
+		if(rate > 0) {
+			/* Pace the frames as they'd come from the network */
+			gint64 when = start + (gint64)i*G_USEC_PER_SEC/rate;
+			gint64 now = janus_get_monotonic_time();
+			if(when > now)
+				g_usleep(when - now);
+		}
+		bench_frame(frame, size, i);
+		gint64 before = janus_get_monotonic_time();
+		if(janus_recorder_save_frame(rc, frame, size) < 0)
+			failed++;
+		times[i] = janus_get_monotonic_time() - before;
+	}
+	gint64 saved = janus_get_monotonic_time() - start;
+	gint64 closing = janus_get_monotonic_time();
+	janus_recorder_close(rc);
+	closing = janus_get_monotonic_time() - closing;
+	char path[1024];
+	g_snprintf(path, sizeof(path), "%s/%s", folder, rc->filename);
+	janus_recorder_free(rc);
+	gint64 total = 0;
+	for(i = 0; i < count; i++)
+		total += times[i];
+	qsort(times, count, sizeof(gint64), compare_times);
+	printf("%-6s %8.2f us/frame avg %6"SCNi64" us p99 %6"SCNi64" us max, %6.1f MB/s, closed in %"SCNi64" us, %d dropped\n",
+		name, (double)total/count, times[count*99/100], times[count-1],
+		saved ? (double)count*size/saved : 0.0, closing, failed);
+	g_free(times);
+	int frames = bench_check(path, size, count);
+	unlink(path);
+	if(frames != count - failed) {
+		fprintf(stderr, "Expected %d frames on file, got %d\n", count - failed, frames);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int count = 200000, size = 1200, rate = 0, opt;
+	guint buffer = 1024, flush = 500, sync_interval = 0;
+	janus_recorder_sync sync = JANUS_RECORDER_SYNC_CLOSE;
+	const char *folder = "/tmp";
+	while((opt = getopt(argc, argv, "d:n:s:r:b:f:y:h")) != -1) {
+		switch(opt) {
+			case 'd': folder = optarg; break;
+			case 'n': count = atoi(optarg); break;
+			case 's': size = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'b': buffer = atoi(optarg); break;
+			case 'f': flush = atoi(optarg); break;
+			case 'y':
+				if(!strcasecmp(optarg, "none")) {
+					sync = JANUS_RECORDER_SYNC_NONE;
+				} else if(atoi(optarg) > 0) {
+					sync = JANUS_RECORDER_SYNC_PERIODIC;
+					sync_interval = atoi(optarg);
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-d folder] [-n frames] [-s size] [-r rate] [-b buffer KB] [-f flush ms] [-y none|close|<ms>]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(count <= 0 || size < 4 || size > 65535)
+		return 1;
+
+	printf("Recording %d frames of %d bytes in %s (%s)\n", count, size, folder,
+		rate > 0 ? "paced" : "as fast as possible");
+	if(bench_run("sync", FALSE, folder, count, size, rate, buffer*1024, flush, sync, sync_interval) < 0)
+		return 1;
+	if(bench_run("async", TRUE, folder, count, size, rate, buffer*1024, flush, sync, sync_interval) < 0)
+		return 1;
+	return 0;
+}
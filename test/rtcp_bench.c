@@ -0,0 +1,414 @@
+/*
+ * rtcp_bench.c
+ *
+ *  Micro-benchmark and fuzzer of janus_rtcp_get_summary: a few compound
+ *  RTCP packets like browsers send them (SR/RR with SDES, REMB, NACKs,
+ *  PLIs and FIRs) are inspected either the way it used to be (a call to
+ *  each of janus_rtcp_get_sender_ssrc, janus_rtcp_get_receiver_ssrc,
+ *  janus_rtcp_has_fir, janus_rtcp_has_pli and janus_rtcp_get_remb, each
+ *  walking the packet on its own) or with a single summary, and the
+ *  throughput is reported in packets per second on a single core.
+ *
+ *  With -f, the same packets are used as a seed corpus instead, and
+ *  mutated (bit flips, random bytes, corrupted lengths, truncations and
+ *  splices) for as many iterations: every mutation is copied to a buffer
+ *  of its exact size, so that building with -fsanitize=address catches
+ *  any read past the end, and whenever it's a well formed packet the
+ *  summary is checked against the getters. Files passed on the command
+ *  line are added to the corpus (e.g., those in test/rtcp_corpus, or
+ *  something a fuzzer found), and -c writes the built-in seeds to a folder.
+ *  Building with -DRTCP_LIBFUZZER provides a libFuzzer entry point instead
+ *  of main, to use with the same corpus.
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o rtcp-bench test/rtcp_bench.c janus-gateway/rtcp.c \
+ *        $(pkg-config --cflags --libs glib-2.0)
+ *    gcc -g -O1 -fsanitize=address,undefined -o rtcp-fuzz test/rtcp_bench.c \
+ *        janus-gateway/rtcp.c $(pkg-config --cflags --libs glib-2.0)
+ *
+ *  Run:
+ *    ./rtcp-bench [-n packets]
+ *    ./rtcp-fuzz -f iterations [-s seed] [corpus files...]
+ *    ./rtcp-bench -c test/rtcp_corpus
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "../janus-gateway/debug.h"
+#include "../janus-gateway/rtcp.h"
+
+/* What the gateway would provide */
+int janus_log_level = LOG_ERR;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+#define RTCP_BUFFER	1500
+
+typedef struct rtcp_seed {
+	char name[32];
+	char *data;
+	int len;
+} rtcp_seed;
+
+static GPtrArray *corpus = NULL;
+
+static void corpus_add(const char *name, const char *data, int len) {
+	rtcp_seed *seed = g_malloc0(sizeof(rtcp_seed));
+	g_snprintf(seed->name, sizeof(seed->name), "%s", name);
+	seed->data = g_memdup(data, len);
+	seed->len = len;
+	g_ptr_array_add(corpus, seed);
+}
+
+/* Appends an SR or RR with some report blocks to a compound packet */
+static int build_report(char *packet, int type, uint32_t ssrc, int blocks) {
+	rtcp_header *rtcp = (rtcp_header *)packet;
+	memset(packet, 0, 32 + blocks*sizeof(report_block));
+	rtcp->version = 2;
+	rtcp->type = type;
+	rtcp->rc = blocks;
+	report_block *rb = NULL;
+	int len = 0;
+	if(type == RTCP_SR) {
+		rtcp_sr *sr = (rtcp_sr *)rtcp;
+		sr->ssrc = htonl(ssrc);
+		sr->si.ntp_ts_msw = htonl(3654929153u);
+		sr->si.rtp_ts = htonl(1234567);
+		sr->si.s_packets = htonl(4242);
+		sr->si.s_octets = htonl(4242*1100);
+		rb = sr->rb;
+		len = 28;
+	} else {
+		rtcp_rr *rr = (rtcp_rr *)rtcp;
+		rr->ssrc = htonl(ssrc);
+		rb = rr->rb;
+		len = 8;
+	}
+	int i = 0;
+	for(i = 0; i < blocks; i++) {
+		rb[i].ssrc = htonl(ssrc + 1000 + i);
+		/* 10/256 lost, and 37 lost since the beginning */
+		rb[i].flcnpl = htonl((10 << 24) | 37);
+		rb[i].ehsnr = htonl(65536 + 1000*i);
+		rb[i].jitter = htonl(90);
+		rb[i].lsr = htonl(0x12345678);
+		rb[i].delay = htonl(6553);
+	}
+	len += blocks*sizeof(report_block);
+	rtcp->length = htons(len/4-1);
+	return len;
+}
+
+/* Sets the sender and media SSRCs of a feedback message */
+static int fb_ssrcs(char *packet, int len, uint32_t ssrc, uint32_t media) {
+	rtcp_fb *rtcpfb = (rtcp_fb *)packet;
+	rtcpfb->ssrc = htonl(ssrc);
+	rtcpfb->media = htonl(media);
+	return len;
+}
+
+static void corpus_seeds(void) {
+	char packet[RTCP_BUFFER];
+	int len = 0, seqnr = 0;
+	/* SR with a report block, and SDES */
+	len = build_report(packet, RTCP_SR, 1111, 1);
+	len += janus_rtcp_sdes(packet+len, 24, "janusvideo", 10);
+	corpus_add("sr-sdes", packet, len);
+	/* SR with no report block, and SDES */
+	len = build_report(packet, RTCP_SR, 1111, 0);
+	len += janus_rtcp_sdes(packet+len, 24, "janusvideo", 10);
+	corpus_add("sr-noblocks-sdes", packet, len);
+	/* RR with a couple of report blocks, and REMB */
+	len = build_report(packet, RTCP_RR, 2222, 2);
+	len += fb_ssrcs(packet+len, janus_rtcp_remb(packet+len, 24, 1500000), 2222, 0);
+	corpus_add("rr-remb", packet, len);
+	/* RR, SDES and REMB, as Chrome sends them */
+	len = build_report(packet, RTCP_RR, 2222, 1);
+	len += janus_rtcp_sdes(packet+len, 24, "chromevid0", 10);
+	len += fb_ssrcs(packet+len, janus_rtcp_remb(packet+len, 24, 256000), 2222, 0);
+	corpus_add("rr-sdes-remb", packet, len);
+	/* RR and NACK */
+	janus_rtcp_seq_map map;
+	janus_rtcp_seq_map_init(&map);
+	uint16_t seq = 0;
+	for(seq = 0; seq < 200; seq++) {
+		if(seq % 7 != 3)
+			janus_rtcp_seq_map_received(&map, seq);
+	}
+	len = build_report(packet, RTCP_RR, 2222, 1);
+	len += fb_ssrcs(packet+len, janus_rtcp_nacks_from_map(packet+len, 64, &map, 200), 2222, 1111);
+	corpus_add("rr-nack", packet, len);
+	/* RR and PLI */
+	len = build_report(packet, RTCP_RR, 2222, 1);
+	len += fb_ssrcs(packet+len, janus_rtcp_pli(packet+len, 12), 2222, 1111);
+	corpus_add("rr-pli", packet, len);
+	/* RR and FIR */
+	len = build_report(packet, RTCP_RR, 2222, 1);
+	len += fb_ssrcs(packet+len, janus_rtcp_fir(packet+len, 20, &seqnr), 2222, 1111);
+	corpus_add("rr-fir", packet, len);
+	/* Legacy FIR on its own */
+	len = janus_rtcp_fir_legacy(packet, 20, &seqnr);
+	corpus_add("fir-legacy", packet, len);
+	/* Everything at once: RR with as many blocks as it gets, SDES, REMB, NACK, PLI, FIR */
+	len = build_report(packet, RTCP_RR, 3333, 31);
+	len += janus_rtcp_sdes(packet+len, 24, "janusaudio", 10);
+	len += fb_ssrcs(packet+len, janus_rtcp_remb(packet+len, 24, 64000000000ULL), 3333, 0);
+	len += fb_ssrcs(packet+len, janus_rtcp_nacks_from_map(packet+len, 64, &map, 200), 3333, 1111);
+	len += fb_ssrcs(packet+len, janus_rtcp_pli(packet+len, 12), 3333, 1111);
+	len += janus_rtcp_fir_legacy(packet+len, 20, &seqnr);
+	corpus_add("everything", packet, len);
+}
+
+/* Writes the seeds to a folder, one file each */
+static int corpus_save(const char *folder) {
+	if(g_mkdir_with_parents(folder, 0755) < 0) {
+		fprintf(stderr, "Couldn't create %s: %s\n", folder, g_strerror(errno));
+		return -1;
+	}
+	guint i = 0;
+	for(i = 0; i < corpus->len; i++) {
+		rtcp_seed *seed = g_ptr_array_index(corpus, i);
+		char *name = g_strdup_printf("%s/%s.rtcp", folder, seed->name);
+		GError *error = NULL;
+		if(!g_file_set_contents(name, seed->data, seed->len, &error)) {
+			fprintf(stderr, "Couldn't write %s: %s\n", name, error->message);
+			g_error_free(error);
+			g_free(name);
+			return -1;
+		}
+		printf("%s (%d bytes)\n", name, seed->len);
+		g_free(name);
+	}
+	return 0;
+}
+
+/* Whether the getters can be trusted with a packet: unlike the summary,
+ * they don't check what they read against the length of each packet */
+static gboolean rtcp_well_formed(char *packet, int len) {
+	int offset = 0;
+	while(offset < len) {
+		if(len - offset < 4)
+			return FALSE;
+		rtcp_header *rtcp = (rtcp_header *)(packet+offset);
+		int length = ntohs(rtcp->length)*4+4;
+		/* Empty packets end the walk of the getters */
+		if(rtcp->version != 2 || length == 4 || length > len - offset)
+			return FALSE;
+		if(rtcp->type == RTCP_SR && length < 28 + rtcp->rc*(int)sizeof(report_block))
+			return FALSE;
+		if(rtcp->type == RTCP_RR && length < 8 + rtcp->rc*(int)sizeof(report_block))
+			return FALSE;
+		if((rtcp->type == RTCP_RTPFB || rtcp->type == RTCP_PSFB) && length < 12)
+			return FALSE;
+		if(rtcp->type == RTCP_PSFB && rtcp->rc == 15 && length < 20)
+			return FALSE;
+		offset += length;
+	}
+	return TRUE;
+}
+
+static int fuzz_failures = 0;
+
+/* Inspects a packet both ways, and complains if they don't agree */
+static void fuzz_one(const char *data, int len) {
+	/* Exactly as big as the packet, so that overreads don't go unnoticed */
+	char *packet = g_malloc(len > 0 ? len : 1);
+	memcpy(packet, data, len);
+	janus_rtcp_summary summary;
+	int res = janus_rtcp_get_summary(packet, len, &summary);
+	if(summary.reports_num < 0 || summary.nacks < 0 || summary.packets*4 > len) {
+		fprintf(stderr, "Inconsistent summary (%d packets in %d bytes)\n", summary.packets, len);
+		fuzz_failures++;
+	}
+	if(res == 0 && rtcp_well_formed(packet, len)) {
+		guint32 sender = janus_rtcp_get_sender_ssrc(packet, len);
+		guint32 receiver = janus_rtcp_get_receiver_ssrc(packet, len);
+		gboolean fir = janus_rtcp_has_fir(packet, len);
+		gboolean pli = janus_rtcp_has_pli(packet, len);
+		uint64_t remb = janus_rtcp_get_remb(packet, len);
+		uint16_t seqs[RTCP_BUFFER];
+		int nacks = janus_rtcp_get_nacks_array(packet, len, seqs, RTCP_BUFFER);
+		if(sender != summary.sender_ssrc || receiver != summary.receiver_ssrc ||
+				fir != summary.fir || pli != summary.pli || remb != summary.remb ||
+				(nacks > 0) != (summary.nacks > 0)) {
+			fprintf(stderr, "Summary and getters disagree on a %d bytes packet:\n", len);
+			fprintf(stderr, "  sender %"SCNu32"/%"SCNu32", receiver %"SCNu32"/%"SCNu32", fir %d/%d, pli %d/%d, remb %"SCNu64"/%"SCNu64", nacks %d/%d\n",
+				summary.sender_ssrc, sender, summary.receiver_ssrc, receiver,
+				summary.fir, fir, summary.pli, pli, summary.remb, remb, summary.nacks, nacks);
+			fuzz_failures++;
+		}
+	}
+	g_free(packet);
+}
+
+static int fuzz_mutate(GRand *rand, char *packet, int len) {
+	int mutations = g_rand_int_range(rand, 1, 5), m = 0;
+	for(m = 0; m < mutations && len > 0; m++) {
+		switch(g_rand_int_range(rand, 0, 6)) {
+			case 0:
+				/* Flip a bit */
+				packet[g_rand_int_range(rand, 0, len)] ^= 1 << g_rand_int_range(rand, 0, 8);
+				break;
+			case 1:
+				/* Random byte */
+				packet[g_rand_int_range(rand, 0, len)] = g_rand_int_range(rand, 0, 256);
+				break;
+			case 2: {
+				/* Corrupt one of the length fields we can find */
+				int offset = 0, target = g_rand_int_range(rand, 0, 4);
+				while(target > 0 && offset + 4 <= len) {
+					int next = offset + ntohs(((rtcp_header *)(packet+offset))->length)*4+4;
+					if(next + 4 > len)
+						break;
+					offset = next;
+					target--;
+				}
+				if(offset + 4 <= len) {
+					uint16_t value = g_rand_boolean(rand) ? g_rand_int_range(rand, 0, 65536) :
+						ntohs(((rtcp_header *)(packet+offset))->length) + g_rand_int_range(rand, -3, 4);
+					((rtcp_header *)(packet+offset))->length = htons(value);
+				}
+				break;
+			}
+			case 3:
+				/* Change the count/format */
+				packet[0] = (packet[0] & 0xE0) | g_rand_int_range(rand, 0, 32);
+				break;
+			case 4:
+				/* Truncate */
+				len = g_rand_int_range(rand, 0, len);
+				break;
+			case 5: {
+				/* Append part of another packet of the corpus */
+				rtcp_seed *other = g_ptr_array_index(corpus, g_rand_int_range(rand, 0, corpus->len));
+				int start = g_rand_int_range(rand, 0, other->len);
+				int size = MIN(other->len - start, RTCP_BUFFER - len);
+				memcpy(packet+len, other->data+start, size);
+				len += size;
+				break;
+			}
+		}
+	}
+	return len;
+}
+
+#ifdef RTCP_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if(corpus == NULL) {
+		corpus = g_ptr_array_new();
+		corpus_seeds();
+	}
+	if(size <= RTCP_BUFFER)
+		fuzz_one((const char *)data, size);
+	if(fuzz_failures > 0)
+		abort();
+	return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+	int count = 10000000, iterations = 0, opt;
+	guint32 seed = 0;
+	const char *save = NULL;
+	while((opt = getopt(argc, argv, "n:f:s:c:h")) != -1) {
+		switch(opt) {
+			case 'n': count = atoi(optarg); break;
+			case 'f': iterations = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'c': save = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n packets] [-f iterations [-s seed]] [-c folder] [corpus files...]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(count <= 0)
+		return 1;
+	corpus = g_ptr_array_new();
+	corpus_seeds();
+	if(save != NULL)
+		return corpus_save(save) < 0 ? 1 : 0;
+	int i = 0;
+	for(i = optind; i < argc; i++) {
+		char *contents = NULL;
+		gsize size = 0;
+		GError *error = NULL;
+		if(!g_file_get_contents(argv[i], &contents, &size, &error)) {
+			fprintf(stderr, "Couldn't read %s: %s\n", argv[i], error->message);
+			g_error_free(error);
+			return 1;
+		}
+		if(size > 0 && size <= RTCP_BUFFER) {
+			char *name = g_path_get_basename(argv[i]);
+			corpus_add(name, contents, size);
+			g_free(name);
+		}
+		g_free(contents);
+	}
+
+	if(iterations > 0) {
+		if(seed == 0)
+			seed = g_random_int();
+		printf("Fuzzing %d iterations from %u packets (seed %"SCNu32")\n", iterations, corpus->len, seed);
+		GRand *rand = g_rand_new_with_seed(seed);
+		char packet[RTCP_BUFFER];
+		guint s = 0;
+		for(s = 0; s < corpus->len; s++) {
+			rtcp_seed *entry = g_ptr_array_index(corpus, s);
+			fuzz_one(entry->data, entry->len);
+		}
+		for(i = 0; i < iterations; i++) {
+			rtcp_seed *entry = g_ptr_array_index(corpus, g_rand_int_range(rand, 0, corpus->len));
+			memcpy(packet, entry->data, entry->len);
+			int len = fuzz_mutate(rand, packet, entry->len);
+			fuzz_one(packet, len);
+		}
+		g_rand_free(rand);
+		printf("%d failures\n", fuzz_failures);
+		return fuzz_failures > 0 ? 1 : 0;
+	}
+
+	/* Check the seeds first: no point in timing something that's wrong */
+	int bytes = 0;
+	guint s = 0;
+	for(s = 0; s < corpus->len; s++) {
+		rtcp_seed *entry = g_ptr_array_index(corpus, s);
+		fuzz_one(entry->data, entry->len);
+		bytes += entry->len;
+	}
+	if(fuzz_failures > 0)
+		return 1;
+	printf("Inspecting %d packets (%u different ones, %d bytes each on average)\n",
+		count, corpus->len, bytes/(int)corpus->len);
+	/* Keep the compiler from optimizing the calls away */
+	volatile guint64 sink = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < count; i++) {
+		rtcp_seed *entry = g_ptr_array_index(corpus, i % corpus->len);
+		sink += janus_rtcp_get_sender_ssrc(entry->data, entry->len);
+		sink += janus_rtcp_get_receiver_ssrc(entry->data, entry->len);
+		sink += janus_rtcp_has_fir(entry->data, entry->len);
+		sink += janus_rtcp_has_pli(entry->data, entry->len);
+		sink += janus_rtcp_get_remb(entry->data, entry->len);
+	}
+	gint64 getters = g_get_monotonic_time() - start;
+	janus_rtcp_summary summary;
+	start = g_get_monotonic_time();
+	for(i = 0; i < count; i++) {
+		rtcp_seed *entry = g_ptr_array_index(corpus, i % corpus->len);
+		janus_rtcp_get_summary(entry->data, entry->len, &summary);
+		sink += summary.sender_ssrc + summary.receiver_ssrc + summary.fir + summary.pli + summary.remb;
+	}
+	gint64 summaries = g_get_monotonic_time() - start;
+	printf("%-10s %8.1f ns/packet %12.0f packets/s\n", "getters",
+		1000.0*getters/count, getters ? 1000000.0*count/getters : 0.0);
+	printf("%-10s %8.1f ns/packet %12.0f packets/s\n", "summary",
+		1000.0*summaries/count, summaries ? 1000000.0*count/summaries : 0.0);
+	return 0;
+}
+#endif
@@ -0,0 +1,478 @@
+/*
+ * simulator.c
+ *
+ *  STM32F4 Discovery simulator: opens a pseudo-terminal pair and answers
+ *  on it the same commands the firmware in example/stm32f4/src/main.c
+ *  does (on/off LED 3-6, read accelerometer and temperature, subscribe/
+ *  unsubscribe, protocol negotiation), JSON or binary, so that the plugin
+ *  can be run and benchmarked without a board. Every command can be given
+ *  a latency and a jitter, to model how long the MCU takes on it.
+ *
+ *  Build:
+ *    gcc -O2 -Wall -o serial-sim test/simulator.c example/stm32f4/src/wire.c \
+ *        -Iexample/stm32f4/include -lm
+ *
+ *  Run:
+ *    ./serial-sim -l /tmp/ttySIM -L read=5:2 -L on=1
+ *  and set portname = /tmp/ttySIM in janus.plugin.serial.cfg
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#include "wire.h"
+
+/* Commands, as in the firmware */
+#define C_ON          0
+#define C_OFF         1
+#define C_READ        2
+#define C_SUBSCRIBE   3
+#define C_UNSUBSCRIBE 4
+#define C_PROTOCOL    5
+#define COMMANDS      6
+#define OK  0
+#define ERR 1
+#define STREAMS  3
+#define RATE_MIN 10
+#define RATE_MAX 60000
+
+static const char *commands[COMMANDS] = { "on", "off", "read", "subscribe", "unsubscribe", "protocol" };
+
+/* Per command latency and jitter (ms): the reply goes out after
+ * latency + [0, jitter] ms, during which the MCU does nothing else */
+static double latency[COMMANDS] = { 1, 1, 1, 1, 1, 1 };
+static double jitter[COMMANDS];
+
+/* Simulated board */
+typedef struct Comand {
+	int name;
+	int ID;
+	unsigned long seq;
+	int rate;
+	int protocol;
+} Comand;
+
+static int leds[7];
+static uint64_t streams[STREAMS];	/* Sampling period (us), 0 if off */
+static uint64_t next_sample[STREAMS];
+static int binary = 0, allow_binary = 1, verbose = 0;
+static unsigned long handled[COMMANDS], errors, samples;
+static volatile sig_atomic_t running = 1;
+static int master = -1;
+
+static void sigint(int signum) {
+	running = 0;
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void write_all(const void *buf, size_t len) {
+	const char *p = buf;
+	while(len > 0) {
+		ssize_t n = write(master, p, len);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN) {
+				struct pollfd pfd = { master, POLLOUT, 0 };
+				poll(&pfd, 1, 100);
+				continue;
+			}
+			/* Nobody on the other side */
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/* Fake sensors: a board lying on a desk, slightly shaken, in a warm room */
+static void accelerometer(int16_t xyz[3]) {
+	xyz[0] = -7 + rand()%5;
+	xyz[1] = 4 + rand()%5;
+	xyz[2] = 1005 + rand()%9;
+}
+
+static int32_t temperature(void) {
+	return (int32_t)((25.0 + sin(now_us()/60e6)*2.0)*10000) + rand()%100;
+}
+
+/* Same answer layout as reply() in the firmware */
+static void reply(unsigned long seq, int stream, int opstatus, int code, int id, int rate, int protocol, int sensor) {
+	char response[256];
+	int16_t xyz[3];
+	int32_t temp = 0;
+	if(sensor == 1)
+		accelerometer(xyz);
+	else if(sensor == 2)
+		temp = temperature();
+	if(binary) {
+		Wire w;
+		uint8_t u8;
+		wire_begin(&w, stream ? WIRE_SAMPLE : WIRE_REPLY);
+		if(stream) {
+			u8 = stream;
+			wire_put(&w, WIRE_STREAM, &u8, 1);
+		} else {
+			uint32_t s = seq;
+			wire_put(&w, WIRE_SEQ, &s, 4);
+		}
+		u8 = opstatus;
+		wire_put(&w, WIRE_OPSTATUS, &u8, 1);
+		if(code >= 0) {
+			u8 = code;
+			wire_put(&w, WIRE_CODE, &u8, 1);
+		}
+		if(id >= 0) {
+			u8 = id;
+			wire_put(&w, WIRE_ID, &u8, 1);
+		}
+		if(rate >= 0) {
+			uint16_t r = rate;
+			wire_put(&w, WIRE_RATE, &r, 2);
+		}
+		if(sensor == 1)
+			wire_put(&w, WIRE_ACCELEROMETER, xyz, 6);
+		else if(sensor == 2)
+			wire_put(&w, WIRE_TEMPERATURE, &temp, 4);
+		int n = wire_finish(&w, (uint8_t *)response);
+		write_all(response, n);
+		return;
+	}
+	int n = 0;
+	if(stream)
+		n += sprintf(response+n, "{ \"stream\" : %d, ", stream);
+	else
+		n += sprintf(response+n, "{ \"seq\" : %lu, ", seq);
+	n += sprintf(response+n, "\"opstatus\" : \"%s\"", opstatus == OK ? "ok" : "err");
+	if(code >= 0)
+		n += sprintf(response+n, ", \"code\" : %d", code);
+	if(id >= 0)
+		n += sprintf(response+n, ", \"id\" : %d", id);
+	if(rate >= 0)
+		n += sprintf(response+n, ", \"rate\" : %d", rate);
+	if(protocol >= 0)
+		n += sprintf(response+n, ", \"protocol\" : %d", protocol);
+	if(sensor == 1) {
+		n += sprintf(response+n, ", \"measure\" : [ %d,%d,%d],\"type\" : \"accelerometer\"", xyz[0], xyz[1], xyz[2]);
+	} else if(sensor == 2) {
+		int32_t t = temp < 0 ? -temp : temp;
+		n += sprintf(response+n, ", \"measure\" : %s%ld.%04ld,\"type\" : \"temperature\"",
+			temp < 0 ? "-" : "", (long)t/10000, (long)t%10000);
+	}
+	n += sprintf(response+n, " }\n");
+	write_all(response, n);
+}
+
+/* Good enough for what the plugin sends: {"key":integer,...} */
+static int json_int(const char *json, const char *key, long *value) {
+	char pattern[32];
+	snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+	const char *p = strstr(json, pattern);
+	if(p == NULL)
+		return -1;
+	p = strchr(p + strlen(pattern), ':');
+	if(p == NULL)
+		return -1;
+	*value = strtol(p+1, NULL, 10);
+	return 0;
+}
+
+static int parsing(const char *json, Comand *received) {
+	long value = 0;
+	memset(received, 0, sizeof(*received));
+	received->name = json_int(json, "command", &value) == 0 ? (int)value : -1;
+	if(json_int(json, "id", &value) == 0)
+		received->ID = value;
+	if(json_int(json, "seq", &value) == 0)
+		received->seq = value;
+	if(json_int(json, "rate", &value) == 0)
+		received->rate = value;
+	if(json_int(json, "protocol", &value) == 0)
+		received->protocol = value;
+	return 0;
+}
+
+static int parsingBinary(uint8_t *packet, int len, Comand *received) {
+	const uint8_t *value;
+	uint8_t tag, vlen;
+	int pos = 1;
+	memset(received, 0, sizeof(*received));
+	received->name = -1;
+	int n = wire_open(packet, len);
+	if(n < 1 || packet[0] != WIRE_REQUEST)
+		return -1;
+	while(wire_next(packet, n, &pos, &tag, &value, &vlen)) {
+		switch(tag) {
+			case WIRE_SEQ: received->seq = wire_uint(value, vlen); break;
+			case WIRE_COMMAND: received->name = wire_uint(value, vlen); break;
+			case WIRE_ID: received->ID = wire_uint(value, vlen); break;
+			case WIRE_RATE: received->rate = wire_uint(value, vlen); break;
+			default: break;
+		}
+	}
+	return 0;
+}
+
+static void execComand(Comand *c) {
+	if(c->name >= 0 && c->name < COMMANDS) {
+		handled[c->name]++;
+		/* The MCU is busy for a while */
+		double delay = latency[c->name] + (jitter[c->name] > 0 ? jitter[c->name]*rand()/RAND_MAX : 0);
+		if(delay > 0)
+			usleep((useconds_t)(delay*1000));
+	}
+	switch(c->name) {
+		case C_ON:
+		case C_OFF:
+			if(c->ID >= 3 && c->ID <= 6) {
+				leds[c->ID] = (c->name == C_ON);
+				reply(c->seq, 0, OK, -1, c->ID, -1, -1, 0);
+			} else {
+				errors++;
+				reply(c->seq, 0, ERR, 2, -1, -1, -1, 0);
+			}
+			break;
+		case C_READ:
+			if(c->ID == 1 || c->ID == 2) {
+				reply(c->seq, 0, OK, -1, -1, -1, -1, c->ID);
+			} else {
+				errors++;
+				reply(c->seq, 0, ERR, 2, -1, -1, -1, 0);
+			}
+			break;
+		case C_SUBSCRIBE:
+			if(c->ID > 0 && c->ID < STREAMS && c->rate >= RATE_MIN && c->rate <= RATE_MAX) {
+				streams[c->ID] = (uint64_t)c->rate*1000;
+				next_sample[c->ID] = now_us();
+				reply(c->seq, 0, OK, -1, c->ID, c->rate, -1, 0);
+			} else {
+				errors++;
+				reply(c->seq, 0, ERR, 2, -1, -1, -1, 0);
+			}
+			break;
+		case C_UNSUBSCRIBE:
+			if(c->ID > 0 && c->ID < STREAMS)
+				streams[c->ID] = 0;
+			reply(c->seq, 0, OK, -1, c->ID, -1, -1, 0);
+			break;
+		case C_PROTOCOL: {
+			int protocol = (c->protocol == 1 && allow_binary) ? 1 : 0;
+			binary = 0;
+			reply(c->seq, 0, OK, -1, -1, -1, protocol, 0);
+			binary = protocol;
+			if(verbose)
+				fprintf(stderr, "Talking %s\n", binary ? "binary" : "JSON");
+			break;
+		}
+		default:
+			errors++;
+			reply(c->seq, 0, ERR, 1, -1, -1, -1, 0);
+			break;
+	}
+}
+
+/* Send the samples that are due, and return how long (ms) until the next */
+static int sampling(void) {
+	uint64_t now = now_us();
+	int timeout = -1;
+	for(int id = 1; id < STREAMS; id++) {
+		if(streams[id] == 0)
+			continue;
+		if(now >= next_sample[id]) {
+			next_sample[id] += streams[id];
+			if(next_sample[id] <= now)
+				next_sample[id] = now + streams[id];
+			samples++;
+			reply(0, id, OK, -1, -1, -1, -1, id);
+		}
+		int wait = (int)((next_sample[id] - now + 999)/1000);
+		if(timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+	return timeout;
+}
+
+static int parse_latency(const char *arg) {
+	char name[32];
+	double l = 0, j = 0;
+	if(sscanf(arg, "%31[^=]=%lf:%lf", name, &l, &j) < 2)
+		return -1;
+	for(int i = 0; i < COMMANDS; i++) {
+		if(!strcmp(name, commands[i]) || !strcmp(name, "all")) {
+			latency[i] = l;
+			jitter[i] = j;
+			if(strcmp(name, "all"))
+				return 0;
+		}
+	}
+	return strcmp(name, "all") ? -1 : 0;
+}
+
+/* The plugin is supposed to put the tty in raw mode itself: if it left
+ * canonical mode, echo or CR/NL translation on, binary packets (that end
+ * with 0 and can contain any byte) would never make it there intact */
+static int check_tty(int fd) {
+	struct termios toptions;
+	if(tcgetattr(fd, &toptions) < 0)
+		return -1;
+	struct { tcflag_t flags, mask; const char *name; } checks[] = {
+		{ toptions.c_lflag, ICANON, "ICANON" }, { toptions.c_lflag, ECHO, "ECHO" },
+		{ toptions.c_lflag, ECHOE, "ECHOE" }, { toptions.c_lflag, ISIG, "ISIG" },
+		{ toptions.c_lflag, IEXTEN, "IEXTEN" }, { toptions.c_iflag, ICRNL, "ICRNL" },
+		{ toptions.c_iflag, INLCR, "INLCR" }, { toptions.c_iflag, IGNCR, "IGNCR" },
+		{ toptions.c_iflag, ISTRIP, "ISTRIP" }, { toptions.c_iflag, IXON, "IXON" },
+		{ toptions.c_oflag, OPOST, "OPOST" },
+	};
+	int wrong = 0;
+	for(size_t i = 0; i < sizeof(checks)/sizeof(checks[0]); i++) {
+		if(checks[i].flags & checks[i].mask) {
+			fprintf(stderr, "%s %s", wrong ? "," : "The tty is not in raw mode:", checks[i].name);
+			wrong++;
+		}
+	}
+	if(wrong)
+		fprintf(stderr, " still set\n");
+	return wrong ? -1 : 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-l link] [-L command=latency[:jitter]]... [-j] [-s seed] [-v]\n"
+		"  -l link     symlink to create to the simulated tty\n"
+		"  -L cmd=l:j  latency and jitter (ms) of a command: on, off, read,\n"
+		"              subscribe, unsubscribe, protocol, or all (default 1:0)\n"
+		"  -j          JSON only, refuse the binary protocol\n"
+		"  -s seed     seed for the jitter and the fake readings\n"
+		"  -v          verbose\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	const char *link = NULL;
+	unsigned int seed = (unsigned int)time(NULL);
+	int opt;
+	while((opt = getopt(argc, argv, "l:L:js:vh")) != -1) {
+		switch(opt) {
+			case 'l': link = optarg; break;
+			case 'L':
+				if(parse_latency(optarg) < 0) {
+					fprintf(stderr, "Invalid latency %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'j': allow_binary = 0; break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	srand(seed);
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		fprintf(stderr, "Error creating the pseudo-terminal: %s\n", strerror(errno));
+		return 1;
+	}
+	const char *slave_name = ptsname(master);
+	/* Keep the slave open ourselves, so that the plugin can come and go
+	 * without the master seeing a hangup. Its line discipline is left as
+	 * it is (canonical, echo on), like a freshly plugged board's: setting
+	 * it up is the plugin's job, and check_tty() tells if it didn't */
+	int slave = open(slave_name, O_RDWR | O_NOCTTY);
+	if(slave < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", slave_name, strerror(errno));
+		return 1;
+	}
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	if(link != NULL) {
+		unlink(link);
+		if(symlink(slave_name, link) < 0) {
+			fprintf(stderr, "Error linking %s to %s: %s\n", link, slave_name, strerror(errno));
+			return 1;
+		}
+	}
+	printf("%s\n", link ? link : slave_name);
+	fflush(stdout);
+	signal(SIGINT, sigint);
+	signal(SIGTERM, sigint);
+
+	/* Same framing as the firmware: JSON commands start with '{' and end
+	 * with '\n', binary ones end with 0 */
+	char request[256];
+	int spot = 0, tty_checked = 0, tty_raw = 1;
+	char buf[256];
+	while(running) {
+		struct pollfd pfd = { master, POLLIN, 0 };
+		int res = poll(&pfd, 1, sampling());
+		if(res < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(!(pfd.revents & POLLIN))
+			continue;
+		ssize_t len = read(master, buf, sizeof(buf));
+		if(len <= 0)
+			continue;
+		if(!tty_checked) {
+			/* Whoever is writing has set the tty up by now */
+			tty_checked = 1;
+			if(check_tty(slave) < 0) {
+				tty_raw = 0;
+				errors++;
+			}
+		}
+		for(ssize_t i = 0; i < len; i++) {
+			char c = buf[i];
+			if(spot == 0 && c == '\0')
+				continue;
+			char end = (spot == 0 ? c : request[0]) == '{' ? '\n' : '\0';
+			if(c != end) {
+				if(spot < (int)sizeof(request)-1)
+					request[spot++] = c;
+				continue;
+			}
+			request[spot] = '\0';
+			Comand received;
+			if(end == '\n') {
+				if(verbose)
+					fprintf(stderr, "<< %s\n", request);
+				binary = 0;
+				parsing(request, &received);
+				execComand(&received);
+			} else if(parsingBinary((uint8_t *)request, spot, &received) == 0) {
+				binary = 1;
+				execComand(&received);
+			} else {
+				errors++;
+				if(verbose)
+					fprintf(stderr, "Dropping broken packet (%d bytes)\n", spot);
+			}
+			spot = 0;
+		}
+	}
+
+	fprintf(stderr, "Handled:");
+	for(int i = 0; i < COMMANDS; i++)
+		fprintf(stderr, " %s %lu", commands[i], handled[i]);
+	fprintf(stderr, ", samples %lu, errors %lu\n", samples, errors);
+	if(link != NULL)
+		unlink(link);
+	close(slave);
+	close(master);
+	return tty_raw ? 0 : 1;
+}